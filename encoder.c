@@ -79,18 +79,32 @@
 
 #define X86_OP_IMM8_MODRM (0x80)
 #define X86_OP_IMM_MODRM (0x81)
-#define X86_OP_LONG_IMM8_MODRM (0x82)
+#define X86_OP_LONG_IMM8_MODRM (0x83) //Sign extended 8bit immediate
 
-#define X86_OP_MODRM_ADD (0x01)
-#define X86_OP_MODRM_OR (0x02)
-#define X86_OP_MODRM_ADC (0x03)
-#define X86_OP_MODRM_SBB (0x04)
-#define X86_OP_MODRM_AND (0x05)
-#define X86_OP_MODRM_SUB (0x06)
-#define X86_OP_MODRM_XOR (0x07)
-#define X86_OP_MODRM_CMP (0x08)
+#define X86_OP_MODRM_ADD (0x00)
+#define X86_OP_MODRM_OR (0x01)
+#define X86_OP_MODRM_ADC (0x02)
+#define X86_OP_MODRM_SBB (0x03)
+#define X86_OP_MODRM_AND (0x04)
+#define X86_OP_MODRM_SUB (0x05)
+#define X86_OP_MODRM_XOR (0x06)
+#define X86_OP_MODRM_CMP (0x07)
 
 #define X86_MOV_MODRM (0x89)
+#define X86_MOV_LOAD_MODRM (0x8B) //Direction reversed, reg is the destination
+#define X86_LEA_MODRM (0x8D)
+#define X86_TEST_MODRM (0x85)
+#define X86_XCHG_MODRM (0x87)
+#define X86_MOVSXD_MODRM (0x63) //Sign extends 32bit R/M to reg
+#define X86_MOV_IMM_MODRM (0xC7) //Sign extended 32bit immediate, reg field is 0
+
+#define X86_SHIFT_CL_MODRM (0xD3)
+#define X86_SHIFT_IMM8_MODRM (0xC1)
+#define X86_SHIFT_MODRM_SHL (0x4)
+#define X86_SHIFT_MODRM_SHR (0x5)
+#define X86_SHIFT_MODRM_SAR (0x7)
+
+#define X86_CQO (0x99) //With REX.W, sign extends RAX to RDX:RAX
 
 #define X86_MOV_REG_IMM_LONG(x) (0xB8 + (x))
 #define X86_MOV_REG_IMM_LOW(x) (0xB0 + (x))
@@ -105,6 +119,71 @@
 
 #define X86_0F (0x0F)
 #define X86_0F_JMP_COND_REL32(x) (0x80 + (x))
+#define X86_0F_SETCC(x) (0x90 + (x)) //8bit R/M, reg field is 0
+#define X86_0F_IMUL_MODRM (0xAF) //Reg is the destination
+#define X86_0F_MOVZX_8 (0xB6)
+#define X86_0F_MOVZX_16 (0xB7)
+#define X86_0F_MOVSX_8 (0xBE)
+#define X86_0F_MOVSX_16 (0xBF)
+
+// SSE scalar instructions, reg is the XMM register. The mandatory prefix
+// selects the double or single precision form
+#define X86_PREFIX_SD (0xF2)
+#define X86_PREFIX_SS (0xF3)
+#define X86_0F_SSE_LOAD (0x10)
+#define X86_0F_SSE_STORE (0x11)
+#define X86_0F_SSE_FROM_INT (0x2A) //R/M is a general purpose register
+#define X86_0F_SSE_TO_INT (0x2C) //Truncating, reg is a general purpose register
+#define X86_0F_SSE_UCOMI (0x2E) //Double form has 0x66 prefix, single none
+#define X86_0F_SSE_ADD (0x58)
+#define X86_0F_SSE_MUL (0x59)
+#define X86_0F_SSE_CONVERT (0x5A) //To the other precision
+#define X86_0F_SSE_SUB (0x5C)
+#define X86_0F_SSE_DIV (0x5E)
+#define X86_0F_MOVD_TO_XMM (0x6E) //With 0x66 prefix, MOVQ with REX.W
+#define X86_0F_MOVD_FROM_XMM (0x7E)
+
+// Packed moves of 16 bytes, or 32 bytes with VEX.L, without alignment
+// requirements. XORPS clears a whole register
+#define X86_0F_MOVUPS_LOAD (0x10)
+#define X86_0F_MOVUPS_STORE (0x11)
+#define X86_0F_XORPS (0x57)
+#define X86_0F_VZEROUPPER (0x77) //VEX.128 form, no operands
+
+// String instructions, with REX.W on the 64bit variant
+#define X86_PREFIX_REP (0xF3)
+#define X86_PREFIX_LOCK (0xF0)
+#define X86_MOVSB (0xA4)
+#define X86_MOVSQ (0xA5)
+#define X86_STOSB (0xAA)
+#define X86_STOSQ (0xAB)
+
+// Packed arithmetic. The floating point forms take no prefix for single
+// and 0x66 for double precision, the integer forms always take 0x66
+#define X86_0F_PACKED_ADD (0x58)
+#define X86_0F_PACKED_MUL (0x59)
+#define X86_0F_PACKED_SUB (0x5C)
+#define X86_0F_PACKED_DIV (0x5E)
+#define X86_0F_PADDD (0xFE)
+#define X86_0F_PADDQ (0xD4)
+#define X86_0F_PSUBD (0xFA)
+#define X86_0F_PSUBQ (0xFB)
+#define X86_0F_PAND (0xDB)
+#define X86_0F_POR (0xEB)
+#define X86_0F_PXOR (0xEF)
+#define X86_0F38_PMULLD (0x40)
+
+// AVX and AVX2 broadcasts of the low element of an XMM register, 0x66
+// prefix
+#define X86_0F38_VBROADCASTSS (0x18)
+#define X86_0F38_VBROADCASTSD (0x19)
+#define X86_0F38_VPBROADCASTD (0x58)
+#define X86_0F38_VPBROADCASTQ (0x59)
+
+#define X86_VEX_2 (0xC5)
+#define X86_VEX_3 (0xC4)
+#define X86_VEX_MAP_0F (0x01)
+#define X86_VEX_MAP_0F38 (0x02)
 
 #define X86_RET (0xC3)
 #define X86_NOP (0x90)
@@ -154,6 +233,14 @@
 
 //ModR/M field
 
+#define X86_MOD_INDIRECT (0x0)
+#define X86_MOD_DISP8 (0x1)
+#define X86_MOD_DISP32 (0x2)
+#define X86_MOD_REGISTER (0x3)
+
+// SIB byte with no index and RSP/R12 as base, required when R/M is 0x4
+#define X86_SIB_BASE_ONLY (0x24)
+
 struct x86_modrm
 {
 	unsigned rm : 3;
@@ -163,16 +250,51 @@ struct x86_modrm
 
 
 
+// Relocation kinds
+#define X86_RELOCATION_ABSOLUTE (0) //64bit address of the label
+#define X86_RELOCATION_RELATIVE (1) //32bit offset of the label from the end of the field
+#define X86_RELOCATION_TABLE (2) //32bit offset of the label from the base label
+
 // Relocation information structure, used with labels, jumps and calls
 struct x86_relocation
 {
 	size_t offset; //Offset of relocation in bytecode
 	size_t label; //Label to relocate to
-	int relative; //Whether relocation is absolute or relative.
+	int relative; //Whether relocation is absolute or relative, X86_RELOCATION_*
 	//Also determines if address is 64bit (absolute) or 32bit (relative)
+	size_t base; //Label table entries are relative to
 };
 
 
+// Instruction record kinds
+#define X86_INSTRUCTION_OTHER (0)
+#define X86_INSTRUCTION_MODRM (1) //Register to register ModR/M instruction
+#define X86_INSTRUCTION_MOV_IMM (2)
+#define X86_INSTRUCTION_JMP (3) //JMP or CALL to a label
+#define X86_INSTRUCTION_JMP_COND (4)
+#define X86_INSTRUCTION_PUSH (5)
+#define X86_INSTRUCTION_POP (6)
+#define X86_INSTRUCTION_RET (7)
+#define X86_INSTRUCTION_NOP (8)
+#define X86_INSTRUCTION_CMP_IMM (9)
+#define X86_INSTRUCTION_MODRM_MEM (10) //ModR/M instruction on [rm + immediate]
+
+// Record of an encoded instruction, kept so that the code can be
+// rewritten before the final bytes are produced
+struct x86_instruction
+{
+	size_t offset; //Offset of the instruction in bytecode
+	size_t relocation; //Relocation of a jump, call or conditional jump
+	unsigned char length;
+	unsigned char kind;
+	unsigned char opcode; //Opcode, for 8bit operations the one of the wider form
+	unsigned char size; //Operand size in bytes
+	char rm; //R/M register, or the only register
+	char reg; //Reg register, opcode extension or condition
+	int call;
+	int64_t immediate;
+};
+
 // Maintains internal encoder state. memset to zero for safe initial conditions
 struct x86_encoder
 {
@@ -187,6 +309,10 @@ struct x86_encoder
 	struct x86_relocation* relocations; //Relocations information
 	size_t relocations_size;
 	size_t relocations_capacity;
+
+	struct x86_instruction* instructions; //Records of encoded instructions
+	size_t instructions_size;
+	size_t instructions_capacity;
 };
 
 void x86_encoder_free(struct x86_encoder* enc)
@@ -194,6 +320,7 @@ void x86_encoder_free(struct x86_encoder* enc)
 	free(enc->buffer);
 	free(enc->labels);
 	free(enc->relocations);
+	free(enc->instructions);
 	memset(enc, 0, sizeof *enc);
 }
 
@@ -243,9 +370,38 @@ void x86_encoder_add_relocation(struct x86_encoder* enc, int label, int relative
 	enc->relocations[enc->relocations_size].offset = enc->buffer_size;
 	enc->relocations[enc->relocations_size].label = label;
 	enc->relocations[enc->relocations_size].relative = relative;
+	enc->relocations[enc->relocations_size].base = 0;
 	enc->relocations_size += 1;
 }
 
+// Writes a 32bit jump table entry holding the offset of "label" from the
+// label "table", which marks the start of the table
+void x86_encoder_write_table_entry(struct x86_encoder* enc, size_t table, size_t label)
+{
+	x86_encoder_check_buffer(enc, 4);
+	*(int32_t*)&ENC_X(enc, 0) = 0;
+	x86_encoder_add_relocation(enc, label, X86_RELOCATION_TABLE);
+	enc->relocations[enc->relocations_size - 1].base = table;
+	ENC_ADVANCE(enc, 4);
+}
+
+// Records an instruction that starts at "offset" and ends at the current position
+struct x86_instruction* x86_encoder_record(struct x86_encoder* enc, size_t offset, int kind)
+{
+	if (enc->instructions_size >= enc->instructions_capacity) {
+		enc->instructions_capacity += 1024;
+		enc->instructions = realloc(enc->instructions, enc->instructions_capacity * sizeof *enc->instructions);
+	}
+	struct x86_instruction* ins = enc->instructions + enc->instructions_size;
+	memset(ins, 0, sizeof *ins);
+	ins->offset = offset;
+	ins->length = enc->buffer_size - offset;
+	ins->kind = kind;
+	ins->relocation = enc->relocations_size - 1;
+	enc->instructions_size += 1;
+	return ins;
+}
+
 // Relocates instructions to new base address. Assumes t_buffer contains the bytecode to modify
 // If code consists only of relative addressing, base is not required
 int x86_encoder_apply_relocations_in_memory(struct x86_encoder* enc, char* t_buffer, size_t base)
@@ -256,7 +412,12 @@ int x86_encoder_apply_relocations_in_memory(struct x86_encoder* enc, char* t_buf
 		if (label >= enc->labels_size)
 			return 1;
 		intptr_t to = (intptr_t) (enc->labels[label]);
-		if (reloc->relative) {
+		if (reloc->relative == X86_RELOCATION_TABLE) {
+			if (reloc->base >= enc->labels_size)
+				return 1;
+			int32_t* entry = (int32_t*)(t_buffer + reloc->offset);
+			(*entry) = to - (intptr_t)enc->labels[reloc->base];
+		} else if (reloc->relative) {
 			//assume relative offsets are 32bit
 			intptr_t from = (intptr_t) (reloc->offset + 4);
 			int32_t* offset = (int32_t*)(t_buffer + reloc->offset);
@@ -300,18 +461,30 @@ void _x86_encoder_prepare_modrm_rex(struct x86_encoder* enc, char opcode, char r
 }
 
 
+void _x86_encoder_record_modrm(struct x86_encoder* enc, size_t offset, char opcode, char rm, char reg, int size)
+{
+	struct x86_instruction* ins = x86_encoder_record(enc, offset, X86_INSTRUCTION_MODRM);
+	ins->opcode = opcode;
+	ins->rm = rm;
+	ins->reg = reg;
+	ins->size = size;
+}
+
 // Generic ModR/M based instruction encoder
 void x86_encoder_write_modrm_rex(struct x86_encoder* enc, char opcode, char rm, char reg, int wide)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 3);
 	_x86_encoder_prepare_modrm_rex(enc, opcode, rm, reg, wide);
 	ENC_ADVANCE(enc, 3);
+	_x86_encoder_record_modrm(enc, offset, opcode, rm, reg, wide ? 8 : 4);
 }
 
 // General instruction encoding functions
 
 void x86_encoder_write_jmp(struct x86_encoder* enc, int call, size_t label)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 5);
 	char opcode;
 	if (call)
@@ -326,12 +499,14 @@ void x86_encoder_write_jmp(struct x86_encoder* enc, int call, size_t label)
 	
 	x86_encoder_add_relocation(enc, label, 1);
 	ENC_ADVANCE(enc, 4);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_JMP)->call = call;
 }
 
 
 
 void x86_encoder_write_jmp_cond(struct x86_encoder* enc, int cond, size_t label)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 6);
 	
 	ENC_X(enc, 0) = X86_0F;
@@ -342,6 +517,7 @@ void x86_encoder_write_jmp_cond(struct x86_encoder* enc, int cond, size_t label)
 	
 	x86_encoder_add_relocation(enc, label, 1);
 	ENC_ADVANCE(enc, 4);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_JMP_COND)->reg = cond;
 }
 
 
@@ -355,6 +531,66 @@ void x86_encoder_write_cmp_reg(struct x86_encoder* enc, char reg_1, char reg_2)
 	x86_encoder_write_modrm_rex(enc, X86_CMP_MODRM, reg_1, reg_2, 1);
 }
 
+void x86_encoder_write_test_reg(struct x86_encoder* enc, char reg_1, char reg_2)
+{
+	x86_encoder_write_modrm_rex(enc, X86_TEST_MODRM, reg_1, reg_2, 1);
+}
+
+// 64bit group 1 operation (X86_OP_MODRM_*) with a sign extended 8bit
+// or 32bit immediate
+void x86_encoder_write_op_imm(struct x86_encoder* enc, char operation, char reg, int32_t value)
+{
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 7);
+	if (value >= -128 && value <= 127) {
+		_x86_encoder_prepare_modrm_rex(enc, X86_OP_LONG_IMM8_MODRM, reg, operation, 1);
+		ENC_X(enc, 3) = (char)value;
+		ENC_ADVANCE(enc, 4);
+	} else {
+		_x86_encoder_prepare_modrm_rex(enc, X86_OP_IMM_MODRM, reg, operation, 1);
+		*(int32_t*)&ENC_X(enc, 3) = value;
+		ENC_ADVANCE(enc, 7);
+	}
+	struct x86_instruction* ins = x86_encoder_record(enc, offset,
+		operation == X86_OP_MODRM_CMP ? X86_INSTRUCTION_CMP_IMM : X86_INSTRUCTION_OTHER);
+	ins->rm = reg;
+	ins->reg = operation;
+	ins->size = 8;
+	ins->immediate = value;
+}
+
+// CMP with a sign extended 8bit or 32bit immediate
+void x86_encoder_write_cmp_imm(struct x86_encoder* enc, char reg, int32_t value)
+{
+	x86_encoder_write_op_imm(enc, X86_OP_MODRM_CMP, reg, value);
+}
+
+// 64bit shift (X86_SHIFT_MODRM_*) by an immediate amount
+void x86_encoder_write_shift_imm(struct x86_encoder* enc, char operation, char reg, uint8_t amount)
+{
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 4);
+	_x86_encoder_prepare_modrm_rex(enc, X86_SHIFT_IMM8_MODRM, reg, operation, 1);
+	ENC_X(enc, 3) = amount;
+	ENC_ADVANCE(enc, 4);
+	struct x86_instruction* ins = x86_encoder_record(enc, offset, X86_INSTRUCTION_OTHER);
+	ins->rm = reg;
+	ins->reg = operation;
+	ins->size = 8;
+	ins->immediate = amount;
+}
+
+// CQO, sign extends RAX into RDX
+void x86_encoder_write_cqo(struct x86_encoder* enc)
+{
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 2);
+	ENC_X(enc, 0) = X86_REX_FIELD(0, 0, 0, 1);
+	ENC_X(enc, 1) = X86_CQO;
+	ENC_ADVANCE(enc, 2);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_OTHER);
+}
+
 
 void x86_encoder_write_modrm(struct x86_encoder* enc, char opcode, char reg_1, char reg_2)
 {
@@ -368,87 +604,838 @@ void x86_encoder_write_modrm_32(struct x86_encoder* enc, char opcode, char reg_1
 
 void x86_encoder_write_modrm_16(struct x86_encoder* enc, char opcode, char reg_1, char reg_2)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 4);
 	ENC_X(enc, 0) = X86_OPERAND_SIZE_OVERRIDE;
 	ENC_ADVANCE(enc, 1);
 	_x86_encoder_prepare_modrm_rex(enc, opcode, reg_1, reg_2, 0);
 	ENC_ADVANCE(enc, 3);
+	_x86_encoder_record_modrm(enc, offset, opcode, reg_1, reg_2, 2);
 }
 
 void x86_encoder_write_modrm_8(struct x86_encoder* enc, char opcode, char reg_1, char reg_2)
 {
-	x86_encoder_write_modrm_rex(enc, opcode - 1, reg_1, reg_2, 0);
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 3);
+	_x86_encoder_prepare_modrm_rex(enc, opcode - 1, reg_1, reg_2, 0);
+	ENC_ADVANCE(enc, 3);
+	_x86_encoder_record_modrm(enc, offset, opcode, reg_1, reg_2, 1);
+}
+
+// Writes the ModR/M byte at "length" bytes into the instruction, followed
+// by the SIB byte and displacement a memory operand needs. Returns the new
+// length
+size_t _x86_encoder_put_modrm_operand(struct x86_encoder* enc, size_t length, int memory, char base, int32_t disp, char reg)
+{
+	struct x86_modrm* modrm = ((struct x86_modrm*)&ENC_X(enc, length++));
+	modrm->rm = base & 0x07;
+	modrm->reg = reg & 0x07;
+	modrm->mod = X86_MOD_REGISTER;
+
+	if (memory) {
+		if ((base & 0x07) == X86_REG_SP)
+			ENC_X(enc, length++) = X86_SIB_BASE_ONLY;
+
+		if (disp == 0 && (base & 0x07) != X86_REG_BP) {
+			modrm->mod = X86_MOD_INDIRECT;
+		} else if (disp >= -128 && disp <= 127) {
+			modrm->mod = X86_MOD_DISP8;
+			ENC_X(enc, length++) = (char)disp;
+		} else {
+			modrm->mod = X86_MOD_DISP32;
+			*(int32_t*)&ENC_X(enc, length) = disp;
+			length += 4;
+		}
+	}
+	return length;
+}
+
+// ModR/M instruction with an optional legacy or mandatory prefix (0 for
+// none) and 0x0F escape. With "memory" set the R/M operand is the memory
+// at [base + disp], otherwise the register "base". Memory operands use
+// the shortest displacement form, RSP and R12 as base need a SIB byte and
+// RBP and R13 as base always need a displacement
+void x86_encoder_write_modrm_generic(struct x86_encoder* enc, unsigned char prefix, int escape, unsigned char opcode,
+	int memory, char base, int32_t disp, char reg, int wide)
+{
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 11);
+	size_t length = 0;
+
+	if (prefix)
+		ENC_X(enc, length++) = prefix;
+	ENC_X(enc, length++) = X86_REX_FIELD(base & 0x08, 0, reg & 0x08, wide);
+	if (escape)
+		ENC_X(enc, length++) = X86_0F;
+	ENC_X(enc, length++) = opcode;
+	length = _x86_encoder_put_modrm_operand(enc, length, memory, base, disp, reg);
+	ENC_ADVANCE(enc, length);
+
+	//Only the plain forms are known to the peephole optimizer
+	int kind = X86_INSTRUCTION_OTHER;
+	if (!prefix && !escape)
+		kind = memory ? X86_INSTRUCTION_MODRM_MEM : X86_INSTRUCTION_MODRM;
+	struct x86_instruction* ins = x86_encoder_record(enc, offset, kind);
+	ins->opcode = opcode;
+	ins->rm = base;
+	ins->reg = reg;
+	ins->size = wide ? 8 : 4;
+	ins->immediate = disp;
+}
+
+// VEX encoded instruction. "prefix" is the implied mandatory prefix (0,
+// 0x66, 0xF3 or 0xF2), "map" the opcode map (X86_VEX_MAP_*), "wide" the
+// W bit, "long_vector" selects the 256bit form and "source" is the extra
+// register operand, 0 if unused. The 2 byte VEX form is used when it can
+// express the instruction
+void x86_encoder_write_vex_modrm(struct x86_encoder* enc, unsigned char prefix, int map, int wide, int long_vector,
+	unsigned char opcode, int memory, char base, int32_t disp, char reg, char source)
+{
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 11);
+	size_t length = 0;
+
+	int pp = 0;
+	if (prefix == X86_OPERAND_SIZE_OVERRIDE)
+		pp = 1;
+	else if (prefix == X86_PREFIX_SS)
+		pp = 2;
+	else if (prefix == X86_PREFIX_SD)
+		pp = 3;
+	unsigned char tail = ((~source & 0x0F) << 3) | (long_vector ? 0x04 : 0) | pp;
+
+	if ((base & 0x08) || wide || map != X86_VEX_MAP_0F) {
+		ENC_X(enc, length++) = X86_VEX_3;
+		//Inverted R, X and B
+		ENC_X(enc, length++) = (reg & 0x08 ? 0 : 0x80) | 0x40 | (base & 0x08 ? 0 : 0x20) | map;
+		ENC_X(enc, length++) = (wide ? 0x80 : 0) | tail;
+	} else {
+		ENC_X(enc, length++) = X86_VEX_2;
+		ENC_X(enc, length++) = (reg & 0x08 ? 0 : 0x80) | tail;
+	}
+	ENC_X(enc, length++) = opcode;
+	length = _x86_encoder_put_modrm_operand(enc, length, memory, base, disp, reg);
+	ENC_ADVANCE(enc, length);
+
+	struct x86_instruction* ins = x86_encoder_record(enc, offset, X86_INSTRUCTION_OTHER);
+	ins->opcode = opcode;
+	ins->rm = base;
+	ins->reg = reg;
+	ins->size = long_vector ? 32 : 16;
+	ins->immediate = disp;
+}
+
+// VZEROUPPER, avoids the penalty of mixing 256bit and legacy SSE code
+void x86_encoder_write_vzeroupper(struct x86_encoder* enc)
+{
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 3);
+	ENC_X(enc, 0) = X86_VEX_2;
+	ENC_X(enc, 1) = 0xF8;
+	ENC_X(enc, 2) = X86_0F_VZEROUPPER;
+	ENC_ADVANCE(enc, 3);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_OTHER);
+}
+
+// REP prefixed string instruction (X86_MOVS*, X86_STOS*), the count is
+// in RCX. The 64bit variants need "wide" set
+void x86_encoder_write_rep(struct x86_encoder* enc, unsigned char opcode, int wide)
+{
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 3);
+	size_t length = 0;
+	ENC_X(enc, length++) = X86_PREFIX_REP;
+	if (wide)
+		ENC_X(enc, length++) = X86_REX_FIELD(0, 0, 0, 1);
+	ENC_X(enc, length++) = opcode;
+	ENC_ADVANCE(enc, length);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_OTHER)->opcode = opcode;
+}
+
+void x86_encoder_write_modrm_mem_rex(struct x86_encoder* enc, char opcode, char base, int32_t disp, char reg, int wide)
+{
+	x86_encoder_write_modrm_generic(enc, 0, 0, opcode, 1, base, disp, reg, wide);
+}
+
+// MOV reg, [base + disp]
+void x86_encoder_write_load(struct x86_encoder* enc, char reg, char base, int32_t disp)
+{
+	x86_encoder_write_modrm_mem_rex(enc, X86_MOV_LOAD_MODRM, base, disp, reg, 1);
+}
+
+// MOV [base + disp], reg
+void x86_encoder_write_store(struct x86_encoder* enc, char base, int32_t disp, char reg)
+{
+	x86_encoder_write_modrm_mem_rex(enc, X86_MOV_MODRM, base, disp, reg, 1);
+}
+
+// LEA reg, [base + disp]
+void x86_encoder_write_lea(struct x86_encoder* enc, char reg, char base, int32_t disp)
+{
+	x86_encoder_write_modrm_mem_rex(enc, X86_LEA_MODRM, base, disp, reg, 1);
+}
+
+// LEA reg, [RIP + label], the address of the label
+void x86_encoder_write_lea_label(struct x86_encoder* enc, char reg, size_t label)
+{
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 7);
+	ENC_X(enc, 0) = X86_REX_FIELD(0, 0, reg & 0x08, 1);
+	ENC_X(enc, 1) = X86_LEA_MODRM;
+	//Indirect through RBP means relative to the end of the instruction
+	struct x86_modrm* modrm = ((struct x86_modrm*)&ENC_X(enc, 2));
+	modrm->rm = X86_REG_BP;
+	modrm->reg = reg & 0x07;
+	modrm->mod = X86_MOD_INDIRECT;
+	ENC_ADVANCE(enc, 3);
+	*(uint32_t*)(enc->buffer + enc->buffer_size) = 0;
+	x86_encoder_add_relocation(enc, label, 1);
+	ENC_ADVANCE(enc, 4);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_OTHER)->opcode = X86_LEA_MODRM;
+}
+
+// LEA reg, [base + index * (1 << scale)], "scale" is 0 to 3 and "index"
+// cannot be RSP. RBP and R13 as base need a zero displacement byte
+void x86_encoder_write_lea_index(struct x86_encoder* enc, char reg, char base, char index, int scale)
+{
+	size_t offset = enc->buffer_size;
+	x86_encoder_check_buffer(enc, 5);
+	size_t length = 0;
+	ENC_X(enc, length++) = X86_REX_FIELD(base & 0x08, index & 0x08, reg & 0x08, 1);
+	ENC_X(enc, length++) = X86_LEA_MODRM;
+	struct x86_modrm* modrm = ((struct x86_modrm*)&ENC_X(enc, length++));
+	modrm->rm = X86_REG_SP;
+	modrm->reg = reg & 0x07;
+	modrm->mod = X86_MOD_INDIRECT;
+	ENC_X(enc, length++) = (char)((scale << 6) | ((index & 0x07) << 3) | (base & 0x07));
+	if ((base & 0x07) == X86_REG_BP) {
+		modrm->mod = X86_MOD_DISP8;
+		ENC_X(enc, length++) = 0;
+	}
+	ENC_ADVANCE(enc, length);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_OTHER)->opcode = X86_LEA_MODRM;
 }
 
 void x86_encoder_write_mov_imm_64(struct x86_encoder* enc, char reg, uint64_t value)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 11);
 	ENC_X(enc, 0) = X86_REX_FIELD(reg & 0x08, 0, 0, 1);
 	ENC_X(enc, 1) = X86_MOV_REG_IMM_LONG(reg & 0x07);
 	*(uint64_t*)(&ENC_X(enc,2)) = value;
 	ENC_ADVANCE(enc, 2 + 8);
+	struct x86_instruction* ins = x86_encoder_record(enc, offset, X86_INSTRUCTION_MOV_IMM);
+	ins->rm = reg;
+	ins->size = 8;
+	ins->immediate = value;
 }
 
 
 void x86_encoder_write_mov_imm_32(struct x86_encoder* enc, char reg, uint32_t value)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 6);
 	ENC_X(enc, 0) = X86_REX_FIELD(reg & 0x08, 0, 0, 0);
 	ENC_X(enc, 1) = X86_MOV_REG_IMM_LONG(reg & 0x07);
 	*(uint32_t*)(&ENC_X(enc,2)) = value;
 	ENC_ADVANCE(enc, 2 + 4);
+	struct x86_instruction* ins = x86_encoder_record(enc, offset, X86_INSTRUCTION_MOV_IMM);
+	ins->rm = reg;
+	ins->size = 4;
+	ins->immediate = value;
 }
 
 void x86_encoder_write_mov_imm_16(struct x86_encoder* enc, char reg, uint16_t value)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 5);
 	ENC_X(enc, 0) = X86_OPERAND_SIZE_OVERRIDE;
 	ENC_X(enc, 1) = X86_REX_FIELD(reg & 0x08, 0, 0, 0);
 	ENC_X(enc, 2) = X86_MOV_REG_IMM_LONG(reg & 0x07);
 	*(uint16_t*)(&ENC_X(enc, 3)) = value;
 	ENC_ADVANCE(enc, 3 + 2);
+	struct x86_instruction* ins = x86_encoder_record(enc, offset, X86_INSTRUCTION_MOV_IMM);
+	ins->rm = reg;
+	ins->size = 2;
+	ins->immediate = value;
 }
 
 void x86_encoder_write_mov_imm_8(struct x86_encoder* enc, char reg, uint8_t value)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 3);
 	ENC_X(enc, 0) = X86_REX_FIELD(reg & 0x08, 0, 0, 0);
 	ENC_X(enc, 1) = X86_MOV_REG_IMM_LOW(reg & 0x07);
 	*(uint8_t*)(&ENC_X(enc, 2)) = value;
 	ENC_ADVANCE(enc, 2 + 1);
+	struct x86_instruction* ins = x86_encoder_record(enc, offset, X86_INSTRUCTION_MOV_IMM);
+	ins->rm = reg;
+	ins->size = 1;
+	ins->immediate = value;
+}
+
+// Loads a 64bit register with the shortest MOV form for the value
+void x86_encoder_write_mov_imm(struct x86_encoder* enc, char reg, int64_t value)
+{
+	if (value >= 0 && value <= 0xFFFFFFFFLL) {
+		x86_encoder_write_mov_imm_32(enc, reg, value);
+	} else if (value >= INT32_MIN && value <= INT32_MAX) {
+		size_t offset = enc->buffer_size;
+		x86_encoder_check_buffer(enc, 7);
+		_x86_encoder_prepare_modrm_rex(enc, X86_MOV_IMM_MODRM, reg, 0, 1);
+		*(int32_t*)&ENC_X(enc, 3) = value;
+		ENC_ADVANCE(enc, 7);
+		struct x86_instruction* ins = x86_encoder_record(enc, offset, X86_INSTRUCTION_MOV_IMM);
+		ins->rm = reg;
+		ins->size = 8;
+		ins->immediate = value;
+	} else {
+		x86_encoder_write_mov_imm_64(enc, reg, value);
+	}
 }
 
 void x86_encoder_write_push(struct x86_encoder* enc, char reg)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 2);
 	ENC_X(enc, 0) = X86_REX_FIELD(reg & 0x08, 0, 0, 0);
 	ENC_X(enc, 1) = X86_PUSH_REG(reg & 0x07);
 	ENC_ADVANCE(enc, 2);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_PUSH)->rm = reg;
 }
 
 void x86_encoder_write_pop(struct x86_encoder* enc, char reg)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 2);
 	ENC_X(enc, 0) = X86_REX_FIELD(reg & 0x08, 0, 0, 0);
 	ENC_X(enc, 1) = X86_POP_REG(reg & 0x07);
 	ENC_ADVANCE(enc, 2);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_POP)->rm = reg;
 }
 
 void x86_encoder_write_ret(struct x86_encoder* enc)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 1);
 	ENC_X(enc, 0) = X86_RET;
 	ENC_ADVANCE(enc, 1);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_RET);
 }
 
 void x86_encoder_write_nop(struct x86_encoder* enc)
 {
+	size_t offset = enc->buffer_size;
 	x86_encoder_check_buffer(enc, 1);
 	ENC_X(enc, 0) = X86_NOP;
 	ENC_ADVANCE(enc, 1);
+	x86_encoder_record(enc, offset, X86_INSTRUCTION_NOP);
 }
 
 
+/*
+	Parallel moves
+
+	Writes a set of 64bit register moves that happen at the same time:
+	every destination receives the value its source had before any of
+	the moves. Destinations must be distinct, a source may feed several
+	destinations.
+
+	A move is written as soon as no other pending move still reads its
+	destination. When no such move is left, the remaining moves form
+	cycles. A cycle of n registers is broken with n - 1 XCHG instructions,
+	or with n + 1 moves through "scratch" if it is not negative. Every
+	other move is written exactly once, which is the minimum.
+
+	Returns the amount of instructions written.
+*/
+
+int x86_encoder_write_parallel_move(struct x86_encoder* enc, const char* destinations, const char* sources, size_t count, int scratch)
+{
+	char* dst = malloc(count + 1);
+	char* src = malloc(count + 1);
+	size_t pending = 0;
+	int written = 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		if (destinations[i] == sources[i])
+			continue;
+		dst[pending] = destinations[i];
+		src[pending] = sources[i];
+		pending += 1;
+	}
+
+	while (pending) {
+		size_t ready = pending;
+		for (size_t i = 0; i < pending && ready == pending; ++i) {
+			size_t k = 0;
+			while (k < pending && src[k] != dst[i])
+				k += 1;
+			if (k == pending)
+				ready = i;
+		}
+
+		if (ready < pending) {
+			x86_encoder_write_modrm(enc, X86_MOV_MODRM, dst[ready], src[ready]);
+			written += 1;
+		} else if (scratch < 0) {
+			//Afterwards the destination holds its value and the old value
+			//of the destination is in the source
+			x86_encoder_write_modrm(enc, X86_XCHG_MODRM, dst[0], src[0]);
+			written += 1;
+			char moved = dst[0];
+			char to = src[0];
+			for (size_t k = 1; k < pending; ++k) {
+				if (src[k] == moved)
+					src[k] = to;
+			}
+			ready = 0;
+		} else {
+			//Free the destination by keeping its value in the scratch
+			x86_encoder_write_modrm(enc, X86_MOV_MODRM, scratch, dst[0]);
+			written += 1;
+			for (size_t k = 0; k < pending; ++k) {
+				if (src[k] == dst[0])
+					src[k] = scratch;
+			}
+			continue;
+		}
+
+		pending -= 1;
+		dst[ready] = dst[pending];
+		src[ready] = src[pending];
+		//Moves turned into no-ops by an exchange
+		for (size_t k = 0; k < pending; ) {
+			if (dst[k] == src[k]) {
+				pending -= 1;
+				dst[k] = dst[pending];
+				src[k] = src[pending];
+			} else {
+				k += 1;
+			}
+		}
+	}
+
+	free(dst);
+	free(src);
+	return written;
+}
+
+
+/*
+	Peephole optimization
+
+	Works on the instruction records before relocations are applied. The
+	rules below are tried at every instruction until none of them applies
+	anywhere anymore. Removing an instruction moves the bytes after it
+	and every label, relocation and record past it, which is safe as jumps
+	are only resolved when relocating.
+
+	Instructions that are jump targets (a label points to them) are never
+	removed when the rule relies on the instruction before them.
+
+	Only the code from a given instruction and a given label on is
+	optimized, so a function can be cleaned up right after it was emitted
+	into a buffer holding many. All the work stays within that code: older
+	labels are never followed, as they may belong to code placed earlier
+	or to code placed later, and they must not point past its start.
+	Labels not placed yet point to where the buffer ended when they were
+	added, which satisfies that.
+*/
+
+struct x86_peephole_stats
+{
+	size_t instructions_removed;
+	size_t bytes_saved;
+	size_t jumps_retargeted;
+	size_t passes;
+};
+
+// State of a peephole run over the end of the buffer
+struct x86_peephole
+{
+	struct x86_encoder* enc;
+	struct x86_peephole_stats* stats;
+	size_t start; //Offset of the first optimized instruction
+	size_t first; //Index of the first optimized instruction
+	size_t first_label; //Index of the first label of the optimized code
+	size_t first_relocation; //Index of the first relocation past the start
+	size_t* labels; //Labels of the optimized code by offset
+	size_t labels_size;
+};
+
+void x86_encoder_remove_instruction(struct x86_peephole* p, size_t index)
+{
+	struct x86_encoder* enc = p->enc;
+	struct x86_instruction* ins = enc->instructions + index;
+	size_t offset = ins->offset;
+	size_t length = ins->length;
+
+	memmove(enc->buffer + offset, enc->buffer + offset + length, enc->buffer_size - offset - length);
+	enc->buffer_size -= length;
+
+	for (size_t i = 0; i < p->labels_size; i++) {
+		if (enc->labels[p->labels[i]] > offset)
+			enc->labels[p->labels[i]] -= length;
+	}
+
+	//Relocations are added in the order of their offsets
+	size_t removed_relocation = (size_t)-1;
+	size_t relocations = p->first_relocation;
+	for (size_t i = p->first_relocation; i < enc->relocations_size; i++) {
+		struct x86_relocation* reloc = enc->relocations + i;
+		if (reloc->offset >= offset && reloc->offset < offset + length) {
+			removed_relocation = i;
+			continue;
+		}
+		if (reloc->offset > offset)
+			reloc->offset -= length;
+		enc->relocations[relocations++] = *reloc;
+	}
+	enc->relocations_size = relocations;
+
+	memmove(ins, ins + 1, (enc->instructions_size - index - 1) * sizeof *ins);
+	enc->instructions_size -= 1;
+	for (size_t i = p->first; i < enc->instructions_size; i++) {
+		if (i >= index)
+			enc->instructions[i].offset -= length;
+		if (removed_relocation != (size_t)-1 && enc->instructions[i].relocation > removed_relocation
+			&& enc->instructions[i].relocation != (size_t)-1)
+			enc->instructions[i].relocation -= 1;
+	}
+}
+
+int x86_peephole_has_label(struct x86_peephole* p, size_t offset)
+{
+	size_t low = 0;
+	size_t high = p->labels_size;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (p->enc->labels[p->labels[mid]] < offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low < p->labels_size && p->enc->labels[p->labels[low]] == offset;
+}
+
+// Index of the instruction at the offset, instructions_size if none
+size_t x86_peephole_instruction_at(struct x86_peephole* p, size_t offset)
+{
+	struct x86_encoder* enc = p->enc;
+	size_t low = p->first;
+	size_t high = enc->instructions_size;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (enc->instructions[mid].offset < offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low < enc->instructions_size && enc->instructions[low].offset == offset)
+		return low;
+	return enc->instructions_size;
+}
+
+// Index of the instruction a label points to, instructions_size if it is
+// outside the optimized code
+size_t x86_peephole_label_target(struct x86_peephole* p, size_t label)
+{
+	if (label < p->first_label || p->enc->labels[label] <= p->start)
+		return p->enc->instructions_size;
+	return x86_peephole_instruction_at(p, p->enc->labels[label]);
+}
+
+size_t x86_peephole_jump_label(struct x86_encoder* enc, struct x86_instruction* ins)
+{
+	return enc->relocations[ins->relocation].label;
+}
+
+int x86_peephole_is_jump(struct x86_instruction* ins)
+{
+	return (ins->kind == X86_INSTRUCTION_JMP && !ins->call) || ins->kind == X86_INSTRUCTION_JMP_COND;
+}
+
+// MOV r64, r64 to itself and MOV a, b; MOV b, a pairs
+int x86_peephole_redundant_mov(struct x86_peephole* p, size_t index)
+{
+	struct x86_encoder* enc = p->enc;
+	struct x86_instruction* ins = enc->instructions + index;
+	if (ins->kind != X86_INSTRUCTION_MODRM || ins->opcode != X86_MOV_MODRM)
+		return 0;
+
+	//32bit moves clear the upper half and are not no-ops
+	if (ins->rm == ins->reg && ins->size == 8) {
+		x86_encoder_remove_instruction(p, index);
+		p->stats->instructions_removed += 1;
+		return 1;
+	}
+
+	if (index + 1 >= enc->instructions_size)
+		return 0;
+	struct x86_instruction* next = ins + 1;
+	if (next->kind != X86_INSTRUCTION_MODRM || next->opcode != X86_MOV_MODRM || next->size != ins->size || ins->size == 4)
+		return 0;
+	if (next->rm != ins->reg || next->reg != ins->rm || x86_peephole_has_label(p, next->offset))
+		return 0;
+	x86_encoder_remove_instruction(p, index + 1);
+	p->stats->instructions_removed += 1;
+	return 1;
+}
+
+// Jumps to the instruction right after them
+int x86_peephole_jump_to_next(struct x86_peephole* p, size_t index)
+{
+	struct x86_encoder* enc = p->enc;
+	struct x86_instruction* ins = enc->instructions + index;
+	if (!x86_peephole_is_jump(ins))
+		return 0;
+	if (enc->labels[x86_peephole_jump_label(enc, ins)] != ins->offset + ins->length)
+		return 0;
+	x86_encoder_remove_instruction(p, index);
+	p->stats->instructions_removed += 1;
+	return 1;
+}
+
+// Jumps to unconditional jumps go directly to the final destination
+int x86_peephole_jump_to_jump(struct x86_peephole* p, size_t index)
+{
+	struct x86_encoder* enc = p->enc;
+	struct x86_instruction* ins = enc->instructions + index;
+	if (!x86_peephole_is_jump(ins))
+		return 0;
+
+	size_t label = x86_peephole_jump_label(enc, ins);
+	size_t final = label;
+	for (int steps = 0; ; steps++) {
+		size_t target = x86_peephole_label_target(p, final);
+		if (target >= enc->instructions_size)
+			break;
+		struct x86_instruction* jump = enc->instructions + target;
+		if (jump->kind != X86_INSTRUCTION_JMP || jump->call)
+			break;
+		//Give up on jump cycles
+		if (steps > 16 || target == index)
+			return 0;
+		final = x86_peephole_jump_label(enc, jump);
+	}
+	if (enc->labels[final] == enc->labels[label])
+		return 0;
+	enc->relocations[ins->relocation].label = final;
+	p->stats->jumps_retargeted += 1;
+	return 1;
+}
+
+// Jcc L1; JMP L2; L1: becomes Jncc L2; L1:
+int x86_peephole_branch_over_jump(struct x86_peephole* p, size_t index)
+{
+	struct x86_encoder* enc = p->enc;
+	struct x86_instruction* ins = enc->instructions + index;
+	if (ins->kind != X86_INSTRUCTION_JMP_COND || index + 1 >= enc->instructions_size)
+		return 0;
+	struct x86_instruction* next = ins + 1;
+	if (next->kind != X86_INSTRUCTION_JMP || next->call || x86_peephole_has_label(p, next->offset))
+		return 0;
+	if (enc->labels[x86_peephole_jump_label(enc, ins)] != next->offset + next->length)
+		return 0;
+
+	ins->reg ^= 1;
+	enc->buffer[ins->offset + 1] = X86_0F_JMP_COND_REL32(ins->reg);
+	enc->relocations[ins->relocation].label = x86_peephole_jump_label(enc, next);
+	x86_encoder_remove_instruction(p, index + 1);
+	p->stats->instructions_removed += 1;
+	return 1;
+}
+
+// Effect of an instruction on the status flags
+#define X86_FLAGS_KEEP (0) //Neither reads nor writes
+#define X86_FLAGS_WRITE (1) //Overwrites all of them without reading
+#define X86_FLAGS_UNKNOWN (2) //Reads or partially writes
+
+int x86_peephole_flags_effect(struct x86_instruction* ins)
+{
+	switch (ins->kind) {
+		case X86_INSTRUCTION_MOV_IMM:
+		case X86_INSTRUCTION_PUSH:
+		case X86_INSTRUCTION_POP:
+		case X86_INSTRUCTION_NOP:
+			return X86_FLAGS_KEEP;
+		case X86_INSTRUCTION_CMP_IMM:
+		case X86_INSTRUCTION_RET:
+			return X86_FLAGS_WRITE;
+		case X86_INSTRUCTION_MODRM:
+			break;
+		case X86_INSTRUCTION_MODRM_MEM:
+			if (ins->opcode == X86_MOV_MODRM || ins->opcode == X86_MOV_LOAD_MODRM || ins->opcode == X86_LEA_MODRM)
+				return X86_FLAGS_KEEP;
+			return X86_FLAGS_UNKNOWN;
+		default:
+			return X86_FLAGS_UNKNOWN;
+	}
+
+	switch (ins->opcode) {
+		case X86_ADD_MODRM:
+		case X86_OR_MODRM:
+		case X86_AND_MODRM:
+		case X86_SUB_MODRM:
+		case X86_XOR_MODRM:
+		case X86_CMP_MODRM:
+		case X86_TEST_MODRM:
+			return X86_FLAGS_WRITE;
+		case X86_MOV_MODRM:
+		case X86_XCHG_MODRM:
+			return X86_FLAGS_KEEP;
+		case X86_F7_MODRM:
+			return ins->reg == X86_F7_MODRM_NOT ? X86_FLAGS_KEEP : X86_FLAGS_WRITE;
+		case X86_FF_MODRM:
+			//Calls do not preserve flags, INC and DEC keep the carry
+			return ins->reg == X86_FF_MODRM_CALL ? X86_FLAGS_WRITE : X86_FLAGS_UNKNOWN;
+	}
+	return X86_FLAGS_UNKNOWN;
+}
+
+// Whether the flags produced right before instruction "index" are only
+// read by conditional jumps using the allowed conditions (bit mask)
+int x86_peephole_flags_used_only_by(struct x86_peephole* p, size_t index, unsigned allowed, int* budget)
+{
+	struct x86_encoder* enc = p->enc;
+	while (index < enc->instructions_size) {
+		struct x86_instruction* ins = enc->instructions + index;
+		if (--(*budget) < 0)
+			return 0;
+
+		if (ins->kind == X86_INSTRUCTION_JMP_COND) {
+			if (!(allowed & (1u << ins->reg)))
+				return 0;
+			size_t target = x86_peephole_label_target(p, x86_peephole_jump_label(enc, ins));
+			if (target >= enc->instructions_size || !x86_peephole_flags_used_only_by(p, target, allowed, budget))
+				return 0;
+			index += 1;
+			continue;
+		}
+		if (ins->kind == X86_INSTRUCTION_JMP) {
+			if (ins->call)
+				return 1;
+			index = x86_peephole_label_target(p, x86_peephole_jump_label(enc, ins));
+			if (index >= enc->instructions_size)
+				return 0;
+			continue;
+		}
+
+		int effect = x86_peephole_flags_effect(ins);
+		if (effect == X86_FLAGS_WRITE)
+			return 1;
+		if (effect == X86_FLAGS_UNKNOWN)
+			return 0;
+		index += 1;
+	}
+	return 1;
+}
+
+// TEST r, r or CMP r, 0 right after an instruction that already set the
+// flags from r. Logical operations clear CF and OF just like TEST does,
+// arithmetic ones only agree on ZF and SF
+int x86_peephole_redundant_test(struct x86_peephole* p, size_t index)
+{
+	struct x86_encoder* enc = p->enc;
+	struct x86_instruction* ins = enc->instructions + index;
+	int is_test = ins->kind == X86_INSTRUCTION_MODRM && ins->opcode == X86_TEST_MODRM && ins->rm == ins->reg;
+	int is_cmp = ins->kind == X86_INSTRUCTION_CMP_IMM && ins->immediate == 0;
+	if ((!is_test && !is_cmp) || index == 0 || enc->instructions[index - 1].offset < p->start || x86_peephole_has_label(p, ins->offset))
+		return 0;
+
+	struct x86_instruction* previous = ins - 1;
+	if (previous->kind != X86_INSTRUCTION_MODRM || previous->rm != ins->rm || previous->size != ins->size)
+		return 0;
+
+	unsigned allowed;
+	switch (previous->opcode) {
+		case X86_AND_MODRM:
+		case X86_OR_MODRM:
+		case X86_XOR_MODRM:
+			allowed = 0xFFFF;
+			break;
+		case X86_ADD_MODRM:
+		case X86_SUB_MODRM:
+			allowed = (1 << X86_COND_E) | (1 << X86_COND_NE) | (1 << X86_COND_S) | (1 << X86_COND_NS);
+			break;
+		case X86_F7_MODRM:
+			if (previous->reg != X86_F7_MODRM_NEG)
+				return 0;
+			allowed = (1 << X86_COND_E) | (1 << X86_COND_NE) | (1 << X86_COND_S) | (1 << X86_COND_NS);
+			break;
+		default:
+			return 0;
+	}
+
+	int budget = 64;
+	if (!x86_peephole_flags_used_only_by(p, index + 1, allowed, &budget))
+		return 0;
+	x86_encoder_remove_instruction(p, index);
+	p->stats->instructions_removed += 1;
+	return 1;
+}
+
+typedef int (*x86_peephole_rule)(struct x86_peephole* p, size_t index);
+
+static const x86_peephole_rule x86_peephole_rules[] = {
+	x86_peephole_redundant_mov,
+	x86_peephole_jump_to_jump,
+	x86_peephole_branch_over_jump,
+	x86_peephole_jump_to_next,
+	x86_peephole_redundant_test,
+};
+
+// Rewrites the encoded instructions from instruction "first" on until no
+// rule applies, following only labels from "first_label" on. Must be run
+// before relocations are applied
+void x86_encoder_peephole(struct x86_encoder* enc, size_t first, size_t first_label, struct x86_peephole_stats* stats)
+{
+	size_t initial_size = enc->buffer_size;
+	memset(stats, 0, sizeof *stats);
+	if (first >= enc->instructions_size)
+		return;
+
+	struct x86_peephole p;
+	p.enc = enc;
+	p.stats = stats;
+	p.start = enc->instructions[first].offset;
+	p.first = first;
+	p.first_label = first_label;
+	p.first_relocation = enc->relocations_size;
+	while (p.first_relocation > 0 && enc->relocations[p.first_relocation - 1].offset >= p.start)
+		p.first_relocation -= 1;
+
+	//Labels are mostly added in order, so an insertion sort is cheap
+	p.labels_size = first_label < enc->labels_size ? enc->labels_size - first_label : 0;
+	p.labels = malloc((p.labels_size + 1) * sizeof *p.labels);
+	for (size_t i = 0; i < p.labels_size; i++) {
+		size_t label = first_label + i;
+		size_t k = i;
+		while (k > 0 && enc->labels[p.labels[k - 1]] > enc->labels[label]) {
+			p.labels[k] = p.labels[k - 1];
+			k -= 1;
+		}
+		p.labels[k] = label;
+	}
+
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		stats->passes += 1;
+		for (size_t i = first; i < enc->instructions_size; i++) {
+			for (size_t r = 0; r < sizeof x86_peephole_rules / sizeof *x86_peephole_rules; r++) {
+				if (i < enc->instructions_size && x86_peephole_rules[r](&p, i))
+					changed = 1;
+			}
+		}
+	}
+	free(p.labels);
+	stats->bytes_saved = initial_size - enc->buffer_size;
+}
+
+
+#ifndef X86_ENCODER_NO_MAIN
 int main(int argc, const char** argv)
 {
 	struct x86_encoder enc;
@@ -499,6 +1486,10 @@ int main(int argc, const char** argv)
 	//value returned is in returned in RAX
 	x86_encoder_write_ret(&enc);
 
+	struct x86_peephole_stats stats;
+	x86_encoder_peephole(&enc, 0, 0, &stats);
+	printf("Peephole removed %zu instructions, %zu bytes\n", stats.instructions_removed, stats.bytes_saved);
+
 
 	//allocate executable memory
 	char* target_mem = mmap(0, enc.buffer_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -560,3 +1551,4 @@ int main(int argc, const char** argv)
 	
 	return 0;
 }
+#endif
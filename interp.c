@@ -0,0 +1,1565 @@
+/*
+	Interpreter for the intermediate representation.
+
+	Runs functions without lowering them first, which is the cheapest way
+	to start code that only runs a few times. Functions that are called
+	often are handed to the lowering and run natively from then on, so
+	interpreted and native functions call each other freely.
+*/
+
+#define LOWER_NO_MAIN
+#include "lower.c"
+#include <time.h>
+
+
+/*
+	Decoded code
+
+	Functions are decoded on their first call. Variables and arguments
+	become offsets into the frame, immediates are extended to 64 bits and
+	every instruction gets the handler for the types involved, so running
+	it does no decoding anymore. Dispatch is threaded: each instruction
+	holds the address of its handler, which jumps straight to the handler
+	of the next one.
+
+	Every variable and argument has a slot in the frame holding its value
+	at its natural width, like the frame of the lowering. Integers are read
+	extended to 64 bits by their type and written truncated to it, so
+	results match the lowered code.
+*/
+
+enum
+{
+	INTERP_NONE,
+	INTERP_IMMEDIATE,
+	INTERP_SLOT,
+	INTERP_ADDRESS,
+	INTERP_DEREFERENCE,
+	INTERP_FUNCTION,
+};
+
+struct InterpOperand
+{
+	unsigned char kind; //INTERP_NONE to INTERP_FUNCTION
+	unsigned char type; //Type of the value read or written
+	uint32_t offset; //Frame offset of the variable or argument
+	uint64_t value; //Immediate extended to 64 bits, or function id
+};
+
+enum
+{
+	INTERP_NOP,
+	INTERP_COPY,
+	INTERP_COPY_FLOAT,
+	INTERP_COPY_TO_INTEGER,
+	INTERP_COPY_STRUCT,
+	INTERP_ADD,
+	INTERP_SUB,
+	INTERP_MUL,
+	INTERP_DIV,
+	INTERP_DIV_UNSIGNED,
+	INTERP_MUL_HIGH,
+	INTERP_MUL_HIGH_UNSIGNED,
+	INTERP_MUL_HIGH_64,
+	INTERP_MUL_HIGH_64_UNSIGNED,
+	INTERP_SHIFT_LEFT,
+	INTERP_SHIFT_RIGHT,
+	INTERP_SHIFT_RIGHT_ARITHMETIC,
+	INTERP_BIT_AND,
+	INTERP_BIT_OR,
+	INTERP_BIT_XOR,
+	INTERP_BIT_NEG,
+	INTERP_NOT,
+	INTERP_AND,
+	INTERP_OR,
+	INTERP_ADD_F64,
+	INTERP_SUB_F64,
+	INTERP_MUL_F64,
+	INTERP_DIV_F64,
+	INTERP_ADD_F32,
+	INTERP_SUB_F32,
+	INTERP_MUL_F32,
+	INTERP_DIV_F32,
+	INTERP_SET,
+	INTERP_SET_UNSIGNED,
+	INTERP_SET_F64,
+	INTERP_SET_F32,
+	INTERP_GOTO,
+	INTERP_GOTO_IF,
+	INTERP_GOTO_IF_UNSIGNED,
+	INTERP_GOTO_IF_F64,
+	INTERP_GOTO_IF_F32,
+	INTERP_CALL,
+	INTERP_TAIL_CALL,
+	INTERP_RETURN,
+	INTERP_OPS
+};
+
+struct InterpInstruction
+{
+	const void* handler; //Address of the code running the instruction
+	int op; //INTERP_NOP to INTERP_RETURN
+	int comparison; //COMPARISON_* of comparisons
+	int argument; //Target of jumps, structure size of copies, call index of calls
+	struct InterpOperand operands[3];
+};
+
+struct InterpCall
+{
+	struct InterpOperand* arguments;
+	struct TypeInfo* types; //Types the arguments are passed as
+	size_t arguments_size;
+	size_t words; //8 byte words the arguments take in a bridge
+	struct TypeInfo result; //Type of the result, IR_TYPE_VOID for none
+	void* bridge; //Bridge to native callees, made on the first native call
+};
+
+struct InterpCode
+{
+	struct InterpInstruction* instructions; //One per opcode, then a return for the end
+	struct InterpCall* calls;
+	size_t calls_size;
+	uint32_t* offsets; //Frame offsets of the variables, then the arguments
+	uint32_t frame_size;
+};
+
+// Handlers of the INTERP_* operations, set up by interp_run
+static const void* const* interp_handlers;
+
+void free_interp_code(struct InterpCode* code)
+{
+	if (!code)
+		return;
+	for (size_t i = 0; i < code->calls_size; ++i) {
+		free(code->calls[i].arguments);
+		free(code->calls[i].types);
+	}
+	free(code->calls);
+	free(code->instructions);
+	free(code->offsets);
+	free(code);
+}
+
+int interp_decode_operand(struct Function* fn, struct InterpCode* code, struct Operand* operand, struct InterpOperand* out)
+{
+	memset(out, 0, sizeof *out);
+	out->type = operand->type_info.type;
+	switch (operand->info_type) {
+		case OPERAND_INFO_TYPE_IMMEDIATE:
+			out->kind = INTERP_IMMEDIATE;
+			if (operand->type_info.type == IR_TYPE_F32)
+				out->value = operand->value_u32;
+			else if (ir_type_is_signed(operand->type_info.type))
+				out->value = operand_immediate_signed(operand);
+			else
+				out->value = operand_immediate_unsigned(operand);
+			return 0;
+		case OPERAND_INFO_TYPE_FUNCTION:
+			out->kind = INTERP_FUNCTION;
+			out->value = operand->ref_id;
+			return 0;
+		case OPERAND_INFO_TYPE_VARIABLE:
+		case OPERAND_INFO_TYPE_ARGUMENT: {
+			int is_argument = operand->info_type == OPERAND_INFO_TYPE_ARGUMENT;
+			size_t size = is_argument ? fn->arguments_size : fn->variables_size;
+			if (operand->ref_id < 0 || (size_t)operand->ref_id >= size)
+				return -1;
+			out->offset = code->offsets[(is_argument ? fn->variables_size : 0) + operand->ref_id];
+			out->kind = INTERP_SLOT;
+			if (operand->info_flags & OPERAND_FLAG_ADDRESS)
+				out->kind = INTERP_ADDRESS;
+			else if (operand->info_flags & OPERAND_FLAG_DEREFERENCE)
+				out->kind = INTERP_DEREFERENCE;
+			else
+				out->type = is_argument ? fn->arguments[operand->ref_id].type : fn->variables[operand->ref_id].type_info.type;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Decodes an operand that is written, which has to be a variable,
+// argument or dereferenced pointer
+int interp_decode_target(struct Function* fn, struct InterpCode* code, struct Operand* operand, struct InterpOperand* out)
+{
+	if (interp_decode_operand(fn, code, operand, out))
+		return -1;
+	return out->kind == INTERP_SLOT || out->kind == INTERP_DEREFERENCE ? 0 : -1;
+}
+
+int interp_integer_op(int type, int is_signed, int bits)
+{
+	switch (type) {
+		case OPCODE_ADD:
+			return INTERP_ADD;
+		case OPCODE_SUB:
+			return INTERP_SUB;
+		case OPCODE_MUL:
+			return INTERP_MUL;
+		case OPCODE_DIV:
+			return is_signed ? INTERP_DIV : INTERP_DIV_UNSIGNED;
+		case OPCODE_MUL_HIGH:
+			if (bits == 64)
+				return is_signed ? INTERP_MUL_HIGH_64 : INTERP_MUL_HIGH_64_UNSIGNED;
+			return is_signed ? INTERP_MUL_HIGH : INTERP_MUL_HIGH_UNSIGNED;
+		case OPCODE_BIT_SHIFT_LEFT:
+			return INTERP_SHIFT_LEFT;
+		case OPCODE_BIT_SHIFT_LOGICAL_RIGHT:
+			return INTERP_SHIFT_RIGHT;
+		case OPCODE_BIT_SHIFT_ARITHMETIC_RIGHT:
+			return INTERP_SHIFT_RIGHT_ARITHMETIC;
+		case OPCODE_BIT_AND:
+			return INTERP_BIT_AND;
+		case OPCODE_BIT_OR:
+			return INTERP_BIT_OR;
+		case OPCODE_BIR_XOR:
+			return INTERP_BIT_XOR;
+		case OPCODE_BIT_NEG:
+			return INTERP_BIT_NEG;
+		case OPCODE_NOT:
+			return INTERP_NOT;
+		case OPCODE_AND:
+			return INTERP_AND;
+		case OPCODE_OR:
+			return INTERP_OR;
+	}
+	return -1;
+}
+
+int interp_float_op(int type, int is_f32)
+{
+	switch (type) {
+		case OPCODE_ADD:
+			return is_f32 ? INTERP_ADD_F32 : INTERP_ADD_F64;
+		case OPCODE_SUB:
+			return is_f32 ? INTERP_SUB_F32 : INTERP_SUB_F64;
+		case OPCODE_MUL:
+			return is_f32 ? INTERP_MUL_F32 : INTERP_MUL_F64;
+		case OPCODE_DIV:
+			return is_f32 ? INTERP_DIV_F32 : INTERP_DIV_F64;
+	}
+	return -1;
+}
+
+// Operation comparing values of the type, "base" being the signed
+// integer one followed by the unsigned, f64 and f32 ones
+int interp_compare_op(int base, int type)
+{
+	if (type == IR_TYPE_F64)
+		return base + 2;
+	if (type == IR_TYPE_F32)
+		return base + 3;
+	return ir_type_is_signed(type) ? base : base + 1;
+}
+
+// Decodes a call from its SET_ARGUMENT opcodes
+int interp_decode_call(struct Function* fn, struct InterpCode* code, struct Opcode* op, struct Opcode** pending, size_t pending_size)
+{
+	struct InterpCall call;
+	memset(&call, 0, sizeof call);
+	call.arguments = malloc((pending_size + 1) * sizeof *call.arguments);
+	call.types = malloc((pending_size + 1) * sizeof *call.types);
+	call.arguments_size = pending_size;
+	int result = 0;
+	for (size_t a = 0; a < pending_size && !result; ++a) {
+		if (!pending[a]) {
+			result = -1;
+			break;
+		}
+		call.types[a] = pending[a]->operands[OPERAND_PRIMARY_1].type_info;
+		call.words += lower_type_words(&call.types[a]);
+		result = interp_decode_operand(fn, code, &pending[a]->operands[OPERAND_PRIMARY_1], &call.arguments[a]);
+	}
+
+	//Tail calls return the result of the callee as it is
+	struct Operand* target = &op->operands[OPERAND_TARGET];
+	if (op->type == OPCODE_TAIL_CALL)
+		call.result = fn->return_type;
+	else if (target->info_type == OPERAND_INFO_TYPE_VARIABLE || target->info_type == OPERAND_INFO_TYPE_ARGUMENT)
+		call.result = target->type_info;
+	else
+		call.result.type = IR_TYPE_VOID;
+	if (result) {
+		free(call.arguments);
+		free(call.types);
+		return -1;
+	}
+	size_t capacity = code->calls_size;
+	DYNAMIC_ARRAY_PUSH(code->calls, code->calls_size, capacity, call, 1);
+	return 0;
+}
+
+// Decodes the function, null if it uses something the interpreter does
+// not support
+struct InterpCode* interp_decode(struct Function* fn)
+{
+	if (!lower_is_supported(fn))
+		return 0;
+	struct InterpCode* code = calloc(1, sizeof *code);
+	size_t count = fn->variables_size + fn->arguments_size;
+	code->offsets = malloc((count + 1) * sizeof *code->offsets);
+	code->instructions = calloc(fn->opcodes_size + 1, sizeof *code->instructions);
+
+	//A slot of whole words for every value
+	uint32_t offset = 0;
+	for (size_t i = 0; i < count; ++i) {
+		struct TypeInfo* type_info = i < fn->variables_size ? &fn->variables[i].type_info : &fn->arguments[i - fn->variables_size];
+		uint32_t alignment = type_info_alignment(type_info) > 8 ? 16 : 8;
+		offset = (offset + alignment - 1) & -alignment;
+		code->offsets[i] = offset;
+		offset += lower_type_words(type_info) * 8;
+	}
+	code->frame_size = (offset + 15) & ~15;
+
+	struct Opcode** pending = 0;
+	size_t pending_size = 0;
+	size_t pending_capacity = 0;
+	int result = 0;
+	for (size_t k = 0; k < fn->opcodes_size && !result; ++k) {
+		struct Opcode* op = &fn->opcodes[k];
+		struct InterpInstruction* ins = &code->instructions[k];
+		struct InterpOperand* operands = ins->operands;
+
+		if (opcode_is_jump(op)) {
+			int label = op->operands[OPERAND_TARGET].ref_id;
+			if (label < 0 || (size_t)label > fn->opcodes_size) {
+				result = -1;
+				break;
+			}
+			ins->argument = label;
+			ins->comparison = op->type - OPCODE_GOTO_BASE;
+			ins->op = INTERP_GOTO;
+			if (ins->comparison != COMPARISON_ALWAYS) {
+				result = interp_decode_operand(fn, code, &op->operands[OPERAND_PRIMARY_1], &operands[1])
+					|| interp_decode_operand(fn, code, &op->operands[OPERAND_PRIMARY_2], &operands[2]);
+				ins->op = interp_compare_op(INTERP_GOTO_IF, operands[1].type);
+			}
+			continue;
+		}
+
+		switch (op->type) {
+			case OPCODE_NOP:
+				ins->op = INTERP_NOP;
+				continue;
+			case OPCODE_SET_ARGUMENT: {
+				//Arguments are read by the call
+				int index = op->operands[OPERAND_TARGET].ref_id;
+				if (index < 0 || (size_t)index > fn->opcodes_size) {
+					result = -1;
+					break;
+				}
+				while (pending_size <= (size_t)index)
+					DYNAMIC_ARRAY_PUSH(pending, pending_size, pending_capacity, 0, 8);
+				pending[index] = op;
+				ins->op = INTERP_NOP;
+				continue;
+			}
+			case OPCODE_CALL:
+			case OPCODE_TAIL_CALL:
+				ins->op = op->type == OPCODE_CALL ? INTERP_CALL : INTERP_TAIL_CALL;
+				ins->argument = code->calls_size;
+				result = interp_decode_operand(fn, code, &op->operands[OPERAND_PRIMARY_1], &operands[1])
+					|| interp_decode_call(fn, code, op, pending, pending_size);
+				if (!result && op->type == OPCODE_CALL && code->calls[ins->argument].result.type != IR_TYPE_VOID)
+					result = interp_decode_target(fn, code, &op->operands[OPERAND_TARGET], &operands[0]);
+				pending_size = 0;
+				continue;
+			case OPCODE_RETURN:
+				ins->op = INTERP_RETURN;
+				result = interp_decode_operand(fn, code, &op->operands[OPERAND_PRIMARY_1], &operands[1]);
+				continue;
+		}
+
+		if (interp_decode_target(fn, code, &op->operands[OPERAND_TARGET], &operands[0])
+			|| interp_decode_operand(fn, code, &op->operands[OPERAND_PRIMARY_1], &operands[1])
+			|| (opcode_read_operand_primary_2(op) && interp_decode_operand(fn, code, &op->operands[OPERAND_PRIMARY_2], &operands[2]))) {
+			result = -1;
+			break;
+		}
+		int type = operands[0].type;
+		if (op->type == OPCODE_COPY) {
+			if (type == IR_TYPE_STRUCT) {
+				//Only zero is copied from an immediate
+				ins->op = INTERP_COPY_STRUCT;
+				ins->argument = op->operands[OPERAND_TARGET].type_info.struct_size;
+				if (operands[1].kind == INTERP_IMMEDIATE ? operands[1].value != 0 : operands[1].kind != INTERP_SLOT && operands[1].kind != INTERP_DEREFERENCE)
+					result = -1;
+			} else if (ir_type_is_float(type)) {
+				ins->op = INTERP_COPY_FLOAT;
+			} else {
+				ins->op = ir_type_is_float(operands[1].type) ? INTERP_COPY_TO_INTEGER : INTERP_COPY;
+			}
+		} else if (op->type >= OPCODE_COMPARE_BASE && op->type < OPCODE_COMPARE_BASE + 8) {
+			ins->comparison = op->type - OPCODE_COMPARE_BASE;
+			if (ir_type_is_float(type)) {
+				result = -1;
+			} else if (ins->comparison == COMPARISON_ALWAYS) {
+				ins->op = INTERP_COPY;
+				operands[1].kind = INTERP_IMMEDIATE;
+				operands[1].value = 1;
+			} else {
+				ins->op = interp_compare_op(INTERP_SET, operands[1].type);
+			}
+		} else if (ir_type_is_float(type)) {
+			ins->op = interp_float_op(op->type, type == IR_TYPE_F32);
+		} else {
+			ins->op = interp_integer_op(op->type, ir_type_is_signed(type), ir_type_bits(type));
+		}
+		if (ins->op < 0)
+			result = -1;
+	}
+	free(pending);
+
+	//Running off the end returns nothing
+	code->instructions[fn->opcodes_size].op = INTERP_RETURN;
+	for (size_t k = 0; k <= fn->opcodes_size; ++k)
+		code->instructions[k].handler = interp_handlers[code->instructions[k].op];
+	if (result) {
+		free_interp_code(code);
+		return 0;
+	}
+	return code;
+}
+
+
+/*
+	Interpreter state
+
+	Frames live on a stack of chunks that are never moved, so addresses
+	of variables stay valid, and the records of the running calls on a
+	separate array. Calls between interpreted functions do not recurse
+	in C, only native code calling interpreted code does.
+
+	Native code is called through bridges, functions lowered from the IR
+	that take the arguments as an array of 8 byte words and store the
+	result through a pointer. A bridge exists for every signature called.
+	Native code calls interpreted functions through entry stubs in turn,
+	lowered from the IR with the signature of the function, which pack
+	their arguments and call interp_call.
+
+	Every interpreted function counts its calls down from "threshold".
+	Reaching zero lowers it, and callers go native from then on. Loops
+	that are running interpreted keep doing so until the function returns.
+*/
+
+enum
+{
+	INTERP_STATE_INTERPRETED,
+	INTERP_STATE_NATIVE,
+	INTERP_STATE_FAILED, //Lowering failed, it stays interpreted
+};
+
+#define INTERP_CHUNK_SIZE (1 << 18)
+
+struct InterpFunction
+{
+	struct Function* function; //Null for ids of native functions
+	struct InterpCode* code; //Decoded on the first interpreted call
+	int64_t countdown; //Calls left until the function is lowered
+	int state; //INTERP_STATE_*
+	void* native; //Lowered code, null if not lowered
+	size_t native_size;
+	void* entry; //Entry stub for native callers, null if none
+	size_t entry_size;
+};
+
+struct InterpChunk
+{
+	struct InterpChunk* previous;
+	struct InterpChunk* next; //Kept for reuse
+	size_t size;
+	size_t used;
+	char* data;
+};
+
+struct InterpFrame
+{
+	struct InterpFunction* function;
+	struct InterpInstruction* ip; //Next instruction when a callee returns
+	char* frame;
+	struct InterpChunk* chunk; //Chunk of the frame and its offset in it
+	size_t used;
+	int tail; //The caller returns the result too
+	void* result; //Where the result goes for the frames entered from C
+};
+
+struct InterpBridge
+{
+	struct TypeInfo* types;
+	size_t types_size;
+	struct TypeInfo result;
+	void* code;
+	size_t code_size;
+};
+
+struct Interpreter
+{
+	struct LowerEnvironment env; //Entry points the lowered code calls, late bound
+	struct InterpFunction* functions; //By function id
+	size_t functions_size;
+	int64_t threshold; //Calls until a function is lowered, 0 for never
+
+	struct InterpFrame* frames;
+	size_t frames_size;
+	size_t frames_capacity;
+	struct InterpChunk* chunk; //Chunk frames are allocated from
+
+	struct InterpBridge* bridges;
+	size_t bridges_size;
+	size_t bridges_capacity;
+	const char* error; //Why the last call failed
+};
+
+int interp_run(struct Interpreter* in, size_t base);
+
+// Allocates from the frame stack, returning the position to free to
+char* interp_alloc(struct Interpreter* in, size_t size, struct InterpChunk** chunk, size_t* used)
+{
+	struct InterpChunk* c = in->chunk;
+	if (c->used + size > c->size) {
+		if (!c->next || c->next->size < size) {
+			struct InterpChunk* next = calloc(1, sizeof *next);
+			next->size = size > INTERP_CHUNK_SIZE ? size : INTERP_CHUNK_SIZE;
+			next->data = aligned_alloc(16, next->size);
+			next->previous = c;
+			next->next = c->next;
+			if (c->next)
+				c->next->previous = next;
+			c->next = next;
+		}
+		c = c->next;
+		c->used = 0;
+		in->chunk = c;
+	}
+	*chunk = c;
+	*used = c->used;
+	c->used += size;
+	return c->data + *used;
+}
+
+void interp_release(struct Interpreter* in, struct InterpChunk* chunk, size_t used)
+{
+	in->chunk = chunk;
+	chunk->used = used;
+}
+
+// Pushes a frame for the function, returning its record
+struct InterpFrame* interp_push(struct Interpreter* in, struct InterpFunction* tf)
+{
+	struct InterpFrame record;
+	memset(&record, 0, sizeof record);
+	record.function = tf;
+	record.ip = tf->code->instructions;
+	record.frame = interp_alloc(in, tf->code->frame_size, &record.chunk, &record.used);
+	if (in->frames_size >= in->frames_capacity) {
+		in->frames_capacity = in->frames_capacity ? 2 * in->frames_capacity : 64;
+		in->frames = realloc(in->frames, in->frames_capacity * sizeof *in->frames);
+	}
+	in->frames[in->frames_size++] = record;
+	return &in->frames[in->frames_size - 1];
+}
+
+int64_t interp_load_typed(const char* p, int type)
+{
+	switch (type) {
+		case IR_TYPE_U32:
+			return *(const uint32_t*)p;
+		case IR_TYPE_I32:
+			return *(const int32_t*)p;
+		case IR_TYPE_U16:
+			return *(const uint16_t*)p;
+		case IR_TYPE_I16:
+			return *(const int16_t*)p;
+		case IR_TYPE_U8:
+			return *(const uint8_t*)p;
+		case IR_TYPE_I8:
+			return *(const int8_t*)p;
+	}
+	return *(const int64_t*)p;
+}
+
+void interp_store_typed(char* p, int type, uint64_t value)
+{
+	switch (ir_type_bits(type)) {
+		case 32:
+			*(uint32_t*)p = value;
+			break;
+		case 16:
+			*(uint16_t*)p = value;
+			break;
+		case 8:
+			*(uint8_t*)p = value;
+			break;
+		default:
+			*(uint64_t*)p = value;
+	}
+}
+
+void* interp_function_address(struct Interpreter* in, int id);
+
+// Memory of a variable, argument or dereferenced pointer
+static inline char* interp_location(char* frame, struct InterpOperand* o)
+{
+	if (o->kind == INTERP_DEREFERENCE)
+		return *(char**)(frame + o->offset);
+	return frame + o->offset;
+}
+
+// Integer value of an operand extended to 64 bits
+static inline uint64_t interp_load(struct Interpreter* in, char* frame, struct InterpOperand* o)
+{
+	switch (o->kind) {
+		case INTERP_IMMEDIATE:
+			return o->value;
+		case INTERP_SLOT:
+			return interp_load_typed(frame + o->offset, o->type);
+		case INTERP_ADDRESS:
+			return (uintptr_t)(frame + o->offset);
+		case INTERP_DEREFERENCE:
+			return interp_load_typed(*(char**)(frame + o->offset), o->type);
+		case INTERP_FUNCTION:
+			return (uintptr_t)interp_function_address(in, o->value);
+	}
+	return 0;
+}
+
+static inline void interp_store(char* frame, struct InterpOperand* o, uint64_t value)
+{
+	interp_store_typed(interp_location(frame, o), o->type, value);
+}
+
+// Value of an operand as a double, converting integers and floats
+static inline double interp_load_f64(struct Interpreter* in, char* frame, struct InterpOperand* o)
+{
+	if (o->type == IR_TYPE_F64) {
+		if (o->kind == INTERP_IMMEDIATE) {
+			double value;
+			memcpy(&value, &o->value, sizeof value);
+			return value;
+		}
+		return *(double*)interp_location(frame, o);
+	}
+	if (o->type == IR_TYPE_F32) {
+		if (o->kind == INTERP_IMMEDIATE) {
+			float value;
+			memcpy(&value, &o->value, sizeof value);
+			return value;
+		}
+		return *(float*)interp_location(frame, o);
+	}
+	return (double)(int64_t)interp_load(in, frame, o);
+}
+
+static inline float interp_load_f32(struct Interpreter* in, char* frame, struct InterpOperand* o)
+{
+	if (o->type == IR_TYPE_F64 || o->type == IR_TYPE_F32)
+		return interp_load_f64(in, frame, o);
+	return (float)(int64_t)interp_load(in, frame, o);
+}
+
+// Bits of the value of an operand as the float type, the low 32 for f32
+static inline uint64_t interp_load_float_bits(struct Interpreter* in, char* frame, struct InterpOperand* o, int type)
+{
+	uint64_t bits = 0;
+	if (type == IR_TYPE_F32) {
+		float value = interp_load_f32(in, frame, o);
+		memcpy(&bits, &value, sizeof value);
+	} else {
+		double value = interp_load_f64(in, frame, o);
+		memcpy(&bits, &value, sizeof value);
+	}
+	return bits;
+}
+
+static inline void interp_store_float_bits(char* p, int type, uint64_t bits)
+{
+	if (type == IR_TYPE_F32)
+		*(uint32_t*)p = bits;
+	else
+		*(uint64_t*)p = bits;
+}
+
+// Whether the comparison holds for values ordered by "less" and "equal".
+// Unordered floats count as both, like the flags of UCOMISS
+static inline int interp_condition(int comparison, int less, int equal)
+{
+	switch (comparison) {
+		case COMPARISON_EQUAL:
+			return equal;
+		case COMPARISON_NOT_EQUAL:
+			return !equal;
+		case COMPARISON_LESS:
+			return less;
+		case COMPARISON_GREATER:
+			return !less && !equal;
+		case COMPARISON_LEQUAL:
+			return less || equal;
+		case COMPARISON_GEQUAL:
+			return !less;
+	}
+	return 1;
+}
+
+// Stores the value of an argument to the slot of a parameter of the
+// declared type
+void interp_pass(struct Interpreter* in, char* frame, struct InterpOperand* value, struct TypeInfo* type_info, char* slot, struct TypeInfo* declared)
+{
+	if (type_info->type == IR_TYPE_STRUCT) {
+		size_t size = type_info->struct_size < declared->struct_size ? type_info->struct_size : declared->struct_size;
+		memcpy(slot, interp_location(frame, value), size);
+	} else if (ir_type_is_float(type_info->type)) {
+		uint64_t bits = interp_load_float_bits(in, frame, value, type_info->type);
+		memcpy(slot, &bits, ir_type_is_float(declared->type) ? ir_type_bits(declared->type) / 8 : 8);
+	} else {
+		interp_store_typed(slot, declared->type, interp_load(in, frame, value));
+	}
+}
+
+// Stores a result of the type to the target of a call
+void interp_store_result(char* frame, struct InterpOperand* target, struct TypeInfo* type_info, uint64_t word, const char* memory, size_t size)
+{
+	if (type_info->type == IR_TYPE_STRUCT) {
+		if (size > type_info->struct_size)
+			size = type_info->struct_size;
+		if (memory)
+			memcpy(interp_location(frame, target), memory, size);
+		else
+			memset(interp_location(frame, target), 0, size);
+	} else if (ir_type_is_float(target->type)) {
+		interp_store_float_bits(interp_location(frame, target), target->type, word);
+	} else {
+		interp_store(frame, target, word);
+	}
+}
+
+
+/*
+	Bridges and entry stubs
+*/
+
+// Lowers a function made up for the interpreter into new executable memory
+void* interp_lower(struct Interpreter* in, struct Function* fn, size_t* size)
+{
+	struct x86_encoder enc;
+	memset(&enc, 0, sizeof enc);
+	void* code = 0;
+	if (!lower_function(&enc, fn, &in->env))
+		code = lower_map_code(&enc, size);
+	x86_encoder_free(&enc);
+	free(fn->opcodes);
+	free(fn->variables);
+	return code;
+}
+
+// Bridge calling native code of the signature:
+// void bridge(uint64_t* words, void* callee, void* result)
+void* interp_bridge(struct Interpreter* in, struct TypeInfo* types, size_t types_size, struct TypeInfo* result)
+{
+	for (size_t b = 0; b < in->bridges_size; ++b) {
+		struct InterpBridge* bridge = &in->bridges[b];
+		if (bridge->types_size != types_size || !type_info_equal(&bridge->result, result))
+			continue;
+		size_t a = 0;
+		while (a < types_size && type_info_equal(&bridge->types[a], &types[a]))
+			a += 1;
+		if (a == types_size)
+			return bridge->code;
+	}
+
+	struct TypeInfo word_type = {IR_TYPE_U64, 0, 0};
+	struct TypeInfo parameters[] = {word_type, word_type, word_type};
+	struct Function fn;
+	memset(&fn, 0, sizeof fn);
+	fn.id = -1;
+	fn.arguments = parameters;
+	fn.arguments_size = 3;
+	fn.return_type.type = IR_TYPE_VOID;
+	struct Operand none;
+	memset(&none, 0, sizeof none);
+	struct Operand parameter_operands[3];
+	for (int p = 0; p < 3; ++p) {
+		parameter_operands[p] = make_variable_operand(p, word_type);
+		parameter_operands[p].info_type = OPERAND_INFO_TYPE_ARGUMENT;
+	}
+
+	//Every argument is read through its own pointer into the words
+	size_t word = 0;
+	for (size_t a = 0; a < types_size; ++a) {
+		struct Operand pointer = make_variable_operand(function_add_variable(&fn, word_type), word_type);
+		struct Opcode op = make_opcode(OPCODE_ADD, pointer, parameter_operands[0], make_immediate_operand(word_type, 8 * word));
+		DYNAMIC_ARRAY_PUSH(fn.opcodes, fn.opcodes_size, fn.opcodes_capacity, op, 16);
+		word += lower_type_words(&types[a]);
+	}
+	for (size_t a = 0; a < types_size; ++a) {
+		struct Operand index = none;
+		index.ref_id = a;
+		struct Operand value = make_variable_operand(a, types[a]);
+		value.info_flags = OPERAND_FLAG_DEREFERENCE;
+		struct Opcode op = make_opcode(OPCODE_SET_ARGUMENT, index, value, none);
+		DYNAMIC_ARRAY_PUSH(fn.opcodes, fn.opcodes_size, fn.opcodes_capacity, op, 16);
+	}
+	struct Operand target = none;
+	if (result->type != IR_TYPE_VOID) {
+		target = parameter_operands[2];
+		target.type_info = *result;
+		target.info_flags = OPERAND_FLAG_DEREFERENCE;
+	}
+	struct Opcode call = make_opcode(OPCODE_CALL, target, parameter_operands[1], none);
+	struct Opcode ret = make_opcode(OPCODE_RETURN, none, none, none);
+	DYNAMIC_ARRAY_PUSH(fn.opcodes, fn.opcodes_size, fn.opcodes_capacity, call, 16);
+	DYNAMIC_ARRAY_PUSH(fn.opcodes, fn.opcodes_size, fn.opcodes_capacity, ret, 16);
+
+	struct InterpBridge bridge;
+	bridge.code = interp_lower(in, &fn, &bridge.code_size);
+	if (!bridge.code)
+		return 0;
+	bridge.types = malloc((types_size + 1) * sizeof *bridge.types);
+	memcpy(bridge.types, types, types_size * sizeof *types);
+	bridge.types_size = types_size;
+	bridge.result = *result;
+	DYNAMIC_ARRAY_PUSH(in->bridges, in->bridges_size, in->bridges_capacity, bridge, 8);
+	return bridge.code;
+}
+
+int interp_call(struct Interpreter* in, int id, uint64_t* arguments, void* result);
+
+// Called by the entry stubs
+void interp_enter(struct Interpreter* in, int64_t id, uint64_t* arguments, void* result)
+{
+	interp_call(in, id, arguments, result);
+}
+
+// Entry stub with the signature of the function, calling interp_call
+void* interp_entry_stub(struct Interpreter* in, struct Function* target, size_t* size)
+{
+	struct TypeInfo word_type = {IR_TYPE_U64, 0, 0};
+	struct Function fn;
+	memset(&fn, 0, sizeof fn);
+	fn.id = -1;
+	fn.arguments = target->arguments;
+	fn.arguments_size = target->arguments_size;
+	fn.return_type = target->return_type;
+	struct Operand none;
+	memset(&none, 0, sizeof none);
+
+	size_t words = 0;
+	for (size_t a = 0; a < fn.arguments_size; ++a)
+		words += lower_type_words(&fn.arguments[a]);
+	size_t result_size = target->return_type.type == IR_TYPE_STRUCT && target->return_type.struct_size > 16 ? target->return_type.struct_size : 16;
+	struct TypeInfo words_type = {IR_TYPE_STRUCT, 0, (words ? words : 1) * 8};
+	struct TypeInfo result_type = {IR_TYPE_STRUCT, 0, result_size};
+	struct Operand buffer = make_variable_operand(function_add_variable(&fn, words_type), word_type);
+	buffer.info_flags = OPERAND_FLAG_ADDRESS;
+	struct Operand result = make_variable_operand(function_add_variable(&fn, result_type), word_type);
+	result.info_flags = OPERAND_FLAG_ADDRESS;
+	struct Operand pointer = make_variable_operand(function_add_variable(&fn, word_type), word_type);
+
+	//The arguments are stored to the words one after another
+	size_t word = 0;
+	for (size_t a = 0; a < fn.arguments_size; ++a) {
+		struct Operand value = make_variable_operand(a, fn.arguments[a]);
+		value.info_type = OPERAND_INFO_TYPE_ARGUMENT;
+		struct Operand slot = pointer;
+		slot.type_info = fn.arguments[a];
+		slot.info_flags = OPERAND_FLAG_DEREFERENCE;
+		struct Opcode ops[] = {
+			make_opcode(OPCODE_ADD, pointer, buffer, make_immediate_operand(word_type, 8 * word)),
+			make_opcode(OPCODE_COPY, slot, value, none),
+		};
+		for (int k = 0; k < 2; ++k)
+			DYNAMIC_ARRAY_PUSH(fn.opcodes, fn.opcodes_size, fn.opcodes_capacity, ops[k], 16);
+		word += lower_type_words(&fn.arguments[a]);
+	}
+	struct Operand values[] = {
+		make_immediate_operand(word_type, (uintptr_t)in),
+		make_immediate_operand(word_type, target->id),
+		buffer,
+		result,
+	};
+	for (int a = 0; a < 4; ++a) {
+		struct Operand index = none;
+		index.ref_id = a;
+		struct Opcode op = make_opcode(OPCODE_SET_ARGUMENT, index, values[a], none);
+		DYNAMIC_ARRAY_PUSH(fn.opcodes, fn.opcodes_size, fn.opcodes_capacity, op, 16);
+	}
+	struct Opcode call = make_opcode(OPCODE_CALL, none, make_immediate_operand(word_type, (uintptr_t)interp_enter), none);
+	DYNAMIC_ARRAY_PUSH(fn.opcodes, fn.opcodes_size, fn.opcodes_capacity, call, 16);
+
+	struct Operand value = none;
+	if (fn.return_type.type != IR_TYPE_VOID) {
+		struct Opcode copy = make_opcode(OPCODE_COPY, pointer, result, none);
+		DYNAMIC_ARRAY_PUSH(fn.opcodes, fn.opcodes_size, fn.opcodes_capacity, copy, 16);
+		value = pointer;
+		value.type_info = fn.return_type;
+		value.info_flags = OPERAND_FLAG_DEREFERENCE;
+	}
+	struct Opcode ret = make_opcode(OPCODE_RETURN, none, value, none);
+	DYNAMIC_ARRAY_PUSH(fn.opcodes, fn.opcodes_size, fn.opcodes_capacity, ret, 16);
+	return interp_lower(in, &fn, size);
+}
+
+// Native address of a function for native callers: its lowered code or
+// an entry stub into the interpreter
+void* interp_function_address(struct Interpreter* in, int id)
+{
+	if (id < 0 || (size_t)id >= in->functions_size)
+		return 0;
+	struct InterpFunction* tf = &in->functions[id];
+	if (!tf->function || tf->native)
+		return in->env.functions[id];
+	if (!tf->entry) {
+		tf->entry = interp_entry_stub(in, tf->function, &tf->entry_size);
+		if (!in->env.functions[id])
+			in->env.functions[id] = tf->entry;
+	}
+	return tf->entry;
+}
+
+// Lowers the function, which native callers use from then on
+int interp_compile(struct Interpreter* in, struct InterpFunction* tf)
+{
+	struct Function* fn = tf->function;
+
+	//Lowered code calls through the environment, which has to reach the
+	//functions still interpreted
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &fn->opcodes[i].operands[o];
+			if (operand->info_type == OPERAND_INFO_TYPE_FUNCTION && !(o == OPERAND_TARGET && opcode_is_jump(&fn->opcodes[i])))
+				interp_function_address(in, operand->ref_id);
+		}
+	}
+
+	struct x86_encoder enc;
+	memset(&enc, 0, sizeof enc);
+	void* code = 0;
+	if (!lower_function(&enc, fn, &in->env))
+		code = lower_map_code(&enc, &tf->native_size);
+	x86_encoder_free(&enc);
+	if (!code) {
+		tf->state = INTERP_STATE_FAILED;
+		return -1;
+	}
+	tf->native = code;
+	tf->state = INTERP_STATE_NATIVE;
+	in->env.functions[fn->id] = code;
+	return 0;
+}
+
+// Counts a call of the id and returns the function if it is to be
+// interpreted. Otherwise "native" is set to the address to call, null if
+// the function can neither be interpreted nor called
+struct InterpFunction* interp_prepare(struct Interpreter* in, int id, void** native)
+{
+	*native = 0;
+	if (id < 0 || (size_t)id >= in->functions_size) {
+		in->error = "Unknown function";
+		return 0;
+	}
+	struct InterpFunction* tf = &in->functions[id];
+	if (!tf->function || tf->native) {
+		*native = in->env.functions[id];
+		if (!*native)
+			in->error = "Unknown function";
+		return 0;
+	}
+	if (in->threshold > 0 && tf->state == INTERP_STATE_INTERPRETED && --tf->countdown <= 0 && !interp_compile(in, tf)) {
+		*native = tf->native;
+		return 0;
+	}
+	if (!tf->code && !(tf->code = interp_decode(tf->function))) {
+		in->error = "Unsupported function";
+		return 0;
+	}
+	return tf;
+}
+
+
+/*
+	Execution
+*/
+
+// Runs the calls from the frame "base" on until it returns. Returns 0 on
+// success, -1 with "error" set if a function could not be run
+int interp_run(struct Interpreter* in, size_t base)
+{
+	static const void* const handlers[INTERP_OPS] = {
+		[INTERP_NOP] = &&op_nop,
+		[INTERP_COPY] = &&op_copy,
+		[INTERP_COPY_FLOAT] = &&op_copy_float,
+		[INTERP_COPY_TO_INTEGER] = &&op_copy_to_integer,
+		[INTERP_COPY_STRUCT] = &&op_copy_struct,
+		[INTERP_ADD] = &&op_add,
+		[INTERP_SUB] = &&op_sub,
+		[INTERP_MUL] = &&op_mul,
+		[INTERP_DIV] = &&op_div,
+		[INTERP_DIV_UNSIGNED] = &&op_div_unsigned,
+		[INTERP_MUL_HIGH] = &&op_mul_high,
+		[INTERP_MUL_HIGH_UNSIGNED] = &&op_mul_high_unsigned,
+		[INTERP_MUL_HIGH_64] = &&op_mul_high_64,
+		[INTERP_MUL_HIGH_64_UNSIGNED] = &&op_mul_high_64_unsigned,
+		[INTERP_SHIFT_LEFT] = &&op_shift_left,
+		[INTERP_SHIFT_RIGHT] = &&op_shift_right,
+		[INTERP_SHIFT_RIGHT_ARITHMETIC] = &&op_shift_right_arithmetic,
+		[INTERP_BIT_AND] = &&op_bit_and,
+		[INTERP_BIT_OR] = &&op_bit_or,
+		[INTERP_BIT_XOR] = &&op_bit_xor,
+		[INTERP_BIT_NEG] = &&op_bit_neg,
+		[INTERP_NOT] = &&op_not,
+		[INTERP_AND] = &&op_and,
+		[INTERP_OR] = &&op_or,
+		[INTERP_ADD_F64] = &&op_add_f64,
+		[INTERP_SUB_F64] = &&op_sub_f64,
+		[INTERP_MUL_F64] = &&op_mul_f64,
+		[INTERP_DIV_F64] = &&op_div_f64,
+		[INTERP_ADD_F32] = &&op_add_f32,
+		[INTERP_SUB_F32] = &&op_sub_f32,
+		[INTERP_MUL_F32] = &&op_mul_f32,
+		[INTERP_DIV_F32] = &&op_div_f32,
+		[INTERP_SET] = &&op_set,
+		[INTERP_SET_UNSIGNED] = &&op_set_unsigned,
+		[INTERP_SET_F64] = &&op_set_f64,
+		[INTERP_SET_F32] = &&op_set_f32,
+		[INTERP_GOTO] = &&op_goto,
+		[INTERP_GOTO_IF] = &&op_goto_if,
+		[INTERP_GOTO_IF_UNSIGNED] = &&op_goto_if_unsigned,
+		[INTERP_GOTO_IF_F64] = &&op_goto_if_f64,
+		[INTERP_GOTO_IF_F32] = &&op_goto_if_f32,
+		[INTERP_CALL] = &&op_call,
+		[INTERP_TAIL_CALL] = &&op_call,
+		[INTERP_RETURN] = &&op_return,
+	};
+	if (!in) {
+		interp_handlers = handlers;
+		return 0;
+	}
+
+	struct InterpFrame* f = &in->frames[in->frames_size - 1];
+	struct InterpCode* code = f->function->code;
+	char* frame = f->frame;
+	struct InterpInstruction* ip = f->ip;
+	struct InterpInstruction* i;
+	struct InterpOperand* o;
+
+	//Result of a returning function
+	uint64_t word;
+	char* memory;
+	size_t size;
+
+#define INTERP_NEXT() do { i = ip++; o = i->operands; goto *i->handler; } while (0)
+#define INTERP_INTEGER(label, expression) \
+label: { \
+	uint64_t x = interp_load(in, frame, &o[1]); \
+	uint64_t y = interp_load(in, frame, &o[2]); \
+	interp_store(frame, &o[0], (expression)); \
+	INTERP_NEXT(); \
+}
+#define INTERP_UNARY(label, expression) \
+label: { \
+	uint64_t x = interp_load(in, frame, &o[1]); \
+	interp_store(frame, &o[0], (expression)); \
+	INTERP_NEXT(); \
+}
+#define INTERP_FLOAT(label, type, load, expression) \
+label: { \
+	type x = load(in, frame, &o[1]); \
+	type y = load(in, frame, &o[2]); \
+	*(type*)interp_location(frame, &o[0]) = (expression); \
+	INTERP_NEXT(); \
+}
+#define INTERP_COMPARE(label, type, load, less, ...) \
+label: { \
+	type x = load(in, frame, &o[1]); \
+	type y = load(in, frame, &o[2]); \
+	int holds = interp_condition(i->comparison, (less), (x == y)); \
+	__VA_ARGS__ \
+}
+#define INTERP_SET_TO(holds) interp_store(frame, &o[0], holds); INTERP_NEXT();
+#define INTERP_JUMP_IF(holds) if (holds) ip = code->instructions + i->argument; INTERP_NEXT();
+
+	INTERP_NEXT();
+
+op_nop:
+	INTERP_NEXT();
+op_copy:
+	interp_store(frame, &o[0], interp_load(in, frame, &o[1]));
+	INTERP_NEXT();
+op_copy_float:
+	interp_store_float_bits(interp_location(frame, &o[0]), o[0].type, interp_load_float_bits(in, frame, &o[1], o[0].type));
+	INTERP_NEXT();
+op_copy_to_integer:
+	interp_store(frame, &o[0], (uint64_t)(int64_t)(o[1].type == IR_TYPE_F32 ? interp_load_f32(in, frame, &o[1]) : interp_load_f64(in, frame, &o[1])));
+	INTERP_NEXT();
+op_copy_struct:
+	if (o[1].kind == INTERP_IMMEDIATE)
+		memset(interp_location(frame, &o[0]), 0, i->argument);
+	else
+		memmove(interp_location(frame, &o[0]), interp_location(frame, &o[1]), i->argument);
+	INTERP_NEXT();
+
+	INTERP_INTEGER(op_add, x + y)
+	INTERP_INTEGER(op_sub, x - y)
+	INTERP_INTEGER(op_mul, x * y)
+	INTERP_INTEGER(op_div, (int64_t)x / (int64_t)y)
+	INTERP_INTEGER(op_div_unsigned, x / y)
+	INTERP_INTEGER(op_mul_high, (uint64_t)((int64_t)(x * y) >> ir_type_bits(o[0].type)))
+	INTERP_INTEGER(op_mul_high_unsigned, (x * y) >> ir_type_bits(o[0].type))
+	INTERP_INTEGER(op_mul_high_64, (uint64_t)(((__int128)(int64_t)x * (int64_t)y) >> 64))
+	INTERP_INTEGER(op_mul_high_64_unsigned, (uint64_t)(((unsigned __int128)x * y) >> 64))
+	INTERP_INTEGER(op_shift_left, x << (y & 63))
+	INTERP_INTEGER(op_shift_right, x >> (y & 63))
+	INTERP_INTEGER(op_shift_right_arithmetic, (uint64_t)((int64_t)x >> (y & 63)))
+	INTERP_INTEGER(op_bit_and, x & y)
+	INTERP_INTEGER(op_bit_or, x | y)
+	INTERP_INTEGER(op_bit_xor, x ^ y)
+	INTERP_UNARY(op_bit_neg, ~x)
+	INTERP_UNARY(op_not, x == 0)
+	INTERP_INTEGER(op_and, x != 0 && y != 0)
+	INTERP_INTEGER(op_or, x != 0 || y != 0)
+
+	INTERP_FLOAT(op_add_f64, double, interp_load_f64, x + y)
+	INTERP_FLOAT(op_sub_f64, double, interp_load_f64, x - y)
+	INTERP_FLOAT(op_mul_f64, double, interp_load_f64, x * y)
+	INTERP_FLOAT(op_div_f64, double, interp_load_f64, x / y)
+	INTERP_FLOAT(op_add_f32, float, interp_load_f32, x + y)
+	INTERP_FLOAT(op_sub_f32, float, interp_load_f32, x - y)
+	INTERP_FLOAT(op_mul_f32, float, interp_load_f32, x * y)
+	INTERP_FLOAT(op_div_f32, float, interp_load_f32, x / y)
+
+	INTERP_COMPARE(op_set, int64_t, (int64_t)interp_load, x < y, INTERP_SET_TO(holds))
+	INTERP_COMPARE(op_set_unsigned, uint64_t, interp_load, x < y, INTERP_SET_TO(holds))
+	INTERP_COMPARE(op_set_f64, double, interp_load_f64, !(x >= y), INTERP_SET_TO(holds))
+	INTERP_COMPARE(op_set_f32, float, interp_load_f32, !(x >= y), INTERP_SET_TO(holds))
+op_goto:
+	ip = code->instructions + i->argument;
+	INTERP_NEXT();
+	INTERP_COMPARE(op_goto_if, int64_t, (int64_t)interp_load, x < y, INTERP_JUMP_IF(holds))
+	INTERP_COMPARE(op_goto_if_unsigned, uint64_t, interp_load, x < y, INTERP_JUMP_IF(holds))
+	INTERP_COMPARE(op_goto_if_f64, double, interp_load_f64, !(x >= y), INTERP_JUMP_IF(holds))
+	INTERP_COMPARE(op_goto_if_f32, float, interp_load_f32, !(x >= y), INTERP_JUMP_IF(holds))
+
+op_call: {
+	struct InterpCall* call = &code->calls[i->argument];
+	int tail = i->op == INTERP_TAIL_CALL;
+	void* native = 0;
+	struct InterpFunction* callee = 0;
+	if (o[1].kind == INTERP_FUNCTION) {
+		callee = interp_prepare(in, o[1].value, &native);
+		if (!callee && !native)
+			goto fail;
+	} else {
+		native = (void*)(uintptr_t)interp_load(in, frame, &o[1]);
+	}
+
+	if (callee) {
+		struct Function* fn = callee->function;
+		size_t caller = in->frames_size - 1;
+		struct InterpFrame* next = interp_push(in, callee);
+		for (size_t a = 0; a < call->arguments_size && a < fn->arguments_size; ++a) {
+			char* slot = next->frame + callee->code->offsets[fn->variables_size + a];
+			interp_pass(in, frame, &call->arguments[a], &call->types[a], slot, &fn->arguments[a]);
+		}
+		f = &in->frames[caller];
+		f->ip = ip;
+		if (tail && next->chunk == f->chunk) {
+			//The callee takes the place of the caller
+			memmove(f->frame, next->frame, callee->code->frame_size);
+			interp_release(in, f->chunk, f->used + callee->code->frame_size);
+			f->function = callee;
+			in->frames_size -= 1;
+		} else {
+			next->tail = tail;
+			f = next;
+		}
+		code = callee->code;
+		frame = f->frame;
+		ip = code->instructions;
+		INTERP_NEXT();
+	}
+
+	//Native callees are called through a bridge with the words on the
+	//frame stack
+	void* bridge = call->bridge;
+	if (!bridge)
+		bridge = call->bridge = interp_bridge(in, call->types, call->arguments_size, &call->result);
+	if (!bridge) {
+		in->error = "Unsupported call";
+		goto fail;
+	}
+	struct InterpChunk* chunk;
+	size_t used;
+	size_t result_size = call->result.type == IR_TYPE_STRUCT && call->result.struct_size > 16 ? call->result.struct_size : 16;
+	uint64_t* words = (uint64_t*)interp_alloc(in, (call->words + 1) * 8 + ((result_size + 15) & ~15), &chunk, &used);
+	char* result = (char*)words + ((call->words * 8 + 15) & ~15);
+	size_t w = 0;
+	for (size_t a = 0; a < call->arguments_size; ++a) {
+		struct TypeInfo* type_info = &call->types[a];
+		if (type_info->type == IR_TYPE_STRUCT)
+			memcpy(&words[w], interp_location(frame, &call->arguments[a]), type_info->struct_size);
+		else if (ir_type_is_float(type_info->type))
+			words[w] = interp_load_float_bits(in, frame, &call->arguments[a], type_info->type);
+		else
+			words[w] = interp_load(in, frame, &call->arguments[a]);
+		w += lower_type_words(type_info);
+	}
+	((void (*)(uint64_t*, void*, void*))bridge)(words, native, result);
+	interp_release(in, chunk, used);
+	f = &in->frames[in->frames_size - 1];
+
+	//The result stays on the released stack until stored
+	word = 0;
+	memory = 0;
+	size = call->result.struct_size;
+	if (call->result.type == IR_TYPE_STRUCT)
+		memory = result;
+	else if (ir_type_is_float(call->result.type))
+		memcpy(&word, result, ir_type_bits(call->result.type) / 8);
+	else if (call->result.type != IR_TYPE_VOID)
+		word = interp_load_typed(result, call->result.type);
+	if (tail)
+		goto returned;
+	if (call->result.type != IR_TYPE_VOID)
+		interp_store_result(frame, &o[0], &call->result, word, memory, size);
+	INTERP_NEXT();
+}
+
+op_return: {
+	struct TypeInfo* type_info = &f->function->function->return_type;
+	word = 0;
+	memory = 0;
+	size = type_info->struct_size;
+	if (o[1].kind != INTERP_NONE && !(o[1].kind == INTERP_IMMEDIATE && o[1].type == IR_TYPE_VOID)) {
+		if (type_info->type == IR_TYPE_STRUCT)
+			memory = interp_location(frame, &o[1]);
+		else if (ir_type_is_float(type_info->type))
+			word = interp_load_float_bits(in, frame, &o[1], type_info->type);
+		else if (type_info->type != IR_TYPE_VOID)
+			word = interp_load(in, frame, &o[1]);
+	}
+}
+returned:
+	//Frames above are only released, so the result stays readable until
+	//it is stored
+	for (;;) {
+		struct InterpFrame done = in->frames[--in->frames_size];
+		interp_release(in, done.chunk, done.used);
+		if (in->frames_size == base) {
+			if (!done.result)
+				return 0;
+			if (memory)
+				memcpy(done.result, memory, size);
+			else if (done.function->function->return_type.type == IR_TYPE_STRUCT)
+				memset(done.result, 0, size);
+			else
+				memcpy(done.result, &word, sizeof word);
+			return 0;
+		}
+		if (!done.tail)
+			break;
+	}
+	f = &in->frames[in->frames_size - 1];
+	code = f->function->code;
+	frame = f->frame;
+	ip = f->ip;
+	{
+		struct InterpInstruction* call = ip - 1;
+		struct TypeInfo* type_info = &code->calls[call->argument].result;
+		if (type_info->type != IR_TYPE_VOID)
+			interp_store_result(frame, &call->operands[0], type_info, word, memory, size);
+	}
+	INTERP_NEXT();
+
+fail:
+	while (in->frames_size > base) {
+		struct InterpFrame done = in->frames[--in->frames_size];
+		interp_release(in, done.chunk, done.used);
+	}
+	return -1;
+
+#undef INTERP_NEXT
+#undef INTERP_INTEGER
+#undef INTERP_UNARY
+#undef INTERP_FLOAT
+#undef INTERP_COMPARE
+#undef INTERP_SET_TO
+#undef INTERP_JUMP_IF
+}
+
+// Calls the function with the arguments as 8 byte words, structures
+// taking as many as they need. The result is stored to "result" as a
+// word, or as the structure. Returns 0 on success, -1 with "error" set
+// if the function could not be run
+int interp_call(struct Interpreter* in, int id, uint64_t* arguments, void* result)
+{
+	void* native;
+	struct InterpFunction* tf = interp_prepare(in, id, &native);
+	if (!tf) {
+		struct Function* fn = id >= 0 && (size_t)id < in->functions_size ? in->functions[id].function : 0;
+		if (!native || !fn) {
+			if (!fn)
+				in->error = "Unknown signature";
+			return -1;
+		}
+		void* bridge = interp_bridge(in, fn->arguments, fn->arguments_size, &fn->return_type);
+		if (!bridge) {
+			in->error = "Unsupported call";
+			return -1;
+		}
+		//Scalars are returned as words like from interpreted functions
+		struct TypeInfo* type_info = &fn->return_type;
+		uint64_t words[2] = {0, 0};
+		((void (*)(uint64_t*, void*, void*))bridge)(arguments, native, type_info->type == IR_TYPE_STRUCT ? result : words);
+		if (result && type_info->type != IR_TYPE_STRUCT) {
+			uint64_t word = ir_type_is_float(type_info->type) ? words[0] : (uint64_t)interp_load_typed((char*)words, type_info->type);
+			memcpy(result, &word, sizeof word);
+		}
+		return 0;
+	}
+
+	struct Function* fn = tf->function;
+	struct InterpFrame* f = interp_push(in, tf);
+	size_t w = 0;
+	for (size_t a = 0; a < fn->arguments_size; ++a) {
+		struct TypeInfo* type_info = &fn->arguments[a];
+		char* slot = f->frame + tf->code->offsets[fn->variables_size + a];
+		if (type_info->type == IR_TYPE_STRUCT || ir_type_is_float(type_info->type))
+			memcpy(slot, &arguments[w], type_info->type == IR_TYPE_STRUCT ? type_info->struct_size : (size_t)ir_type_bits(type_info->type) / 8);
+		else
+			interp_store_typed(slot, type_info->type, arguments[w]);
+		w += lower_type_words(type_info);
+	}
+	f->result = result;
+	return interp_run(in, in->frames_size - 1);
+}
+
+// Sets up the interpreter for the functions, indexed by their ids.
+// "natives" are the addresses of the ids without a function. Functions
+// are lowered after "threshold" calls, never if it is 0
+void interp_init(struct Interpreter* in, struct Function** functions, size_t functions_size,
+	void** natives, size_t natives_size, int64_t threshold)
+{
+	if (!interp_handlers)
+		interp_run(0, 0);
+	memset(in, 0, sizeof *in);
+	size_t size = natives_size;
+	for (size_t i = 0; i < functions_size; ++i) {
+		if (functions[i]->id >= 0 && (size_t)functions[i]->id >= size)
+			size = functions[i]->id + 1;
+	}
+	in->env.functions = calloc(size + 1, sizeof *in->env.functions);
+	in->env.functions_size = size;
+	in->env.late_binding = 1;
+	if (natives_size)
+		memcpy(in->env.functions, natives, natives_size * sizeof *natives);
+	in->functions = calloc(size + 1, sizeof *in->functions);
+	in->functions_size = size;
+	for (size_t i = 0; i < functions_size; ++i) {
+		if (functions[i]->id < 0)
+			continue;
+		struct InterpFunction* tf = &in->functions[functions[i]->id];
+		tf->function = functions[i];
+		tf->countdown = threshold;
+		in->env.functions[functions[i]->id] = 0;
+	}
+	in->threshold = threshold;
+	in->chunk = calloc(1, sizeof *in->chunk);
+	in->chunk->size = INTERP_CHUNK_SIZE;
+	in->chunk->data = aligned_alloc(16, INTERP_CHUNK_SIZE);
+}
+
+void interp_free(struct Interpreter* in)
+{
+	for (size_t i = 0; i < in->functions_size; ++i) {
+		struct InterpFunction* tf = &in->functions[i];
+		free_interp_code(tf->code);
+		if (tf->native)
+			munmap(tf->native, tf->native_size);
+		if (tf->entry)
+			munmap(tf->entry, tf->entry_size);
+	}
+	for (size_t b = 0; b < in->bridges_size; ++b) {
+		munmap(in->bridges[b].code, in->bridges[b].code_size);
+		free(in->bridges[b].types);
+	}
+	struct InterpChunk* chunk = in->chunk;
+	while (chunk->previous)
+		chunk = chunk->previous;
+	while (chunk) {
+		struct InterpChunk* next = chunk->next;
+		free(chunk->data);
+		free(chunk);
+		chunk = next;
+	}
+	free(in->bridges);
+	free(in->frames);
+	free(in->functions);
+	free(in->env.functions);
+	memset(in, 0, sizeof *in);
+}
+
+
+#ifndef INTERP_NO_MAIN
+double interp_demo_seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Compares signed divisions by constants after strength reduction with
+// the plain division, interpreted and lowered. Returns the mismatches
+int interp_demo_check_division(void)
+{
+	static const char* types[] = {"i8", "i16", "i32", "i64"};
+	static const int bits[] = {8, 16, 32, 64};
+	static const int64_t divisors[] = {2, 3, 7, 16, -2, -3, -7, -16, 100, -128};
+	int mismatches = 0;
+	for (int t = 0; t < 4; ++t) {
+		for (size_t d = 0; d < sizeof divisors / sizeof *divisors; ++d) {
+			char source[256];
+			int length = snprintf(source, sizeof source,
+				"function 0 (%s) -> %s\n variables %s\n div %s v0, %s a0, %s %lld\n return _, %s v0\nend\n",
+				types[t], types[t], types[t], types[t], types[t], types[t], (long long)divisors[d], types[t]);
+			struct IrArena arena;
+			memset(&arena, 0, sizeof arena);
+			struct IrParser parser;
+			ir_parser_init(&parser, source, length, &arena);
+			struct Function plain;
+			if (ir_parse_function(&parser, &plain) != 1)
+				return mismatches + 1;
+			struct Function reduced;
+			struct TypeInfo* arguments;
+			function_copy(&plain, &reduced, &arguments);
+			reduced.id = 1;
+			reduce_constant_arithmetic(&reduced);
+
+			struct Function* list[] = {&plain, &reduced};
+			for (int threshold = 0; threshold < 2; ++threshold) {
+				struct Interpreter in;
+				interp_init(&in, list, 2, 0, 0, threshold);
+				for (int64_t x = -300; x <= 300; ++x) {
+					//Sign extended like narrow values are stored
+					int shift = 64 - bits[t];
+					uint64_t argument = (uint64_t)((int64_t)((uint64_t)x << shift) >> shift);
+					uint64_t expected = 0;
+					uint64_t result = 0;
+					if (interp_call(&in, 0, &argument, &expected) || interp_call(&in, 1, &argument, &result))
+						return mismatches + 1;
+					if (expected != result) {
+						if (!mismatches)
+							printf("%s %lld / %lld: %lld instead of %lld\n", types[t], (long long)argument,
+								(long long)divisors[d], (long long)result, (long long)expected);
+						mismatches += 1;
+					}
+				}
+				interp_free(&in);
+			}
+			free(reduced.opcodes);
+			free(reduced.variables);
+			free(arguments);
+			ir_parser_free(&parser);
+			ir_arena_free(&arena);
+		}
+	}
+	return mismatches;
+}
+
+int main(int argc, const char** argv)
+{
+	if (interp_demo_check_division()) {
+		printf("Strength reduced divisions differ from plain ones\n");
+		return 1;
+	}
+
+	size_t count = argc > 1 ? strtoul(argv[1], 0, 10) : 10000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 20;
+	if (!count)
+		return 1;
+
+	// long f<i>(long x) {
+	//	for (long k = 0; k < 8; k += 1)
+	//		x = (x * 3 + k) ^ i;
+	//	return i ? x + f<i / 2>(x) : x;
+	// }
+	struct IrText text;
+	memset(&text, 0, sizeof text);
+	for (size_t i = 0; i < count; ++i) {
+		char buffer[1024];
+		int length = snprintf(buffer, sizeof buffer,
+			"function %zu (i64) -> i64\n"
+			" variables i64 i64 i64\n"
+			" copy i64 v0, i64 a0\n"
+			" copy i64 v1, i64 0\n"
+			" goto_ge @8, i64 v1, i64 8\n"
+			" mul i64 v0, i64 v0, i64 3\n"
+			" add i64 v0, i64 v0, i64 v1\n"
+			" bit_xor i64 v0, i64 v0, i64 %zu\n"
+			" add i64 v1, i64 v1, i64 1\n"
+			" goto @2\n", i, i);
+		if (i)
+			length += snprintf(buffer + length, sizeof buffer - length,
+				" set_argument @0, i64 v0\n"
+				" call i64 v2, u64 f%zu\n"
+				" add i64 v0, i64 v0, i64 v2\n", i / 2);
+		length += snprintf(buffer + length, sizeof buffer - length, " return _, i64 v0\nend\n");
+		ir_text_reserve(&text, length);
+		ir_text_put(&text, buffer, length);
+	}
+
+	//Interpreted only, lowered on the first call and lowered once hot
+	int64_t thresholds[] = {0, 1, 50};
+	const char* names[] = {"interpreted", "lowered", "mixed"};
+	uint64_t checksums[3];
+	for (int mode = 0; mode < 3; ++mode) {
+		double start = interp_demo_seconds();
+		struct IrArena arena;
+		memset(&arena, 0, sizeof arena);
+		struct IrParser parser;
+		ir_parser_init(&parser, text.data, text.size, &arena);
+		struct Function* functions = malloc(count * sizeof *functions);
+		struct Function** list = malloc(count * sizeof *list);
+		for (size_t i = 0; i < count; ++i) {
+			if (ir_parse_function(&parser, &functions[i]) != 1) {
+				printf("Parsing failed at line %d: %s\n", ir_parser_line(&parser), parser.error);
+				return 1;
+			}
+			list[i] = &functions[i];
+		}
+		struct Interpreter in;
+		interp_init(&in, list, count, 0, 0, thresholds[mode]);
+
+		//Startup calls every function once, then the hot phase repeats it
+		uint64_t checksum = 0;
+		double startup = 0;
+		for (int round = 0; round <= rounds; ++round) {
+			for (size_t i = 0; i < count; ++i) {
+				uint64_t argument = i + round;
+				uint64_t result;
+				if (interp_call(&in, i, &argument, &result)) {
+					printf("Call of %zu failed: %s\n", i, in.error);
+					return 1;
+				}
+				checksum = checksum * 31 + result;
+			}
+			if (!round)
+				startup = interp_demo_seconds() - start;
+		}
+		double total = interp_demo_seconds() - start;
+
+		size_t lowered = 0;
+		for (size_t i = 0; i < count; ++i)
+			lowered += in.functions[i].state == INTERP_STATE_NATIVE;
+		printf("%-12s startup %8.3f ms, %d more rounds %8.3f ms, %zu of %zu lowered, checksum %016llx\n",
+			names[mode], startup * 1e3, rounds, (total - startup) * 1e3, lowered, count, (unsigned long long)checksum);
+		checksums[mode] = checksum;
+
+		interp_free(&in);
+		free(list);
+		free(functions);
+		ir_parser_free(&parser);
+		ir_arena_free(&arena);
+	}
+	ir_text_free(&text);
+	return checksums[0] != checksums[1] || checksums[0] != checksums[2];
+}
+#endif
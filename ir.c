@@ -7,6 +7,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /*
@@ -125,6 +132,11 @@ do { \
 #define OPCODE_CALL 33
 #define OPCODE_RETURN 34
 
+// High half of the double width product, signed or unsigned by type
+#define OPCODE_MUL_HIGH 35
+// Call that replaces the frame of the caller and returns its result
+#define OPCODE_TAIL_CALL 36
+
 #define COMPARISON_ALWAYS 0
 #define COMPARISON_EQUAL 1
 #define COMPARISON_NOT_EQUAL 2
@@ -212,33 +224,84 @@ struct VariableInfo
 	unsigned flags;
 };
 
+/*
+	Basic blocks are maximal runs of opcodes with a single entry point.
+	A block starts at the function entry, at every jump target and right
+	after every jump or return. Blocks are stored in opcode order, so the
+	fall-through successor of a block is always the next block.
+*/
+
+struct BasicBlock
+{
+	int start; //Index of the first opcode of the block
+	int end; //Index one past the last opcode of the block
+
+	int successors[2];
+	int successors_size;
+
+	int* predecessors;
+	size_t predecessors_size;
+	size_t predecessors_capacity;
+
+	int idom; //Immediate dominator, -1 for the entry and unreachable blocks
+	int rpo_index; //Position in reverse post-order, -1 if unreachable
+
+	int loop; //Innermost loop containing the block, -1 if none
+	int loop_depth; //Amount of loops containing the block
+};
+
+struct Loop
+{
+	int header; //Header block, dominates every block of the loop
+	int parent; //Enclosing loop, -1 for outermost loops
+	int depth; //Nesting depth, 1 for outermost loops
+
+	int* blocks;
+	size_t blocks_size;
+	size_t blocks_capacity;
+};
+
 struct FunctionAnalysis
 {
 	struct Function* function;
 	struct OpcodeInfo* infos;
 	struct VariableInfo* variables;
+
+	struct BasicBlock* blocks;
+	size_t blocks_size;
+	int* opcode_blocks; //Block index of every opcode
+
+	int* rpo; //Reachable blocks in reverse post-order
+	size_t rpo_size;
+
+	struct Loop* loops; //Sorted so that enclosing loops come first
+	size_t loops_size;
 };
 
 int opcode_is_jump(struct Opcode* x) {
 	return (x->type >= OPCODE_GOTO_BASE) && (x->type < OPCODE_GOTO_BASE + 8);
 }
 
-int opcode_is_pure_assignment(struct Opcode* x) {
-	if (x->type == OPCODE_COPY)
+int opcode_modifies_target_operand(struct Opcode* x) {
+	if (x->type >= 1 && x->type <= 15)
+		return 1;
+	if (x->type == OPCODE_MUL_HIGH)
+		return 1;
+	if (x->type >= OPCODE_COMPARE_BASE && x->type < OPCODE_COMPARE_BASE + 8)
 		return 1;
 	if (x->type == OPCODE_CALL)
 		return 1;
 	return 0;
 }
 
-int opcode_modifies_target_operand(struct Opcode* x) {
-	if (x->type >= 1 && x->type <= 15)
-		return 1;
-	if (x->type >= OPCODE_COMPARE_BASE && x->type < OPCODE_COMPARE_BASE + 8)
+// Opcodes are in three address form: the target is overwritten with a
+// value computed from the primary operands only
+int opcode_is_pure_assignment(struct Opcode* x) {
+	if (x->type == OPCODE_COPY)
 		return 1;
 	if (x->type == OPCODE_CALL)
 		return 1;
-	return 0;
+	return opcode_modifies_target_operand(x);
 }
 
 int opcode_read_operand_primary_1(struct Opcode* x) {
@@ -254,7 +317,7 @@ int opcode_read_operand_primary_2(struct Opcode* x) {
 		return 0;
 	if (x->type == OPCODE_RETURN)
 		return 0;
-	if (x->type == OPCODE_CALL)
+	if (x->type == OPCODE_CALL || x->type == OPCODE_TAIL_CALL)
 		return 0;
 	if (x->type == OPCODE_SET_ARGUMENT)
 		return 0;
@@ -290,7 +353,7 @@ int opcode_read_operand_primary_2(struct Opcode* x) {
 */
 
 void extend_variable_lifetime(struct FunctionAnalysis* a, struct VariableInfo* var, int index, int pure_assignment) {
-	if (var->lifetime_end >= index || (var->flags & VARIABLE_INFO_ETERNAL) || (var->flags & VARIABLE_INFO_UNINITIALIZED))
+	if (var->lifetime_end > index || (var->flags & VARIABLE_INFO_ETERNAL) || (var->flags & VARIABLE_INFO_UNINITIALIZED))
 		return;
 
 	if (var->lifetime_start == -1) {
@@ -338,6 +401,122 @@ void extend_variable_lifetime(struct FunctionAnalysis* a, struct VariableInfo* v
 	var->lifetime_end = maximum;
 }
 
+int ir_type_is_integer(int type)
+{
+	return type >= IR_TYPE_U64 && type <= IR_TYPE_I8;
+}
+
+int ir_type_is_signed(int type)
+{
+	return type == IR_TYPE_I64 || type == IR_TYPE_I32 || type == IR_TYPE_I16 || type == IR_TYPE_I8;
+}
+
+int ir_type_is_float(int type)
+{
+	return type == IR_TYPE_F64 || type == IR_TYPE_F32;
+}
+
+// Size of a scalar type in bits, 0 for others
+int ir_type_bits(int type)
+{
+	switch (type) {
+		case IR_TYPE_U64:
+		case IR_TYPE_I64:
+		case IR_TYPE_F64:
+			return 64;
+		case IR_TYPE_U32:
+		case IR_TYPE_I32:
+		case IR_TYPE_F32:
+			return 32;
+		case IR_TYPE_U16:
+		case IR_TYPE_I16:
+			return 16;
+		case IR_TYPE_U8:
+		case IR_TYPE_I8:
+			return 8;
+	}
+	return 0;
+}
+
+// Immediate value zero extended from its type
+uint64_t operand_immediate_unsigned(struct Operand* operand)
+{
+	switch (ir_type_bits(operand->type_info.type)) {
+		case 32:
+			return operand->value_u32;
+		case 16:
+			return operand->value_u16;
+		case 8:
+			return operand->value_u8;
+	}
+	return operand->value_u64;
+}
+
+// Immediate value sign extended from its type
+int64_t operand_immediate_signed(struct Operand* operand)
+{
+	switch (ir_type_bits(operand->type_info.type)) {
+		case 32:
+			return operand->value_i32;
+		case 16:
+			return operand->value_i16;
+		case 8:
+			return operand->value_i8;
+	}
+	return operand->value_i64;
+}
+
+struct Operand make_immediate_operand(struct TypeInfo type_info, uint64_t value)
+{
+	struct Operand operand;
+	memset(&operand, 0, sizeof operand);
+	operand.info_type = OPERAND_INFO_TYPE_IMMEDIATE;
+	operand.type_info = type_info;
+	switch (ir_type_bits(type_info.type)) {
+		case 32:
+			operand.value_u32 = value;
+			break;
+		case 16:
+			operand.value_u16 = value;
+			break;
+		case 8:
+			operand.value_u8 = value;
+			break;
+		default:
+			operand.value_u64 = value;
+	}
+	return operand;
+}
+
+struct Operand make_variable_operand(int id, struct TypeInfo type_info)
+{
+	struct Operand operand;
+	memset(&operand, 0, sizeof operand);
+	operand.info_type = OPERAND_INFO_TYPE_VARIABLE;
+	operand.ref_id = id;
+	operand.type_info = type_info;
+	return operand;
+}
+
+struct Opcode make_opcode(int type, struct Operand target, struct Operand primary_1, struct Operand primary_2)
+{
+	struct Opcode op;
+	op.type = type;
+	op.operands[OPERAND_TARGET] = target;
+	op.operands[OPERAND_PRIMARY_1] = primary_1;
+	op.operands[OPERAND_PRIMARY_2] = primary_2;
+	return op;
+}
+
+// Adds a new variable to the function, returns its id
+int function_add_variable(struct Function* fn, struct TypeInfo type_info)
+{
+	struct Variable variable;
+	variable.type_info = type_info;
+	DYNAMIC_ARRAY_PUSH(fn->variables, fn->variables_size, fn->variables_capacity, variable, 64);
+	return fn->variables_size - 1;
+}
+
 int operand_is_variable(struct Operand* operand)
 {
 	return (operand->info_type == OPERAND_INFO_TYPE_VARIABLE);
@@ -345,29 +524,344 @@ int operand_is_variable(struct Operand* operand)
 
 int operand_is_variable_address_load(struct Operand* operand)
 {
-	return (operand_is_variable(operand) && (operand->info_flags |OPERAND_FLAG_ADDRESS));
+	return (operand_is_variable(operand) && (operand->info_flags & OPERAND_FLAG_ADDRESS));
 }
 
-void analyse_function(struct Function* fn)
+// Operands without address or dereference flags name the value itself
+int operand_is_plain(struct Operand* operand)
 {
-	struct FunctionAnalysis* a = malloc(sizeof *a);
-	memset(a, 0, sizeof *a);
+	return !(operand->info_flags & (OPERAND_FLAG_ADDRESS | OPERAND_FLAG_DEREFERENCE));
+}
 
-	a->infos = malloc(fn->opcodes_size * sizeof *a->infos);
-	a->variables = malloc(fn->variables_size * sizeof *a->variables);
+int type_info_equal(struct TypeInfo* a, struct TypeInfo* b)
+{
+	if (a->type != b->type || a->sub_type != b->sub_type)
+		return 0;
+	if (a->type == IR_TYPE_STRUCT && a->struct_size != b->struct_size)
+		return 0;
+	return 1;
+}
 
-	//Initialize variables
-	for (size_t i = 0; i < fn->variables_size; ++i) {
-		a->variables[i].lifetime_start = -1;
-		a->variables[i].lifetime_end = -1;
-		a->variables[i].flags = 0;
+int opcode_is_return(struct Opcode* x) {
+	return x->type == OPCODE_RETURN || x->type == OPCODE_TAIL_CALL;
+}
+
+// Whether the opcode reads the given operand. A target operand that is
+// dereferenced reads the pointer it is stored through
+int opcode_reads_operand(struct Opcode* x, int operand)
+{
+	if (operand == OPERAND_TARGET)
+		return opcode_modifies_target_operand(x) && (x->operands[OPERAND_TARGET].info_flags & OPERAND_FLAG_DEREFERENCE);
+	if (operand == OPERAND_PRIMARY_1)
+		return opcode_read_operand_primary_1(x);
+	return opcode_read_operand_primary_2(x);
+}
+
+// Whether the opcode overwrites the variable named by its target operand
+int opcode_writes_target_variable(struct Opcode* x)
+{
+	return opcode_modifies_target_operand(x) && operand_is_variable(&x->operands[OPERAND_TARGET])
+		&& operand_is_plain(&x->operands[OPERAND_TARGET]);
+}
+
+void free_function_analysis(struct FunctionAnalysis* a)
+{
+	for (size_t i = 0; i < a->blocks_size; ++i)
+		free(a->blocks[i].predecessors);
+	for (size_t i = 0; i < a->loops_size; ++i)
+		free(a->loops[i].blocks);
+	free(a->loops);
+	free(a->blocks);
+	free(a->opcode_blocks);
+	free(a->rpo);
+	free(a->infos);
+	free(a->variables);
+	free(a);
+}
+
+void build_basic_blocks(struct FunctionAnalysis* a)
+{
+	struct Function* fn = a->function;
+	size_t blocks_capacity = 0;
+
+	a->opcode_blocks = malloc((fn->opcodes_size + 1) * sizeof *a->opcode_blocks);
+
+	//Split the opcodes into blocks
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		int leader = (i == 0) || a->infos[i].jump_from >= 0;
+		if (i > 0 && (opcode_is_jump(&fn->opcodes[i - 1]) || opcode_is_return(&fn->opcodes[i - 1])))
+			leader = 1;
+		if (leader) {
+			struct BasicBlock b;
+			memset(&b, 0, sizeof b);
+			b.start = i;
+			DYNAMIC_ARRAY_PUSH(a->blocks, a->blocks_size, blocks_capacity, b, 16);
+		}
+		a->blocks[a->blocks_size - 1].end = i + 1;
+		a->opcode_blocks[i] = a->blocks_size - 1;
+	}
+	a->opcode_blocks[fn->opcodes_size] = -1;
+
+	//Connect the blocks
+	for (size_t i = 0; i < a->blocks_size; ++i) {
+		struct BasicBlock* b = &a->blocks[i];
+		struct Opcode* last = &fn->opcodes[b->end - 1];
+		int falls_through = 1;
+
+		if (opcode_is_jump(last)) {
+			int label = last->operands[OPERAND_TARGET].ref_id;
+			if (label >= 0 && (size_t)label < fn->opcodes_size)
+				b->successors[b->successors_size++] = a->opcode_blocks[label];
+			if (last->type == OPCODE_GOTO_BASE)
+				falls_through = 0;
+		} else if (opcode_is_return(last)) {
+			falls_through = 0;
+		}
+
+		if (falls_through && i + 1 < a->blocks_size && (b->successors_size == 0 || b->successors[0] != (int)i + 1))
+			b->successors[b->successors_size++] = i + 1;
+	}
+
+	for (size_t i = 0; i < a->blocks_size; ++i) {
+		for (int s = 0; s < a->blocks[i].successors_size; ++s) {
+			struct BasicBlock* succ = &a->blocks[a->blocks[i].successors[s]];
+			DYNAMIC_ARRAY_PUSH(succ->predecessors, succ->predecessors_size, succ->predecessors_capacity, (int)i, 4);
+		}
+	}
+}
+
+/*
+	Dominators are computed with the iterative algorithm of Cooper, Harvey
+	and Kennedy: blocks are visited in reverse post-order and the
+	immediate dominator of a block is the nearest common dominator of its
+	already processed predecessors. Converges in a couple of rounds for
+	any reasonable control flow.
+*/
+
+int dominator_intersect(struct FunctionAnalysis* a, int x, int y)
+{
+	while (x != y) {
+		while (a->blocks[x].rpo_index > a->blocks[y].rpo_index)
+			x = a->blocks[x].idom;
+		while (a->blocks[y].rpo_index > a->blocks[x].rpo_index)
+			y = a->blocks[y].idom;
+	}
+	return x;
+}
+
+void compute_dominators(struct FunctionAnalysis* a)
+{
+	for (size_t i = 0; i < a->blocks_size; ++i) {
+		a->blocks[i].idom = -1;
+		a->blocks[i].rpo_index = -1;
+	}
+	a->rpo = malloc((a->blocks_size + 1) * sizeof *a->rpo);
+	a->rpo_size = 0;
+	if (a->blocks_size == 0)
+		return;
+
+	//Iterative depth first search for the post-order
+	int* stack = malloc(a->blocks_size * sizeof *stack);
+	int* next_successor = calloc(a->blocks_size, sizeof *next_successor);
+	char* visited = calloc(a->blocks_size, 1);
+	size_t stack_size = 0;
+	size_t post_size = 0;
+
+	stack[stack_size++] = 0;
+	visited[0] = 1;
+	while (stack_size) {
+		int b = stack[stack_size - 1];
+		struct BasicBlock* block = &a->blocks[b];
+		if (next_successor[b] < block->successors_size) {
+			int s = block->successors[next_successor[b]++];
+			if (!visited[s]) {
+				visited[s] = 1;
+				stack[stack_size++] = s;
+			}
+			continue;
+		}
+		stack_size -= 1;
+		a->rpo[post_size++] = b;
+	}
+	a->rpo_size = post_size;
+	for (size_t i = 0; i < post_size / 2; ++i) {
+		int t = a->rpo[i];
+		a->rpo[i] = a->rpo[post_size - 1 - i];
+		a->rpo[post_size - 1 - i] = t;
+	}
+	for (size_t i = 0; i < a->rpo_size; ++i)
+		a->blocks[a->rpo[i]].rpo_index = i;
+
+	free(stack);
+	free(next_successor);
+	free(visited);
+
+	//The entry block temporarily dominates itself to terminate intersections
+	a->blocks[0].idom = 0;
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		for (size_t i = 1; i < a->rpo_size; ++i) {
+			int b = a->rpo[i];
+			struct BasicBlock* block = &a->blocks[b];
+			int idom = -1;
+			for (size_t p = 0; p < block->predecessors_size; ++p) {
+				int pred = block->predecessors[p];
+				if (a->blocks[pred].idom < 0)
+					continue;
+				idom = (idom < 0) ? pred : dominator_intersect(a, pred, idom);
+			}
+			if (idom != block->idom) {
+				block->idom = idom;
+				changed = 1;
+			}
+		}
+	}
+	a->blocks[0].idom = -1;
+}
+
+// Whether block x dominates block y
+int block_dominates(struct FunctionAnalysis* a, int x, int y)
+{
+	if (a->blocks[y].rpo_index < 0)
+		return 0;
+	while (y >= 0 && y != x)
+		y = a->blocks[y].idom;
+	return y == x;
+}
+
+/*
+	Natural loops
+
+	An edge from block t to block h is a back edge when h dominates t. The
+	loop of the back edge consists of h and every block that reaches t
+	without passing through h. Back edges sharing a header are merged into
+	a single loop. Loops are either disjoint or nested, so the parent of a
+	loop is the smallest other loop containing its header.
+
+	The loop depth of every block is exported for cost heuristics: code
+	in loops runs much more often than code outside them.
+*/
+
+int loop_compare_size(const void* x, const void* y)
+{
+	const struct Loop* a = x;
+	const struct Loop* b = y;
+	if (a->blocks_size != b->blocks_size)
+		return a->blocks_size < b->blocks_size ? 1 : -1;
+	return a->header - b->header;
+}
+
+void find_loops(struct FunctionAnalysis* a)
+{
+	size_t loops_capacity = 0;
+	int* header_loop = malloc((a->blocks_size + 1) * sizeof *header_loop);
+	int* marks = calloc(a->blocks_size + 1, sizeof *marks);
+	int* worklist = malloc((a->blocks_size + 1) * sizeof *worklist);
+
+	for (size_t i = 0; i < a->blocks_size; ++i) {
+		header_loop[i] = -1;
+		a->blocks[i].loop = -1;
+		a->blocks[i].loop_depth = 0;
+	}
+
+	for (size_t i = 0; i < a->rpo_size; ++i) {
+		int t = a->rpo[i];
+		for (int s = 0; s < a->blocks[t].successors_size; ++s) {
+			int h = a->blocks[t].successors[s];
+			if (!block_dominates(a, h, t))
+				continue;
+
+			if (header_loop[h] < 0) {
+				struct Loop loop;
+				memset(&loop, 0, sizeof loop);
+				loop.header = h;
+				loop.parent = -1;
+				DYNAMIC_ARRAY_PUSH(loop.blocks, loop.blocks_size, loop.blocks_capacity, h, 8);
+				header_loop[h] = a->loops_size;
+				DYNAMIC_ARRAY_PUSH(a->loops, a->loops_size, loops_capacity, loop, 8);
+			}
+
+			//Walk backwards from the latch until the header
+			int l = header_loop[h];
+			struct Loop* loop = &a->loops[l];
+			int mark = l + 1;
+			size_t worklist_size = 0;
+			for (size_t b = 0; b < loop->blocks_size; ++b)
+				marks[loop->blocks[b]] = mark;
+			if (marks[t] != mark) {
+				marks[t] = mark;
+				worklist[worklist_size++] = t;
+				DYNAMIC_ARRAY_PUSH(loop->blocks, loop->blocks_size, loop->blocks_capacity, t, 8);
+			}
+			while (worklist_size) {
+				int x = worklist[--worklist_size];
+				for (size_t p = 0; p < a->blocks[x].predecessors_size; ++p) {
+					int pred = a->blocks[x].predecessors[p];
+					if (marks[pred] == mark || a->blocks[pred].rpo_index < 0)
+						continue;
+					marks[pred] = mark;
+					worklist[worklist_size++] = pred;
+					DYNAMIC_ARRAY_PUSH(loop->blocks, loop->blocks_size, loop->blocks_capacity, pred, 8);
+				}
+			}
+		}
+	}
+
+	//Enclosing loops first. A loop is enclosed by the last larger loop
+	//containing its header, which is also the smallest such loop
+	if (a->loops_size)
+		qsort(a->loops, a->loops_size, sizeof *a->loops, loop_compare_size);
+	for (size_t l = 0; l < a->loops_size; ++l) {
+		struct Loop* loop = &a->loops[l];
+		for (size_t b = 0; b < loop->blocks_size; ++b) {
+			struct BasicBlock* block = &a->blocks[loop->blocks[b]];
+			if (block->loop >= 0 && loop->blocks[b] == loop->header && loop->parent < 0)
+				loop->parent = block->loop;
+			block->loop = l;
+		}
+		loop->depth = (loop->parent >= 0) ? a->loops[loop->parent].depth + 1 : 1;
 	}
+	for (size_t i = 0; i < a->blocks_size; ++i) {
+		if (a->blocks[i].loop >= 0)
+			a->blocks[i].loop_depth = a->loops[a->blocks[i].loop].depth;
+	}
+
+	free(header_loop);
+	free(marks);
+	free(worklist);
+}
+
+// Whether the loop contains the block, including nested loops
+int loop_contains(struct FunctionAnalysis* a, int loop, int block)
+{
+	int l = a->blocks[block].loop;
+	while (l >= 0 && l != loop)
+		l = a->loops[l].parent;
+	return l == loop;
+}
+
+// Loop nesting depth of an opcode, 0 outside loops
+int opcode_loop_depth(struct FunctionAnalysis* a, int index)
+{
+	return a->blocks[a->opcode_blocks[index]].loop_depth;
+}
+
+// Labels, blocks, dominators and loops of the analysis
+void analyse_control_flow(struct FunctionAnalysis* a)
+{
+	struct Function* fn = a->function;
+	a->infos = malloc((fn->opcodes_size + 1) * sizeof *a->infos);
+	for (size_t i = 0; i < fn->opcodes_size; ++i)
+		a->infos[i].jump_from = -1;
 
 	//Generate label data
 	for (int i = fn->opcodes_size - 1; i >= 0; --i) {
 		struct Opcode* op = fn->opcodes + i;
 		if (opcode_is_jump(op)) {
 			int label = op->operands[0].ref_id;
+			if (label < 0 || (size_t)label >= fn->opcodes_size)
+				continue;
 			if (a->infos[label].jump_from >= 0)
 				continue;
 			a->infos[label].jump_from = i;
@@ -382,13 +876,33 @@ void analyse_function(struct Function* fn)
 			previous_label = i;
 	}
 
-	//Calculate variable lifetimes
+	build_basic_blocks(a);
+	compute_dominators(a);
+	find_loops(a);
+}
+
+// Variable lifetimes of the analysis, which need its labels
+void analyse_lifetimes(struct FunctionAnalysis* a)
+{
+	struct Function* fn = a->function;
+	a->variables = realloc(a->variables, (fn->variables_size + 1) * sizeof *a->variables);
+	for (size_t i = 0; i < fn->variables_size; ++i) {
+		a->variables[i].lifetime_start = -1;
+		a->variables[i].lifetime_end = -1;
+		a->variables[i].flags = 0;
+	}
+
 	for (size_t i = 0; i < fn->opcodes_size; ++i) {
 		struct Opcode* op = &fn->opcodes[i];
 		int pure_assign = opcode_is_pure_assignment(op);
 
-		if (operand_is_variable(&op->operands[OPERAND_TARGET]) && (pure_assign || opcode_modifies_target_operand(op)))
-			extend_variable_lifetime(a, &a->variables[op->operands[OPERAND_TARGET].ref_id], i, pure_assign);
+		if (operand_is_variable(&op->operands[OPERAND_TARGET]) && (pure_assign || opcode_modifies_target_operand(op))) {
+			//Storing through a pointer reads the pointer variable
+			if (op->operands[OPERAND_TARGET].info_flags & OPERAND_FLAG_DEREFERENCE)
+				extend_variable_lifetime(a, &a->variables[op->operands[OPERAND_TARGET].ref_id], i, 0);
+			else
+				extend_variable_lifetime(a, &a->variables[op->operands[OPERAND_TARGET].ref_id], i, pure_assign);
+		}
 
 		if (operand_is_variable_address_load(&op->operands[OPERAND_PRIMARY_1]))
 			a->variables[op->operands[OPERAND_PRIMARY_1].ref_id].flags |= VARIABLE_INFO_ETERNAL;
@@ -400,6 +914,4558 @@ void analyse_function(struct Function* fn)
 		else if (operand_is_variable(&op->operands[OPERAND_PRIMARY_2]) && opcode_read_operand_primary_2(op))
 			extend_variable_lifetime(a, &a->variables[op->operands[OPERAND_PRIMARY_2].ref_id], i, 0);
 	}
+}
 
-	free(a);
-}
\ No newline at end of file
+struct FunctionAnalysis* analyse_function(struct Function* fn)
+{
+	struct FunctionAnalysis* a = malloc(sizeof *a);
+	memset(a, 0, sizeof *a);
+	a->function = fn;
+	analyse_control_flow(a);
+	analyse_lifetimes(a);
+	return a;
+}
+
+
+/*
+	Analysis manager
+
+	Most passes start by analysing the function and many of them end up
+	changing nothing, so analysing anew for every pass repeats the same
+	work over and over. The manager keeps the analysis of every function
+	between passes instead. A pass borrows the analysis with
+	analysis_manager_get and hands it back with analysis_manager_release,
+	telling which parts its changes made stale:
+
+	ANALYSIS_LIFETIMES after rewriting operands or turning opcodes into
+	NOPs or copies, which keeps every opcode in place.
+
+	ANALYSIS_CONTROL_FLOW after inserting, removing or moving opcodes or
+	changing jumps. Lifetimes depend on the labels so they go stale too.
+
+	Passes changing the function without analysing it report their
+	changes with analysis_manager_invalidate. Stale control flow means a
+	new analysis while stale lifetimes are recomputed in place. A null
+	manager analyses anew on every get and frees on every release, so
+	passes work the same without one.
+
+	Analyses are indexed by function id like the function table. The
+	function pointer is kept to notice another function taking the id.
+*/
+
+#define ANALYSIS_LIFETIMES (1 << 0)
+#define ANALYSIS_CONTROL_FLOW (1 << 1)
+#define ANALYSIS_ALL (ANALYSIS_LIFETIMES | ANALYSIS_CONTROL_FLOW)
+
+struct AnalysisEntry
+{
+	struct Function* function;
+	struct FunctionAnalysis* analysis; //Null when not computed
+	int valid; //ANALYSIS_* flags of the parts that are up to date
+};
+
+struct AnalysisManager
+{
+	struct AnalysisEntry* entries; //Indexed by function id
+	size_t entries_size;
+	size_t entries_capacity;
+
+	size_t computed; //Analyses computed from scratch
+	size_t recomputed; //Lifetimes recomputed in place
+	size_t reused; //Analyses handed out unchanged
+};
+
+void analysis_manager_init(struct AnalysisManager* m)
+{
+	memset(m, 0, sizeof *m);
+}
+
+// Entry of the function, null if it can not be cached
+struct AnalysisEntry* analysis_manager_entry(struct AnalysisManager* m, struct Function* fn)
+{
+	if (!m || fn->id < 0)
+		return 0;
+	if ((size_t)fn->id >= m->entries_size) {
+		size_t size = m->entries_size;
+		DYNAMIC_ARRAY_RESIZE(m->entries, m->entries_size, m->entries_capacity, (size_t)fn->id + 1);
+		memset(m->entries + size, 0, (m->entries_size - size) * sizeof *m->entries);
+	}
+	struct AnalysisEntry* e = &m->entries[fn->id];
+	if (e->function != fn) {
+		if (e->analysis)
+			free_function_analysis(e->analysis);
+		e->function = fn;
+		e->analysis = 0;
+		e->valid = 0;
+	}
+	return e;
+}
+
+// Up to date analysis of the function, owned by the manager if there is one
+struct FunctionAnalysis* analysis_manager_get(struct AnalysisManager* m, struct Function* fn)
+{
+	struct AnalysisEntry* e = analysis_manager_entry(m, fn);
+	if (!e)
+		return analyse_function(fn);
+
+	if (e->analysis && !(e->valid & ANALYSIS_CONTROL_FLOW)) {
+		free_function_analysis(e->analysis);
+		e->analysis = 0;
+	}
+	if (!e->analysis) {
+		e->analysis = analyse_function(fn);
+		m->computed += 1;
+	} else if (!(e->valid & ANALYSIS_LIFETIMES)) {
+		analyse_lifetimes(e->analysis);
+		m->recomputed += 1;
+	} else {
+		m->reused += 1;
+	}
+	e->valid = ANALYSIS_ALL;
+	return e->analysis;
+}
+
+// Marks the changed parts of the analysis of the function stale
+void analysis_manager_invalidate(struct AnalysisManager* m, struct Function* fn, int changed)
+{
+	if (!m || fn->id < 0 || (size_t)fn->id >= m->entries_size || m->entries[fn->id].function != fn)
+		return;
+	if (changed & ANALYSIS_CONTROL_FLOW)
+		changed |= ANALYSIS_LIFETIMES;
+	m->entries[fn->id].valid &= ~changed;
+}
+
+// Hands back an analysis from analysis_manager_get
+void analysis_manager_release(struct AnalysisManager* m, struct FunctionAnalysis* a, int changed)
+{
+	struct Function* fn = a->function;
+	if (!m || fn->id < 0 || (size_t)fn->id >= m->entries_size || m->entries[fn->id].analysis != a) {
+		free_function_analysis(a);
+		return;
+	}
+	analysis_manager_invalidate(m, fn, changed);
+}
+
+void analysis_manager_free(struct AnalysisManager* m)
+{
+	for (size_t i = 0; i < m->entries_size; ++i) {
+		if (m->entries[i].analysis)
+			free_function_analysis(m->entries[i].analysis);
+	}
+	DYNAMIC_ARRAY_FREE(m->entries, m->entries_size, m->entries_capacity);
+}
+
+
+/*
+	Small fixed size bitsets used by the data flow passes
+*/
+
+#define BITSET_WORDS(bits) (((bits) + 63) / 64)
+#define BITSET_SET(set, bit) ((set)[(bit) / 64] |= ((uint64_t)1 << ((bit) % 64)))
+#define BITSET_CLEAR(set, bit) ((set)[(bit) / 64] &= ~((uint64_t)1 << ((bit) % 64)))
+#define BITSET_TEST(set, bit) (((set)[(bit) / 64] >> ((bit) % 64)) & 1)
+
+
+// Replaces every reference to variable "from" with variable "to"
+void function_rename_variable(struct Function* fn, int from, int to)
+{
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		for (int o = 0; o < 3; ++o) {
+			if (opcode_is_jump(op) && o == OPERAND_TARGET)
+				continue;
+			if (operand_is_variable(&op->operands[o]) && op->operands[o].ref_id == from)
+				op->operands[o].ref_id = to;
+		}
+	}
+}
+
+// Removes NOP opcodes from the function and retargets jumps.
+// A jump to a removed opcode lands on the next remaining one.
+// Returns the amount of removed opcodes
+int function_remove_nops(struct Function* fn)
+{
+	int* new_index = malloc((fn->opcodes_size + 1) * sizeof *new_index);
+	size_t size = 0;
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		new_index[i] = size;
+		if (fn->opcodes[i].type != OPCODE_NOP)
+			size += 1;
+	}
+	new_index[fn->opcodes_size] = size;
+
+	int removed = fn->opcodes_size - size;
+	if (removed) {
+		for (size_t i = 0; i < fn->opcodes_size; ++i) {
+			struct Opcode* op = &fn->opcodes[i];
+			if (op->type == OPCODE_NOP)
+				continue;
+			if (opcode_is_jump(op)) {
+				int label = op->operands[OPERAND_TARGET].ref_id;
+				if (label >= 0 && (size_t)label <= fn->opcodes_size)
+					op->operands[OPERAND_TARGET].ref_id = new_index[label];
+			}
+			fn->opcodes[new_index[i]] = *op;
+		}
+		fn->opcodes_size = size;
+	}
+
+	free(new_index);
+	return removed;
+}
+
+
+/*
+	Copy propagation
+
+	Front-ends emit plenty of "t = COPY s" opcodes. Each of them would
+	become a live variable of its own and later a register to register
+	move. The propagation replaces reads of t with s wherever the copy is
+	known to be available: the copy has been executed on every path
+	leading to the read and neither t nor s has been reassigned since.
+
+	Availability is a classic forward "must" data flow problem over the
+	basic blocks. Sets are intersected at merge points, copies are
+	generated by the copy opcode itself and killed by any assignment to
+	either side of the copy.
+
+	Only variables whose address is never taken participate: assignments
+	through pointers could otherwise silently invalidate a copy. Copies
+	converting between types are left alone as well.
+
+	Copies that end up without any readers are removed afterwards.
+*/
+
+struct CopyCandidate
+{
+	int opcode; //Opcode index of the copy
+	int target; //Target variable
+	struct Operand source; //Source operand at the time of the analysis
+};
+
+struct CopyPropagation
+{
+	struct Function* function;
+	struct FunctionAnalysis* analysis;
+
+	struct CopyCandidate* copies;
+	size_t copies_size;
+	size_t copies_capacity;
+
+	//Copies referencing each key, variables first and arguments after them
+	int* key_offsets;
+	int* key_copies;
+
+	size_t words;
+};
+
+int copy_propagation_key(struct Function* fn, struct Operand* operand)
+{
+	if (operand->info_type == OPERAND_INFO_TYPE_VARIABLE)
+		return operand->ref_id;
+	if (operand->info_type == OPERAND_INFO_TYPE_ARGUMENT)
+		return fn->variables_size + operand->ref_id;
+	return -1;
+}
+
+// Key overwritten by the opcode, -1 if none
+int copy_propagation_written_key(struct Function* fn, struct Opcode* op)
+{
+	if (!opcode_modifies_target_operand(op) || !operand_is_plain(&op->operands[OPERAND_TARGET]))
+		return -1;
+	return copy_propagation_key(fn, &op->operands[OPERAND_TARGET]);
+}
+
+void copy_propagation_transfer(struct CopyPropagation* cp, uint64_t* set, int index, int copy)
+{
+	int key = copy_propagation_written_key(cp->function, &cp->function->opcodes[index]);
+	if (key >= 0) {
+		for (int i = cp->key_offsets[key]; i < cp->key_offsets[key + 1]; ++i)
+			BITSET_CLEAR(set, cp->key_copies[i]);
+	}
+	if (copy >= 0)
+		BITSET_SET(set, copy);
+}
+
+int copy_propagation_collect(struct CopyPropagation* cp)
+{
+	struct Function* fn = cp->function;
+	struct FunctionAnalysis* a = cp->analysis;
+	size_t keys = fn->variables_size + fn->arguments_size;
+
+	//Arguments whose address is taken are treated like eternal variables
+	char* eternal = calloc(keys + 1, 1);
+	for (size_t i = 0; i < fn->variables_size; ++i)
+		eternal[i] = (a->variables[i].flags & VARIABLE_INFO_ETERNAL) != 0;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &fn->opcodes[i].operands[o];
+			if (operand->info_type == OPERAND_INFO_TYPE_ARGUMENT && (operand->info_flags & OPERAND_FLAG_ADDRESS))
+				eternal[fn->variables_size + operand->ref_id] = 1;
+		}
+	}
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		struct Operand* target = &op->operands[OPERAND_TARGET];
+		struct Operand* source = &op->operands[OPERAND_PRIMARY_1];
+		if (op->type != OPCODE_COPY)
+			continue;
+		if (!operand_is_variable(target) || !operand_is_plain(target) || eternal[target->ref_id])
+			continue;
+		if (!operand_is_plain(source) || !type_info_equal(&target->type_info, &source->type_info))
+			continue;
+		if (source->info_type != OPERAND_INFO_TYPE_IMMEDIATE) {
+			int key = copy_propagation_key(fn, source);
+			if (key < 0 || eternal[key] || key == target->ref_id)
+				continue;
+		}
+		struct CopyCandidate candidate;
+		candidate.opcode = i;
+		candidate.target = target->ref_id;
+		candidate.source = *source;
+		DYNAMIC_ARRAY_PUSH(cp->copies, cp->copies_size, cp->copies_capacity, candidate, 64);
+	}
+	free(eternal);
+
+	if (cp->copies_size == 0)
+		return 0;
+
+	//Index the copies by the keys that kill them
+	cp->key_offsets = calloc(keys + 2, sizeof *cp->key_offsets);
+	cp->key_copies = malloc(2 * cp->copies_size * sizeof *cp->key_copies);
+	for (size_t c = 0; c < cp->copies_size; ++c) {
+		cp->key_offsets[cp->copies[c].target + 1] += 1;
+		int key = copy_propagation_key(fn, &cp->copies[c].source);
+		if (key >= 0)
+			cp->key_offsets[key + 1] += 1;
+	}
+	for (size_t k = 0; k < keys; ++k)
+		cp->key_offsets[k + 1] += cp->key_offsets[k];
+	int* fill = malloc((keys + 1) * sizeof *fill);
+	memcpy(fill, cp->key_offsets, (keys + 1) * sizeof *fill);
+	for (size_t c = 0; c < cp->copies_size; ++c) {
+		cp->key_copies[fill[cp->copies[c].target]++] = c;
+		int key = copy_propagation_key(fn, &cp->copies[c].source);
+		if (key >= 0)
+			cp->key_copies[fill[key]++] = c;
+	}
+	free(fill);
+
+	cp->words = BITSET_WORDS(cp->copies_size);
+	return 1;
+}
+
+// Available copy assigning to the key, -1 if none
+int copy_propagation_find(struct CopyPropagation* cp, uint64_t* set, int key)
+{
+	for (int i = cp->key_offsets[key]; i < cp->key_offsets[key + 1]; ++i) {
+		int c = cp->key_copies[i];
+		if (BITSET_TEST(set, c) && cp->copies[c].target == key)
+			return c;
+	}
+	return -1;
+}
+
+// Returns the amount of operands replaced
+int propagate_copies(struct AnalysisManager* analyses, struct Function* fn)
+{
+	struct CopyPropagation cp;
+	memset(&cp, 0, sizeof cp);
+	cp.function = fn;
+	cp.analysis = analysis_manager_get(analyses, fn);
+
+	struct FunctionAnalysis* a = cp.analysis;
+	int replaced = 0;
+
+	if (!copy_propagation_collect(&cp)) {
+		analysis_manager_release(analyses, a, 0);
+		return 0;
+	}
+
+	//Copy index of each opcode
+	int* opcode_copy = malloc(fn->opcodes_size * sizeof *opcode_copy);
+	for (size_t i = 0; i < fn->opcodes_size; ++i)
+		opcode_copy[i] = -1;
+	for (size_t c = 0; c < cp.copies_size; ++c)
+		opcode_copy[cp.copies[c].opcode] = c;
+
+	size_t words = cp.words;
+	uint64_t* in = malloc(a->blocks_size * words * sizeof *in);
+	uint64_t* out = malloc(a->blocks_size * words * sizeof *out);
+	uint64_t* set = malloc(words * sizeof *set);
+
+	memset(out, 0xff, a->blocks_size * words * sizeof *out);
+
+	//Iterate until the available sets stabilize
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		for (size_t b = 0; b < a->blocks_size; ++b) {
+			struct BasicBlock* block = &a->blocks[b];
+			uint64_t* b_in = in + b * words;
+			if (b == 0 || block->predecessors_size == 0) {
+				memset(b_in, 0, words * sizeof *b_in);
+			} else {
+				memcpy(b_in, out + block->predecessors[0] * words, words * sizeof *b_in);
+				for (size_t p = 1; p < block->predecessors_size; ++p) {
+					uint64_t* p_out = out + block->predecessors[p] * words;
+					for (size_t w = 0; w < words; ++w)
+						b_in[w] &= p_out[w];
+				}
+			}
+
+			memcpy(set, b_in, words * sizeof *set);
+			for (int i = block->start; i < block->end; ++i)
+				copy_propagation_transfer(&cp, set, i, opcode_copy[i]);
+
+			if (memcmp(set, out + b * words, words * sizeof *set)) {
+				memcpy(out + b * words, set, words * sizeof *set);
+				changed = 1;
+			}
+		}
+	}
+
+	//Replace reads of copy targets with the copy sources
+	for (size_t b = 0; b < a->blocks_size; ++b) {
+		struct BasicBlock* block = &a->blocks[b];
+		memcpy(set, in + b * words, words * sizeof *set);
+
+		for (int i = block->start; i < block->end; ++i) {
+			struct Opcode* op = &fn->opcodes[i];
+			for (int o = 0; o < 3; ++o) {
+				struct Operand* operand = &op->operands[o];
+				if (!operand_is_variable(operand) || (operand->info_flags & OPERAND_FLAG_ADDRESS))
+					continue;
+				if (!opcode_reads_operand(op, o))
+					continue;
+				int c = copy_propagation_find(&cp, set, operand->ref_id);
+				if (c < 0)
+					continue;
+
+				struct Operand* source = &cp.copies[c].source;
+				if (operand_is_plain(operand)) {
+					struct TypeInfo type_info = operand->type_info;
+					*operand = *source;
+					operand->type_info = type_info;
+				} else if (source->info_type != OPERAND_INFO_TYPE_IMMEDIATE) {
+					//Pointers can only be replaced by other named values
+					operand->info_type = source->info_type;
+					operand->ref_id = source->ref_id;
+				} else {
+					continue;
+				}
+				replaced += 1;
+			}
+			copy_propagation_transfer(&cp, set, i, opcode_copy[i]);
+		}
+	}
+
+	free(set);
+	free(in);
+	free(out);
+	free(opcode_copy);
+	free(cp.copies);
+	free(cp.key_offsets);
+	free(cp.key_copies);
+	analysis_manager_release(analyses, a, replaced ? ANALYSIS_LIFETIMES : 0);
+	return replaced;
+}
+
+// Turns copies to variables that are never read into NOPs.
+// Returns the amount of removed copies
+int remove_dead_copies(struct Function* fn)
+{
+	int* reads = calloc(fn->variables_size + 1, sizeof *reads);
+	int removed = 0;
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &op->operands[o];
+			if (!operand_is_variable(operand))
+				continue;
+			if (opcode_reads_operand(op, o) || (operand->info_flags & OPERAND_FLAG_ADDRESS))
+				reads[operand->ref_id] += 1;
+		}
+	}
+
+	//Removing a copy may leave its source without readers, so iterate
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		for (size_t i = 0; i < fn->opcodes_size; ++i) {
+			struct Opcode* op = &fn->opcodes[i];
+			if (op->type != OPCODE_COPY || !operand_is_variable(&op->operands[OPERAND_TARGET]))
+				continue;
+			if (!operand_is_plain(&op->operands[OPERAND_TARGET]) || reads[op->operands[OPERAND_TARGET].ref_id])
+				continue;
+			if (operand_is_variable(&op->operands[OPERAND_PRIMARY_1]))
+				reads[op->operands[OPERAND_PRIMARY_1].ref_id] -= 1;
+			op->type = OPCODE_NOP;
+			removed += 1;
+			changed = 1;
+		}
+	}
+
+	free(reads);
+	return removed;
+}
+
+
+/*
+	Move coalescing
+
+	A copy "t = COPY s" between two variables whose lifetimes meet only at
+	the copy itself can be removed by giving both variables the same
+	identity: after renaming t to s the copy assigns s to itself.
+
+	Lifetimes come from analyse_function. The merged variable inherits the
+	union of both lifetimes, which keeps later decisions conservative
+	without re-running the analysis after every merge.
+*/
+
+int variable_lifetimes_interfere(struct VariableInfo* x, struct VariableInfo* y, int copy_index)
+{
+	int start = x->lifetime_start > y->lifetime_start ? x->lifetime_start : y->lifetime_start;
+	int end = x->lifetime_end < y->lifetime_end ? x->lifetime_end : y->lifetime_end;
+	if (start >= end)
+		return 0;
+	//Overlapping only at the copy itself is fine
+	return !(start == copy_index && end == copy_index + 1);
+}
+
+// Returns the amount of coalesced copies
+int coalesce_copies(struct AnalysisManager* analyses, struct Function* fn)
+{
+	struct FunctionAnalysis* a = analysis_manager_get(analyses, fn);
+	int coalesced = 0;
+	int changed = 0;
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		struct Operand* target = &op->operands[OPERAND_TARGET];
+		struct Operand* source = &op->operands[OPERAND_PRIMARY_1];
+		if (op->type != OPCODE_COPY)
+			continue;
+		if (!operand_is_variable(target) || !operand_is_variable(source))
+			continue;
+		if (!operand_is_plain(target) || !operand_is_plain(source))
+			continue;
+
+		int t = target->ref_id;
+		int s = source->ref_id;
+		if (t == s) {
+			op->type = OPCODE_NOP;
+			changed = 1;
+			continue;
+		}
+
+		struct VariableInfo* tv = &a->variables[t];
+		struct VariableInfo* sv = &a->variables[s];
+		unsigned unsafe = VARIABLE_INFO_ETERNAL | VARIABLE_INFO_UNINITIALIZED;
+		if ((tv->flags & unsafe) || (sv->flags & unsafe))
+			continue;
+		if (tv->lifetime_start < 0 || sv->lifetime_start < 0)
+			continue;
+		if (!type_info_equal(&fn->variables[t].type_info, &fn->variables[s].type_info))
+			continue;
+		if (!type_info_equal(&target->type_info, &source->type_info))
+			continue;
+		if (variable_lifetimes_interfere(tv, sv, i))
+			continue;
+
+		function_rename_variable(fn, t, s);
+		op->type = OPCODE_NOP;
+
+		if (tv->lifetime_start < sv->lifetime_start)
+			sv->lifetime_start = tv->lifetime_start;
+		if (tv->lifetime_end > sv->lifetime_end)
+			sv->lifetime_end = tv->lifetime_end;
+		tv->lifetime_start = -1;
+		tv->lifetime_end = -1;
+		coalesced += 1;
+	}
+
+	analysis_manager_release(analyses, a, changed || coalesced ? ANALYSIS_LIFETIMES : 0);
+	return coalesced;
+}
+
+// Runs copy propagation and coalescing until nothing changes.
+// Returns the amount of removed opcodes
+int optimize_copies(struct AnalysisManager* analyses, struct Function* fn)
+{
+	int removed = 0;
+	for (;;) {
+		int changes = propagate_copies(analyses, fn);
+		int dead = remove_dead_copies(fn);
+		if (dead)
+			analysis_manager_invalidate(analyses, fn, ANALYSIS_LIFETIMES);
+		changes += dead;
+		changes += coalesce_copies(analyses, fn);
+		int nops = function_remove_nops(fn);
+		if (nops)
+			analysis_manager_invalidate(analyses, fn, ANALYSIS_CONTROL_FLOW);
+		removed += nops;
+		if (!changes && !nops)
+			break;
+	}
+	return removed;
+}
+
+
+/*
+	Value numbering
+
+	Redundant computations such as repeated address arithmetic are found
+	with a hash table walked along the dominator tree. An expression
+	computed in a block is available in every block it dominates, so the
+	table entries inserted by a block are visible while its dominator
+	subtree is processed and removed afterwards.
+
+	The IR is not in SSA form, which is handled by versioning: every
+	assignment to a variable or argument gives it a fresh version number
+	and expressions are keyed on the versions of their operands. An entry
+	is only reused while the variable holding its result still has the
+	version it got from the computation.
+
+	Entering a block with several predecessors, the values that reach it
+	may have been reassigned on any path from its immediate dominator.
+	Those paths only pass through blocks the dominator dominates, so the
+	blocks are found by walking predecessors backwards until the dominator
+	and every variable they assign gets a fresh version.
+
+	The redundant opcode is replaced with a copy from the earlier result,
+	which copy propagation is then free to remove.
+*/
+
+struct ValueKey
+{
+	int opcode;
+	unsigned short type;
+	unsigned short operand_kinds[2];
+	uint64_t operands[2]; //Immediate values or variable/argument keys
+	int versions[2];
+};
+
+struct ValueEntry
+{
+	struct ValueKey key;
+	int used;
+	int holder; //Variable holding the value
+	int holder_version;
+};
+
+struct ValueTable
+{
+	struct ValueEntry* entries;
+	size_t capacity; //Always a power of two
+	size_t mask;
+};
+
+uint64_t value_key_hash(struct ValueKey* key)
+{
+	uint64_t h = (uint64_t)key->opcode * 0x9E3779B97F4A7C15ull;
+	h ^= key->type + ((uint64_t)key->operand_kinds[0] << 16) + ((uint64_t)key->operand_kinds[1] << 32);
+	h = (h ^ (h >> 29)) * 0xBF58476D1CE4E5B9ull;
+	for (int i = 0; i < 2; ++i) {
+		h ^= key->operands[i] + ((uint64_t)(unsigned)key->versions[i] << 32);
+		h = (h ^ (h >> 31)) * 0x94D049BB133111EBull;
+	}
+	return h ^ (h >> 32);
+}
+
+// Slot of the key, or the empty slot where it would be inserted
+struct ValueEntry* value_table_find(struct ValueTable* table, struct ValueKey* key)
+{
+	size_t i = value_key_hash(key) & table->mask;
+	while (table->entries[i].used) {
+		if (!memcmp(&table->entries[i].key, key, sizeof *key))
+			return &table->entries[i];
+		i = (i + 1) & table->mask;
+	}
+	return &table->entries[i];
+}
+
+int opcode_is_commutative(int type)
+{
+	switch (type) {
+		case OPCODE_ADD:
+		case OPCODE_MUL:
+		case OPCODE_MUL_HIGH:
+		case OPCODE_OR:
+		case OPCODE_AND:
+		case OPCODE_BIT_OR:
+		case OPCODE_BIT_AND:
+		case OPCODE_BIR_XOR:
+		case OPCODE_COMPARE(COMPARISON_EQUAL):
+		case OPCODE_COMPARE(COMPARISON_NOT_EQUAL):
+			return 1;
+	}
+	return 0;
+}
+
+// Opcodes whose result only depends on their operands
+int opcode_is_pure_computation(int type)
+{
+	if (type >= OPCODE_ADD && type <= OPCODE_BIT_SHIFT_ARITHMETIC_RIGHT)
+		return 1;
+	if (type == OPCODE_MUL_HIGH)
+		return 1;
+	if (type > OPCODE_COMPARE_BASE && type < OPCODE_COMPARE_BASE + 8)
+		return 1;
+	return 0;
+}
+
+struct SavedVersion
+{
+	int key;
+	int version;
+};
+
+struct ValueNumbering
+{
+	struct Function* function;
+	struct FunctionAnalysis* analysis;
+	struct ValueTable table;
+
+	int* versions; //Current version of every key
+	int next_version;
+	char* eternal;
+
+	//Undo logs for leaving a dominator subtree
+	struct ValueEntry** inserted;
+	size_t inserted_size;
+	size_t inserted_capacity;
+	struct SavedVersion* saved;
+	size_t saved_size;
+	size_t saved_capacity;
+
+	//Assigned keys of every block in CSR form
+	int* block_def_offsets;
+	int* block_defs;
+
+	int* visit_marks;
+	int visit_mark;
+	int* worklist;
+};
+
+void value_numbering_bump(struct ValueNumbering* vn, int key)
+{
+	struct SavedVersion saved;
+	saved.key = key;
+	saved.version = vn->versions[key];
+	DYNAMIC_ARRAY_PUSH(vn->saved, vn->saved_size, vn->saved_capacity, saved, 256);
+	vn->versions[key] = vn->next_version++;
+}
+
+// Builds the lookup key of a candidate opcode, returns 0 if it is not one
+int value_numbering_key(struct ValueNumbering* vn, struct Opcode* op, struct ValueKey* key)
+{
+	struct Function* fn = vn->function;
+	struct Operand* target = &op->operands[OPERAND_TARGET];
+
+	if (!opcode_is_pure_computation(op->type))
+		return 0;
+	if (!operand_is_variable(target) || !operand_is_plain(target) || vn->eternal[target->ref_id])
+		return 0;
+
+	memset(key, 0, sizeof *key);
+	key->opcode = op->type;
+	key->type = target->type_info.type;
+
+	int count = opcode_read_operand_primary_2(op) ? 2 : 1;
+	for (int i = 0; i < count; ++i) {
+		struct Operand* operand = &op->operands[OPERAND_PRIMARY_1 + i];
+		if (!operand_is_plain(operand))
+			return 0;
+		key->operand_kinds[i] = operand->info_type | (operand->type_info.type << 4);
+		if (operand->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+			key->operands[i] = operand->value_u64;
+		} else {
+			int k = copy_propagation_key(fn, operand);
+			if (k < 0 || vn->eternal[k])
+				return 0;
+			key->operands[i] = k;
+			key->versions[i] = vn->versions[k];
+		}
+	}
+
+	//Sort the operands of commutative opcodes into a canonical order
+	if (count == 2 && opcode_is_commutative(op->type)) {
+		int swap = key->operand_kinds[0] > key->operand_kinds[1];
+		if (key->operand_kinds[0] == key->operand_kinds[1])
+			swap = key->operands[0] > key->operands[1] ||
+				(key->operands[0] == key->operands[1] && key->versions[0] > key->versions[1]);
+		if (swap) {
+			unsigned short kind = key->operand_kinds[0];
+			uint64_t value = key->operands[0];
+			int version = key->versions[0];
+			key->operand_kinds[0] = key->operand_kinds[1];
+			key->operands[0] = key->operands[1];
+			key->versions[0] = key->versions[1];
+			key->operand_kinds[1] = kind;
+			key->operands[1] = value;
+			key->versions[1] = version;
+		}
+	}
+	return 1;
+}
+
+// Gives fresh versions to everything assigned on paths from the
+// immediate dominator of the block to the block itself
+void value_numbering_enter_join(struct ValueNumbering* vn, int b)
+{
+	struct FunctionAnalysis* a = vn->analysis;
+	int idom = a->blocks[b].idom;
+	size_t worklist_size = 0;
+
+	vn->visit_mark += 1;
+	for (size_t p = 0; p < a->blocks[b].predecessors_size; ++p) {
+		int pred = a->blocks[b].predecessors[p];
+		if (pred != idom && vn->visit_marks[pred] != vn->visit_mark) {
+			vn->visit_marks[pred] = vn->visit_mark;
+			vn->worklist[worklist_size++] = pred;
+		}
+	}
+
+	while (worklist_size) {
+		int x = vn->worklist[--worklist_size];
+		for (int i = vn->block_def_offsets[x]; i < vn->block_def_offsets[x + 1]; ++i)
+			value_numbering_bump(vn, vn->block_defs[i]);
+		for (size_t p = 0; p < a->blocks[x].predecessors_size; ++p) {
+			int pred = a->blocks[x].predecessors[p];
+			if (pred != idom && vn->visit_marks[pred] != vn->visit_mark) {
+				vn->visit_marks[pred] = vn->visit_mark;
+				vn->worklist[worklist_size++] = pred;
+			}
+		}
+	}
+}
+
+int value_numbering_block(struct ValueNumbering* vn, int b)
+{
+	struct Function* fn = vn->function;
+	struct BasicBlock* block = &vn->analysis->blocks[b];
+	int replaced = 0;
+
+	for (int i = block->start; i < block->end; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		struct ValueKey key;
+		int candidate = value_numbering_key(vn, op, &key);
+
+		if (candidate) {
+			struct ValueEntry* entry = value_table_find(&vn->table, &key);
+			if (entry->used && vn->versions[entry->holder] == entry->holder_version
+				&& type_info_equal(&fn->variables[entry->holder].type_info, &op->operands[OPERAND_TARGET].type_info)) {
+				struct Operand* source = &op->operands[OPERAND_PRIMARY_1];
+				memset(source, 0, sizeof *source);
+				source->info_type = OPERAND_INFO_TYPE_VARIABLE;
+				source->ref_id = entry->holder;
+				source->type_info = op->operands[OPERAND_TARGET].type_info;
+				memset(&op->operands[OPERAND_PRIMARY_2], 0, sizeof op->operands[OPERAND_PRIMARY_2]);
+				op->type = OPCODE_COPY;
+				replaced += 1;
+				candidate = 0;
+			}
+		}
+
+		int written = copy_propagation_written_key(fn, op);
+		if (written >= 0)
+			value_numbering_bump(vn, written);
+
+		if (candidate) {
+			struct ValueEntry* entry = value_table_find(&vn->table, &key);
+			if (!entry->used) {
+				entry->key = key;
+				entry->used = 1;
+				DYNAMIC_ARRAY_PUSH(vn->inserted, vn->inserted_size, vn->inserted_capacity, entry, 256);
+			}
+			entry->holder = written;
+			entry->holder_version = vn->versions[written];
+		}
+	}
+	return replaced;
+}
+
+// Returns the amount of redundant computations replaced with copies
+int number_values(struct AnalysisManager* analyses, struct Function* fn)
+{
+	struct ValueNumbering vn;
+	memset(&vn, 0, sizeof vn);
+	vn.function = fn;
+	vn.analysis = analysis_manager_get(analyses, fn);
+
+	struct FunctionAnalysis* a = vn.analysis;
+	size_t keys = fn->variables_size + fn->arguments_size;
+	int replaced = 0;
+
+	vn.eternal = calloc(keys + 1, 1);
+	vn.versions = calloc(keys + 1, sizeof *vn.versions);
+	vn.next_version = 1;
+	for (size_t i = 0; i < fn->variables_size; ++i)
+		vn.eternal[i] = (a->variables[i].flags & VARIABLE_INFO_ETERNAL) != 0;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &fn->opcodes[i].operands[o];
+			if (operand->info_type == OPERAND_INFO_TYPE_ARGUMENT && (operand->info_flags & OPERAND_FLAG_ADDRESS))
+				vn.eternal[fn->variables_size + operand->ref_id] = 1;
+		}
+	}
+
+	size_t candidates = 0;
+	for (size_t i = 0; i < fn->opcodes_size; ++i)
+		candidates += opcode_is_pure_computation(fn->opcodes[i].type);
+
+	vn.table.capacity = 16;
+	while (vn.table.capacity < candidates * 2)
+		vn.table.capacity *= 2;
+	vn.table.mask = vn.table.capacity - 1;
+	vn.table.entries = calloc(vn.table.capacity, sizeof *vn.table.entries);
+
+	//Index the assignments of every block
+	vn.block_def_offsets = calloc(a->blocks_size + 1, sizeof *vn.block_def_offsets);
+	vn.block_defs = malloc((fn->opcodes_size + 1) * sizeof *vn.block_defs);
+	size_t defs = 0;
+	for (size_t b = 0; b < a->blocks_size; ++b) {
+		vn.block_def_offsets[b] = defs;
+		for (int i = a->blocks[b].start; i < a->blocks[b].end; ++i) {
+			int written = copy_propagation_written_key(fn, &fn->opcodes[i]);
+			if (written >= 0)
+				vn.block_defs[defs++] = written;
+		}
+	}
+	vn.block_def_offsets[a->blocks_size] = defs;
+
+	vn.visit_marks = calloc(a->blocks_size + 1, sizeof *vn.visit_marks);
+	vn.worklist = malloc((a->blocks_size + 1) * sizeof *vn.worklist);
+
+	//Dominator tree children in CSR form
+	int* child_offsets = calloc(a->blocks_size + 2, sizeof *child_offsets);
+	int* children = malloc((a->blocks_size + 1) * sizeof *children);
+	for (size_t i = 0; i < a->rpo_size; ++i) {
+		int idom = a->blocks[a->rpo[i]].idom;
+		if (idom >= 0)
+			child_offsets[idom + 1] += 1;
+	}
+	for (size_t b = 0; b < a->blocks_size; ++b)
+		child_offsets[b + 1] += child_offsets[b];
+	int* fill = malloc((a->blocks_size + 1) * sizeof *fill);
+	memcpy(fill, child_offsets, (a->blocks_size + 1) * sizeof *fill);
+	for (size_t i = 0; i < a->rpo_size; ++i) {
+		int idom = a->blocks[a->rpo[i]].idom;
+		if (idom >= 0)
+			children[fill[idom]++] = a->rpo[i];
+	}
+	free(fill);
+
+	//Depth first walk over the dominator tree with explicit undo marks
+	struct WalkState
+	{
+		int block;
+		int next_child;
+		size_t inserted_mark;
+		size_t saved_mark;
+	};
+	struct WalkState* stack = malloc((a->blocks_size + 1) * sizeof *stack);
+	size_t stack_size = 0;
+
+	if (a->blocks_size) {
+		stack[stack_size].block = 0;
+		stack[stack_size].next_child = child_offsets[0];
+		stack[stack_size].inserted_mark = 0;
+		stack[stack_size].saved_mark = 0;
+		stack_size += 1;
+		replaced += value_numbering_block(&vn, 0);
+	}
+
+	while (stack_size) {
+		struct WalkState* top = &stack[stack_size - 1];
+		if (top->next_child < child_offsets[top->block + 1]) {
+			int child = children[top->next_child++];
+			struct WalkState* next = &stack[stack_size++];
+			next->block = child;
+			next->next_child = child_offsets[child];
+			next->inserted_mark = vn.inserted_size;
+			next->saved_mark = vn.saved_size;
+
+			struct BasicBlock* block = &a->blocks[child];
+			int join = block->predecessors_size > 1;
+			for (size_t p = 0; p < block->predecessors_size; ++p)
+				join |= block->predecessors[p] != block->idom;
+			if (join)
+				value_numbering_enter_join(&vn, child);
+			replaced += value_numbering_block(&vn, child);
+			continue;
+		}
+
+		//Leaving the subtree, undo in reverse order
+		while (vn.inserted_size > top->inserted_mark)
+			vn.inserted[--vn.inserted_size]->used = 0;
+		while (vn.saved_size > top->saved_mark) {
+			vn.saved_size -= 1;
+			vn.versions[vn.saved[vn.saved_size].key] = vn.saved[vn.saved_size].version;
+		}
+		stack_size -= 1;
+	}
+
+	free(stack);
+	free(children);
+	free(child_offsets);
+	free(vn.worklist);
+	free(vn.visit_marks);
+	free(vn.block_defs);
+	free(vn.block_def_offsets);
+	free(vn.table.entries);
+	free(vn.inserted);
+	free(vn.saved);
+	free(vn.versions);
+	free(vn.eternal);
+	analysis_manager_release(analyses, a, replaced ? ANALYSIS_LIFETIMES : 0);
+	return replaced;
+}
+
+
+// Inserts opcodes before index "at". Jumps to "at" reach the inserted
+// opcodes, jumps past it are shifted along with their targets
+void function_insert_opcodes(struct Function* fn, int at, struct Opcode* ops, int count)
+{
+	if (count <= 0)
+		return;
+	DYNAMIC_ARRAY_RESERVE(fn->opcodes, fn->opcodes_size, fn->opcodes_capacity, fn->opcodes_size + count);
+	memmove(fn->opcodes + at + count, fn->opcodes + at, (fn->opcodes_size - at) * sizeof *fn->opcodes);
+	memcpy(fn->opcodes + at, ops, count * sizeof *ops);
+	fn->opcodes_size += count;
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		if ((int)i >= at && (int)i < at + count)
+			continue;
+		if (opcode_is_jump(op) && op->operands[OPERAND_TARGET].ref_id > at)
+			op->operands[OPERAND_TARGET].ref_id += count;
+	}
+}
+
+// Whether code can be inserted right before the loop header so that it
+// runs once before entering the loop. Fails when a block of the loop
+// falls through into the header
+int loop_can_insert_preheader(struct FunctionAnalysis* a, int loop)
+{
+	struct BasicBlock* header = &a->blocks[a->loops[loop].header];
+	if (header->start == 0)
+		return 1;
+	int previous = a->opcode_blocks[header->start - 1];
+	if (!loop_contains(a, loop, previous))
+		return 1;
+	struct Opcode* last = &a->function->opcodes[a->blocks[previous].end - 1];
+	return last->type == OPCODE_GOTO_BASE || opcode_is_return(last);
+}
+
+// Inserts opcodes in front of the loop header, outside the loop. Jumps
+// entering the loop reach the inserted opcodes, back edges skip them
+void loop_insert_before_header(struct FunctionAnalysis* a, int loop, struct Opcode* ops, int count)
+{
+	struct Function* fn = a->function;
+	int at = a->blocks[a->loops[loop].header].start;
+
+	//Back edges jump to the header and are found before the indices shift
+	int* back_edges = malloc((fn->opcodes_size + 1) * sizeof *back_edges);
+	size_t back_edges_size = 0;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		if (opcode_is_jump(op) && op->operands[OPERAND_TARGET].ref_id == at && loop_contains(a, loop, a->opcode_blocks[i]))
+			back_edges[back_edges_size++] = i;
+	}
+
+	function_insert_opcodes(fn, at, ops, count);
+
+	for (size_t i = 0; i < back_edges_size; ++i) {
+		int index = back_edges[i] >= at ? back_edges[i] + count : back_edges[i];
+		fn->opcodes[index].operands[OPERAND_TARGET].ref_id = at + count;
+	}
+	free(back_edges);
+}
+
+// Gives every loop a preheader: an empty block through which all entries
+// into the loop pass. Returns the amount of inserted preheaders
+int insert_loop_preheaders(struct AnalysisManager* analyses, struct Function* fn)
+{
+	int inserted = 0;
+	for (;;) {
+		struct FunctionAnalysis* a = analysis_manager_get(analyses, fn);
+		int done = 1;
+		for (size_t l = 0; l < a->loops_size; ++l) {
+			struct BasicBlock* header = &a->blocks[a->loops[l].header];
+			int entries = 0;
+			int entry = -1;
+			for (size_t p = 0; p < header->predecessors_size; ++p) {
+				if (!loop_contains(a, l, header->predecessors[p])) {
+					entries += 1;
+					entry = header->predecessors[p];
+				}
+			}
+			//A lone predecessor without other successors already is one
+			if (entries == 1 && a->blocks[entry].successors_size == 1)
+				continue;
+			if (header->start != 0 && entries == 0)
+				continue;
+			if (!loop_can_insert_preheader(a, l))
+				continue;
+
+			struct Opcode nop;
+			memset(&nop, 0, sizeof nop);
+			nop.type = OPCODE_NOP;
+			loop_insert_before_header(a, l, &nop, 1);
+			inserted += 1;
+			done = 0;
+			break;
+		}
+		analysis_manager_release(analyses, a, done ? 0 : ANALYSIS_ALL);
+		if (done)
+			break;
+	}
+	return inserted;
+}
+
+
+/*
+	Loop-invariant code motion
+
+	Opcodes computing the same value on every iteration are moved in front
+	of the loop header, which acts as the preheader: loop entries run the
+	hoisted code while back edges skip it.
+
+	An opcode "t = x op y" is invariant when its operands are immediates,
+	values not assigned in the loop, or variables whose only assignment in
+	the loop is itself invariant. Hoisting it is safe when
+	- it is the only assignment to t in the loop,
+	- it dominates every read of t in the loop, so no read observes the
+	  value t had before the loop,
+	- t is not read outside the loop, or it dominates every loop exit.
+
+	Hoisted code runs even when the loop body would not, so only opcodes
+	without side effects are moved. Divisions are moved only by constants
+	that can not trap.
+
+	Loops are processed innermost first and the analysis is redone after
+	every hoist, so invariants hoisted out of an inner loop can continue
+	out of the enclosing loops.
+*/
+
+int licm_opcode_is_candidate(struct Opcode* op)
+{
+	if (op->type != OPCODE_COPY && !opcode_is_pure_computation(op->type))
+		return 0;
+	if (!operand_is_plain(&op->operands[OPERAND_PRIMARY_1]))
+		return 0;
+	if (opcode_read_operand_primary_2(op) && !operand_is_plain(&op->operands[OPERAND_PRIMARY_2]))
+		return 0;
+	if (op->type == OPCODE_DIV) {
+		struct Operand* divisor = &op->operands[OPERAND_PRIMARY_2];
+		if (divisor->info_type != OPERAND_INFO_TYPE_IMMEDIATE || divisor->value_u64 == 0)
+			return 0;
+		if (divisor->value_i64 == -1 || (divisor->type_info.type == IR_TYPE_I32 && divisor->value_i32 == -1))
+			return 0;
+	}
+	return 1;
+}
+
+// Whether the opcode at index "def" executes before the one at "use"
+// on every path through the loop
+int licm_dominates_opcode(struct FunctionAnalysis* a, int def, int use)
+{
+	int def_block = a->opcode_blocks[def];
+	int use_block = a->opcode_blocks[use];
+	if (def_block == use_block)
+		return def < use;
+	return block_dominates(a, def_block, use_block);
+}
+
+int licm_order_compare(const void* x, const void* y)
+{
+	const int* a = x;
+	const int* b = y;
+	if (a[0] != b[0])
+		return a[0] - b[0];
+	return a[1] - b[1];
+}
+
+// Hoists the invariants of a single loop, returns the amount of hoisted opcodes
+int licm_hoist_loop(struct FunctionAnalysis* a, int loop)
+{
+	struct Function* fn = a->function;
+	size_t keys = fn->variables_size + fn->arguments_size;
+
+	if (!loop_can_insert_preheader(a, loop))
+		return 0;
+
+	char* in_loop = calloc(fn->opcodes_size + 1, 1);
+	for (size_t b = 0; b < a->loops[loop].blocks_size; ++b) {
+		struct BasicBlock* block = &a->blocks[a->loops[loop].blocks[b]];
+		memset(in_loop + block->start, 1, block->end - block->start);
+	}
+
+	//Assignments in the loop and the index of the last one
+	int* defs = calloc(keys + 1, sizeof *defs);
+	int* def_index = malloc((keys + 1) * sizeof *def_index);
+	char* read_outside = calloc(keys + 1, 1);
+	char* eternal = calloc(keys + 1, 1);
+	for (size_t i = 0; i < fn->variables_size; ++i)
+		eternal[i] = (a->variables[i].flags & VARIABLE_INFO_ETERNAL) != 0;
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &op->operands[o];
+			int key = opcode_is_jump(op) && o == OPERAND_TARGET ? -1 : copy_propagation_key(fn, operand);
+			if (key < 0)
+				continue;
+			if (operand->info_flags & OPERAND_FLAG_ADDRESS)
+				eternal[key] = 1;
+			if (!in_loop[i] && opcode_reads_operand(op, o))
+				read_outside[key] = 1;
+		}
+		int written = copy_propagation_written_key(fn, op);
+		if (written >= 0 && in_loop[i]) {
+			defs[written] += 1;
+			def_index[written] = i;
+		}
+	}
+
+	//Blocks of the loop with successors outside it
+	int* exits = malloc((a->loops[loop].blocks_size + 1) * sizeof *exits);
+	size_t exits_size = 0;
+	for (size_t b = 0; b < a->loops[loop].blocks_size; ++b) {
+		struct BasicBlock* block = &a->blocks[a->loops[loop].blocks[b]];
+		for (int s = 0; s < block->successors_size; ++s) {
+			if (!loop_contains(a, loop, block->successors[s])) {
+				exits[exits_size++] = a->loops[loop].blocks[b];
+				break;
+			}
+		}
+		if (block->successors_size == 0)
+			exits[exits_size++] = a->loops[loop].blocks[b];
+	}
+
+	//Mark invariants until nothing changes
+	char* invariant = calloc(fn->opcodes_size + 1, 1);
+	int changed = 1;
+	size_t hoisted = 0;
+	while (changed) {
+		changed = 0;
+		for (size_t i = 0; i < fn->opcodes_size; ++i) {
+			struct Opcode* op = &fn->opcodes[i];
+			if (!in_loop[i] || invariant[i] || !licm_opcode_is_candidate(op))
+				continue;
+
+			struct Operand* target = &op->operands[OPERAND_TARGET];
+			if (!operand_is_variable(target) || !operand_is_plain(target))
+				continue;
+			int t = target->ref_id;
+			if (eternal[t] || defs[t] != 1)
+				continue;
+
+			int ok = 1;
+			for (int o = OPERAND_PRIMARY_1; o <= OPERAND_PRIMARY_2 && ok; ++o) {
+				if (!opcode_reads_operand(op, o))
+					continue;
+				int key = copy_propagation_key(fn, &op->operands[o]);
+				if (key < 0)
+					continue;
+				if (eternal[key] || key == t)
+					ok = 0;
+				else if (defs[key] && !(defs[key] == 1 && invariant[def_index[key]] && licm_dominates_opcode(a, def_index[key], i)))
+					ok = 0;
+			}
+			if (!ok)
+				continue;
+
+			//Every read of t in the loop must see this assignment
+			for (size_t j = 0; j < fn->opcodes_size && ok; ++j) {
+				if (!in_loop[j])
+					continue;
+				for (int o = 0; o < 3; ++o) {
+					struct Operand* operand = &fn->opcodes[j].operands[o];
+					if (operand_is_variable(operand) && operand->ref_id == t && opcode_reads_operand(&fn->opcodes[j], o)
+						&& !licm_dominates_opcode(a, i, j))
+						ok = 0;
+				}
+			}
+
+			if (ok && read_outside[t]) {
+				for (size_t e = 0; e < exits_size && ok; ++e) {
+					if (!block_dominates(a, a->opcode_blocks[i], exits[e]))
+						ok = 0;
+				}
+			}
+
+			if (ok) {
+				invariant[i] = 1;
+				hoisted += 1;
+				changed = 1;
+			}
+		}
+	}
+
+	if (hoisted) {
+		//Keep dominating definitions first: reverse post-order, then position
+		int* order = malloc(hoisted * 2 * sizeof *order);
+		size_t n = 0;
+		for (size_t i = 0; i < fn->opcodes_size; ++i) {
+			if (!invariant[i])
+				continue;
+			order[n * 2] = a->blocks[a->opcode_blocks[i]].rpo_index;
+			order[n * 2 + 1] = i;
+			n += 1;
+		}
+		qsort(order, n, 2 * sizeof *order, licm_order_compare);
+
+		struct Opcode* ops = malloc(hoisted * sizeof *ops);
+		for (size_t k = 0; k < n; ++k) {
+			ops[k] = fn->opcodes[order[k * 2 + 1]];
+			fn->opcodes[order[k * 2 + 1]].type = OPCODE_NOP;
+		}
+		loop_insert_before_header(a, loop, ops, n);
+		free(ops);
+		free(order);
+	}
+
+	free(invariant);
+	free(exits);
+	free(eternal);
+	free(read_outside);
+	free(def_index);
+	free(defs);
+	free(in_loop);
+	return hoisted;
+}
+
+// Returns the amount of hoisted opcodes
+int hoist_loop_invariants(struct AnalysisManager* analyses, struct Function* fn)
+{
+	int hoisted = 0;
+	for (;;) {
+		struct FunctionAnalysis* a = analysis_manager_get(analyses, fn);
+		int moved = 0;
+		//Innermost loops are sorted last
+		for (int l = a->loops_size - 1; l >= 0 && !moved; --l)
+			moved = licm_hoist_loop(a, l);
+		analysis_manager_release(analyses, a, moved ? ANALYSIS_ALL : 0);
+		if (!moved)
+			break;
+		hoisted += moved;
+	}
+	if (function_remove_nops(fn))
+		analysis_manager_invalidate(analyses, fn, ANALYSIS_ALL);
+	return hoisted;
+}
+
+
+/*
+	Strength reduction
+
+	Integer multiplications and divisions by constants are rewritten into
+	cheaper opcodes so that they never reach the hardware divider:
+	- multiplications by powers of two become left shifts and
+	  multiplications by 2^a + 2^b or 2^a - 2^b a pair of shifts combined
+	  with an addition or a subtraction,
+	- unsigned divisions by powers of two become logical right shifts and
+	  signed ones an arithmetic shift with rounding towards zero,
+	- other divisions multiply by a "magic" reciprocal with OPCODE_MUL_HIGH
+	  and shift the result, as described by Granlund and Montgomery in
+	  "Division by Invariant Integers using Multiplication" and in
+	  Hacker's Delight chapter 10.
+
+	Inside loops a multiplication of a basic induction variable by a
+	constant is replaced with a new variable that is advanced by the
+	scaled step whenever the induction variable is.
+*/
+
+struct DivisionMagic
+{
+	uint64_t multiplier;
+	int shift;
+	int add; //Unsigned division needs the add and shift fix-up
+};
+
+// Magic numbers for unsigned division by d in the given width. d must be
+// at least 3, not a power of two and below 2^(bits - 1)
+void compute_unsigned_division_magic(uint64_t d, int bits, struct DivisionMagic* magic)
+{
+	unsigned __int128 one = 1;
+	int l = 64 - __builtin_clzll(d); //ceil(log2(d)) as d is not a power of two
+
+	//Rounding the reciprocal up works if the error is small enough
+	for (int p = 0; p < l; ++p) {
+		unsigned __int128 power = one << (bits + p);
+		unsigned __int128 m = (power + d - 1) / d;
+		if (m >> bits)
+			break;
+		if (m * d - power <= (one << p)) {
+			magic->multiplier = (uint64_t)m;
+			magic->shift = p;
+			magic->add = 0;
+			return;
+		}
+	}
+
+	//Otherwise the multiplier needs bits + 1 bits, the top one is added back
+	uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+	magic->multiplier = (uint64_t)((one << (bits + l)) / d + 1) & mask;
+	magic->shift = l - 1;
+	magic->add = 1;
+}
+
+// Magic numbers for signed division by d in the given width. |d| must be
+// at least 3 and not a power of two. Hacker's Delight figure 10-1
+void compute_signed_division_magic(int64_t d, int bits, struct DivisionMagic* magic)
+{
+	uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+	uint64_t high = (uint64_t)1 << (bits - 1);
+	uint64_t ad = d < 0 ? -(uint64_t)d : (uint64_t)d;
+	uint64_t t = high + (d < 0);
+	uint64_t anc = t - 1 - t % ad;
+	int p = bits - 1;
+	uint64_t q1 = high / anc;
+	uint64_t r1 = high - q1 * anc;
+	uint64_t q2 = high / ad;
+	uint64_t r2 = high - q2 * ad;
+	uint64_t delta;
+
+	do {
+		p += 1;
+		q1 = (2 * q1) & mask;
+		r1 = (2 * r1) & mask;
+		if (r1 >= anc) {
+			q1 = (q1 + 1) & mask;
+			r1 -= anc;
+		}
+		q2 = (2 * q2) & mask;
+		r2 = (2 * r2) & mask;
+		if (r2 >= ad) {
+			q2 = (q2 + 1) & mask;
+			r2 -= ad;
+		}
+		delta = ad - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+
+	magic->multiplier = (q2 + 1) & mask;
+	if (d < 0)
+		magic->multiplier = -magic->multiplier & mask;
+	magic->shift = p - bits;
+	magic->add = 0;
+}
+
+// Sequence builder for replacing a single opcode
+struct ReductionSequence
+{
+	struct Function* function;
+	struct TypeInfo type_info;
+	struct Opcode ops[8];
+	int size;
+};
+
+struct Operand reduction_emit(struct ReductionSequence* seq, int type, struct Operand x, struct Operand y)
+{
+	struct Operand target = make_variable_operand(function_add_variable(seq->function, seq->type_info), seq->type_info);
+	seq->ops[seq->size++] = make_opcode(type, target, x, y);
+	return target;
+}
+
+struct Operand reduction_immediate(struct ReductionSequence* seq, uint64_t value)
+{
+	return make_immediate_operand(seq->type_info, value);
+}
+
+int is_power_of_two(uint64_t x)
+{
+	return x && !(x & (x - 1));
+}
+
+// Builds a cheaper sequence for a multiplication by constant c. The last
+// opcode computes the result into a temporary. Returns 0 when not worth it
+int reduce_multiplication(struct ReductionSequence* seq, struct Operand x, uint64_t c, int bits)
+{
+	uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+	struct Operand zero = reduction_immediate(seq, 0);
+	c &= mask;
+
+	if (c == 0) {
+		reduction_emit(seq, OPCODE_COPY, zero, zero);
+		return 1;
+	}
+	if (c == 1) {
+		reduction_emit(seq, OPCODE_COPY, x, zero);
+		return 1;
+	}
+	if (is_power_of_two(c)) {
+		reduction_emit(seq, OPCODE_BIT_SHIFT_LEFT, x, reduction_immediate(seq, __builtin_ctzll(c)));
+		return 1;
+	}
+	if (is_power_of_two(-c & mask)) {
+		struct Operand t = reduction_emit(seq, OPCODE_BIT_SHIFT_LEFT, x, reduction_immediate(seq, __builtin_ctzll(-c & mask)));
+		reduction_emit(seq, OPCODE_SUB, zero, t);
+		return 1;
+	}
+
+	//Other constants stay a multiplication, lowering turns small ones into lea
+	return 0;
+}
+
+// Builds a sequence for a division by constant d. Returns 0 when the
+// division is left alone
+int reduce_division(struct ReductionSequence* seq, struct Operand x, struct Operand* divisor, int is_signed, int bits)
+{
+	struct Operand zero = reduction_immediate(seq, 0);
+
+	if (!is_signed) {
+		uint64_t d = operand_immediate_unsigned(divisor);
+		if (d == 0)
+			return 0;
+		if (d == 1) {
+			reduction_emit(seq, OPCODE_COPY, x, zero);
+			return 1;
+		}
+		if (is_power_of_two(d)) {
+			reduction_emit(seq, OPCODE_BIT_SHIFT_LOGICAL_RIGHT, x, reduction_immediate(seq, __builtin_ctzll(d)));
+			return 1;
+		}
+		if (d >> (bits - 1)) {
+			//The quotient is either zero or one
+			reduction_emit(seq, OPCODE_COMPARE(COMPARISON_GEQUAL), x, reduction_immediate(seq, d));
+			return 1;
+		}
+
+		struct DivisionMagic magic;
+		compute_unsigned_division_magic(d, bits, &magic);
+		struct Operand t = reduction_emit(seq, OPCODE_MUL_HIGH, x, reduction_immediate(seq, magic.multiplier));
+		if (magic.add) {
+			struct Operand u = reduction_emit(seq, OPCODE_SUB, x, t);
+			u = reduction_emit(seq, OPCODE_BIT_SHIFT_LOGICAL_RIGHT, u, reduction_immediate(seq, 1));
+			t = reduction_emit(seq, OPCODE_ADD, u, t);
+		}
+		if (magic.shift)
+			reduction_emit(seq, OPCODE_BIT_SHIFT_LOGICAL_RIGHT, t, reduction_immediate(seq, magic.shift));
+		return 1;
+	}
+
+	int64_t d = operand_immediate_signed(divisor);
+	uint64_t ad = d < 0 ? -(uint64_t)d : (uint64_t)d;
+	if (d == 0)
+		return 0;
+	if (d == 1) {
+		reduction_emit(seq, OPCODE_COPY, x, zero);
+		return 1;
+	}
+	if (d == -1) {
+		reduction_emit(seq, OPCODE_SUB, zero, x);
+		return 1;
+	}
+	if (is_power_of_two(ad)) {
+		//Negative dividends are biased by d - 1 to round towards zero.
+		//Narrow values are sign extended, so the bias is masked rather
+		//than shifted in logically
+		int k = __builtin_ctzll(ad);
+		struct Operand t = reduction_emit(seq, OPCODE_BIT_SHIFT_ARITHMETIC_RIGHT, x, reduction_immediate(seq, bits - 1));
+		t = reduction_emit(seq, OPCODE_BIT_AND, t, reduction_immediate(seq, ((uint64_t)1 << k) - 1));
+		t = reduction_emit(seq, OPCODE_ADD, x, t);
+		t = reduction_emit(seq, OPCODE_BIT_SHIFT_ARITHMETIC_RIGHT, t, reduction_immediate(seq, k));
+		if (d < 0)
+			reduction_emit(seq, OPCODE_SUB, zero, t);
+		return 1;
+	}
+
+	struct DivisionMagic magic;
+	compute_signed_division_magic(d, bits, &magic);
+	int64_t multiplier = (int64_t)(magic.multiplier << (64 - bits)) >> (64 - bits);
+	struct Operand t = reduction_emit(seq, OPCODE_MUL_HIGH, x, reduction_immediate(seq, magic.multiplier));
+	if (d > 0 && multiplier < 0)
+		t = reduction_emit(seq, OPCODE_ADD, t, x);
+	if (d < 0 && multiplier > 0)
+		t = reduction_emit(seq, OPCODE_SUB, t, x);
+	if (magic.shift)
+		t = reduction_emit(seq, OPCODE_BIT_SHIFT_ARITHMETIC_RIGHT, t, reduction_immediate(seq, magic.shift));
+	//Adds one to negative quotients, the sign being 0 or -1
+	struct Operand sign = reduction_emit(seq, OPCODE_BIT_SHIFT_ARITHMETIC_RIGHT, t, reduction_immediate(seq, bits - 1));
+	reduction_emit(seq, OPCODE_SUB, t, sign);
+	return 1;
+}
+
+// Reduces multiplications and divisions by constants.
+// Returns the amount of reduced opcodes
+int reduce_constant_arithmetic(struct Function* fn)
+{
+	int reduced = 0;
+
+	//Backwards so that insertions do not move unvisited opcodes
+	for (int i = fn->opcodes_size - 1; i >= 0; --i) {
+		struct Opcode op = fn->opcodes[i];
+		struct Operand* target = &op.operands[OPERAND_TARGET];
+		if (op.type != OPCODE_MUL && op.type != OPCODE_DIV)
+			continue;
+
+		int type = target->type_info.type;
+		if (!ir_type_is_integer(type))
+			continue;
+
+		struct Operand x = op.operands[OPERAND_PRIMARY_1];
+		struct Operand c = op.operands[OPERAND_PRIMARY_2];
+		if (op.type == OPCODE_MUL && x.info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+			struct Operand t = x;
+			x = c;
+			c = t;
+		}
+		if (c.info_type != OPERAND_INFO_TYPE_IMMEDIATE || x.info_type == OPERAND_INFO_TYPE_IMMEDIATE)
+			continue;
+		//The sequences read the operand several times
+		if (!operand_is_plain(&x) || !operand_is_plain(&c))
+			continue;
+		if (x.type_info.type != type || c.type_info.type != type)
+			continue;
+
+		struct ReductionSequence seq;
+		memset(&seq, 0, sizeof seq);
+		seq.function = fn;
+		seq.type_info = target->type_info;
+
+		size_t variables = fn->variables_size;
+		int ok;
+		if (op.type == OPCODE_MUL)
+			ok = reduce_multiplication(&seq, x, operand_immediate_unsigned(&c), ir_type_bits(type));
+		else
+			ok = reduce_division(&seq, x, &c, ir_type_is_signed(type), ir_type_bits(type));
+		if (!ok) {
+			fn->variables_size = variables;
+			continue;
+		}
+
+		//The last opcode writes to the original target instead, so its
+		//temporary, which was the last one added, is dropped
+		fn->variables_size -= 1;
+		seq.ops[seq.size - 1].operands[OPERAND_TARGET] = *target;
+		fn->opcodes[i] = seq.ops[seq.size - 1];
+		function_insert_opcodes(fn, i, seq.ops, seq.size - 1);
+		reduced += 1;
+	}
+	return reduced;
+}
+
+// Replaces multiplications of basic induction variables by constants
+// with additions. Returns the amount of reduced multiplications
+int reduce_induction_variables(struct AnalysisManager* analyses, struct Function* fn)
+{
+	int reduced = 0;
+	for (;;) {
+		struct FunctionAnalysis* a = analysis_manager_get(analyses, fn);
+		size_t keys = fn->variables_size + fn->arguments_size;
+		int* defs = malloc((keys + 1) * sizeof *defs);
+		int* def_index = malloc((keys + 1) * sizeof *def_index);
+		int found = 0;
+
+		for (int l = a->loops_size - 1; l >= 0 && !found; --l) {
+			if (!loop_can_insert_preheader(a, l))
+				continue;
+
+			memset(defs, 0, (keys + 1) * sizeof *defs);
+			char* in_loop = calloc(fn->opcodes_size + 1, 1);
+			for (size_t b = 0; b < a->loops[l].blocks_size; ++b) {
+				struct BasicBlock* block = &a->blocks[a->loops[l].blocks[b]];
+				memset(in_loop + block->start, 1, block->end - block->start);
+			}
+			for (size_t i = 0; i < fn->opcodes_size; ++i) {
+				int written = copy_propagation_written_key(fn, &fn->opcodes[i]);
+				if (written >= 0 && in_loop[i]) {
+					defs[written] += 1;
+					def_index[written] = i;
+				}
+			}
+
+			for (size_t i = 0; i < fn->opcodes_size && !found; ++i) {
+				struct Opcode* op = &fn->opcodes[i];
+				if (!in_loop[i] || op->type != OPCODE_MUL)
+					continue;
+				struct Operand* target = &op->operands[OPERAND_TARGET];
+				int type = target->type_info.type;
+				if (!ir_type_is_integer(type))
+					continue;
+
+				struct Operand* iv = &op->operands[OPERAND_PRIMARY_1];
+				struct Operand* c = &op->operands[OPERAND_PRIMARY_2];
+				if (iv->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+					iv = &op->operands[OPERAND_PRIMARY_2];
+					c = &op->operands[OPERAND_PRIMARY_1];
+				}
+				if (!operand_is_variable(iv) || !operand_is_plain(iv) || c->info_type != OPERAND_INFO_TYPE_IMMEDIATE)
+					continue;
+				if (iv->type_info.type != type || c->type_info.type != type || (a->variables[iv->ref_id].flags & VARIABLE_INFO_ETERNAL))
+					continue;
+				if (defs[iv->ref_id] != 1 || (operand_is_variable(target) && target->ref_id == iv->ref_id))
+					continue;
+
+				//The only assignment must be "iv = iv +- step"
+				struct Opcode* update = &fn->opcodes[def_index[iv->ref_id]];
+				struct Operand* u1 = &update->operands[OPERAND_PRIMARY_1];
+				struct Operand* u2 = &update->operands[OPERAND_PRIMARY_2];
+				if (update->type != OPCODE_ADD && update->type != OPCODE_SUB)
+					continue;
+				if (update->type == OPCODE_ADD && u1->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+					struct Operand* t = u1;
+					u1 = u2;
+					u2 = t;
+				}
+				if (!operand_is_variable(u1) || u1->ref_id != iv->ref_id || !operand_is_plain(u1))
+					continue;
+				if (u2->info_type != OPERAND_INFO_TYPE_IMMEDIATE || u2->type_info.type != type)
+					continue;
+				if (update->operands[OPERAND_TARGET].type_info.type != type)
+					continue;
+
+				uint64_t step = operand_immediate_unsigned(u2);
+				if (update->type == OPCODE_SUB)
+					step = -step;
+				uint64_t scaled = step * operand_immediate_unsigned(c);
+
+				struct TypeInfo type_info = target->type_info;
+				struct Operand r = make_variable_operand(function_add_variable(fn, type_info), type_info);
+				struct Opcode init = make_opcode(OPCODE_MUL, r, *iv, *c);
+				int header_start = a->blocks[a->loops[l].header].start;
+				int mul_index = i + (i >= (size_t)header_start);
+				int update_index = def_index[iv->ref_id];
+				update_index += (update_index >= header_start);
+
+				//Initial value in front of the loop
+				loop_insert_before_header(a, l, &init, 1);
+
+				//The multiplication becomes a copy of the reduced variable
+				op = &fn->opcodes[mul_index];
+				op->type = OPCODE_COPY;
+				op->operands[OPERAND_PRIMARY_1] = r;
+				memset(&op->operands[OPERAND_PRIMARY_2], 0, sizeof op->operands[OPERAND_PRIMARY_2]);
+
+				//Advance along with the induction variable. The update is
+				//duplicated so jumps to it still reach the pair
+				struct Opcode pair[2];
+				pair[0] = fn->opcodes[update_index];
+				pair[1] = make_opcode(OPCODE_ADD, r, r, make_immediate_operand(type_info, scaled));
+				fn->opcodes[update_index] = pair[1];
+				function_insert_opcodes(fn, update_index, pair, 1);
+				found = 1;
+			}
+			free(in_loop);
+		}
+
+		free(defs);
+		free(def_index);
+		analysis_manager_release(analyses, a, found ? ANALYSIS_ALL : 0);
+		if (!found)
+			break;
+		reduced += 1;
+	}
+	return reduced;
+}
+
+// Returns the amount of reduced opcodes
+int reduce_strength(struct AnalysisManager* analyses, struct Function* fn)
+{
+	int reduced = reduce_induction_variables(analyses, fn);
+	int arithmetic = reduce_constant_arithmetic(fn);
+	if (arithmetic)
+		analysis_manager_invalidate(analyses, fn, ANALYSIS_ALL);
+	return reduced + arithmetic;
+}
+
+
+/*
+	Function table
+
+	Functions reference each other by id through operands of type
+	OPERAND_INFO_TYPE_FUNCTION. The table maps those ids back to the
+	functions. It does not own them.
+*/
+
+struct FunctionTable
+{
+	struct Function** functions; //Indexed by function id, null for unused ids
+	size_t functions_size;
+	size_t functions_capacity;
+};
+
+void function_table_add(struct FunctionTable* table, struct Function* fn)
+{
+	if ((size_t)fn->id >= table->functions_size) {
+		size_t size = table->functions_size;
+		DYNAMIC_ARRAY_RESIZE(table->functions, table->functions_size, table->functions_capacity, (size_t)fn->id + 1);
+		memset(table->functions + size, 0, (table->functions_size - size) * sizeof *table->functions);
+	}
+	table->functions[fn->id] = fn;
+}
+
+struct Function* function_table_find(struct FunctionTable* table, int id)
+{
+	if (id < 0 || (size_t)id >= table->functions_size)
+		return 0;
+	return table->functions[id];
+}
+
+void function_table_free(struct FunctionTable* table)
+{
+	DYNAMIC_ARRAY_FREE(table->functions, table->functions_size, table->functions_capacity);
+}
+
+// Function called by a call opcode, null if unknown
+struct Function* opcode_callee(struct FunctionTable* table, struct Opcode* op)
+{
+	if (op->type != OPCODE_CALL || op->operands[OPERAND_PRIMARY_1].info_type != OPERAND_INFO_TYPE_FUNCTION)
+		return 0;
+	return function_table_find(table, op->operands[OPERAND_PRIMARY_1].ref_id);
+}
+
+// Amount of opcodes that are not NOPs
+int function_size(struct Function* fn)
+{
+	int size = 0;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		if (fn->opcodes[i].type != OPCODE_NOP)
+			size += 1;
+	}
+	return size;
+}
+
+
+/*
+	Execution profiles
+
+	A profile counts, for every function, how often each block of
+	analyse_function ran and how often the conditional jump ending a
+	block fell through, which gives the count of every edge. The lowering
+	fills the counters in when instrumenting, recompiling with the profile
+	then guides block layout, inlining and register allocation.
+
+	Counters are plain memory increments without a lock, as cheap as
+	counting gets. Threads may lose an increment now and then when they
+	race on a counter, which does not matter for heuristics. To keep them
+	apart the counters of a function exist in "shards" copies and the
+	instrumented code picks one from the address of its stack, which is
+	different for every thread. Reading sums up the shards. Setting
+	"atomic" makes the increments exact at the price of a locked
+	instruction each.
+
+	Counts belong to the function as it was instrumented. A fingerprint of
+	its opcodes is kept and a function that changed since does not use
+	the profile anymore.
+*/
+
+#define PROFILE_SHARD_SHIFT (23) //Stacks of threads lie at least 8MB apart
+
+struct FunctionProfile
+{
+	int id;
+	uint64_t fingerprint;
+	size_t blocks_size;
+	size_t stride; //Bytes of a shard, a power of two of at least a cache line
+	uint64_t* counters; //Per shard the entry counts of the blocks, then their fall-through counts
+};
+
+struct Profile
+{
+	struct FunctionProfile** functions; //Indexed by function id, null for unprofiled ones
+	size_t functions_size;
+	size_t functions_capacity;
+	size_t shards; //Power of two, 0 counts as 1
+	int atomic;
+};
+
+// Hash of the opcode types and jump targets of the function
+uint64_t function_fingerprint(struct Function* fn)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ fn->opcodes_size;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		hash = (hash ^ (uint32_t)op->type) * 0x100000001b3ULL;
+		if (opcode_is_jump(op))
+			hash = (hash ^ (uint32_t)op->operands[OPERAND_TARGET].ref_id) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+uint64_t hash_mix(uint64_t hash, uint64_t value)
+{
+	hash = (hash ^ value) * 0x9E3779B97F4A7C15ull;
+	return (hash ^ (hash >> 29)) * 0xBF58476D1CE4E5B9ull;
+}
+
+uint64_t hash_type_info(uint64_t hash, struct TypeInfo* type_info)
+{
+	return hash_mix(hash, type_info->type | (uint64_t)type_info->sub_type << 16 | (uint64_t)type_info->struct_size << 32);
+}
+
+// Hash of everything about the function that the lowering reads: its
+// signature, variables and opcodes with their operands. Only the values
+// are hashed, never addresses or padding, so it is the same in every
+// process. The id of the function itself is left out
+uint64_t function_hash(struct Function* fn)
+{
+	uint64_t hash = hash_mix(0xcbf29ce484222325ULL, fn->arguments_size);
+	hash = hash_type_info(hash, &fn->return_type);
+	for (size_t i = 0; i < fn->arguments_size; ++i)
+		hash = hash_type_info(hash, &fn->arguments[i]);
+	hash = hash_mix(hash, fn->variables_size);
+	for (size_t i = 0; i < fn->variables_size; ++i)
+		hash = hash_type_info(hash, &fn->variables[i].type_info);
+	hash = hash_mix(hash, fn->opcodes_size);
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		hash = hash_mix(hash, (uint32_t)op->type);
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &op->operands[o];
+			uint64_t value = operand->value_u64;
+			if (operand->info_type != OPERAND_INFO_TYPE_IMMEDIATE && operand->info_type <= OPERAND_INFO_TYPE_FUNCTION)
+				value = (uint32_t)operand->ref_id;
+			else if (operand->info_type == OPERAND_INFO_TYPE_IMMEDIATE && ir_type_bits(operand->type_info.type))
+				value = operand_immediate_unsigned(operand);
+			hash = hash_mix(hash, operand->info_type | (uint64_t)operand->info_flags << 16);
+			hash = hash_type_info(hash, &operand->type_info);
+			hash = hash_mix(hash, value);
+		}
+	}
+	return hash ^ (hash >> 32);
+}
+
+size_t profile_shards(struct Profile* profile)
+{
+	return profile->shards ? profile->shards : 1;
+}
+
+void free_function_profile(struct FunctionProfile* fp)
+{
+	if (fp)
+		free(fp->counters);
+	free(fp);
+}
+
+// Function profile with zeroed counters, replacing the one of the id
+struct FunctionProfile* profile_create_function(struct Profile* profile, int id, uint64_t fingerprint, size_t blocks_size)
+{
+	if ((size_t)id >= profile->functions_size) {
+		size_t size = profile->functions_size;
+		DYNAMIC_ARRAY_RESIZE(profile->functions, profile->functions_size, profile->functions_capacity, (size_t)id + 1);
+		memset(profile->functions + size, 0, (profile->functions_size - size) * sizeof *profile->functions);
+	}
+	free_function_profile(profile->functions[id]);
+
+	struct FunctionProfile* fp = malloc(sizeof *fp);
+	fp->id = id;
+	fp->fingerprint = fingerprint;
+	fp->blocks_size = blocks_size;
+	fp->stride = 64;
+	while (fp->stride < 2 * blocks_size * sizeof *fp->counters)
+		fp->stride *= 2;
+	fp->counters = aligned_alloc(64, profile_shards(profile) * fp->stride);
+	memset(fp->counters, 0, profile_shards(profile) * fp->stride);
+	profile->functions[id] = fp;
+	return fp;
+}
+
+// Profile to count the function into, the existing one if it is for the
+// same code
+struct FunctionProfile* profile_add_function(struct Profile* profile, struct Function* fn, size_t blocks_size)
+{
+	if (fn->id < 0)
+		return 0;
+	uint64_t fingerprint = function_fingerprint(fn);
+	struct FunctionProfile* fp = (size_t)fn->id < profile->functions_size ? profile->functions[fn->id] : 0;
+	if (fp && fp->fingerprint == fingerprint && fp->blocks_size == blocks_size)
+		return fp;
+	return profile_create_function(profile, fn->id, fingerprint, blocks_size);
+}
+
+// Profile of the function, null if there is none for its current code
+struct FunctionProfile* profile_find(struct Profile* profile, struct Function* fn)
+{
+	if (!profile || fn->id < 0 || (size_t)fn->id >= profile->functions_size)
+		return 0;
+	struct FunctionProfile* fp = profile->functions[fn->id];
+	if (!fp || fp->fingerprint != function_fingerprint(fn))
+		return 0;
+	return fp;
+}
+
+// Counter summed over the shards
+uint64_t profile_counter(struct Profile* profile, struct FunctionProfile* fp, size_t index)
+{
+	uint64_t sum = 0;
+	for (size_t s = 0; s < profile_shards(profile); ++s)
+		sum += *(uint64_t*)((char*)fp->counters + s * fp->stride + index * sizeof *fp->counters);
+	return sum;
+}
+
+// Entry counts of the blocks of the function followed by their
+// fall-through counts, null if there is no profile for its current code
+uint64_t* profile_block_counts(struct Profile* profile, struct Function* fn)
+{
+	struct FunctionProfile* fp = profile_find(profile, fn);
+	if (!fp)
+		return 0;
+	uint64_t* counts = malloc((2 * fp->blocks_size + 1) * sizeof *counts);
+	for (size_t i = 0; i < 2 * fp->blocks_size; ++i)
+		counts[i] = profile_counter(profile, fp, i);
+	return counts;
+}
+
+// Execution count of every opcode, then the count of the function entry,
+// null if there is no profile for the current code of the function
+uint64_t* profile_opcode_counts(struct Profile* profile, struct AnalysisManager* analyses, struct Function* fn)
+{
+	struct FunctionProfile* fp = profile_find(profile, fn);
+	if (!fp)
+		return 0;
+	struct FunctionAnalysis* a = analysis_manager_get(analyses, fn);
+	uint64_t* counts = 0;
+	if (a->blocks_size == fp->blocks_size) {
+		counts = malloc((fn->opcodes_size + 1) * sizeof *counts);
+		for (size_t i = 0; i < fn->opcodes_size; ++i)
+			counts[i] = profile_counter(profile, fp, a->opcode_blocks[i]);
+		counts[fn->opcodes_size] = a->blocks_size ? profile_counter(profile, fp, 0) : 0;
+	}
+	analysis_manager_release(analyses, a, 0);
+	return counts;
+}
+
+void profile_free(struct Profile* profile)
+{
+	for (size_t i = 0; i < profile->functions_size; ++i)
+		free_function_profile(profile->functions[i]);
+	DYNAMIC_ARRAY_FREE(profile->functions, profile->functions_size, profile->functions_capacity);
+}
+
+// Writes the summed counters as text, a line per function:
+//	function <id> <fingerprint> <blocks> <entry counts...> <fall-through counts...>
+// Returns 0 on success
+int profile_write(struct Profile* profile, FILE* file)
+{
+	for (size_t i = 0; i < profile->functions_size; ++i) {
+		struct FunctionProfile* fp = profile->functions[i];
+		if (!fp)
+			continue;
+		fprintf(file, "function %d %016llx %zu", fp->id, (unsigned long long)fp->fingerprint, fp->blocks_size);
+		for (size_t c = 0; c < 2 * fp->blocks_size; ++c)
+			fprintf(file, " %llu", (unsigned long long)profile_counter(profile, fp, c));
+		fputc('\n', file);
+	}
+	return ferror(file) ? -1 : 0;
+}
+
+// Adds the counts of a written profile to this one, so profiles of
+// several runs merge. Returns 0 on success, -1 on malformed input
+int profile_read(struct Profile* profile, FILE* file)
+{
+	int id;
+	unsigned long long fingerprint;
+	size_t blocks_size;
+	int read;
+	while ((read = fscanf(file, " function %d %llx %zu", &id, &fingerprint, &blocks_size)) == 3) {
+		if (id < 0)
+			return -1;
+		struct FunctionProfile* fp = (size_t)id < profile->functions_size ? profile->functions[id] : 0;
+		if (!fp || fp->fingerprint != fingerprint || fp->blocks_size != blocks_size)
+			fp = profile_create_function(profile, id, fingerprint, blocks_size);
+		for (size_t c = 0; c < 2 * blocks_size; ++c) {
+			unsigned long long count;
+			if (fscanf(file, "%llu", &count) != 1)
+				return -1;
+			fp->counters[c] += count;
+		}
+	}
+	return read == EOF ? 0 : -1;
+}
+
+
+/*
+	Inlining
+
+	A call costs the argument setup, the call itself, the prologue and
+	epilogue of the callee and the return. For small callees that is more
+	than the body, and the body in the caller is exposed to the other
+	passes with the actual arguments.
+
+	The callee opcodes are cloned in place of the call. Its variables are
+	appended to the caller, every argument becomes a fresh variable that
+	the SET_ARGUMENT opcodes in front of the call assign, and every return
+	becomes a copy to the call result followed by a jump past the body.
+	Only calls whose arguments are set by the opcodes right in front of
+	them, each exactly once, are inlined.
+
+	Callees up to "always_size" opcodes are always inlined. Larger ones up
+	to "max_size" are inlined when the saved call overhead, constant
+	arguments and loop depth of the call site pay for the growth. Callers
+	never grow past "max_growth" times their original size. With a
+	profile the depth is how many times ten the call site runs per call of
+	the caller, and sites that never ran only get the always inlined
+	callees.
+
+	Functions are processed bottom-up in the call graph so callees are
+	already inlined into when their callers are. Recursive calls are not
+	inlined and a function may be a chain of at most "max_depth" levels
+	of inlined bodies.
+*/
+
+struct InlineParameters
+{
+	int always_size;
+	int max_size;
+	int threshold; //Allowed growth in opcodes after the benefit is subtracted
+	int max_growth;
+	int max_depth;
+	struct Profile* profile; //Execution counts of the call sites, null if unknown
+};
+
+struct InlineParameters default_inline_parameters()
+{
+	struct InlineParameters params;
+	params.always_size = 8;
+	params.max_size = 64;
+	params.threshold = 12;
+	params.max_growth = 3;
+	params.max_depth = 4;
+	params.profile = 0;
+	return params;
+}
+
+struct InlineState
+{
+	struct FunctionTable* table;
+	struct InlineParameters params;
+	int* depth; //Inlining depth of every function id
+	char* visited;
+	struct AnalysisManager* analyses; //Analyses of the callers to reuse, null if none
+};
+
+// Index of the first SET_ARGUMENT opcode of a call with "count" arguments
+// or -1 if the arguments are not set right in front of the call
+int inline_arguments_start(struct Function* fn, int call, int count)
+{
+	char seen[256];
+	if (count > (int)sizeof seen || call < count)
+		return -1;
+	memset(seen, 0, count);
+	int start = call - count;
+	for (int i = start; i < call; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		int index = op->operands[OPERAND_TARGET].ref_id;
+		if (op->type != OPCODE_SET_ARGUMENT || index < 0 || index >= count || seen[index])
+			return -1;
+		seen[index] = 1;
+	}
+	//An additional argument setter would belong to this call as well
+	if (start > 0 && fn->opcodes[start - 1].type == OPCODE_SET_ARGUMENT)
+		return -1;
+	return start;
+}
+
+// Recursive callees and callees leaving through tail calls are never inlined
+int inline_is_excluded(struct Function* fn)
+{
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		if (op->type == OPCODE_TAIL_CALL)
+			return 1;
+		if (op->type == OPCODE_CALL && op->operands[OPERAND_PRIMARY_1].info_type == OPERAND_INFO_TYPE_FUNCTION
+			&& op->operands[OPERAND_PRIMARY_1].ref_id == fn->id)
+			return 1;
+	}
+	return 0;
+}
+
+// Whether the call site at "call" is worth inlining
+int inline_is_profitable(struct InlineState* s, struct Function* caller, int call, int start, struct Function* callee, int loop_depth)
+{
+	int size = function_size(callee);
+	if (size <= s->params.always_size)
+		return 1;
+	if (size > s->params.max_size || loop_depth < 0)
+		return 0;
+
+	//Argument setup, call, return and the saved prologue and epilogue
+	int benefit = (call - start) + 4;
+	for (int i = start; i < call; ++i) {
+		if (caller->opcodes[i].operands[OPERAND_PRIMARY_1].info_type == OPERAND_INFO_TYPE_IMMEDIATE)
+			benefit += 2;
+	}
+	if (loop_depth > 3)
+		loop_depth = 3;
+	benefit += loop_depth * 4;
+	return size - benefit <= s->params.threshold;
+}
+
+// Rewrites an operand of the callee to refer to caller variables
+void inline_map_operand(struct Operand* operand, int variable_base, int argument_base)
+{
+	if (operand->info_type == OPERAND_INFO_TYPE_VARIABLE) {
+		operand->ref_id += variable_base;
+	} else if (operand->info_type == OPERAND_INFO_TYPE_ARGUMENT) {
+		operand->info_type = OPERAND_INFO_TYPE_VARIABLE;
+		operand->ref_id += argument_base;
+	}
+}
+
+// Replaces the call at "call" with the body of the callee
+void inline_call(struct Function* caller, int call, int start, struct Function* callee)
+{
+	struct Opcode call_op = caller->opcodes[call];
+	struct Operand* result = &call_op.operands[OPERAND_TARGET];
+	int has_result = operand_is_variable(result) && callee->return_type.type != IR_TYPE_VOID;
+
+	int variable_base = caller->variables_size;
+	for (size_t i = 0; i < callee->variables_size; ++i)
+		function_add_variable(caller, callee->variables[i].type_info);
+	int argument_base = caller->variables_size;
+	for (size_t i = 0; i < callee->arguments_size; ++i)
+		function_add_variable(caller, callee->arguments[i]);
+
+	//Arguments are assigned where they were set
+	for (int i = start; i < call; ++i) {
+		struct Opcode* op = &caller->opcodes[i];
+		int index = op->operands[OPERAND_TARGET].ref_id;
+		op->type = OPCODE_COPY;
+		op->operands[OPERAND_TARGET] = make_variable_operand(argument_base + index, callee->arguments[index]);
+	}
+
+	//Returns expand to a copy and a jump, except the jump of a final return
+	int* new_index = malloc((callee->opcodes_size + 1) * sizeof *new_index);
+	int count = 0;
+	for (size_t i = 0; i < callee->opcodes_size; ++i) {
+		new_index[i] = count;
+		struct Opcode* op = &callee->opcodes[i];
+		if (opcode_is_return(op))
+			count += has_result + (i + 1 < callee->opcodes_size);
+		else
+			count += 1;
+	}
+	new_index[callee->opcodes_size] = count;
+
+	struct Opcode* body = malloc((count ? count : 1) * sizeof *body);
+	int end = call + count;
+	int n = 0;
+	for (size_t i = 0; i < callee->opcodes_size; ++i) {
+		struct Opcode op = callee->opcodes[i];
+		if (opcode_is_jump(&op)) {
+			int label = op.operands[OPERAND_TARGET].ref_id;
+			if (label >= 0 && (size_t)label <= callee->opcodes_size)
+				op.operands[OPERAND_TARGET].ref_id = call + new_index[label];
+			inline_map_operand(&op.operands[OPERAND_PRIMARY_1], variable_base, argument_base);
+			inline_map_operand(&op.operands[OPERAND_PRIMARY_2], variable_base, argument_base);
+			body[n++] = op;
+			continue;
+		}
+		for (int o = 0; o < 3; ++o)
+			inline_map_operand(&op.operands[o], variable_base, argument_base);
+		if (!opcode_is_return(&op)) {
+			body[n++] = op;
+			continue;
+		}
+		if (has_result)
+			body[n++] = make_opcode(OPCODE_COPY, *result, op.operands[OPERAND_PRIMARY_1], make_immediate_operand(result->type_info, 0));
+		if (i + 1 < callee->opcodes_size) {
+			struct TypeInfo none;
+			memset(&none, 0, sizeof none);
+			struct Operand label = make_immediate_operand(none, 0);
+			label.ref_id = end;
+			body[n++] = make_opcode(OPCODE_GOTO_BASE, label, make_immediate_operand(none, 0), make_immediate_operand(none, 0));
+		}
+	}
+
+	function_insert_opcodes(caller, call, body, count);
+	caller->opcodes[end].type = OPCODE_NOP;
+
+	free(body);
+	free(new_index);
+}
+
+// Inlines the profitable calls of a single function. Callees are taken
+// as they are. Returns the amount of inlined calls
+int inline_function_calls(struct InlineState* s, struct Function* fn)
+{
+	struct FunctionAnalysis* a = analysis_manager_get(s->analyses, fn);
+	int* loop_depth = malloc((fn->opcodes_size + 1) * sizeof *loop_depth);
+	for (size_t i = 0; i < fn->opcodes_size; ++i)
+		loop_depth[i] = opcode_loop_depth(a, i);
+	analysis_manager_release(s->analyses, a, 0);
+
+	//Measured call frequencies replace the loop depths, -1 for cold sites
+	uint64_t* counts = profile_opcode_counts(s->params.profile, s->analyses, fn);
+	if (counts) {
+		uint64_t entry = counts[fn->opcodes_size] ? counts[fn->opcodes_size] : 1;
+		for (size_t i = 0; i < fn->opcodes_size; ++i) {
+			loop_depth[i] = counts[i] ? 0 : -1;
+			for (uint64_t hotness = counts[i] / entry; hotness >= 10; hotness /= 10)
+				loop_depth[i] += 1;
+		}
+		free(counts);
+	}
+
+	int limit = function_size(fn) * s->params.max_growth + s->params.always_size;
+	int inlined = 0;
+
+	//Going backwards keeps the indices of the remaining calls valid
+	//and never revisits the calls of inlined bodies
+	for (int i = fn->opcodes_size - 1; i >= 0; --i) {
+		struct Function* callee = opcode_callee(s->table, &fn->opcodes[i]);
+		if (!callee || callee == fn || inline_is_excluded(callee))
+			continue;
+		if (s->depth[callee->id] + 1 > s->params.max_depth)
+			continue;
+		int start = inline_arguments_start(fn, i, callee->arguments_size);
+		if (start < 0 || !inline_is_profitable(s, fn, i, start, callee, loop_depth[i]))
+			continue;
+		if (function_size(fn) + function_size(callee) > limit)
+			continue;
+
+		inline_call(fn, i, start, callee);
+		if (s->depth[fn->id] < s->depth[callee->id] + 1)
+			s->depth[fn->id] = s->depth[callee->id] + 1;
+		inlined += 1;
+	}
+
+	free(loop_depth);
+	if (inlined) {
+		function_remove_nops(fn);
+		analysis_manager_invalidate(s->analyses, fn, ANALYSIS_ALL);
+	}
+	return inlined;
+}
+
+int inline_visit(struct InlineState* s, struct Function* fn)
+{
+	if (s->visited[fn->id])
+		return 0;
+	//Marked before visiting the callees so cycles end here
+	s->visited[fn->id] = 1;
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Function* callee = opcode_callee(s->table, &fn->opcodes[i]);
+		if (callee)
+			inline_visit(s, callee);
+	}
+	return inline_function_calls(s, fn);
+}
+
+// Inlines calls across every function of the table.
+// Returns the amount of inlined calls
+int inline_functions(struct FunctionTable* table, struct InlineParameters* params)
+{
+	struct InlineState s;
+	s.table = table;
+	s.params = *params;
+	s.depth = calloc(table->functions_size + 1, sizeof *s.depth);
+	s.visited = calloc(table->functions_size + 1, 1);
+	s.analyses = 0;
+
+	int inlined = 0;
+	for (size_t i = 0; i < table->functions_size; ++i) {
+		if (table->functions[i])
+			inlined += inline_visit(&s, table->functions[i]);
+	}
+
+	free(s.depth);
+	free(s.visited);
+	return inlined;
+}
+
+
+/*
+	Modules
+
+	A module indexes functions by id and keeps the call graph between
+	them in compressed rows: the callees of the function "id" are
+	callees[callees_start[id]] up to callees[callees_start[id + 1] - 1],
+	each listed once in the order of its first call. Calls of ids
+	without a function in the module are left out. The module does not
+	own the functions.
+
+	The bottom-up order lists callees before their callers. Functions
+	calling each other recursively form a component and are listed next
+	to each other. Inlining walks the order so that callees are done
+	before their callers, and the lowering places functions in it so
+	that callers are close to their callees.
+*/
+
+struct Module
+{
+	struct FunctionTable table;
+	size_t* callees_start; //Per function id, and one past the last
+	int* callees;
+	size_t callees_size;
+	size_t callees_capacity;
+	int* order; //Function ids bottom-up
+	size_t order_size;
+	int* components; //Component of every id, -1 for ids without a function
+	size_t components_size;
+};
+
+void module_init(struct Module* module)
+{
+	memset(module, 0, sizeof *module);
+}
+
+// Adds the function under its id. The call graph is out of date until
+// module_analyse is called
+void module_add(struct Module* module, struct Function* fn)
+{
+	function_table_add(&module->table, fn);
+}
+
+struct Function* module_find(struct Module* module, int id)
+{
+	return function_table_find(&module->table, id);
+}
+
+void module_build_call_graph(struct Module* module)
+{
+	size_t size = module->table.functions_size;
+	free(module->callees_start);
+	module->callees_start = malloc((size + 1) * sizeof *module->callees_start);
+	module->callees_size = 0;
+
+	//The last caller that listed each callee, to list it once
+	int* listed = malloc((size + 1) * sizeof *listed);
+	for (size_t i = 0; i < size; ++i)
+		listed[i] = -1;
+	for (size_t id = 0; id < size; ++id) {
+		module->callees_start[id] = module->callees_size;
+		struct Function* fn = module->table.functions[id];
+		for (size_t i = 0; fn && i < fn->opcodes_size; ++i) {
+			struct Opcode* op = &fn->opcodes[i];
+			struct Operand* callee = &op->operands[OPERAND_PRIMARY_1];
+			if ((op->type != OPCODE_CALL && op->type != OPCODE_TAIL_CALL) || callee->info_type != OPERAND_INFO_TYPE_FUNCTION)
+				continue;
+			if (!module_find(module, callee->ref_id) || listed[callee->ref_id] == (int)id)
+				continue;
+			listed[callee->ref_id] = id;
+			DYNAMIC_ARRAY_PUSH(module->callees, module->callees_size, module->callees_capacity, callee->ref_id, 64);
+		}
+	}
+	module->callees_start[size] = module->callees_size;
+	free(listed);
+}
+
+// Finds the components with Tarjan's algorithm, which completes every
+// component after the components it calls. The depth-first search keeps
+// its own stack, call chains may be long
+void module_order_bottom_up(struct Module* module)
+{
+	size_t size = module->table.functions_size;
+	free(module->order);
+	free(module->components);
+	module->order = malloc((size + 1) * sizeof *module->order);
+	module->order_size = 0;
+	module->components = malloc((size + 1) * sizeof *module->components);
+	module->components_size = 0;
+
+	int* index = malloc((size + 1) * sizeof *index);
+	int* low = malloc((size + 1) * sizeof *low);
+	size_t* edge = malloc((size + 1) * sizeof *edge);
+	int* path = malloc((size + 1) * sizeof *path);
+	int* stack = malloc((size + 1) * sizeof *stack);
+	char* on_stack = calloc(size + 1, 1);
+	size_t path_size = 0;
+	size_t stack_size = 0;
+	int visited = 0;
+	for (size_t i = 0; i < size; ++i) {
+		index[i] = -1;
+		module->components[i] = -1;
+	}
+
+	for (size_t root = 0; root < size; ++root) {
+		if (!module->table.functions[root] || index[root] >= 0)
+			continue;
+		int next = root;
+		for (;;) {
+			if (next >= 0) {
+				index[next] = low[next] = visited++;
+				edge[next] = module->callees_start[next];
+				stack[stack_size++] = next;
+				on_stack[next] = 1;
+				path[path_size++] = next;
+				next = -1;
+			}
+			int v = path[path_size - 1];
+			if (edge[v] < module->callees_start[v + 1]) {
+				int w = module->callees[edge[v]++];
+				if (index[w] < 0)
+					next = w;
+				else if (on_stack[w] && index[w] < low[v])
+					low[v] = index[w];
+				continue;
+			}
+
+			path_size -= 1;
+			if (low[v] == index[v]) {
+				int w;
+				do {
+					w = stack[--stack_size];
+					on_stack[w] = 0;
+					module->components[w] = module->components_size;
+					module->order[module->order_size++] = w;
+				} while (w != v);
+				module->components_size += 1;
+			}
+			if (!path_size)
+				break;
+			int u = path[path_size - 1];
+			if (low[v] < low[u])
+				low[u] = low[v];
+		}
+	}
+
+	free(index);
+	free(low);
+	free(edge);
+	free(path);
+	free(stack);
+	free(on_stack);
+}
+
+// Builds the call graph and the bottom-up order of the functions added
+void module_analyse(struct Module* module)
+{
+	module_build_call_graph(module);
+	module_order_bottom_up(module);
+}
+
+// Inlines calls across the module bottom-up and updates the call graph.
+// Returns the amount of inlined calls
+int module_inline(struct Module* module, struct InlineParameters* params)
+{
+	struct InlineState s;
+	s.table = &module->table;
+	s.params = *params;
+	s.depth = calloc(module->table.functions_size + 1, sizeof *s.depth);
+	s.visited = 0;
+	s.analyses = 0;
+
+	int inlined = 0;
+	for (size_t i = 0; i < module->order_size; ++i)
+		inlined += inline_function_calls(&s, module->table.functions[module->order[i]]);
+
+	free(s.depth);
+	module_analyse(module);
+	return inlined;
+}
+
+void module_free(struct Module* module)
+{
+	function_table_free(&module->table);
+	free(module->callees_start);
+	DYNAMIC_ARRAY_FREE(module->callees, module->callees_size, module->callees_capacity);
+	free(module->order);
+	free(module->components);
+	memset(module, 0, sizeof *module);
+}
+
+
+/*
+	Tail calls
+
+	A call whose result is returned right away, or a call of a void
+	function followed by a return, is in tail position. Nothing of the
+	caller is needed after it, so the callee can reuse the frame of the
+	caller and return directly to its caller.
+
+	Self-recursive tail calls become loops: the new argument values are
+	computed into temporaries first, since they may read the current
+	arguments, then assigned to the arguments before jumping back to the
+	start of the function. Other tail calls are turned into
+	OPCODE_TAIL_CALL and left to the lowering, which places the arguments
+	and jumps to the callee instead of calling it.
+
+	Neither is done when the address of a variable or argument is taken:
+	the callee could still reach the frame being replaced.
+*/
+
+int function_takes_addresses(struct Function* fn)
+{
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		for (int o = 0; o < 3; ++o) {
+			if (opcode_is_jump(op) && o == OPERAND_TARGET)
+				continue;
+			int type = op->operands[o].info_type;
+			if ((type == OPERAND_INFO_TYPE_VARIABLE || type == OPERAND_INFO_TYPE_ARGUMENT)
+				&& (op->operands[o].info_flags & OPERAND_FLAG_ADDRESS))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+// Whether the call at "call" is directly followed by the return of its
+// result, skipping NOPs and unconditional jumps
+int call_is_in_tail_position(struct Function* fn, int call)
+{
+	struct Operand* result = &fn->opcodes[call].operands[OPERAND_TARGET];
+	size_t i = call + 1;
+	for (int steps = 0; i < fn->opcodes_size && steps < 16; ++steps) {
+		struct Opcode* op = &fn->opcodes[i];
+		if (op->type == OPCODE_NOP) {
+			i += 1;
+		} else if (op->type == OPCODE_GOTO_BASE) {
+			i = op->operands[OPERAND_TARGET].ref_id;
+		} else if (op->type == OPCODE_RETURN) {
+			if (fn->return_type.type == IR_TYPE_VOID)
+				return 1;
+			struct Operand* value = &op->operands[OPERAND_PRIMARY_1];
+			return operand_is_variable(result) && operand_is_plain(result) && operand_is_variable(value)
+				&& operand_is_plain(value) && value->ref_id == result->ref_id;
+		} else {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// Replaces the self-recursive call at "call" with argument assignments
+// and a jump to the function entry
+void tail_recursion_to_loop(struct Function* fn, int call, int start)
+{
+	int count = call - start;
+	struct Opcode* ops = malloc((count + 1) * sizeof *ops);
+
+	for (int i = start; i < call; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		int index = op->operands[OPERAND_TARGET].ref_id;
+		struct TypeInfo type_info = fn->arguments[index];
+		int temporary = function_add_variable(fn, type_info);
+
+		struct Operand argument = make_variable_operand(index, type_info);
+		argument.info_type = OPERAND_INFO_TYPE_ARGUMENT;
+		op->type = OPCODE_COPY;
+		op->operands[OPERAND_TARGET] = make_variable_operand(temporary, type_info);
+		ops[i - start] = make_opcode(OPCODE_COPY, argument, make_variable_operand(temporary, type_info), make_immediate_operand(type_info, 0));
+	}
+
+	struct TypeInfo none;
+	memset(&none, 0, sizeof none);
+	struct Operand entry = make_immediate_operand(none, 0);
+	entry.ref_id = 0;
+	ops[count] = make_opcode(OPCODE_GOTO_BASE, entry, make_immediate_operand(none, 0), make_immediate_operand(none, 0));
+
+	function_insert_opcodes(fn, call, ops, count + 1);
+	fn->opcodes[call + count + 1].type = OPCODE_NOP;
+	free(ops);
+}
+
+// Turns self-recursive tail calls into loops. Returns the amount of
+// removed calls
+int eliminate_tail_recursion(struct Function* fn)
+{
+	if (function_takes_addresses(fn))
+		return 0;
+
+	int eliminated = 0;
+	for (int i = fn->opcodes_size - 1; i >= 0; --i) {
+		struct Opcode* op = &fn->opcodes[i];
+		if (op->type != OPCODE_CALL || op->operands[OPERAND_PRIMARY_1].info_type != OPERAND_INFO_TYPE_FUNCTION
+			|| op->operands[OPERAND_PRIMARY_1].ref_id != fn->id)
+			continue;
+		if (!call_is_in_tail_position(fn, i))
+			continue;
+		int start = inline_arguments_start(fn, i, fn->arguments_size);
+		if (start < 0)
+			continue;
+		tail_recursion_to_loop(fn, i, start);
+		eliminated += 1;
+	}
+	if (eliminated)
+		function_remove_nops(fn);
+	return eliminated;
+}
+
+// Marks the remaining calls in tail position as tail calls.
+// Returns the amount of marked calls
+int mark_tail_calls(struct Function* fn)
+{
+	if (function_takes_addresses(fn))
+		return 0;
+
+	int marked = 0;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		if (op->type == OPCODE_CALL && call_is_in_tail_position(fn, i)) {
+			op->type = OPCODE_TAIL_CALL;
+			marked += 1;
+		}
+	}
+	return marked;
+}
+
+int optimize_tail_calls(struct Function* fn)
+{
+	int optimized = eliminate_tail_recursion(fn);
+	optimized += mark_tail_calls(fn);
+	return optimized;
+}
+
+
+/*
+	Stack frame layout
+
+	Variables whose address is taken or that are used uninitialized are
+	eternal and live in memory for the whole function. Variables the
+	register allocator could not keep in registers are spilled and need
+	memory only during their lifetime.
+
+	Slots are colored like registers: a variable reuses an existing slot
+	of the same size and alignment when its lifetime is disjoint from the
+	lifetimes of every variable already in the slot. Eternal variables
+	conflict with everything and get slots of their own.
+
+	Offsets are relative to the stack pointer after the prologue. Scalar
+	slots come first, ordered by decreasing alignment so no padding is
+	needed between them, and the most used ones first within the same
+	alignment. Aggregates follow. That keeps the frequently accessed
+	slots within the 8bit displacement range whenever possible.
+*/
+
+struct FrameSlot
+{
+	int offset;
+	int size;
+	int alignment;
+	int weight; //Uses of the variables in the slot, weighted by loop depth
+
+	int* variables;
+	size_t variables_size;
+	size_t variables_capacity;
+};
+
+struct FrameLayout
+{
+	int* variable_slots; //Slot of every variable, -1 if it has none
+	size_t variable_slots_size;
+
+	struct FrameSlot* slots;
+	size_t slots_size;
+	size_t slots_capacity;
+
+	int size; //Frame size in bytes, multiple of 16
+};
+
+// Size of a value of the type in bytes
+int type_info_size(struct TypeInfo* type_info)
+{
+	if (type_info->type == IR_TYPE_STRUCT)
+		return type_info->struct_size;
+	return ir_type_bits(type_info->type) / 8;
+}
+
+// Alignment of a value of the type in bytes. Aggregates are aligned to
+// the largest power of two dividing their size, at most 16
+int type_info_alignment(struct TypeInfo* type_info)
+{
+	int size = type_info_size(type_info);
+	if (size <= 0)
+		return 1;
+	int alignment = 1;
+	while (alignment < 16 && size % (alignment * 2) == 0)
+		alignment *= 2;
+	return alignment;
+}
+
+void free_frame_layout(struct FrameLayout* layout)
+{
+	for (size_t i = 0; i < layout->slots_size; ++i)
+		DYNAMIC_ARRAY_FREE(layout->slots[i].variables, layout->slots[i].variables_size, layout->slots[i].variables_capacity);
+	DYNAMIC_ARRAY_FREE(layout->slots, layout->slots_size, layout->slots_capacity);
+	free(layout->variable_slots);
+	memset(layout, 0, sizeof *layout);
+}
+
+// Offset of the slot of a variable, -1 if it has none
+int frame_variable_offset(struct FrameLayout* layout, int variable)
+{
+	if (variable < 0 || (size_t)variable >= layout->variable_slots_size || layout->variable_slots[variable] < 0)
+		return -1;
+	return layout->slots[layout->variable_slots[variable]].offset;
+}
+
+struct FrameCandidate
+{
+	int variable;
+	int size;
+	int alignment;
+	int weight;
+};
+
+int frame_candidate_compare(const void* x, const void* y)
+{
+	const struct FrameCandidate* a = x;
+	const struct FrameCandidate* b = y;
+	if (a->alignment != b->alignment)
+		return b->alignment - a->alignment;
+	if (a->size != b->size)
+		return b->size - a->size;
+	if (a->weight != b->weight)
+		return b->weight - a->weight;
+	return a->variable - b->variable;
+}
+
+// Orders slots, with the slot index in place of the variable
+int frame_slot_order_compare(const void* x, const void* y)
+{
+	const struct FrameCandidate* a = x;
+	const struct FrameCandidate* b = y;
+	int a_scalar = a->size <= 8;
+	int b_scalar = b->size <= 8;
+	if (a_scalar != b_scalar)
+		return b_scalar - a_scalar;
+	if (a->alignment != b->alignment)
+		return b->alignment - a->alignment;
+	if (a->weight != b->weight)
+		return b->weight - a->weight;
+	return a->variable - b->variable;
+}
+
+int frame_slot_accepts(struct FunctionAnalysis* a, struct FrameSlot* slot, struct FrameCandidate* candidate)
+{
+	if (slot->size != candidate->size || slot->alignment != candidate->alignment)
+		return 0;
+	struct VariableInfo* info = &a->variables[candidate->variable];
+	if (info->flags & VARIABLE_INFO_ETERNAL)
+		return 0;
+	for (size_t i = 0; i < slot->variables_size; ++i) {
+		struct VariableInfo* other = &a->variables[slot->variables[i]];
+		if ((other->flags & VARIABLE_INFO_ETERNAL) || variable_lifetimes_interfere(info, other, -1))
+			return 0;
+	}
+	return 1;
+}
+
+// Lays out the stack slots of eternal variables and of the variables
+// marked in "spilled", which may be null. Returns the frame size
+int layout_frame(struct FunctionAnalysis* a, const char* spilled, struct FrameLayout* layout)
+{
+	struct Function* fn = a->function;
+	memset(layout, 0, sizeof *layout);
+	layout->variable_slots = malloc((fn->variables_size + 1) * sizeof *layout->variable_slots);
+	layout->variable_slots_size = fn->variables_size;
+
+	int* weights = calloc(fn->variables_size + 1, sizeof *weights);
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		int depth = opcode_loop_depth(a, i);
+		int weight = 1 << (depth < 4 ? 3 * depth : 12);
+		for (int o = 0; o < 3; ++o) {
+			struct Opcode* op = &fn->opcodes[i];
+			if (opcode_is_jump(op) && o == OPERAND_TARGET)
+				continue;
+			if (operand_is_variable(&op->operands[o]))
+				weights[op->operands[o].ref_id] += weight;
+		}
+	}
+
+	struct FrameCandidate* candidates = malloc((fn->variables_size + 1) * sizeof *candidates);
+	size_t candidates_size = 0;
+	for (size_t i = 0; i < fn->variables_size; ++i) {
+		layout->variable_slots[i] = -1;
+		struct VariableInfo* info = &a->variables[i];
+		int eternal = (info->flags & VARIABLE_INFO_ETERNAL) != 0;
+		if (!eternal && !(spilled && spilled[i] && info->lifetime_start >= 0))
+			continue;
+		struct FrameCandidate* candidate = &candidates[candidates_size++];
+		candidate->variable = i;
+		candidate->size = type_info_size(&fn->variables[i].type_info);
+		candidate->alignment = type_info_alignment(&fn->variables[i].type_info);
+		candidate->weight = weights[i];
+		if (candidate->size <= 0)
+			candidate->size = 1;
+	}
+	if (candidates_size)
+		qsort(candidates, candidates_size, sizeof *candidates, frame_candidate_compare);
+
+	//Color the slots
+	for (size_t c = 0; c < candidates_size; ++c) {
+		struct FrameCandidate* candidate = &candidates[c];
+		size_t s = 0;
+		while (s < layout->slots_size && !frame_slot_accepts(a, &layout->slots[s], candidate))
+			s += 1;
+		if (s == layout->slots_size) {
+			struct FrameSlot slot;
+			memset(&slot, 0, sizeof slot);
+			slot.size = candidate->size;
+			slot.alignment = candidate->alignment;
+			DYNAMIC_ARRAY_PUSH(layout->slots, layout->slots_size, layout->slots_capacity, slot, 16);
+		}
+		struct FrameSlot* slot = &layout->slots[s];
+		slot->weight += candidate->weight;
+		DYNAMIC_ARRAY_PUSH(slot->variables, slot->variables_size, slot->variables_capacity, candidate->variable, 4);
+		layout->variable_slots[candidate->variable] = s;
+	}
+
+	//Assign the offsets
+	struct FrameCandidate* order = malloc((layout->slots_size + 1) * sizeof *order);
+	for (size_t s = 0; s < layout->slots_size; ++s) {
+		order[s].variable = s;
+		order[s].size = layout->slots[s].size;
+		order[s].alignment = layout->slots[s].alignment;
+		order[s].weight = layout->slots[s].weight;
+	}
+	if (layout->slots_size)
+		qsort(order, layout->slots_size, sizeof *order, frame_slot_order_compare);
+
+	int offset = 0;
+	for (size_t i = 0; i < layout->slots_size; ++i) {
+		struct FrameSlot* slot = &layout->slots[order[i].variable];
+		offset = (offset + slot->alignment - 1) & ~(slot->alignment - 1);
+		slot->offset = offset;
+		offset += slot->size;
+	}
+	layout->size = (offset + 15) & ~15;
+
+	free(order);
+	free(candidates);
+	free(weights);
+	return layout->size;
+}
+
+
+/*
+	Binary serialization
+
+	A module of functions is stored so that it can be used in place, for
+	example straight from mmap, without deserialization. All offsets are
+	relative to the start of the data, so the data is position
+	independent. Records are the x86-64 little endian memory layout of the
+	IR structures, which the static assertions below pin down, with
+	padding zeroed:
+
+		struct IrFileHeader
+		struct IrFileFunction[function_count]   at functions_offset
+		per function, each array 16 byte aligned:
+			struct TypeInfo[arguments_count]    at arguments_offset
+			struct Opcode[opcodes_count]        at opcodes_offset
+			struct Variable[variables_count]    at variables_offset
+
+	Opening a module only checks the header. A function is checked when it
+	is first accessed, so using a few functions of a large module only
+	touches their pages. Functions of a module point into its data and
+	must not be modified, function_copy makes a modifiable copy.
+*/
+
+#define IR_FILE_MAGIC "X64IRMOD"
+#define IR_FILE_VERSION (1)
+#define IR_FILE_ALIGNMENT (16)
+
+_Static_assert(sizeof(struct TypeInfo) == 16, "TypeInfo record layout");
+_Static_assert(sizeof(struct Operand) == 32, "Operand record layout");
+_Static_assert(sizeof(struct Opcode) == 104, "Opcode record layout");
+_Static_assert(sizeof(struct Variable) == 16, "Variable record layout");
+
+struct IrFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t size; //Size of the whole data
+	uint64_t function_count;
+	uint64_t functions_offset;
+	uint64_t reserved[3];
+};
+
+struct IrFileFunction
+{
+	int32_t id;
+	uint32_t reserved;
+	struct TypeInfo return_type;
+	uint64_t arguments_offset;
+	uint64_t arguments_count;
+	uint64_t opcodes_offset;
+	uint64_t opcodes_count;
+	uint64_t variables_offset;
+	uint64_t variables_count;
+};
+
+struct IrModule
+{
+	const char* data;
+	size_t size;
+	const struct IrFileHeader* header;
+	const struct IrFileFunction* functions;
+	size_t functions_size;
+	int mapped; //Data is mapped by ir_module_map_file
+};
+
+size_t ir_file_align(size_t offset)
+{
+	return (offset + IR_FILE_ALIGNMENT - 1) & ~(size_t)(IR_FILE_ALIGNMENT - 1);
+}
+
+// Copies of the records with the padding zeroed, so equal functions
+// always give equal data
+struct TypeInfo ir_file_type_info(struct TypeInfo* type_info)
+{
+	struct TypeInfo record;
+	memset(&record, 0, sizeof record);
+	record.type = type_info->type;
+	record.sub_type = type_info->sub_type;
+	record.struct_size = type_info->struct_size;
+	return record;
+}
+
+struct Opcode ir_file_opcode(struct Opcode* op)
+{
+	struct Opcode record;
+	memset(&record, 0, sizeof record);
+	record.type = op->type;
+	for (int o = 0; o < 3; ++o) {
+		record.operands[o].value_u64 = op->operands[o].value_u64;
+		record.operands[o].info_type = op->operands[o].info_type;
+		record.operands[o].info_flags = op->operands[o].info_flags;
+		record.operands[o].type_info = ir_file_type_info(&op->operands[o].type_info);
+	}
+	return record;
+}
+
+// Serializes the functions to a newly allocated buffer. Returns the
+// buffer and its size in "size"
+char* ir_module_serialize(struct Function** functions, size_t count, size_t* size)
+{
+	size_t offset = ir_file_align(sizeof(struct IrFileHeader));
+	size_t functions_offset = offset;
+	offset = ir_file_align(offset + count * sizeof(struct IrFileFunction));
+	for (size_t i = 0; i < count; ++i) {
+		offset = ir_file_align(offset + functions[i]->arguments_size * sizeof(struct TypeInfo));
+		offset = ir_file_align(offset + functions[i]->opcodes_size * sizeof(struct Opcode));
+		offset = ir_file_align(offset + functions[i]->variables_size * sizeof(struct Variable));
+	}
+
+	char* data = calloc(offset ? offset : 1, 1);
+	*size = offset;
+
+	struct IrFileHeader* header = (struct IrFileHeader*)data;
+	memcpy(header->magic, IR_FILE_MAGIC, sizeof header->magic);
+	header->version = IR_FILE_VERSION;
+	header->header_size = sizeof *header;
+	header->size = offset;
+	header->function_count = count;
+	header->functions_offset = functions_offset;
+
+	offset = ir_file_align(functions_offset + count * sizeof(struct IrFileFunction));
+	for (size_t i = 0; i < count; ++i) {
+		struct Function* fn = functions[i];
+		struct IrFileFunction* record = (struct IrFileFunction*)(data + functions_offset) + i;
+		record->id = fn->id;
+		record->return_type = ir_file_type_info(&fn->return_type);
+
+		record->arguments_offset = offset;
+		record->arguments_count = fn->arguments_size;
+		for (size_t k = 0; k < fn->arguments_size; ++k)
+			((struct TypeInfo*)(data + offset))[k] = ir_file_type_info(&fn->arguments[k]);
+		offset = ir_file_align(offset + fn->arguments_size * sizeof(struct TypeInfo));
+
+		record->opcodes_offset = offset;
+		record->opcodes_count = fn->opcodes_size;
+		for (size_t k = 0; k < fn->opcodes_size; ++k)
+			((struct Opcode*)(data + offset))[k] = ir_file_opcode(&fn->opcodes[k]);
+		offset = ir_file_align(offset + fn->opcodes_size * sizeof(struct Opcode));
+
+		record->variables_offset = offset;
+		record->variables_count = fn->variables_size;
+		for (size_t k = 0; k < fn->variables_size; ++k)
+			((struct Variable*)(data + offset))[k].type_info = ir_file_type_info(&fn->variables[k].type_info);
+		offset = ir_file_align(offset + fn->variables_size * sizeof(struct Variable));
+	}
+	return data;
+}
+
+// Writes the serialized functions to a file. Returns 0 on success
+int ir_module_write_file(const char* path, struct Function** functions, size_t count)
+{
+	size_t size;
+	char* data = ir_module_serialize(functions, count, &size);
+	FILE* file = fopen(path, "wb");
+	int result = -1;
+	if (file) {
+		result = fwrite(data, 1, size, file) == size ? 0 : -1;
+		if (fclose(file))
+			result = -1;
+	}
+	free(data);
+	return result;
+}
+
+// Uses serialized data in place. The data must stay valid and 16 byte
+// aligned while the module is used. Returns 0 on success, -1 if the data
+// is not a module of this version
+int ir_module_open(struct IrModule* module, const void* data, size_t size)
+{
+	memset(module, 0, sizeof *module);
+	const struct IrFileHeader* header = data;
+	if (size < sizeof *header || ((uintptr_t)data % IR_FILE_ALIGNMENT))
+		return -1;
+	if (memcmp(header->magic, IR_FILE_MAGIC, sizeof header->magic) || header->version != IR_FILE_VERSION)
+		return -1;
+	if (header->header_size != sizeof *header || header->size > size || header->functions_offset % IR_FILE_ALIGNMENT)
+		return -1;
+	if (header->functions_offset > header->size
+		|| header->function_count > (header->size - header->functions_offset) / sizeof(struct IrFileFunction))
+		return -1;
+
+	module->data = data;
+	module->size = header->size;
+	module->header = header;
+	module->functions = (const struct IrFileFunction*)(module->data + header->functions_offset);
+	module->functions_size = header->function_count;
+	return 0;
+}
+
+// Whether an array of records lies inside the module
+int ir_module_array_valid(struct IrModule* module, uint64_t offset, uint64_t count, size_t record_size)
+{
+	if (offset % IR_FILE_ALIGNMENT || offset > module->size)
+		return 0;
+	return count <= (module->size - offset) / record_size;
+}
+
+// Fills "fn" with the function at "index" of the module, its arrays
+// pointing into the module data. Returns 0 on success, -1 if the index
+// or the record is invalid
+int ir_module_function(struct IrModule* module, size_t index, struct Function* fn)
+{
+	memset(fn, 0, sizeof *fn);
+	if (index >= module->functions_size)
+		return -1;
+	const struct IrFileFunction* record = &module->functions[index];
+	if (!ir_module_array_valid(module, record->arguments_offset, record->arguments_count, sizeof(struct TypeInfo))
+		|| !ir_module_array_valid(module, record->opcodes_offset, record->opcodes_count, sizeof(struct Opcode))
+		|| !ir_module_array_valid(module, record->variables_offset, record->variables_count, sizeof(struct Variable)))
+		return -1;
+
+	//Capacities stay 0, the arrays are not owned
+	fn->id = record->id;
+	fn->return_type = record->return_type;
+	fn->arguments = (struct TypeInfo*)(module->data + record->arguments_offset);
+	fn->arguments_size = record->arguments_count;
+	fn->opcodes = (struct Opcode*)(module->data + record->opcodes_offset);
+	fn->opcodes_size = record->opcodes_count;
+	fn->variables = (struct Variable*)(module->data + record->variables_offset);
+	fn->variables_size = record->variables_count;
+	return 0;
+}
+
+// Maps a module file read-only. Returns 0 on success
+int ir_module_map_file(struct IrModule* module, const char* path)
+{
+	memset(module, 0, sizeof *module);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	void* data = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size > 0)
+		data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+
+	if (ir_module_open(module, data, st.st_size)) {
+		munmap(data, st.st_size);
+		return -1;
+	}
+	module->size = st.st_size;
+	module->mapped = 1;
+	return 0;
+}
+
+void ir_module_close(struct IrModule* module)
+{
+	if (module->mapped)
+		munmap((void*)module->data, module->size);
+	memset(module, 0, sizeof *module);
+}
+
+// Copy of a function owning its arrays, for modifying a function of a
+// module. The arguments are owned by the caller as with any function
+void function_copy(struct Function* from, struct Function* to, struct TypeInfo** arguments)
+{
+	memset(to, 0, sizeof *to);
+	to->id = from->id;
+	to->return_type = from->return_type;
+	*arguments = malloc((from->arguments_size + 1) * sizeof **arguments);
+	memcpy(*arguments, from->arguments, from->arguments_size * sizeof **arguments);
+	to->arguments = *arguments;
+	to->arguments_size = from->arguments_size;
+	DYNAMIC_ARRAY_RESIZE(to->opcodes, to->opcodes_size, to->opcodes_capacity, from->opcodes_size + 1);
+	to->opcodes_size = from->opcodes_size;
+	memcpy(to->opcodes, from->opcodes, from->opcodes_size * sizeof *to->opcodes);
+	DYNAMIC_ARRAY_RESIZE(to->variables, to->variables_size, to->variables_capacity, from->variables_size + 1);
+	to->variables_size = from->variables_size;
+	memcpy(to->variables, from->variables, from->variables_size * sizeof *to->variables);
+}
+
+
+/*
+	Textual IR
+
+	A readable form of functions for test corpora and dumps, which the
+	printer and the parser round-trip exactly:
+
+		function 1 (i64, f64) -> f64
+			variables i64 f64 struct(24)
+			copy i64 v0, i64 0
+			goto_ge @5, i64 v0, i64 a0
+			mul f64 v1, f64 a1, f64 0.5
+			copy f32 *a2, f32 v1
+			return _, f64 v1
+		end
+
+	An operand is "_" when it is all zero, "@n" for a void immediate such
+	as a jump target and otherwise a type followed by the value. Variables
+	(v), arguments (a), constants (c) and functions (f) are given by id,
+	immediates by their value in the type. Prefixes "&" and "*" are the
+	address and dereference flags, "!n" gives the flags numerically when
+	others are set. A value which the typed form would not reproduce, such
+	as a NaN payload, is written as the raw 64 bit union "#0x...". Types
+	take an optional ".n" sub type and "(n)" size. Whitespace is free and
+	";" starts a comment.
+
+	The parser works in a single pass over the text without allocating
+	per function: opcodes collect into scratch arrays kept between
+	functions and the finished arrays are copied into an arena, which owns
+	the parsed functions. Like the functions of a module, they must not
+	be modified, function_copy makes a modifiable copy.
+*/
+
+const char* ir_type_names[] = {
+	"void", "u64", "i64", "u32", "i32", "u16", "i16", "u8", "i8", "f64", "f32", "struct"
+};
+
+const char* ir_opcode_names[] = {
+	"nop", "copy", "add", "sub", "mul", "div",
+	"not", "or", "and", "bit_neg", "bit_or", "bit_and", "bit_xor",
+	"shl", "shr", "sar",
+	"goto", "goto_eq", "goto_ne", "goto_lt", "goto_gt", "goto_le", "goto_ge", 0,
+	"compare", "compare_eq", "compare_ne", "compare_lt", "compare_gt", "compare_le", "compare_ge", 0,
+	"set_argument", "call", "return", "mul_high", "tail_call"
+};
+
+#define IR_TYPE_NAMES_SIZE (sizeof ir_type_names / sizeof *ir_type_names)
+#define IR_OPCODE_NAMES_SIZE (sizeof ir_opcode_names / sizeof *ir_opcode_names)
+
+// Longest line the printer writes for one opcode
+#define IR_TEXT_LINE_MAX (512)
+
+struct IrText
+{
+	char* data;
+	size_t size;
+	size_t capacity;
+};
+
+void ir_text_free(struct IrText* text)
+{
+	DYNAMIC_ARRAY_FREE(text->data, text->size, text->capacity);
+}
+
+void ir_text_reserve(struct IrText* text, size_t amount)
+{
+	if (text->size + amount > text->capacity)
+		DYNAMIC_ARRAY_RESERVE(text->data, text->size, text->capacity, text->capacity * 2 + amount);
+}
+
+// The writers expect ir_text_reserve to have made room
+void ir_text_put(struct IrText* text, const char* str, size_t length)
+{
+	memcpy(text->data + text->size, str, length);
+	text->size += length;
+}
+
+void ir_text_put_string(struct IrText* text, const char* str)
+{
+	ir_text_put(text, str, strlen(str));
+}
+
+void ir_text_put_unsigned(struct IrText* text, uint64_t value)
+{
+	char digits[20];
+	int length = 0;
+	do {
+		digits[sizeof digits - ++length] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	ir_text_put(text, digits + sizeof digits - length, length);
+}
+
+void ir_text_put_signed(struct IrText* text, int64_t value)
+{
+	if (value < 0) {
+		text->data[text->size++] = '-';
+		ir_text_put_unsigned(text, -(uint64_t)value);
+	} else {
+		ir_text_put_unsigned(text, value);
+	}
+}
+
+void ir_text_put_raw(struct IrText* text, uint64_t value)
+{
+	ir_text_put(text, "#0x", 3);
+	for (int shift = 60; shift >= 0; shift -= 4)
+		text->data[text->size++] = "0123456789abcdef"[(value >> shift) & 15];
+}
+
+void ir_text_put_type(struct IrText* text, struct TypeInfo* type_info)
+{
+	if (type_info->type < IR_TYPE_NAMES_SIZE) {
+		ir_text_put_string(text, ir_type_names[type_info->type]);
+	} else {
+		text->data[text->size++] = 't';
+		ir_text_put_unsigned(text, type_info->type);
+	}
+	if (type_info->sub_type) {
+		text->data[text->size++] = '.';
+		ir_text_put_unsigned(text, type_info->sub_type);
+	}
+	if (type_info->struct_size || type_info->type == IR_TYPE_STRUCT) {
+		text->data[text->size++] = '(';
+		ir_text_put_unsigned(text, type_info->struct_size);
+		text->data[text->size++] = ')';
+	}
+}
+
+// Shortest of the tried precisions which reads back to the same bits,
+// 0 if none does
+int ir_text_put_float(struct IrText* text, struct Operand* operand)
+{
+	char buffer[64];
+	if (operand->type_info.type == IR_TYPE_F64) {
+		for (int precision = 15; precision <= 17; precision += 2) {
+			int length = snprintf(buffer, sizeof buffer, "%.*g", precision, operand->value_f64);
+			double value = strtod(buffer, 0);
+			if (!memcmp(&value, &operand->value_u64, sizeof value)) {
+				ir_text_put(text, buffer, length);
+				return 1;
+			}
+		}
+	} else if (!(operand->value_u64 >> 32)) {
+		for (int precision = 6; precision <= 9; precision += 3) {
+			int length = snprintf(buffer, sizeof buffer, "%.*g", precision, operand->value_f32);
+			float value = strtof(buffer, 0);
+			if (!memcmp(&value, &operand->value_u32, sizeof value)) {
+				ir_text_put(text, buffer, length);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+void ir_text_put_immediate(struct IrText* text, struct Operand* operand)
+{
+	int type = operand->type_info.type;
+	int bits = ir_type_bits(type);
+	if (ir_type_is_float(type)) {
+		if (!ir_text_put_float(text, operand))
+			ir_text_put_raw(text, operand->value_u64);
+	} else if (bits < 64 && bits && (operand->value_u64 >> bits)) {
+		ir_text_put_raw(text, operand->value_u64);
+	} else if (ir_type_is_signed(type)) {
+		ir_text_put_signed(text, operand_immediate_signed(operand));
+	} else {
+		ir_text_put_unsigned(text, operand->value_u64);
+	}
+}
+
+int ir_operand_is_none(struct Operand* operand)
+{
+	return !operand->value_u64 && !operand->info_type && !operand->info_flags
+		&& !operand->type_info.type && !operand->type_info.sub_type && !operand->type_info.struct_size;
+}
+
+void ir_text_put_operand(struct IrText* text, struct Operand* operand)
+{
+	if (ir_operand_is_none(operand)) {
+		text->data[text->size++] = '_';
+		return;
+	}
+	struct TypeInfo* type_info = &operand->type_info;
+	if (operand->info_type == OPERAND_INFO_TYPE_IMMEDIATE && !operand->info_flags
+		&& type_info->type == IR_TYPE_VOID && !type_info->sub_type && !type_info->struct_size) {
+		text->data[text->size++] = '@';
+		ir_text_put_unsigned(text, operand->value_u64);
+		return;
+	}
+
+	ir_text_put_type(text, type_info);
+	text->data[text->size++] = ' ';
+	if (operand->info_flags & ~(OPERAND_FLAG_ADDRESS | OPERAND_FLAG_DEREFERENCE)) {
+		text->data[text->size++] = '!';
+		ir_text_put_unsigned(text, operand->info_flags);
+		text->data[text->size++] = ' ';
+	} else {
+		if (operand->info_flags & OPERAND_FLAG_ADDRESS)
+			text->data[text->size++] = '&';
+		if (operand->info_flags & OPERAND_FLAG_DEREFERENCE)
+			text->data[text->size++] = '*';
+	}
+
+	if (operand->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+		ir_text_put_immediate(text, operand);
+		return;
+	}
+	if (operand->info_type <= OPERAND_INFO_TYPE_FUNCTION) {
+		text->data[text->size++] = " vacf"[operand->info_type];
+	} else {
+		text->data[text->size++] = 'k';
+		ir_text_put_unsigned(text, operand->info_type);
+	}
+	if (operand->info_type > OPERAND_INFO_TYPE_FUNCTION || (operand->value_u64 >> 32))
+		ir_text_put_raw(text, operand->value_u64);
+	else
+		ir_text_put_signed(text, operand->ref_id);
+}
+
+// Appends the function to the text
+void ir_print_function(struct IrText* text, struct Function* fn)
+{
+	ir_text_reserve(text, IR_TEXT_LINE_MAX);
+	ir_text_put_string(text, "function ");
+	ir_text_put_signed(text, fn->id);
+	ir_text_put(text, " (", 2);
+	for (size_t i = 0; i < fn->arguments_size; ++i) {
+		ir_text_reserve(text, IR_TEXT_LINE_MAX);
+		if (i)
+			ir_text_put(text, ", ", 2);
+		ir_text_put_type(text, &fn->arguments[i]);
+	}
+	ir_text_reserve(text, IR_TEXT_LINE_MAX);
+	ir_text_put(text, ") -> ", 5);
+	ir_text_put_type(text, &fn->return_type);
+	text->data[text->size++] = '\n';
+
+	//Sixteen variables a line keeps long lists diffable
+	for (size_t i = 0; i < fn->variables_size; ++i) {
+		ir_text_reserve(text, IR_TEXT_LINE_MAX);
+		if (!i)
+			ir_text_put_string(text, "\tvariables");
+		else if (i % 16 == 0)
+			ir_text_put(text, "\n\t\t", 3);
+		text->data[text->size++] = ' ';
+		ir_text_put_type(text, &fn->variables[i].type_info);
+	}
+	if (fn->variables_size)
+		text->data[text->size++] = '\n';
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		ir_text_reserve(text, IR_TEXT_LINE_MAX);
+		text->data[text->size++] = '\t';
+		if (op->type >= 0 && (size_t)op->type < IR_OPCODE_NAMES_SIZE && ir_opcode_names[op->type]) {
+			ir_text_put_string(text, ir_opcode_names[op->type]);
+		} else {
+			ir_text_put(text, "op", 2);
+			ir_text_put_signed(text, op->type);
+		}
+		int count = 3;
+		while (count && ir_operand_is_none(&op->operands[count - 1]))
+			--count;
+		for (int o = 0; o < count; ++o) {
+			ir_text_put(text, o ? ", " : " ", o ? 2 : 1);
+			ir_text_put_operand(text, &op->operands[o]);
+		}
+		text->data[text->size++] = '\n';
+	}
+	ir_text_reserve(text, IR_TEXT_LINE_MAX);
+	ir_text_put(text, "end\n", 4);
+}
+
+#define IR_ARENA_CHUNK_SIZE (1 << 20)
+
+struct IrArenaChunk
+{
+	struct IrArenaChunk* next;
+	char* data; //16 byte aligned start of the space after the header
+	size_t size;
+	size_t used;
+};
+
+// Owns the parsed functions, freed all at once
+struct IrArena
+{
+	struct IrArenaChunk* chunks;
+};
+
+void* ir_arena_alloc(struct IrArena* arena, size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	struct IrArenaChunk* chunk = arena->chunks;
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = size > IR_ARENA_CHUNK_SIZE ? size : IR_ARENA_CHUNK_SIZE;
+		chunk = malloc(sizeof *chunk + 16 + chunk_size);
+		chunk->data = (char*)(((uintptr_t)(chunk + 1) + 15) & ~(uintptr_t)15);
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	void* memory = chunk->data + chunk->used;
+	chunk->used += size;
+	return memory;
+}
+
+void* ir_arena_copy(struct IrArena* arena, const void* data, size_t size)
+{
+	if (!size)
+		return 0;
+	return memcpy(ir_arena_alloc(arena, size), data, size);
+}
+
+void ir_arena_free(struct IrArena* arena)
+{
+	while (arena->chunks) {
+		struct IrArenaChunk* next = arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks = next;
+	}
+}
+
+struct IrParser
+{
+	const char* text;
+	const char* p;
+	const char* end;
+	const char* error; //Message of the error, the position is left at it
+
+	struct IrArena* arena;
+
+	//Scratch arrays reused between functions
+	struct TypeInfo* arguments;
+	size_t arguments_size;
+	size_t arguments_capacity;
+	struct Variable* variables;
+	size_t variables_size;
+	size_t variables_capacity;
+	struct Opcode* opcodes;
+	size_t opcodes_size;
+	size_t opcodes_capacity;
+};
+
+void ir_parser_init(struct IrParser* ps, const char* text, size_t size, struct IrArena* arena)
+{
+	memset(ps, 0, sizeof *ps);
+	ps->text = text;
+	ps->p = text;
+	ps->end = text + size;
+	ps->arena = arena;
+}
+
+void ir_parser_free(struct IrParser* ps)
+{
+	DYNAMIC_ARRAY_FREE(ps->arguments, ps->arguments_size, ps->arguments_capacity);
+	DYNAMIC_ARRAY_FREE(ps->variables, ps->variables_size, ps->variables_capacity);
+	DYNAMIC_ARRAY_FREE(ps->opcodes, ps->opcodes_size, ps->opcodes_capacity);
+}
+
+// Line of the parser position, counted only for error messages
+int ir_parser_line(struct IrParser* ps)
+{
+	int line = 1;
+	const char* p = ps->text;
+	while ((p = memchr(p, '\n', ps->p - p))) {
+		++line;
+		++p;
+	}
+	return line;
+}
+
+int ir_parser_fail(struct IrParser* ps, const char* error)
+{
+	ps->error = error;
+	return -1;
+}
+
+// Skips whitespace and comments, sixteen bytes at a time where SSE2 is
+// available as indentation makes up much of the text
+void ir_parser_skip_space(struct IrParser* ps)
+{
+	const char* p = ps->p;
+	const char* end = ps->end;
+	//Mostly there is a single space or none between tokens
+	if (p < end && *p == ' ')
+		++p;
+	if (p == end || (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' && *p != ';')) {
+		ps->p = p;
+		return;
+	}
+	for (;;) {
+#ifdef __SSE2__
+		while (end - p >= 16) {
+			__m128i chunk = _mm_loadu_si128((const __m128i*)p);
+			__m128i space = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+			unsigned other = ~_mm_movemask_epi8(space) & 0xffff;
+			if (other) {
+				p += __builtin_ctz(other);
+				break;
+			}
+			p += 16;
+		}
+#endif
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+			++p;
+		if (p == end || *p != ';')
+			break;
+		p = memchr(p, '\n', end - p);
+		if (!p)
+			p = end;
+	}
+	ps->p = p;
+}
+
+int ir_parser_is_word(char c)
+{
+	return (unsigned)((c | 0x20) - 'a') < 26 || (unsigned)(c - '0') < 10 || c == '_';
+}
+
+// Length of the word at the position
+size_t ir_parser_word(struct IrParser* ps)
+{
+	const char* p = ps->p;
+	while (p < ps->end && ir_parser_is_word(*p))
+		++p;
+	return p - ps->p;
+}
+
+int ir_parser_accept(struct IrParser* ps, char c)
+{
+	ir_parser_skip_space(ps);
+	if (ps->p < ps->end && *ps->p == c) {
+		++ps->p;
+		return 1;
+	}
+	return 0;
+}
+
+int ir_parser_keyword(struct IrParser* ps, const char* keyword)
+{
+	ir_parser_skip_space(ps);
+	size_t length = strlen(keyword);
+	if (ir_parser_word(ps) != length || memcmp(ps->p, keyword, length))
+		return 0;
+	ps->p += length;
+	return 1;
+}
+
+// Index of the word in the names, -1 if not found
+int ir_parser_find_name(const char* word, size_t length, const char** names, size_t names_size)
+{
+	for (size_t i = 0; i < names_size; ++i)
+		if (names[i] && names[i][0] == word[0] && !strncmp(names[i], word, length) && !names[i][length])
+			return i;
+	return -1;
+}
+
+// Type of a type name, -1 if not one. Decoded directly as types are
+// the most common words
+int ir_parser_find_type(const char* word, size_t length)
+{
+	static const signed char scalar_types[3][4] = {
+		{IR_TYPE_I8, IR_TYPE_I16, IR_TYPE_I32, IR_TYPE_I64},
+		{IR_TYPE_U8, IR_TYPE_U16, IR_TYPE_U32, IR_TYPE_U64},
+		{-1, -1, IR_TYPE_F32, IR_TYPE_F64},
+	};
+	const char* kinds = "iuf";
+	const char* kind = memchr(kinds, word[0], 3);
+	if (kind && length == 2 && word[1] == '8')
+		return scalar_types[kind - kinds][0];
+	if (kind && length == 3) {
+		int bits = (word[1] - '0') * 10 + word[2] - '0';
+		int index = bits == 16 ? 1 : bits == 32 ? 2 : bits == 64 ? 3 : -1;
+		return index < 0 ? -1 : scalar_types[kind - kinds][index];
+	}
+	if (length == 4 && !memcmp(word, "void", 4))
+		return IR_TYPE_VOID;
+	if (length == 6 && !memcmp(word, "struct", 6))
+		return IR_TYPE_STRUCT;
+	return -1;
+}
+
+// Decimal or 0x prefixed hexadecimal number
+int ir_parser_unsigned(struct IrParser* ps, uint64_t* value)
+{
+	const char* p = ps->p;
+	uint64_t v = 0;
+	if (ps->end - p > 2 && p[0] == '0' && p[1] == 'x') {
+		p += 2;
+		const char* start = p;
+		for (; p < ps->end; ++p) {
+			int digit;
+			if (*p >= '0' && *p <= '9')
+				digit = *p - '0';
+			else if (*p >= 'a' && *p <= 'f')
+				digit = *p - 'a' + 10;
+			else
+				break;
+			if (v >> 60)
+				return ir_parser_fail(ps, "number out of range");
+			v = v << 4 | digit;
+		}
+		if (p == start)
+			return ir_parser_fail(ps, "expected a number");
+	} else {
+		if (p == ps->end || *p < '0' || *p > '9')
+			return ir_parser_fail(ps, "expected a number");
+		for (; p < ps->end && *p >= '0' && *p <= '9'; ++p) {
+			uint64_t digit = *p - '0';
+			if (v > (UINT64_MAX - digit) / 10)
+				return ir_parser_fail(ps, "number out of range");
+			v = v * 10 + digit;
+		}
+	}
+	if (p < ps->end && ir_parser_is_word(*p))
+		return ir_parser_fail(ps, "expected a number");
+	ps->p = p;
+	*value = v;
+	return 0;
+}
+
+// Number in the range of a "bits" wide integer, signed or unsigned
+int ir_parser_integer(struct IrParser* ps, int bits, uint64_t* value)
+{
+	int negative = ps->p < ps->end && *ps->p == '-';
+	ps->p += negative;
+	uint64_t v;
+	if (ir_parser_unsigned(ps, &v))
+		return -1;
+	uint64_t limit = bits < 64 ? ((uint64_t)1 << bits) - 1 : UINT64_MAX;
+	if (negative ? v > limit / 2 + 1 : v > limit)
+		return ir_parser_fail(ps, "number out of range");
+	*value = negative ? -v : v;
+	return 0;
+}
+
+int ir_parser_type(struct IrParser* ps, struct TypeInfo* type_info)
+{
+	memset(type_info, 0, sizeof *type_info);
+	ir_parser_skip_space(ps);
+	size_t length = ir_parser_word(ps);
+	int type = length ? ir_parser_find_type(ps->p, length) : -1;
+	uint64_t value;
+	if (type >= 0) {
+		ps->p += length;
+	} else if (length > 1 && *ps->p == 't' && ps->p[1] >= '0' && ps->p[1] <= '9') {
+		++ps->p;
+		if (ir_parser_integer(ps, 16, &value))
+			return -1;
+		type = value;
+	} else {
+		return ir_parser_fail(ps, "expected a type");
+	}
+	type_info->type = type;
+
+	if (ps->p < ps->end && *ps->p == '.') {
+		++ps->p;
+		if (ir_parser_integer(ps, 16, &value))
+			return -1;
+		type_info->sub_type = value;
+	}
+	if (ps->p < ps->end && *ps->p == '(') {
+		++ps->p;
+		ir_parser_skip_space(ps);
+		if (ir_parser_unsigned(ps, &value))
+			return -1;
+		type_info->struct_size = value;
+		if (!ir_parser_accept(ps, ')'))
+			return ir_parser_fail(ps, "expected )");
+	}
+	return 0;
+}
+
+// Whether a type starts at the position
+int ir_parser_at_type(struct IrParser* ps)
+{
+	ir_parser_skip_space(ps);
+	size_t length = ir_parser_word(ps);
+	if (!length)
+		return 0;
+	if (ir_parser_find_type(ps->p, length) >= 0)
+		return 1;
+	return length > 1 && *ps->p == 't' && ps->p[1] >= '0' && ps->p[1] <= '9';
+}
+
+int ir_parser_float(struct IrParser* ps, struct Operand* operand)
+{
+	char buffer[64];
+	size_t length = 0;
+	const char* p = ps->p;
+	while (p < ps->end && (ir_parser_is_word(*p) || *p == '.' || *p == '-' || *p == '+')) {
+		if (length == sizeof buffer - 1)
+			return ir_parser_fail(ps, "expected a number");
+		buffer[length++] = *p++;
+	}
+	buffer[length] = 0;
+	char* number_end;
+	if (operand->type_info.type == IR_TYPE_F64)
+		operand->value_f64 = strtod(buffer, &number_end);
+	else
+		operand->value_f32 = strtof(buffer, &number_end);
+	if (!length || number_end != buffer + length)
+		return ir_parser_fail(ps, "expected a number");
+	ps->p = p;
+	return 0;
+}
+
+int ir_parser_operand(struct IrParser* ps, struct Operand* operand)
+{
+	memset(operand, 0, sizeof *operand);
+	ir_parser_skip_space(ps);
+	if (ps->p < ps->end && *ps->p == '_' && ir_parser_word(ps) == 1) {
+		++ps->p;
+		return 0;
+	}
+	if (ps->p < ps->end && *ps->p == '@') {
+		++ps->p;
+		return ir_parser_unsigned(ps, &operand->value_u64);
+	}
+
+	if (ir_parser_type(ps, &operand->type_info))
+		return -1;
+	uint64_t value;
+	ir_parser_skip_space(ps);
+	if (ps->p < ps->end && *ps->p == '!') {
+		++ps->p;
+		if (ir_parser_integer(ps, 16, &value))
+			return -1;
+		operand->info_flags = value;
+		ir_parser_skip_space(ps);
+	} else {
+		for (; ps->p < ps->end && (*ps->p == '&' || *ps->p == '*'); ++ps->p)
+			operand->info_flags |= *ps->p == '&' ? OPERAND_FLAG_ADDRESS : OPERAND_FLAG_DEREFERENCE;
+	}
+
+	if (ps->p == ps->end)
+		return ir_parser_fail(ps, "expected an operand");
+	const char* kind = strchr("vacf", *ps->p);
+	if (*ps->p && kind) {
+		operand->info_type = OPERAND_INFO_TYPE_VARIABLE + (kind - "vacf");
+		++ps->p;
+	} else if (*ps->p == 'k') {
+		++ps->p;
+		if (ir_parser_integer(ps, 16, &value))
+			return -1;
+		operand->info_type = value;
+		if (ps->p == ps->end || *ps->p != '#')
+			return ir_parser_fail(ps, "expected a raw value");
+	}
+
+	if (ps->p < ps->end && *ps->p == '#') {
+		++ps->p;
+		return ir_parser_unsigned(ps, &operand->value_u64);
+	}
+	if (operand->info_type != OPERAND_INFO_TYPE_IMMEDIATE) {
+		if (ir_parser_integer(ps, 32, &value))
+			return -1;
+		operand->ref_id = value;
+		return 0;
+	}
+	if (ir_type_is_float(operand->type_info.type))
+		return ir_parser_float(ps, operand);
+
+	int bits = ir_type_bits(operand->type_info.type);
+	if (ir_parser_integer(ps, bits ? bits : 64, &value))
+		return -1;
+	operand->value_u64 = bits && bits < 64 ? value & (((uint64_t)1 << bits) - 1) : value;
+	return 0;
+}
+
+// Parses the next function of the text into "fn", its arrays owned by
+// the arena. Returns 1 if a function was parsed, 0 at the end of the
+// text and -1 on an error, described by the parser error
+int ir_parse_function(struct IrParser* ps, struct Function* fn)
+{
+	memset(fn, 0, sizeof *fn);
+	ir_parser_skip_space(ps);
+	if (ps->p == ps->end)
+		return 0;
+	if (!ir_parser_keyword(ps, "function"))
+		return ir_parser_fail(ps, "expected function");
+
+	uint64_t value;
+	ir_parser_skip_space(ps);
+	if (ir_parser_integer(ps, 32, &value))
+		return -1;
+	fn->id = value;
+
+	ps->arguments_size = 0;
+	ps->variables_size = 0;
+	ps->opcodes_size = 0;
+	if (!ir_parser_accept(ps, '('))
+		return ir_parser_fail(ps, "expected (");
+	if (!ir_parser_accept(ps, ')')) {
+		do {
+			struct TypeInfo type_info;
+			if (ir_parser_type(ps, &type_info))
+				return -1;
+			DYNAMIC_ARRAY_PUSH(ps->arguments, ps->arguments_size, ps->arguments_capacity, type_info, 16);
+		} while (ir_parser_accept(ps, ','));
+		if (!ir_parser_accept(ps, ')'))
+			return ir_parser_fail(ps, "expected )");
+	}
+	if (!ir_parser_accept(ps, '-') || !ir_parser_accept(ps, '>'))
+		return ir_parser_fail(ps, "expected ->");
+	if (ir_parser_type(ps, &fn->return_type))
+		return -1;
+
+	if (ir_parser_keyword(ps, "variables")) {
+		while (ir_parser_at_type(ps)) {
+			struct Variable variable;
+			if (ir_parser_type(ps, &variable.type_info))
+				return -1;
+			DYNAMIC_ARRAY_PUSH(ps->variables, ps->variables_size, ps->variables_capacity, variable, 64);
+		}
+	}
+
+	for (;;) {
+		ir_parser_skip_space(ps);
+		size_t length = ir_parser_word(ps);
+		if (!length)
+			return ir_parser_fail(ps, "expected an opcode");
+		if (length == 3 && !memcmp(ps->p, "end", 3)) {
+			ps->p += 3;
+			break;
+		}
+		int type = ir_parser_find_name(ps->p, length, ir_opcode_names, IR_OPCODE_NAMES_SIZE);
+		if (type >= 0) {
+			ps->p += length;
+		} else if (length > 2 && !memcmp(ps->p, "op", 2)) {
+			ps->p += 2;
+			if (ir_parser_integer(ps, 32, &value))
+				return -1;
+			type = value;
+		} else {
+			return ir_parser_fail(ps, "unknown opcode");
+		}
+
+		struct Opcode op;
+		memset(&op, 0, sizeof op);
+		op.type = type;
+		ir_parser_skip_space(ps);
+		if (ps->p < ps->end && (*ps->p == '_' || *ps->p == '@' || ir_parser_at_type(ps))) {
+			int count = 0;
+			do {
+				if (count == 3)
+					return ir_parser_fail(ps, "too many operands");
+				if (ir_parser_operand(ps, &op.operands[count++]))
+					return -1;
+			} while (ir_parser_accept(ps, ','));
+		}
+		DYNAMIC_ARRAY_PUSH(ps->opcodes, ps->opcodes_size, ps->opcodes_capacity, op, 256);
+	}
+
+	fn->arguments = ir_arena_copy(ps->arena, ps->arguments, ps->arguments_size * sizeof *fn->arguments);
+	fn->arguments_size = ps->arguments_size;
+	fn->variables = ir_arena_copy(ps->arena, ps->variables, ps->variables_size * sizeof *fn->variables);
+	fn->variables_size = ps->variables_size;
+	fn->opcodes = ir_arena_copy(ps->arena, ps->opcodes, ps->opcodes_size * sizeof *fn->opcodes);
+	fn->opcodes_size = ps->opcodes_size;
+	return 1;
+}
+
+
+/*
+	Block layout
+
+	The lowering emits opcodes in order, so the order of the blocks
+	decides which branches fall through. Blocks are reordered with the
+	bottom-up chain layout of Pettis and Hansen: edges are visited from
+	the most to the least frequent and an edge joins two chains when it
+	leaves the tail of one and enters the head of the other. The chain of
+	the entry block is placed first, then repeatedly the chain entered
+	most frequently from the already placed ones.
+
+	Cold blocks, which next to never run, stay out of the hot chains and
+	move after all hot code of the function, keeping the hot part dense in
+	the instruction cache. A conditional jump whose target ends up next is
+	inverted so the likely path falls through. The inverse comparisons
+	are exact complements for floats too, as the lowering maps unordered
+	results to the same flags for both. A fall-through that no longer
+	reaches its block gets a jump and a jump to the next block is dropped.
+
+	Frequencies come from execution counts of the blocks when those are
+	known, for example from a profile, and the fall-through counts of the
+	conditional jumps make the branch probabilities exact. Otherwise they
+	are estimated:
+	a branch stays in its loop with probability 0.9, a branch to a
+	returning block is taken with 0.3 as early exits are mostly error
+	paths, others are even and a loop header runs 10 times per entry.
+	Only the ratios of the estimates matter.
+*/
+
+#define LAYOUT_LOOP_TRIPS (10.0)
+#define LAYOUT_COLD_FREQUENCY (0.001) //Relative to the entry block
+
+struct LayoutEdge
+{
+	int from;
+	int to;
+	double weight;
+};
+
+// Comparison which holds exactly when the given one does not, -1 for
+// COMPARISON_ALWAYS
+int comparison_inverse(int comparison)
+{
+	static const int inverse[] = {
+		-1, COMPARISON_NOT_EQUAL, COMPARISON_EQUAL,
+		COMPARISON_GEQUAL, COMPARISON_LEQUAL, COMPARISON_GREATER, COMPARISON_LESS
+	};
+	if (comparison < 0 || comparison > COMPARISON_GEQUAL)
+		return -1;
+	return inverse[comparison];
+}
+
+int layout_block_returns(struct FunctionAnalysis* a, int b)
+{
+	return opcode_is_return(&a->function->opcodes[a->blocks[b].end - 1]);
+}
+
+// Probability that block "b" continues to its successor number "s", the
+// jump target comes first. Measured fall-through counts give it exactly,
+// measured frequencies without them are shared by the successors
+double layout_edge_probability(struct FunctionAnalysis* a, double* frequencies, const uint64_t* counts, const uint64_t* fall_throughs, int b, int s)
+{
+	struct BasicBlock* block = &a->blocks[b];
+	if (block->successors_size < 2)
+		return 1;
+	int to = block->successors[s];
+	int other = block->successors[1 - s];
+
+	if (counts && fall_throughs) {
+		double fall = counts[b] ? (double)fall_throughs[b] / counts[b] : 0.5;
+		if (fall > 1)
+			fall = 1;
+		return s == 1 ? fall : 1 - fall;
+	}
+	if (counts) {
+		double total = frequencies[to] + frequencies[other];
+		return total > 0 ? frequencies[to] / total : 0.5;
+	}
+	if (block->loop >= 0) {
+		int stays = loop_contains(a, block->loop, to);
+		if (stays != loop_contains(a, block->loop, other))
+			return stays ? 0.9 : 0.1;
+	}
+	int returns = layout_block_returns(a, to);
+	if (returns != layout_block_returns(a, other))
+		return returns ? 0.3 : 0.7;
+	return 0.5;
+}
+
+// Frequencies of the blocks relative to the entry block, from "counts"
+// when given. The estimate visits blocks in reverse post-order so that
+// the forward predecessors of a block are done before it
+double* layout_block_frequencies(struct FunctionAnalysis* a, const uint64_t* counts)
+{
+	double* frequencies = calloc(a->blocks_size + 1, sizeof *frequencies);
+	if (counts) {
+		double entry = counts[0] ? counts[0] : 1;
+		for (size_t b = 0; b < a->blocks_size; ++b)
+			frequencies[b] = counts[b] / entry;
+		return frequencies;
+	}
+
+	for (size_t i = 0; i < a->rpo_size; ++i) {
+		int b = a->rpo[i];
+		struct BasicBlock* block = &a->blocks[b];
+		double frequency = b == 0 ? 1 : 0;
+		for (size_t p = 0; p < block->predecessors_size; ++p) {
+			int pred = block->predecessors[p];
+			if (a->blocks[pred].rpo_index < 0 || a->blocks[pred].rpo_index >= block->rpo_index)
+				continue;
+			int s = a->blocks[pred].successors[0] == b ? 0 : 1;
+			frequency += frequencies[pred] * layout_edge_probability(a, frequencies, 0, 0, pred, s);
+		}
+		if (block->loop >= 0 && a->loops[block->loop].header == b)
+			frequency *= LAYOUT_LOOP_TRIPS;
+		frequencies[b] = frequency;
+	}
+	return frequencies;
+}
+
+int layout_edge_compare(const void* x, const void* y)
+{
+	const struct LayoutEdge* a = x;
+	const struct LayoutEdge* b = y;
+	if (a->weight != b->weight)
+		return a->weight < b->weight ? 1 : -1;
+	if (a->from != b->from)
+		return a->from - b->from;
+	return a->to - b->to;
+}
+
+// Order of the blocks, hot chains first and cold blocks last
+void layout_order_blocks(struct FunctionAnalysis* a, struct LayoutEdge* edges, size_t edges_size, const char* cold, int* order)
+{
+	int n = a->blocks_size;
+	int* next = malloc(n * sizeof *next);
+	int* head = malloc(n * sizeof *head);
+	int* tail = malloc(n * sizeof *tail);
+	char* placed = calloc(n, 1);
+	double* entering = malloc(n * sizeof *entering);
+	for (int b = 0; b < n; ++b) {
+		next[b] = -1;
+		head[b] = b;
+		tail[b] = b;
+	}
+
+	for (size_t e = 0; e < edges_size; ++e) {
+		int from = edges[e].from;
+		int to = edges[e].to;
+		if (cold[from] != cold[to] || tail[head[from]] != from || head[to] != to || head[from] == to)
+			continue;
+		int chain = head[from];
+		next[from] = to;
+		tail[chain] = tail[to];
+		for (int x = to; x >= 0; x = next[x])
+			head[x] = chain;
+	}
+
+	int order_size = 0;
+	for (int chain = 0; chain >= 0;) {
+		placed[chain] = 1;
+		for (int x = chain; x >= 0; x = next[x])
+			order[order_size++] = x;
+
+		for (int b = 0; b < n; ++b)
+			entering[b] = 0;
+		for (size_t e = 0; e < edges_size; ++e)
+			if (placed[head[edges[e].from]] && !placed[head[edges[e].to]])
+				entering[head[edges[e].to]] += edges[e].weight;
+		chain = -1;
+		for (int b = 0; b < n; ++b)
+			if (head[b] == b && !placed[b] && !cold[b] && (chain < 0 || entering[b] > entering[chain]))
+				chain = b;
+	}
+	for (int b = 0; b < n; ++b) {
+		if (head[b] == b && !placed[b]) {
+			for (int x = b; x >= 0; x = next[x])
+				order[order_size++] = x;
+		}
+	}
+
+	free(next);
+	free(head);
+	free(tail);
+	free(placed);
+	free(entering);
+}
+
+struct Operand layout_label(int index)
+{
+	struct Operand label;
+	memset(&label, 0, sizeof label);
+	label.ref_id = index;
+	return label;
+}
+
+// Rewrites the function of the analysis with its blocks in the given
+// order. Blocks missing from "order" are dropped, no kept block may jump
+// or fall through to them. Jumps to the following block disappear and
+// fall-throughs to a block which moved get a jump
+void layout_apply_order(struct FunctionAnalysis* a, const int* order, int order_size)
+{
+	struct Function* fn = a->function;
+	int n = a->blocks_size;
+	//Decide how every block ends, -1 stands for the end of the function
+	int* falls_to = malloc(n * sizeof *falls_to);
+	int* new_start = malloc((n + 1) * sizeof *new_start);
+	size_t size = 0;
+	for (int i = 0; i < order_size; ++i) {
+		int b = order[i];
+		int following = i + 1 < order_size ? order[i + 1] : -1;
+		struct Opcode* last = &fn->opcodes[a->blocks[b].end - 1];
+		int label = last->operands[OPERAND_TARGET].ref_id;
+		int target = -2;
+		if (opcode_is_jump(last))
+			target = (size_t)label == fn->opcodes_size ? -1 : a->opcode_blocks[label];
+
+		falls_to[b] = b + 1 < n ? b + 1 : -1;
+		if (opcode_is_return(last) || last->type == OPCODE_GOTO_BASE)
+			falls_to[b] = -2;
+		new_start[b] = size;
+		size += a->blocks[b].end - a->blocks[b].start;
+		if (last->type == OPCODE_GOTO_BASE && target == following)
+			size -= 1;
+		else if (falls_to[b] != -2 && falls_to[b] != following && target != following)
+			size += 1;
+	}
+
+	struct Opcode* opcodes = malloc((size + 1) * sizeof *opcodes);
+	size_t at = 0;
+	for (int i = 0; i < order_size; ++i) {
+		int b = order[i];
+		int following = i + 1 < order_size ? order[i + 1] : -1;
+		int fall = falls_to[b];
+		for (int k = a->blocks[b].start; k < a->blocks[b].end; ++k) {
+			struct Opcode op = fn->opcodes[k];
+			if (opcode_is_jump(&op)) {
+				int label = op.operands[OPERAND_TARGET].ref_id;
+				int target = (size_t)label == fn->opcodes_size ? -1 : a->opcode_blocks[label];
+				if (op.type == OPCODE_GOTO_BASE && target == following)
+					continue;
+				if (op.type != OPCODE_GOTO_BASE && target == following && fall != following) {
+					op.type = OPCODE_GOTO_COND(comparison_inverse(op.type - OPCODE_GOTO_BASE));
+					target = fall;
+					fall = following;
+				}
+				op.operands[OPERAND_TARGET].ref_id = target < 0 ? (int)size : new_start[target];
+			}
+			opcodes[at++] = op;
+		}
+		if (fall != -2 && fall != following) {
+			struct Operand none;
+			memset(&none, 0, sizeof none);
+			opcodes[at++] = make_opcode(OPCODE_GOTO_COND(COMPARISON_ALWAYS), layout_label(fall < 0 ? (int)size : new_start[fall]), none, none);
+		}
+	}
+
+	DYNAMIC_ARRAY_RESERVE(fn->opcodes, fn->opcodes_size, fn->opcodes_capacity, size + 1);
+	memcpy(fn->opcodes, opcodes, size * sizeof *opcodes);
+	fn->opcodes_size = size;
+	free(opcodes);
+	free(falls_to);
+	free(new_start);
+}
+
+// Reorders the blocks of the function as described above. "counts" has
+// an execution count for every block of analyse_function(fn), or is 0 to
+// estimate them. "fall_throughs" optionally has for every block how often
+// its conditional jump was not taken, as profile_block_counts gives after
+// the block counts. Returns the amount of blocks which moved
+int layout_blocks(struct AnalysisManager* analyses, struct Function* fn, const uint64_t* counts, const uint64_t* fall_throughs)
+{
+	struct FunctionAnalysis* a = analysis_manager_get(analyses, fn);
+	int n = a->blocks_size;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		int label = fn->opcodes[i].operands[OPERAND_TARGET].ref_id;
+		if (opcode_is_jump(&fn->opcodes[i]) && (label < 0 || (size_t)label > fn->opcodes_size))
+			n = 0;
+	}
+	if (n < 2) {
+		analysis_manager_release(analyses, a, 0);
+		return 0;
+	}
+
+	double* frequencies = layout_block_frequencies(a, counts);
+	char* cold = malloc(n);
+	struct LayoutEdge* edges = 0;
+	size_t edges_size = 0;
+	size_t edges_capacity = 0;
+	for (int b = 0; b < n; ++b) {
+		cold[b] = b && (a->blocks[b].rpo_index < 0 || frequencies[b] < LAYOUT_COLD_FREQUENCY);
+		if (a->blocks[b].rpo_index < 0)
+			continue;
+		for (int s = 0; s < a->blocks[b].successors_size; ++s) {
+			struct LayoutEdge edge;
+			edge.from = b;
+			edge.to = a->blocks[b].successors[s];
+			edge.weight = frequencies[b] * layout_edge_probability(a, frequencies, counts, fall_throughs, b, s);
+			if (edge.to != 0)
+				DYNAMIC_ARRAY_PUSH(edges, edges_size, edges_capacity, edge, 16);
+		}
+	}
+	if (edges_size)
+		qsort(edges, edges_size, sizeof *edges, layout_edge_compare);
+
+	int* order = malloc(n * sizeof *order);
+	layout_order_blocks(a, edges, edges_size, cold, order);
+	int moved = 0;
+	for (int i = 0; i < n; ++i)
+		moved += order[i] != i;
+
+	if (moved)
+		layout_apply_order(a, order, n);
+
+	free(order);
+	free(edges);
+	free(cold);
+	free(frequencies);
+	analysis_manager_release(analyses, a, moved ? ANALYSIS_ALL : 0);
+	return moved;
+}
+
+
+/*
+	Jump threading
+
+	Front-ends and the passes before leave jumps to jumps behind, and
+	branches whose outcome is already decided on the way to them. Jumps
+	are retargeted past unconditional gotos. A conditional jump whose
+	target tests the same operands again takes the outcome it implies,
+	so "if (x < y) goto A ... A: if (x != y) goto B" goes to B at once.
+	Comparisons of immediates or of a value with itself become a goto or
+	disappear, and a goto to a RETURN becomes a copy of it.
+
+	Afterwards the blocks which are no longer reachable are dropped and
+	every block ending with a goto to a block only it leads to is followed
+	by that block, which merges the chain and removes the goto.
+
+	Float comparisons are left alone as unordered values break the
+	implications between them.
+*/
+
+// Possible orderings of the operands for which a comparison holds, as
+// bits "less", "equal" and "greater" from high to low
+int comparison_outcomes(int comparison)
+{
+	static const int outcomes[] = {7, 2, 5, 4, 1, 6, 3};
+	if (comparison < 0 || comparison > COMPARISON_GEQUAL)
+		return 0;
+	return outcomes[comparison];
+}
+
+// Comparison which holds for swapped operands exactly when the given one
+// holds
+int comparison_swap(int comparison)
+{
+	static const int swapped[] = {
+		COMPARISON_ALWAYS, COMPARISON_EQUAL, COMPARISON_NOT_EQUAL,
+		COMPARISON_GREATER, COMPARISON_LESS, COMPARISON_GEQUAL, COMPARISON_LEQUAL
+	};
+	return swapped[comparison];
+}
+
+// Whether the operands name the same value, both read at the same time
+int operand_same(struct Operand* a, struct Operand* b)
+{
+	if (a->info_type != b->info_type || a->info_flags != b->info_flags)
+		return 0;
+	if (!type_info_equal(&a->type_info, &b->type_info))
+		return 0;
+	if (a->info_type == OPERAND_INFO_TYPE_IMMEDIATE)
+		return operand_immediate_unsigned(a) == operand_immediate_unsigned(b);
+	return a->ref_id == b->ref_id;
+}
+
+// Outcome of the conditional jump "op": 1 if it is always taken, 0 if it
+// never is and -1 if it is not known
+int thread_known_outcome(struct Opcode* op)
+{
+	int comparison = op->type - OPCODE_GOTO_BASE;
+	if (comparison == COMPARISON_ALWAYS)
+		return 1;
+	struct Operand* x = &op->operands[OPERAND_PRIMARY_1];
+	struct Operand* y = &op->operands[OPERAND_PRIMARY_2];
+	if (ir_type_is_float(x->type_info.type))
+		return -1;
+
+	int ordering;
+	if (operand_same(x, y) && (x->info_type == OPERAND_INFO_TYPE_IMMEDIATE || operand_is_plain(x))) {
+		ordering = 2;
+	} else if (x->info_type == OPERAND_INFO_TYPE_IMMEDIATE && y->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+		int less;
+		int equal = operand_immediate_unsigned(x) == operand_immediate_unsigned(y);
+		if (ir_type_is_signed(x->type_info.type))
+			less = operand_immediate_signed(x) < operand_immediate_signed(y);
+		else
+			less = operand_immediate_unsigned(x) < operand_immediate_unsigned(y);
+		ordering = less ? 4 : equal ? 2 : 1;
+	} else {
+		return -1;
+	}
+	return (comparison_outcomes(comparison) & ordering) != 0;
+}
+
+// Outcome of the conditional jump "next" right after "op" was taken, as
+// in thread_known_outcome
+int thread_implied_outcome(struct Opcode* op, struct Opcode* next)
+{
+	int taken = op->type - OPCODE_GOTO_BASE;
+	int tested = next->type - OPCODE_GOTO_BASE;
+	if (taken == COMPARISON_ALWAYS || tested == COMPARISON_ALWAYS)
+		return tested == COMPARISON_ALWAYS ? 1 : -1;
+
+	struct Operand* x = &op->operands[OPERAND_PRIMARY_1];
+	struct Operand* y = &op->operands[OPERAND_PRIMARY_2];
+	struct Operand* u = &next->operands[OPERAND_PRIMARY_1];
+	struct Operand* v = &next->operands[OPERAND_PRIMARY_2];
+	if (ir_type_is_float(x->type_info.type))
+		return -1;
+	if (operand_same(x, v) && operand_same(y, u))
+		tested = comparison_swap(tested);
+	else if (!operand_same(x, u) || !operand_same(y, v))
+		return -1;
+
+	int holds = comparison_outcomes(taken);
+	int passes = comparison_outcomes(tested);
+	if (!(holds & ~passes))
+		return 1;
+	if (!(holds & passes))
+		return 0;
+	return -1;
+}
+
+// Label the jump at "index" ends up at, skipping NOPs, gotos and jumps
+// decided by its own outcome. Every step moves to a different opcode and
+// their amount is bounded so that cycles of gotos stop
+int thread_jump_target(struct Function* fn, size_t index)
+{
+	struct Opcode* op = &fn->opcodes[index];
+	int label = op->operands[OPERAND_TARGET].ref_id;
+	for (size_t steps = 0; steps <= fn->opcodes_size; ++steps) {
+		if ((size_t)label == fn->opcodes_size)
+			break;
+		struct Opcode* at = &fn->opcodes[label];
+		if (at->type == OPCODE_NOP) {
+			label += 1;
+			continue;
+		}
+		if (!opcode_is_jump(at) || (size_t)label == index)
+			break;
+		int outcome = thread_implied_outcome(op, at);
+		if (outcome < 0)
+			break;
+		label = outcome ? at->operands[OPERAND_TARGET].ref_id : label + 1;
+	}
+	return label;
+}
+
+// Whether only NOPs lie between the opcode at "index" and "label"
+int thread_is_next(struct Function* fn, size_t index, int label)
+{
+	if ((size_t)label <= index)
+		return 0;
+	for (size_t i = index + 1; i < (size_t)label; ++i)
+		if (fn->opcodes[i].type != OPCODE_NOP)
+			return 0;
+	return 1;
+}
+
+// Retargets and folds the jumps of the function, returns the amount of
+// changed opcodes
+int thread_jumps(struct Function* fn)
+{
+	int changed = 0;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		if (!opcode_is_jump(op))
+			continue;
+
+		int outcome = thread_known_outcome(op);
+		if (outcome == 0) {
+			op->type = OPCODE_NOP;
+			changed += 1;
+			continue;
+		}
+		if (outcome == 1 && op->type != OPCODE_GOTO_BASE) {
+			struct Operand none;
+			memset(&none, 0, sizeof none);
+			*op = make_opcode(OPCODE_GOTO_BASE, op->operands[OPERAND_TARGET], none, none);
+			changed += 1;
+		}
+
+		int label = thread_jump_target(fn, i);
+		if (label != op->operands[OPERAND_TARGET].ref_id) {
+			op->operands[OPERAND_TARGET].ref_id = label;
+			changed += 1;
+		}
+		if (thread_is_next(fn, i, label)) {
+			op->type = OPCODE_NOP;
+			changed += 1;
+		} else if (op->type == OPCODE_GOTO_BASE && (size_t)label < fn->opcodes_size && fn->opcodes[label].type == OPCODE_RETURN) {
+			*op = fn->opcodes[label];
+			changed += 1;
+		}
+	}
+	return changed;
+}
+
+// Order of the reachable blocks which places the single successor of a
+// block right after it where possible. Returns the amount of blocks
+int thread_merge_order(struct FunctionAnalysis* a, int* order)
+{
+	struct Function* fn = a->function;
+	int n = a->blocks_size;
+	char* placed = calloc(n, 1);
+	int order_size = 0;
+	for (int b = 0; b < n; ++b) {
+		for (int x = b; x >= 0 && !placed[x] && a->blocks[x].rpo_index >= 0;) {
+			placed[x] = 1;
+			order[order_size++] = x;
+
+			struct Opcode* last = &fn->opcodes[a->blocks[x].end - 1];
+			int label = last->operands[OPERAND_TARGET].ref_id;
+			if (last->type == OPCODE_GOTO_BASE) {
+				int to = (size_t)label == fn->opcodes_size ? -1 : a->opcode_blocks[label];
+				x = to > 0 && a->blocks[to].predecessors_size == 1 ? to : -1;
+			} else {
+				x = opcode_is_return(last) || x + 1 >= n ? -1 : x + 1;
+			}
+		}
+	}
+	free(placed);
+	return order_size;
+}
+
+// Threads jumps and merges block chains as described above. The arrays
+// of the function must be heap allocated. Returns the amount of changes
+int optimize_jumps(struct AnalysisManager* analyses, struct Function* fn)
+{
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		int label = fn->opcodes[i].operands[OPERAND_TARGET].ref_id;
+		if (opcode_is_jump(&fn->opcodes[i]) && (label < 0 || (size_t)label > fn->opcodes_size))
+			return 0;
+	}
+
+	int changed = thread_jumps(fn);
+	if (function_remove_nops(fn) || changed)
+		analysis_manager_invalidate(analyses, fn, ANALYSIS_ALL);
+	if (fn->opcodes_size == 0)
+		return changed;
+
+	struct FunctionAnalysis* a = analysis_manager_get(analyses, fn);
+	int n = a->blocks_size;
+	int* order = malloc(n * sizeof *order);
+	int order_size = thread_merge_order(a, order);
+	int moved = order_size != n;
+	for (int i = 0; i < order_size; ++i)
+		moved += order[i] != i;
+	if (moved)
+		layout_apply_order(a, order, order_size);
+
+	free(order);
+	analysis_manager_release(analyses, a, moved ? ANALYSIS_ALL : 0);
+	return changed + moved;
+}
+
+
+/*
+	Optimization pipeline
+
+	Runs the function passes in an order where each one feeds the next:
+	tail calls become loops before the loop passes see them, redundant
+	values become copies that copy propagation removes, and loop
+	invariants and strength reduction work on the smaller code. Jump
+	threading cleans up the branches they leave behind, and block layout
+	comes last as the passes before it do not keep the layout.
+	Inlining is not part of it, as it looks at other functions.
+
+	The passes share their analyses through the manager, which may be
+	null. The analysis left in it stays valid for the lowering after.
+*/
+
+// Optimizes the function in place, its arrays must be heap allocated.
+// Returns the amount of changes made
+int optimize_function(struct AnalysisManager* analyses, struct Function* fn)
+{
+	int changed = optimize_tail_calls(fn);
+	if (changed)
+		analysis_manager_invalidate(analyses, fn, ANALYSIS_ALL);
+	changed += number_values(analyses, fn);
+	changed += optimize_copies(analyses, fn);
+	changed += hoist_loop_invariants(analyses, fn);
+	changed += reduce_strength(analyses, fn);
+	changed += optimize_copies(analyses, fn);
+	changed += optimize_jumps(analyses, fn);
+	changed += layout_blocks(analyses, fn, 0, 0);
+	return changed;
+}
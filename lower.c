@@ -0,0 +1,3989 @@
+/*
+	Lowering of the intermediate representation to x86-64 machine code.
+
+	Follows the System V AMD64 calling convention so lowered functions
+	can call and be called by native C code directly.
+*/
+
+#define X86_ENCODER_NO_MAIN
+#include "ir.c"
+#include "encoder.c"
+#include <cpuid.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+
+/*
+	Calling convention
+
+	Integer and pointer values are passed in RDI, RSI, RDX, RCX, R8 and
+	R9, floating point values in XMM0 to XMM7. Structures up to 16 bytes
+	are passed in one or two general purpose registers when enough of
+	them are left, larger ones and everything that did not fit into
+	registers are passed on the stack in 8 byte words. The stack pointer
+	is aligned to 16 bytes at every call.
+
+	Integer values are returned in RAX, floating point values in XMM0 and
+	structures up to 16 bytes in RAX and RDX. Larger structures are
+	written to memory provided by the caller, whose address is passed as
+	a hidden first argument in RDI and returned in RAX.
+
+	Structures are always classified as integer data: TypeInfo does not
+	describe their members.
+*/
+
+#define LOWER_INTEGER_REGISTERS (6)
+#define LOWER_FLOAT_REGISTERS (8)
+
+static const char lower_argument_registers[LOWER_INTEGER_REGISTERS] = {
+	X86_REG_DI, X86_REG_SI, X86_REG_D, X86_REG_C, X86_REG_R8, X86_REG_R9
+};
+
+#define LOWER_CLASS_INTEGER (0)
+#define LOWER_CLASS_FLOAT (1)
+#define LOWER_CLASS_MEMORY (2)
+
+int lower_type_class(struct TypeInfo* type_info)
+{
+	if (ir_type_is_float(type_info->type))
+		return LOWER_CLASS_FLOAT;
+	if (type_info->type == IR_TYPE_STRUCT && type_info->struct_size > 16)
+		return LOWER_CLASS_MEMORY;
+	return LOWER_CLASS_INTEGER;
+}
+
+// Amount of 8 byte words a value occupies when passed
+int lower_type_words(struct TypeInfo* type_info)
+{
+	if (type_info->type == IR_TYPE_STRUCT)
+		return (type_info->struct_size + 7) / 8;
+	return 1;
+}
+
+int lower_returns_in_memory(struct TypeInfo* type_info)
+{
+	return lower_type_class(type_info) == LOWER_CLASS_MEMORY;
+}
+
+// Location of a passed value
+struct LowerPlace
+{
+	int in_memory; //Passed on the stack
+	int registers[2]; //General purpose or XMM registers
+	int registers_size;
+	int stack_offset; //Offset in the stack argument area
+};
+
+// Places values passed in the given order. Returns the size of the stack
+// argument area
+int lower_place_values(struct TypeInfo* types, size_t count, int hidden_pointer, struct LowerPlace* places)
+{
+	int next_integer = hidden_pointer ? 1 : 0;
+	int next_float = 0;
+	int stack = 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		struct LowerPlace* place = &places[i];
+		int words = lower_type_words(&types[i]);
+		memset(place, 0, sizeof *place);
+
+		switch (lower_type_class(&types[i])) {
+			case LOWER_CLASS_FLOAT:
+				if (next_float < LOWER_FLOAT_REGISTERS) {
+					place->registers[place->registers_size++] = next_float++;
+					continue;
+				}
+				break;
+			case LOWER_CLASS_INTEGER:
+				if (next_integer + words <= LOWER_INTEGER_REGISTERS) {
+					for (int w = 0; w < words; ++w)
+						place->registers[place->registers_size++] = lower_argument_registers[next_integer++];
+					continue;
+				}
+				break;
+		}
+		place->in_memory = 1;
+		place->stack_offset = stack;
+		stack += words * 8;
+	}
+	return stack;
+}
+
+
+/*
+	Register allocation
+
+	Linear scan over the interval lifetimes of the function analysis.
+	Only integer variables and arguments whose address is never taken
+	live in registers, everything else is kept in the stack frame.
+
+	RAX, RCX, RDX and R11 are scratch registers of the lowering and
+	never allocated. Variables live across a call only get callee saved
+	registers. RDI, RSI, R8 and R9 are allocated to intervals that do not
+	cross a call, an argument arriving in one of them prefers to stay
+	there. Incoming and outgoing arguments are then shuffled in place
+	with parallel moves. Values a call reads through a register, pointers
+	it dereferences and the callee itself, never get argument registers.
+	When no register is free, the interval ending last is spilled. With a
+	profile the interval whose uses ran the least often is spilled
+	instead.
+*/
+
+static const char lower_callee_saved_registers[] = {
+	X86_REG_B, X86_REG_R12, X86_REG_R13, X86_REG_R14, X86_REG_R15
+};
+
+static const char lower_caller_saved_registers[] = {
+	X86_REG_R10, X86_REG_R9, X86_REG_R8, X86_REG_SI, X86_REG_DI
+};
+
+#define LOWER_HOME_NONE (0)
+#define LOWER_HOME_REGISTER (1)
+#define LOWER_HOME_FRAME (2)
+
+struct LowerHome
+{
+	int kind;
+	char reg;
+	int offset; //Offset from the stack pointer after the prologue
+};
+
+struct LowerInterval
+{
+	int home; //Index in the homes, variables first and then arguments
+	int start;
+	int end;
+	int crosses_call;
+	int preferred; //Register the argument arrives in, -1 if none
+	int no_argument_registers;
+	uint64_t weight; //Executions of the opcodes using the value, with a profile
+};
+
+int lower_interval_compare(const void* x, const void* y)
+{
+	const struct LowerInterval* a = x;
+	const struct LowerInterval* b = y;
+	if (a->start != b->start)
+		return a->start - b->start;
+	return a->home - b->home;
+}
+
+int lower_register_is_callee_saved(char reg)
+{
+	for (size_t i = 0; i < sizeof lower_callee_saved_registers; ++i) {
+		if (lower_callee_saved_registers[i] == reg)
+			return 1;
+	}
+	return 0;
+}
+
+int lower_register_is_argument(char reg)
+{
+	for (size_t i = 0; i < sizeof lower_argument_registers; ++i) {
+		if (lower_argument_registers[i] == reg)
+			return 1;
+	}
+	return 0;
+}
+
+// Whether the register may hold the interval
+int lower_register_fits(struct LowerInterval* interval, char reg)
+{
+	if (interval->crosses_call && !lower_register_is_callee_saved(reg))
+		return 0;
+	if (interval->no_argument_registers && lower_register_is_argument(reg))
+		return 0;
+	return 1;
+}
+
+// Assigns registers to the intervals. Homes of spilled intervals are
+// left as they are. "weighted" spills by the interval weights
+void lower_linear_scan(struct LowerInterval* intervals, size_t count, struct LowerHome* homes, int weighted)
+{
+	int* active = malloc((count + 1) * sizeof *active);
+	size_t active_size = 0;
+	char used[16];
+	memset(used, 0, sizeof used);
+
+	//Registers some interval prefers are handed out last to the others
+	char preferred[16];
+	memset(preferred, 0, sizeof preferred);
+	for (size_t i = 0; i < count; ++i) {
+		if (intervals[i].preferred >= 0)
+			preferred[intervals[i].preferred] = 1;
+	}
+
+	if (count)
+		qsort(intervals, count, sizeof *intervals, lower_interval_compare);
+
+	for (size_t i = 0; i < count; ++i) {
+		struct LowerInterval* current = &intervals[i];
+
+		//Expire the intervals ending before this one
+		size_t kept = 0;
+		for (size_t k = 0; k < active_size; ++k) {
+			struct LowerInterval* other = &intervals[active[k]];
+			if (other->end <= current->start)
+				used[(int)homes[other->home].reg] = 0;
+			else
+				active[kept++] = active[k];
+		}
+		active_size = kept;
+
+		//The preferred register first, then one nobody prefers, then any
+		int reg = -1;
+		for (int pass = 0; pass < 3 && reg < 0; ++pass) {
+			for (size_t r = 0; r < sizeof lower_caller_saved_registers && reg < 0; ++r) {
+				char candidate = lower_caller_saved_registers[r];
+				if (pass == 0 && candidate != current->preferred)
+					continue;
+				if (pass == 1 && preferred[(int)candidate])
+					continue;
+				if (!used[(int)candidate] && lower_register_fits(current, candidate))
+					reg = candidate;
+			}
+		}
+		for (size_t r = 0; r < sizeof lower_callee_saved_registers && reg < 0; ++r) {
+			if (!used[(int)lower_callee_saved_registers[r]])
+				reg = lower_callee_saved_registers[r];
+		}
+
+		if (reg < 0) {
+			//Spill the interval ending last, or used least, among those
+			//whose register fits
+			int victim = -1;
+			for (size_t k = 0; k < active_size; ++k) {
+				struct LowerInterval* other = &intervals[active[k]];
+				if (!lower_register_fits(current, homes[other->home].reg))
+					continue;
+				if (victim < 0 || (weighted ? other->weight < intervals[active[victim]].weight : other->end > intervals[active[victim]].end))
+					victim = k;
+			}
+			if (victim < 0)
+				continue;
+			if (weighted ? intervals[active[victim]].weight >= current->weight : intervals[active[victim]].end <= current->end)
+				continue;
+			struct LowerHome* spilled = &homes[intervals[active[victim]].home];
+			reg = spilled->reg;
+			spilled->kind = LOWER_HOME_NONE;
+			active[victim] = active[--active_size];
+		}
+
+		used[reg] = 1;
+		homes[current->home].kind = LOWER_HOME_REGISTER;
+		homes[current->home].reg = reg;
+		active[active_size++] = i;
+	}
+
+	free(active);
+}
+
+
+/*
+	Lowering state
+*/
+
+struct LowerEnvironment
+{
+	void** functions; //Native address of every function id, null if unknown
+	size_t functions_size;
+	struct Profile* profile; //Execution counts to optimize for, null if none
+	struct Profile* instrument; //Profile the lowered code counts into, null to not count
+	int late_binding; //Calls read the address from "functions" when made, so it may still change
+	size_t* labels; //Encoder label of every function id placed in the same code, LOWER_NO_LABEL for others. Null if none
+	struct AnalysisManager* analyses; //Analyses left by the optimization passes, null to analyse anew
+	struct x86_peephole_stats* peephole; //Adds up what the peephole pass saved, null if not counted
+};
+
+#define LOWER_NO_LABEL ((size_t)-1)
+
+struct LowerJumpTable
+{
+	size_t label; //Start of the table
+	size_t* targets; //Label of every entry
+	size_t size;
+};
+
+struct Lowering
+{
+	struct x86_encoder* enc;
+	struct Function* function;
+	struct LowerEnvironment* env;
+	struct FunctionAnalysis* analysis;
+	struct FrameLayout layout;
+
+	struct LowerHome* homes; //Variables followed by the arguments
+	struct LowerPlace* places; //Incoming argument locations
+	size_t* labels; //Label of every opcode, the last one is the epilogue
+
+	char saved[sizeof lower_callee_saved_registers];
+	int saved_size;
+	int frame_size; //Bytes allocated below the saved registers
+	int sret_offset; //Frame offset of the hidden structure return pointer, -1 if none
+	unsigned features; //LOWER_FEATURE_* of the CPU
+
+	struct Opcode** arguments; //Pending SET_ARGUMENT opcodes by argument index
+	size_t arguments_size;
+	size_t arguments_capacity;
+
+	struct FunctionProfile* counters; //Counters of the instrumented function, null if not instrumented
+	int* references; //Operands naming every variable, null in baseline code
+
+	struct LowerJumpTable* tables; //Jump tables written after the code
+	size_t tables_size;
+	size_t tables_capacity;
+};
+
+struct LowerHome* lower_operand_home(struct Lowering* l, struct Operand* operand)
+{
+	if (operand->info_type == OPERAND_INFO_TYPE_VARIABLE)
+		return &l->homes[operand->ref_id];
+	if (operand->info_type == OPERAND_INFO_TYPE_ARGUMENT)
+		return &l->homes[l->function->variables_size + operand->ref_id];
+	return 0;
+}
+
+// Declared type of the variable or argument named by the operand
+struct TypeInfo* lower_operand_declared_type(struct Lowering* l, struct Operand* operand)
+{
+	if (operand->info_type == OPERAND_INFO_TYPE_VARIABLE)
+		return &l->function->variables[operand->ref_id].type_info;
+	if (operand->info_type == OPERAND_INFO_TYPE_ARGUMENT)
+		return &l->function->arguments[operand->ref_id];
+	return &operand->type_info;
+}
+
+// Type of the value an operand reads or writes
+int lower_operand_value_type(struct Lowering* l, struct Operand* operand)
+{
+	if (operand->info_type == OPERAND_INFO_TYPE_IMMEDIATE || (operand->info_flags & OPERAND_FLAG_DEREFERENCE))
+		return operand->type_info.type;
+	return lower_operand_declared_type(l, operand)->type;
+}
+
+int lower_is_register_candidate(struct TypeInfo* type_info)
+{
+	return lower_type_class(type_info) == LOWER_CLASS_INTEGER && type_info->type != IR_TYPE_STRUCT;
+}
+
+
+/*
+	Value movement helpers
+
+	Integer values in registers are kept extended to 64 bits according to
+	their type, zero extended for unsigned and sign extended for signed
+	types. Memory holds them at their natural width.
+*/
+
+// Extends the low part of a register in place to the canonical form of the type
+void lower_normalize(struct Lowering* l, char reg, int type)
+{
+	switch (type) {
+		case IR_TYPE_U32:
+			x86_encoder_write_modrm_32(l->enc, X86_MOV_MODRM, reg, reg);
+			break;
+		case IR_TYPE_I32:
+			x86_encoder_write_modrm_generic(l->enc, 0, 0, X86_MOVSXD_MODRM, 0, reg, 0, reg, 1);
+			break;
+		case IR_TYPE_U16:
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVZX_16, 0, reg, 0, reg, 0);
+			break;
+		case IR_TYPE_I16:
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVSX_16, 0, reg, 0, reg, 1);
+			break;
+		case IR_TYPE_U8:
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVZX_8, 0, reg, 0, reg, 0);
+			break;
+		case IR_TYPE_I8:
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVSX_8, 0, reg, 0, reg, 1);
+			break;
+	}
+}
+
+// Loads an integer of the type from [base + disp], extended to 64 bits
+void lower_load_memory(struct Lowering* l, char reg, char base, int32_t disp, int type)
+{
+	switch (type) {
+		case IR_TYPE_U32:
+			x86_encoder_write_modrm_generic(l->enc, 0, 0, X86_MOV_LOAD_MODRM, 1, base, disp, reg, 0);
+			break;
+		case IR_TYPE_I32:
+			x86_encoder_write_modrm_generic(l->enc, 0, 0, X86_MOVSXD_MODRM, 1, base, disp, reg, 1);
+			break;
+		case IR_TYPE_U16:
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVZX_16, 1, base, disp, reg, 0);
+			break;
+		case IR_TYPE_I16:
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVSX_16, 1, base, disp, reg, 1);
+			break;
+		case IR_TYPE_U8:
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVZX_8, 1, base, disp, reg, 0);
+			break;
+		case IR_TYPE_I8:
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVSX_8, 1, base, disp, reg, 1);
+			break;
+		default:
+			x86_encoder_write_load(l->enc, reg, base, disp);
+	}
+}
+
+// Stores the low "size" bytes of a register, size being 1, 2, 4 or 8
+void lower_store_memory(struct Lowering* l, char base, int32_t disp, char reg, int size)
+{
+	switch (size) {
+		case 1:
+			x86_encoder_write_modrm_generic(l->enc, 0, 0, X86_MOV_MODRM - 1, 1, base, disp, reg, 0);
+			break;
+		case 2:
+			x86_encoder_write_modrm_generic(l->enc, X86_OPERAND_SIZE_OVERRIDE, 0, X86_MOV_MODRM, 1, base, disp, reg, 0);
+			break;
+		case 4:
+			x86_encoder_write_modrm_generic(l->enc, 0, 0, X86_MOV_MODRM, 1, base, disp, reg, 0);
+			break;
+		default:
+			x86_encoder_write_store(l->enc, base, disp, reg);
+	}
+}
+
+int lower_type_store_size(int type)
+{
+	int bits = ir_type_bits(type);
+	return bits ? bits / 8 : 8;
+}
+
+// Loads "size" bytes, 1 to 8, zero extended. Sizes that are not a power
+// of two are assembled from smaller loads through R11
+void lower_load_partial(struct Lowering* l, char reg, char base, int32_t disp, int size)
+{
+	static const int types[] = { IR_TYPE_U8, IR_TYPE_U16, IR_TYPE_U32, IR_TYPE_U64 };
+	int loaded = 0;
+	for (int piece = 8, t = 3; piece > 0; piece /= 2, --t) {
+		if (size - loaded < piece)
+			continue;
+		if (!loaded) {
+			lower_load_memory(l, reg, base, disp, types[t]);
+		} else {
+			lower_load_memory(l, X86_REG_R11, base, disp + loaded, types[t]);
+			x86_encoder_write_shift_imm(l->enc, X86_SHIFT_MODRM_SHL, X86_REG_R11, loaded * 8);
+			x86_encoder_write_modrm(l->enc, X86_OR_MODRM, reg, X86_REG_R11);
+		}
+		loaded += piece;
+	}
+}
+
+// Stores the low "size" bytes, 1 to 8, of a register. The register is
+// shifted in the process
+void lower_store_partial(struct Lowering* l, char base, int32_t disp, char reg, int size)
+{
+	int stored = 0;
+	for (int piece = 8; piece > 0; piece /= 2) {
+		if (size - stored < piece)
+			continue;
+		lower_store_memory(l, base, disp + stored, reg, piece);
+		stored += piece;
+		if (stored < size)
+			x86_encoder_write_shift_imm(l->enc, X86_SHIFT_MODRM_SHR, reg, piece * 8);
+	}
+}
+
+/*
+	Aggregate copies
+
+	Structure copies and zero fills are lowered by size class, never by
+	calling memcpy. Up to 16 bytes go through RAX, the last piece
+	overlapping the previous one instead of being split further. Up to
+	LOWER_VECTOR_COPY_LIMIT bytes go through XMM0, or YMM0 when AVX is
+	available, the last vector overlapping in the same way. Larger copies
+	use REP MOVSB on CPUs with fast short string operations (ERMSB) and
+	REP MOVSQ otherwise.
+
+	Overlapping pieces rely on the source and destination not
+	overlapping, which holds for distinct IR values. Memory operands are
+	based on RSP, RCX or RDX, never on RSI or RDI.
+*/
+
+#define LOWER_FEATURE_AVX (1 << 0)
+#define LOWER_FEATURE_ERMSB (1 << 1)
+#define LOWER_FEATURE_AVX2 (1 << 2)
+
+#define LOWER_VECTOR_COPY_LIMIT (256)
+
+// Features of the CPU the lowered code runs on
+unsigned lower_cpu_features(void)
+{
+	unsigned features = 0;
+	unsigned a, b, c, d;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		features |= LOWER_FEATURE_AVX;
+	if (__builtin_cpu_supports("avx2"))
+		features |= LOWER_FEATURE_AVX2;
+	if (__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1 << 9)))
+		features |= LOWER_FEATURE_ERMSB;
+	return features;
+}
+
+void lower_copy_scalar(struct Lowering* l, char dst, int32_t dst_disp, char src, int32_t src_disp, int size)
+{
+	static const int types[] = { IR_TYPE_U8, IR_TYPE_U16, IR_TYPE_U32, IR_TYPE_U64 };
+	int piece = 8, t = 3;
+	while (piece > size) {
+		piece /= 2;
+		t -= 1;
+	}
+
+	if (src < 0)
+		x86_encoder_write_modrm_32(l->enc, X86_XOR_MODRM, X86_REG_A, X86_REG_A);
+	for (int offset = 0; offset < size; offset += piece) {
+		if (offset + piece > size)
+			offset = size - piece;
+		if (src >= 0)
+			lower_load_memory(l, X86_REG_A, src, src_disp + offset, types[t]);
+		lower_store_memory(l, dst, dst_disp + offset, X86_REG_A, piece);
+	}
+}
+
+void lower_copy_vector(struct Lowering* l, char dst, int32_t dst_disp, char src, int32_t src_disp, int size)
+{
+	int avx = (l->features & LOWER_FEATURE_AVX) && size > 32;
+	int width = avx ? 32 : 16;
+
+	if (src < 0) {
+		if (avx)
+			x86_encoder_write_vex_modrm(l->enc, 0, X86_VEX_MAP_0F, 0, 1, X86_0F_XORPS, 0, 0, 0, 0, 0);
+		else
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_XORPS, 0, 0, 0, 0, 0);
+	}
+	for (int offset = 0; offset < size; offset += width) {
+		if (offset + width > size)
+			offset = size - width;
+		if (avx) {
+			if (src >= 0)
+				x86_encoder_write_vex_modrm(l->enc, 0, X86_VEX_MAP_0F, 0, 1, X86_0F_MOVUPS_LOAD, 1, src, src_disp + offset, 0, 0);
+			x86_encoder_write_vex_modrm(l->enc, 0, X86_VEX_MAP_0F, 0, 1, X86_0F_MOVUPS_STORE, 1, dst, dst_disp + offset, 0, 0);
+		} else {
+			if (src >= 0)
+				x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVUPS_LOAD, 1, src, src_disp + offset, 0, 0);
+			x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVUPS_STORE, 1, dst, dst_disp + offset, 0, 0);
+		}
+	}
+	if (avx)
+		x86_encoder_write_vzeroupper(l->enc);
+}
+
+// REP MOVS or STOS. RDI and RSI may hold homes, they are kept in R11
+// and RAX meanwhile
+void lower_copy_string(struct Lowering* l, char dst, int32_t dst_disp, char src, int32_t src_disp, int size)
+{
+	struct x86_encoder* enc = l->enc;
+	int bytes = (l->features & LOWER_FEATURE_ERMSB) != 0;
+	int tail = bytes ? 0 : size % 8;
+
+	x86_encoder_write_modrm(enc, X86_MOV_MODRM, X86_REG_R11, X86_REG_DI);
+	if (src >= 0) {
+		x86_encoder_write_modrm(enc, X86_MOV_MODRM, X86_REG_A, X86_REG_SI);
+		x86_encoder_write_lea(enc, X86_REG_SI, src, src_disp);
+	}
+	x86_encoder_write_lea(enc, X86_REG_DI, dst, dst_disp);
+	x86_encoder_write_mov_imm(enc, X86_REG_C, bytes ? size : size / 8);
+
+	if (src >= 0) {
+		x86_encoder_write_rep(enc, bytes ? X86_MOVSB : X86_MOVSQ, !bytes);
+		//The last, partially copied word again as a whole
+		if (tail) {
+			x86_encoder_write_load(enc, X86_REG_C, X86_REG_SI, tail - 8);
+			x86_encoder_write_store(enc, X86_REG_DI, tail - 8, X86_REG_C);
+		}
+		x86_encoder_write_modrm(enc, X86_MOV_MODRM, X86_REG_SI, X86_REG_A);
+	} else {
+		x86_encoder_write_modrm_32(enc, X86_XOR_MODRM, X86_REG_A, X86_REG_A);
+		x86_encoder_write_rep(enc, bytes ? X86_STOSB : X86_STOSQ, !bytes);
+		if (tail)
+			x86_encoder_write_store(enc, X86_REG_DI, tail - 8, X86_REG_A);
+	}
+	x86_encoder_write_modrm(enc, X86_MOV_MODRM, X86_REG_DI, X86_REG_R11);
+}
+
+// Copies "size" bytes from [src + src_disp] to [dst + dst_disp], or zeroes
+// them when "src" is negative. Clobbers RAX, RCX, R11 and XMM0
+void lower_copy_memory(struct Lowering* l, char dst, int32_t dst_disp, char src, int32_t src_disp, int size)
+{
+	if (size <= 0)
+		return;
+	if (size <= 16)
+		lower_copy_scalar(l, dst, dst_disp, src, src_disp, size);
+	else if (size <= LOWER_VECTOR_COPY_LIMIT)
+		lower_copy_vector(l, dst, dst_disp, src, src_disp, size);
+	else
+		lower_copy_string(l, dst, dst_disp, src, src_disp, size);
+}
+
+// Memory location of a variable, argument or dereferenced pointer.
+// Dereferenced pointers are loaded to "scratch". Returns -1 for operands
+// without memory
+int lower_operand_memory(struct Lowering* l, struct Operand* operand, char scratch, char* base, int32_t* disp)
+{
+	struct LowerHome* home = lower_operand_home(l, operand);
+	if (!home)
+		return -1;
+	if (operand->info_flags & OPERAND_FLAG_DEREFERENCE) {
+		if (home->kind == LOWER_HOME_REGISTER)
+			x86_encoder_write_modrm(l->enc, X86_MOV_MODRM, scratch, home->reg);
+		else if (home->kind == LOWER_HOME_FRAME)
+			x86_encoder_write_load(l->enc, scratch, X86_REG_SP, home->offset);
+		else
+			return -1;
+		*base = scratch;
+		*disp = 0;
+		return 0;
+	}
+	if (home->kind != LOWER_HOME_FRAME)
+		return -1;
+	*base = X86_REG_SP;
+	*disp = home->offset;
+	return 0;
+}
+
+// Loads the integer value of an operand to "reg", extended to 64 bits.
+// Encoder label of the function referenced by the operand, LOWER_NO_LABEL
+// if it is not lowered into the same code
+size_t lower_function_label(struct Lowering* l, struct Operand* operand)
+{
+	int id = operand->ref_id;
+	if (operand->info_type != OPERAND_INFO_TYPE_FUNCTION || !l->env->labels || id < 0 || (size_t)id >= l->env->functions_size)
+		return LOWER_NO_LABEL;
+	return l->env->labels[id];
+}
+
+// No other register is modified. Returns -1 if unsupported
+int lower_load_integer(struct Lowering* l, char reg, struct Operand* operand)
+{
+	if (operand->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+		if (ir_type_is_signed(operand->type_info.type))
+			x86_encoder_write_mov_imm(l->enc, reg, operand_immediate_signed(operand));
+		else
+			x86_encoder_write_mov_imm(l->enc, reg, operand_immediate_unsigned(operand));
+		return 0;
+	}
+	if (operand->info_type == OPERAND_INFO_TYPE_FUNCTION) {
+		int id = operand->ref_id;
+		if (id < 0 || (size_t)id >= l->env->functions_size)
+			return -1;
+		size_t label = lower_function_label(l, operand);
+		if (label != LOWER_NO_LABEL) {
+			x86_encoder_write_lea_label(l->enc, reg, label);
+			return 0;
+		}
+		if (l->env->late_binding) {
+			x86_encoder_write_mov_imm_64(l->enc, reg, (uint64_t)(uintptr_t)&l->env->functions[id]);
+			x86_encoder_write_load(l->enc, reg, reg, 0);
+			return 0;
+		}
+		if (!l->env->functions[id])
+			return -1;
+		x86_encoder_write_mov_imm_64(l->enc, reg, (uint64_t)(uintptr_t)l->env->functions[id]);
+		return 0;
+	}
+
+	struct LowerHome* home = lower_operand_home(l, operand);
+	if (!home || home->kind == LOWER_HOME_NONE) {
+		//Values that are never defined are undefined
+		return home ? 0 : -1;
+	}
+	if (operand->info_flags & OPERAND_FLAG_ADDRESS) {
+		if (home->kind != LOWER_HOME_FRAME)
+			return -1;
+		x86_encoder_write_lea(l->enc, reg, X86_REG_SP, home->offset);
+		return 0;
+	}
+
+	char base;
+	int32_t disp;
+	if (operand->info_flags & OPERAND_FLAG_DEREFERENCE) {
+		lower_operand_memory(l, operand, reg, &base, &disp);
+		lower_load_memory(l, reg, base, disp, operand->type_info.type);
+		return 0;
+	}
+	if (home->kind == LOWER_HOME_REGISTER) {
+		if (home->reg != reg)
+			x86_encoder_write_modrm(l->enc, X86_MOV_MODRM, reg, home->reg);
+		return 0;
+	}
+	lower_load_memory(l, reg, X86_REG_SP, home->offset, lower_operand_declared_type(l, operand)->type);
+	return 0;
+}
+
+// Stores an integer value to the target operand. Dereferenced targets
+// load their pointer to "scratch". Returns -1 if unsupported
+int lower_store_integer(struct Lowering* l, char reg, struct Operand* target, char scratch)
+{
+	struct LowerHome* home = lower_operand_home(l, target);
+	if (!home || (target->info_flags & OPERAND_FLAG_ADDRESS))
+		return -1;
+	if (home->kind == LOWER_HOME_NONE)
+		return 0;
+
+	if (target->info_flags & OPERAND_FLAG_DEREFERENCE) {
+		char base;
+		int32_t disp;
+		lower_operand_memory(l, target, scratch, &base, &disp);
+		lower_store_memory(l, base, disp, reg, lower_type_store_size(target->type_info.type));
+		return 0;
+	}
+
+	int type = lower_operand_declared_type(l, target)->type;
+	if (home->kind == LOWER_HOME_REGISTER) {
+		if (home->reg != reg)
+			x86_encoder_write_modrm(l->enc, X86_MOV_MODRM, home->reg, reg);
+		lower_normalize(l, home->reg, type);
+		return 0;
+	}
+	lower_store_memory(l, X86_REG_SP, home->offset, reg, lower_type_store_size(type));
+	return 0;
+}
+
+unsigned char lower_sse_prefix(int type)
+{
+	return type == IR_TYPE_F32 ? X86_PREFIX_SS : X86_PREFIX_SD;
+}
+
+// Loads the value of an operand to an XMM register as the floating point
+// type "type", converting integers and the other precision. Uses R11 as
+// scratch. Returns -1 if unsupported
+int lower_load_float(struct Lowering* l, char xmm, struct Operand* operand, int type)
+{
+	int operand_type = lower_operand_value_type(l, operand);
+
+	if (!ir_type_is_float(operand_type)) {
+		if (lower_load_integer(l, X86_REG_R11, operand))
+			return -1;
+		x86_encoder_write_modrm_generic(l->enc, lower_sse_prefix(type), 1, X86_0F_SSE_FROM_INT, 0, X86_REG_R11, 0, xmm, 1);
+		return 0;
+	}
+
+	if (operand->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+		uint64_t bits = operand_type == IR_TYPE_F32 ? operand->value_u32 : operand->value_u64;
+		x86_encoder_write_mov_imm(l->enc, X86_REG_R11, bits);
+		x86_encoder_write_modrm_generic(l->enc, X86_OPERAND_SIZE_OVERRIDE, 1, X86_0F_MOVD_TO_XMM, 0, X86_REG_R11, 0, xmm,
+			operand_type == IR_TYPE_F64);
+	} else {
+		char base;
+		int32_t disp;
+		if (lower_operand_memory(l, operand, X86_REG_R11, &base, &disp)) {
+			struct LowerHome* home = lower_operand_home(l, operand);
+			return home && home->kind == LOWER_HOME_NONE ? 0 : -1;
+		}
+		x86_encoder_write_modrm_generic(l->enc, lower_sse_prefix(operand_type), 1, X86_0F_SSE_LOAD, 1, base, disp, xmm, 0);
+	}
+
+	if (operand_type != type)
+		x86_encoder_write_modrm_generic(l->enc, lower_sse_prefix(operand_type), 1, X86_0F_SSE_CONVERT, 0, xmm, 0, xmm, 0);
+	return 0;
+}
+
+// Stores an XMM register holding a value of the type of the target.
+// Uses R11 as scratch. Returns -1 if unsupported
+int lower_store_float(struct Lowering* l, char xmm, struct Operand* target)
+{
+	struct LowerHome* home = lower_operand_home(l, target);
+	if (home && home->kind == LOWER_HOME_NONE)
+		return 0;
+	char base;
+	int32_t disp;
+	if (lower_operand_memory(l, target, X86_REG_R11, &base, &disp))
+		return -1;
+	x86_encoder_write_modrm_generic(l->enc, lower_sse_prefix(lower_operand_value_type(l, target)), 1, X86_0F_SSE_STORE, 1, base, disp, xmm, 0);
+	return 0;
+}
+
+
+/*
+	Frame and homes
+
+	From the stack pointer upwards the frame holds the outgoing stack
+	arguments of calls, the slots of the frame layout, the slots of the
+	arguments that need memory and the hidden structure return pointer,
+	followed by the saved callee saved registers and the return address.
+	Arguments passed on the stack stay where the caller put them.
+*/
+
+// Size of the stack argument area of the calls of the function
+int lower_outgoing_size(struct Function* fn)
+{
+	struct TypeInfo* types = malloc((fn->opcodes_size + 1) * sizeof *types);
+	struct LowerPlace* places = malloc((fn->opcodes_size + 1) * sizeof *places);
+	int count = 0;
+	int outgoing = 0;
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		if (op->type == OPCODE_SET_ARGUMENT) {
+			int index = op->operands[OPERAND_TARGET].ref_id;
+			if (index >= 0 && (size_t)index < fn->opcodes_size) {
+				while (count <= index)
+					memset(&types[count++], 0, sizeof *types);
+				types[index] = op->operands[OPERAND_PRIMARY_1].type_info;
+			}
+		} else if (op->type == OPCODE_CALL || op->type == OPCODE_TAIL_CALL) {
+			int hidden = lower_returns_in_memory(&op->operands[OPERAND_TARGET].type_info);
+			int stack = lower_place_values(types, count, hidden, places);
+			if (stack > outgoing)
+				outgoing = stack;
+			count = 0;
+		}
+	}
+
+	free(places);
+	free(types);
+	return outgoing;
+}
+
+// Calls before every opcode, for finding lifetimes spanning calls
+int* lower_call_counts(struct Function* fn)
+{
+	int* counts = malloc((fn->opcodes_size + 1) * sizeof *counts);
+	counts[0] = 0;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		int type = fn->opcodes[i].type;
+		counts[i + 1] = counts[i] + (type == OPCODE_CALL || type == OPCODE_TAIL_CALL);
+	}
+	return counts;
+}
+
+// Lifetimes of the arguments. Arguments are defined at the function entry
+void lower_argument_lifetimes(struct Lowering* l, struct VariableInfo* infos)
+{
+	struct Function* fn = l->function;
+	for (size_t i = 0; i < fn->arguments_size; ++i) {
+		infos[i].lifetime_start = 0;
+		infos[i].lifetime_end = 1;
+		infos[i].flags = 0;
+	}
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &op->operands[o];
+			if (opcode_is_jump(op) && o == OPERAND_TARGET)
+				continue;
+			if (operand->info_type != OPERAND_INFO_TYPE_ARGUMENT || (size_t)operand->ref_id >= fn->arguments_size)
+				continue;
+			if (operand->info_flags & OPERAND_FLAG_ADDRESS)
+				infos[operand->ref_id].flags |= VARIABLE_INFO_ETERNAL;
+			else
+				extend_variable_lifetime(l->analysis, &infos[operand->ref_id], i, 0);
+		}
+	}
+}
+
+// Index of the call the SET_ARGUMENT at "index" belongs to, -1 if none
+int lower_argument_call(struct Function* fn, size_t index)
+{
+	for (size_t i = index + 1; i < fn->opcodes_size; ++i) {
+		int type = fn->opcodes[i].type;
+		if (type == OPCODE_CALL || type == OPCODE_TAIL_CALL)
+			return i;
+	}
+	return -1;
+}
+
+// Arguments are read by their call rather than by SET_ARGUMENT, so their
+// values have to live until the call. Also marks the homes a call reads
+// through a register other than as a plain argument value
+void lower_call_reads(struct Lowering* l, struct VariableInfo* argument_infos, char* pinned)
+{
+	struct Function* fn = l->function;
+	size_t variables = fn->variables_size;
+
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		struct Operand* value = &op->operands[OPERAND_PRIMARY_1];
+		int is_variable = value->info_type == OPERAND_INFO_TYPE_VARIABLE && (size_t)value->ref_id < variables;
+		int is_argument = value->info_type == OPERAND_INFO_TYPE_ARGUMENT && (size_t)value->ref_id < fn->arguments_size;
+		size_t home = is_variable ? (size_t)value->ref_id : variables + value->ref_id;
+
+		if (op->type == OPCODE_SET_ARGUMENT) {
+			int call = lower_argument_call(fn, i);
+			if (!(is_variable || is_argument) || call < 0)
+				continue;
+			if (value->info_flags & OPERAND_FLAG_DEREFERENCE)
+				pinned[home] = 1;
+			if (is_variable)
+				extend_variable_lifetime(l->analysis, &l->analysis->variables[value->ref_id], call, 0);
+			else
+				extend_variable_lifetime(l->analysis, &argument_infos[value->ref_id], call, 0);
+		} else if (op->type == OPCODE_CALL || op->type == OPCODE_TAIL_CALL) {
+			if (is_variable || is_argument)
+				pinned[home] = 1;
+			struct Operand* target = &op->operands[OPERAND_TARGET];
+			if ((target->info_flags & OPERAND_FLAG_DEREFERENCE) && target->info_type == OPERAND_INFO_TYPE_VARIABLE)
+				pinned[target->ref_id] = 1;
+			else if ((target->info_flags & OPERAND_FLAG_DEREFERENCE) && target->info_type == OPERAND_INFO_TYPE_ARGUMENT)
+				pinned[variables + target->ref_id] = 1;
+		}
+	}
+}
+
+// Decides where every variable and argument lives and sizes the frame
+// Sizes the frame for "area" bytes of homes below the saved registers
+// and places the arguments passed on the stack
+void lower_finish_frame(struct Lowering* l, int area)
+{
+	struct Function* fn = l->function;
+
+	//The stack is 16 byte aligned before the return address was pushed
+	l->frame_size = (area + 15) & ~15;
+	if ((8 + 8 * l->saved_size + l->frame_size) % 16)
+		l->frame_size += 8;
+
+	//Arguments on the stack stay in place unless they got a register
+	for (size_t i = 0; i < fn->arguments_size; ++i) {
+		struct LowerHome* home = &l->homes[fn->variables_size + i];
+		if (l->places[i].in_memory && home->kind != LOWER_HOME_REGISTER) {
+			home->kind = LOWER_HOME_FRAME;
+			home->offset = l->frame_size + 8 * l->saved_size + 8 + l->places[i].stack_offset;
+		}
+	}
+}
+
+void lower_assign_homes(struct Lowering* l)
+{
+	struct Function* fn = l->function;
+	struct FunctionAnalysis* a = l->analysis;
+	size_t variables = fn->variables_size;
+	size_t count = variables + fn->arguments_size;
+
+	l->homes = calloc(count + 1, sizeof *l->homes);
+	struct VariableInfo* argument_infos = malloc((fn->arguments_size + 1) * sizeof *argument_infos);
+	lower_argument_lifetimes(l, argument_infos);
+	char* pinned = calloc(count + 1, 1);
+	lower_call_reads(l, argument_infos, pinned);
+
+	int hidden = lower_returns_in_memory(&fn->return_type);
+	l->places = malloc((fn->arguments_size + 1) * sizeof *l->places);
+	lower_place_values(fn->arguments, fn->arguments_size, hidden, l->places);
+
+	//Uses weighted by how often they ran when there is a profile
+	uint64_t* weights = calloc(count + 1, sizeof *weights);
+	uint64_t* counts = profile_opcode_counts(l->env->profile, l->env->analyses, fn);
+	for (size_t i = 0; counts && i < fn->opcodes_size; ++i) {
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &fn->opcodes[i].operands[o];
+			if (o == OPERAND_TARGET && opcode_is_jump(&fn->opcodes[i]))
+				continue;
+			if (operand->info_type == OPERAND_INFO_TYPE_VARIABLE || operand->info_type == OPERAND_INFO_TYPE_ARGUMENT)
+				weights[lower_operand_home(l, operand) - l->homes] += counts[i];
+		}
+	}
+
+	//Registers for the integer values
+	int* calls = lower_call_counts(fn);
+	struct LowerInterval* intervals = malloc((count + 1) * sizeof *intervals);
+	size_t intervals_size = 0;
+	for (size_t i = 0; i < count; ++i) {
+		struct VariableInfo* info = i < variables ? &a->variables[i] : &argument_infos[i - variables];
+		struct TypeInfo* type_info = i < variables ? &fn->variables[i].type_info : &fn->arguments[i - variables];
+		if (info->lifetime_start < 0 || (info->flags & VARIABLE_INFO_ETERNAL) || !lower_is_register_candidate(type_info))
+			continue;
+		struct LowerInterval* interval = &intervals[intervals_size++];
+		interval->home = i;
+		interval->start = info->lifetime_start;
+		interval->end = info->lifetime_end;
+		interval->crosses_call = interval->end - 1 > interval->start + 1
+			&& calls[interval->end - 1] - calls[interval->start + 1] > 0;
+		interval->no_argument_registers = pinned[i];
+		interval->weight = weights[i];
+		interval->preferred = -1;
+		if (i >= variables && !l->places[i - variables].in_memory)
+			interval->preferred = l->places[i - variables].registers[0];
+	}
+	lower_linear_scan(intervals, intervals_size, l->homes, counts != 0);
+	free(counts);
+	free(weights);
+
+	//Everything else that is used lives in the frame
+	char* spilled = calloc(variables + 1, 1);
+	for (size_t i = 0; i < variables; ++i)
+		spilled[i] = a->variables[i].lifetime_start >= 0 && l->homes[i].kind == LOWER_HOME_NONE;
+	int outgoing = lower_outgoing_size(fn);
+	layout_frame(a, spilled, &l->layout);
+	for (size_t i = 0; i < variables; ++i) {
+		int offset = frame_variable_offset(&l->layout, i);
+		if (offset >= 0) {
+			l->homes[i].kind = LOWER_HOME_FRAME;
+			l->homes[i].offset = outgoing + offset;
+		}
+	}
+
+	//Incoming arguments
+	int area = outgoing + l->layout.size;
+	for (size_t i = 0; i < fn->arguments_size; ++i) {
+		struct LowerHome* home = &l->homes[variables + i];
+		struct VariableInfo* info = &argument_infos[i];
+		int used = info->lifetime_start >= 0 || (info->flags & VARIABLE_INFO_ETERNAL);
+		if (!used || home->kind == LOWER_HOME_REGISTER || l->places[i].in_memory)
+			continue;
+		home->kind = LOWER_HOME_FRAME;
+		home->offset = area;
+		area += lower_type_words(&fn->arguments[i]) * 8;
+	}
+	l->sret_offset = -1;
+	if (hidden) {
+		l->sret_offset = area;
+		area += 8;
+	}
+
+	//Callee saved registers in use
+	l->saved_size = 0;
+	for (size_t r = 0; r < sizeof lower_callee_saved_registers; ++r) {
+		for (size_t i = 0; i < count; ++i) {
+			if (l->homes[i].kind == LOWER_HOME_REGISTER && l->homes[i].reg == lower_callee_saved_registers[r]) {
+				l->saved[l->saved_size++] = lower_callee_saved_registers[r];
+				break;
+			}
+		}
+	}
+
+	lower_finish_frame(l, area);
+
+	free(spilled);
+	free(pinned);
+	free(intervals);
+	free(calls);
+	free(argument_infos);
+}
+
+void lower_prologue(struct Lowering* l)
+{
+	struct Function* fn = l->function;
+	for (int i = 0; i < l->saved_size; ++i)
+		x86_encoder_write_push(l->enc, l->saved[i]);
+	if (l->frame_size)
+		x86_encoder_write_op_imm(l->enc, X86_OP_MODRM_SUB, X86_REG_SP, l->frame_size);
+	if (l->sret_offset >= 0)
+		x86_encoder_write_store(l->enc, X86_REG_SP, l->sret_offset, lower_argument_registers[0]);
+
+	//Arguments kept in memory are stored first, as the moves below
+	//overwrite argument registers
+	char* destinations = malloc(fn->arguments_size + 1);
+	char* sources = malloc(fn->arguments_size + 1);
+	size_t moves = 0;
+	for (size_t i = 0; i < fn->arguments_size; ++i) {
+		struct LowerHome* home = &l->homes[fn->variables_size + i];
+		struct LowerPlace* place = &l->places[i];
+		struct TypeInfo* type_info = &fn->arguments[i];
+
+		if (place->in_memory)
+			continue;
+		if (home->kind == LOWER_HOME_REGISTER) {
+			destinations[moves] = home->reg;
+			sources[moves] = place->registers[0];
+			moves += 1;
+		} else if (home->kind == LOWER_HOME_FRAME) {
+			if (lower_type_class(type_info) == LOWER_CLASS_FLOAT) {
+				x86_encoder_write_modrm_generic(l->enc, lower_sse_prefix(type_info->type), 1, X86_0F_SSE_STORE, 1,
+					X86_REG_SP, home->offset, place->registers[0], 0);
+			} else if (type_info->type == IR_TYPE_STRUCT) {
+				for (int w = 0; w < place->registers_size; ++w)
+					x86_encoder_write_store(l->enc, X86_REG_SP, home->offset + 8 * w, place->registers[w]);
+			} else {
+				lower_store_memory(l, X86_REG_SP, home->offset, place->registers[0], lower_type_store_size(type_info->type));
+			}
+		}
+	}
+	x86_encoder_write_parallel_move(l->enc, destinations, sources, moves, -1);
+	free(destinations);
+	free(sources);
+
+	for (size_t i = 0; i < fn->arguments_size; ++i) {
+		struct LowerHome* home = &l->homes[fn->variables_size + i];
+		struct LowerPlace* place = &l->places[i];
+		if (home->kind != LOWER_HOME_REGISTER)
+			continue;
+		if (place->in_memory)
+			lower_load_memory(l, home->reg, X86_REG_SP, l->frame_size + 8 * l->saved_size + 8 + place->stack_offset, fn->arguments[i].type);
+		else
+			lower_normalize(l, home->reg, fn->arguments[i].type);
+	}
+}
+
+// Restores the stack and the callee saved registers, without returning
+void lower_epilogue_body(struct Lowering* l)
+{
+	if (l->frame_size)
+		x86_encoder_write_op_imm(l->enc, X86_OP_MODRM_ADD, X86_REG_SP, l->frame_size);
+	for (int i = l->saved_size - 1; i >= 0; --i)
+		x86_encoder_write_pop(l->enc, l->saved[i]);
+}
+
+
+/*
+	Opcode lowering
+
+	Opcodes are lowered one at a time with the first operand in RAX and
+	the second in RCX. Floating point operations use XMM0 and XMM1.
+*/
+
+int lower_condition(int comparison, int is_signed)
+{
+	switch (comparison) {
+		case COMPARISON_EQUAL:
+			return X86_COND_E;
+		case COMPARISON_NOT_EQUAL:
+			return X86_COND_NE;
+		case COMPARISON_LESS:
+			return is_signed ? X86_COND_L : X86_COND_B;
+		case COMPARISON_GREATER:
+			return is_signed ? X86_COND_G : X86_COND_A;
+		case COMPARISON_LEQUAL:
+			return is_signed ? X86_COND_NG : X86_COND_NA;
+		case COMPARISON_GEQUAL:
+			return is_signed ? X86_COND_NL : X86_COND_NB;
+	}
+	return -1;
+}
+
+// SETcc AL followed by MOVZX EAX, AL
+void lower_set_condition(struct Lowering* l, int condition)
+{
+	x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_SETCC(condition), 0, X86_REG_A, 0, 0, 0);
+	x86_encoder_write_modrm_generic(l->enc, 0, 1, X86_0F_MOVZX_8, 0, X86_REG_A, 0, X86_REG_A, 0);
+}
+
+// Compares the primary operands and returns the condition code for the
+// comparison, -1 if unsupported
+int lower_compare(struct Lowering* l, struct Opcode* op, int comparison)
+{
+	struct Operand* x = &op->operands[OPERAND_PRIMARY_1];
+	struct Operand* y = &op->operands[OPERAND_PRIMARY_2];
+	int type = lower_operand_value_type(l, x);
+
+	if (ir_type_is_float(type)) {
+		if (lower_load_float(l, 0, x, type) || lower_load_float(l, 1, y, type))
+			return -1;
+		x86_encoder_write_modrm_generic(l->enc, type == IR_TYPE_F64 ? X86_OPERAND_SIZE_OVERRIDE : 0, 1, X86_0F_SSE_UCOMI, 0, 1, 0, 0, 0);
+		return lower_condition(comparison, 0);
+	}
+
+	if (lower_load_integer(l, X86_REG_A, x) || lower_load_integer(l, X86_REG_C, y))
+		return -1;
+	x86_encoder_write_cmp_reg(l->enc, X86_REG_A, X86_REG_C);
+	return lower_condition(comparison, ir_type_is_signed(type));
+}
+
+int lower_float_operation(struct Lowering* l, struct Opcode* op, int type)
+{
+	unsigned char operation;
+	switch (op->type) {
+		case OPCODE_ADD:
+			operation = X86_0F_SSE_ADD;
+			break;
+		case OPCODE_SUB:
+			operation = X86_0F_SSE_SUB;
+			break;
+		case OPCODE_MUL:
+			operation = X86_0F_SSE_MUL;
+			break;
+		case OPCODE_DIV:
+			operation = X86_0F_SSE_DIV;
+			break;
+		default:
+			return -1;
+	}
+	if (lower_load_float(l, 0, &op->operands[OPERAND_PRIMARY_1], type) || lower_load_float(l, 1, &op->operands[OPERAND_PRIMARY_2], type))
+		return -1;
+	x86_encoder_write_modrm_generic(l->enc, lower_sse_prefix(type), 1, operation, 0, 1, 0, 0, 0);
+	return lower_store_float(l, 0, &op->operands[OPERAND_TARGET]);
+}
+
+// Multiplier c = m * 2^k with m of 3, 5 or 9 is an LEA with index scale
+// m - 1 and a shift by k. Returns the scale as 1 to 3, 0 for other values
+int lower_lea_multiplier(struct Operand* c, int bits, int* shift)
+{
+	if (c->info_type != OPERAND_INFO_TYPE_IMMEDIATE)
+		return 0;
+	uint64_t value = operand_immediate_unsigned(c);
+	if (bits < 64)
+		value &= ((uint64_t)1 << bits) - 1;
+	if (!value)
+		return 0;
+	*shift = __builtin_ctzll(value);
+	value >>= *shift;
+	if (value == 3)
+		return 1;
+	if (value == 5)
+		return 2;
+	if (value == 9)
+		return 3;
+	return 0;
+}
+
+int lower_integer_operation(struct Lowering* l, struct Opcode* op)
+{
+	struct x86_encoder* enc = l->enc;
+	struct Operand* target = &op->operands[OPERAND_TARGET];
+	int type = lower_operand_value_type(l, target);
+
+	if (op->type >= OPCODE_COMPARE_BASE && op->type < OPCODE_COMPARE_BASE + 8) {
+		int comparison = op->type - OPCODE_COMPARE_BASE;
+		if (comparison == COMPARISON_ALWAYS) {
+			x86_encoder_write_mov_imm(enc, X86_REG_A, 1);
+		} else {
+			int condition = lower_compare(l, op, comparison);
+			if (condition < 0)
+				return -1;
+			lower_set_condition(l, condition);
+		}
+		return lower_store_integer(l, X86_REG_A, target, X86_REG_C);
+	}
+
+	if (lower_load_integer(l, X86_REG_A, &op->operands[OPERAND_PRIMARY_1]))
+		return -1;
+
+	int shift = 0;
+	int scale = op->type == OPCODE_MUL ? lower_lea_multiplier(&op->operands[OPERAND_PRIMARY_2], ir_type_bits(type), &shift) : 0;
+	if (scale) {
+		//The low bits match IMUL, narrow results are canonicalized by the store
+		x86_encoder_write_lea_index(enc, X86_REG_A, X86_REG_A, X86_REG_A, scale);
+		if (shift)
+			x86_encoder_write_shift_imm(enc, X86_SHIFT_MODRM_SHL, X86_REG_A, shift);
+		return lower_store_integer(l, X86_REG_A, target, X86_REG_C);
+	}
+
+	if (opcode_read_operand_primary_2(op) && lower_load_integer(l, X86_REG_C, &op->operands[OPERAND_PRIMARY_2]))
+		return -1;
+
+	switch (op->type) {
+		case OPCODE_ADD:
+			x86_encoder_write_modrm(enc, X86_ADD_MODRM, X86_REG_A, X86_REG_C);
+			break;
+		case OPCODE_SUB:
+			x86_encoder_write_modrm(enc, X86_SUB_MODRM, X86_REG_A, X86_REG_C);
+			break;
+		case OPCODE_BIT_AND:
+			x86_encoder_write_modrm(enc, X86_AND_MODRM, X86_REG_A, X86_REG_C);
+			break;
+		case OPCODE_BIT_OR:
+			x86_encoder_write_modrm(enc, X86_OR_MODRM, X86_REG_A, X86_REG_C);
+			break;
+		case OPCODE_BIR_XOR:
+			x86_encoder_write_modrm(enc, X86_XOR_MODRM, X86_REG_A, X86_REG_C);
+			break;
+		case OPCODE_BIT_NEG:
+			x86_encoder_write_modrm(enc, X86_F7_MODRM, X86_REG_A, X86_F7_MODRM_NOT);
+			break;
+		case OPCODE_MUL:
+			x86_encoder_write_modrm_generic(enc, 0, 1, X86_0F_IMUL_MODRM, 0, X86_REG_C, 0, X86_REG_A, 1);
+			break;
+		case OPCODE_DIV:
+			if (ir_type_is_signed(type)) {
+				x86_encoder_write_cqo(enc);
+				x86_encoder_write_modrm(enc, X86_F7_MODRM, X86_REG_C, X86_F7_MODRM_IDIV);
+			} else {
+				x86_encoder_write_modrm_32(enc, X86_XOR_MODRM, X86_REG_D, X86_REG_D);
+				x86_encoder_write_modrm(enc, X86_F7_MODRM, X86_REG_C, X86_F7_MODRM_DIV);
+			}
+			break;
+		case OPCODE_MUL_HIGH: {
+			int bits = ir_type_bits(type);
+			int is_signed = ir_type_is_signed(type);
+			if (bits == 64) {
+				x86_encoder_write_modrm(enc, X86_F7_MODRM, X86_REG_C, is_signed ? X86_F7_MODRM_IMUL : X86_F7_MODRM_MUL);
+				x86_encoder_write_modrm(enc, X86_MOV_MODRM, X86_REG_A, X86_REG_D);
+			} else {
+				//The whole product of canonical values fits in 64 bits
+				x86_encoder_write_modrm_generic(enc, 0, 1, X86_0F_IMUL_MODRM, 0, X86_REG_C, 0, X86_REG_A, 1);
+				x86_encoder_write_shift_imm(enc, is_signed ? X86_SHIFT_MODRM_SAR : X86_SHIFT_MODRM_SHR, X86_REG_A, bits);
+			}
+			break;
+		}
+		case OPCODE_BIT_SHIFT_LEFT:
+			x86_encoder_write_modrm(enc, X86_SHIFT_CL_MODRM, X86_REG_A, X86_SHIFT_MODRM_SHL);
+			break;
+		case OPCODE_BIT_SHIFT_LOGICAL_RIGHT:
+			x86_encoder_write_modrm(enc, X86_SHIFT_CL_MODRM, X86_REG_A, X86_SHIFT_MODRM_SHR);
+			break;
+		case OPCODE_BIT_SHIFT_ARITHMETIC_RIGHT:
+			x86_encoder_write_modrm(enc, X86_SHIFT_CL_MODRM, X86_REG_A, X86_SHIFT_MODRM_SAR);
+			break;
+		case OPCODE_NOT:
+			x86_encoder_write_test_reg(enc, X86_REG_A, X86_REG_A);
+			lower_set_condition(l, X86_COND_E);
+			break;
+		case OPCODE_AND:
+		case OPCODE_OR:
+			x86_encoder_write_test_reg(enc, X86_REG_A, X86_REG_A);
+			x86_encoder_write_modrm_generic(enc, 0, 1, X86_0F_SETCC(X86_COND_NE), 0, X86_REG_A, 0, 0, 0);
+			x86_encoder_write_test_reg(enc, X86_REG_C, X86_REG_C);
+			x86_encoder_write_modrm_generic(enc, 0, 1, X86_0F_SETCC(X86_COND_NE), 0, X86_REG_C, 0, 0, 0);
+			x86_encoder_write_modrm_8(enc, op->type == OPCODE_AND ? X86_AND_MODRM : X86_OR_MODRM, X86_REG_A, X86_REG_C);
+			x86_encoder_write_modrm_generic(enc, 0, 1, X86_0F_MOVZX_8, 0, X86_REG_A, 0, X86_REG_A, 0);
+			break;
+		default:
+			return -1;
+	}
+	return lower_store_integer(l, X86_REG_A, target, X86_REG_C);
+}
+
+int lower_copy(struct Lowering* l, struct Opcode* op)
+{
+	struct Operand* target = &op->operands[OPERAND_TARGET];
+	struct Operand* source = &op->operands[OPERAND_PRIMARY_1];
+	int target_type = lower_operand_value_type(l, target);
+	int source_type = lower_operand_value_type(l, source);
+
+	//Copying an immediate zero to a structure clears it
+	if (target_type == IR_TYPE_STRUCT) {
+		char dst, src = -1;
+		int32_t dst_disp, src_disp = 0;
+		if (lower_operand_memory(l, target, X86_REG_D, &dst, &dst_disp))
+			return -1;
+		if (source->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+			if (source->value_u64)
+				return -1;
+		} else if (lower_operand_memory(l, source, X86_REG_C, &src, &src_disp)) {
+			return -1;
+		}
+		lower_copy_memory(l, dst, dst_disp, src, src_disp, target->type_info.struct_size);
+		return 0;
+	}
+	if (ir_type_is_float(target_type)) {
+		if (lower_load_float(l, 0, source, target_type))
+			return -1;
+		return lower_store_float(l, 0, target);
+	}
+	if (ir_type_is_float(source_type)) {
+		if (lower_load_float(l, 0, source, source_type))
+			return -1;
+		x86_encoder_write_modrm_generic(l->enc, lower_sse_prefix(source_type), 1, X86_0F_SSE_TO_INT, 0, 0, 0, X86_REG_A, 1);
+	} else if (lower_load_integer(l, X86_REG_A, source)) {
+		return -1;
+	}
+	return lower_store_integer(l, X86_REG_A, target, X86_REG_C);
+}
+
+// Places the arguments of a call. Returns the amount of arguments in XMM
+// registers or -1 if unsupported
+int lower_call_arguments(struct Lowering* l, struct Opcode* call, int hidden)
+{
+	size_t count = l->arguments_size;
+	struct TypeInfo* types = malloc((count + 1) * sizeof *types);
+	struct LowerPlace* places = malloc((count + 1) * sizeof *places);
+	int floats = 0;
+	int result = 0;
+
+	for (size_t i = 0; i < count && !result; ++i) {
+		if (!l->arguments[i])
+			result = -1;
+		else
+			types[i] = l->arguments[i]->operands[OPERAND_PRIMARY_1].type_info;
+	}
+	if (result)
+		goto done;
+	lower_place_values(types, count, hidden, places);
+
+	//Stack first, it may use any scratch register
+	for (size_t i = 0; i < count && !result; ++i) {
+		struct Operand* value = &l->arguments[i]->operands[OPERAND_PRIMARY_1];
+		struct LowerPlace* place = &places[i];
+		if (!place->in_memory)
+			continue;
+		if (types[i].type == IR_TYPE_STRUCT) {
+			char base;
+			int32_t disp;
+			result = lower_operand_memory(l, value, X86_REG_C, &base, &disp);
+			if (!result)
+				lower_copy_memory(l, X86_REG_SP, place->stack_offset, base, disp, types[i].struct_size);
+		} else if (ir_type_is_float(types[i].type)) {
+			result = lower_load_float(l, 0, value, types[i].type);
+			x86_encoder_write_modrm_generic(l->enc, lower_sse_prefix(types[i].type), 1, X86_0F_SSE_STORE, 1, X86_REG_SP, place->stack_offset, 0, 0);
+		} else {
+			result = lower_load_integer(l, X86_REG_A, value);
+			x86_encoder_write_store(l->enc, X86_REG_SP, place->stack_offset, X86_REG_A);
+		}
+	}
+
+	//Floating point values may read any home, they only write XMM
+	//registers and R11
+	for (size_t i = 0; i < count && !result; ++i) {
+		if (!places[i].in_memory && ir_type_is_float(types[i].type)) {
+			result = lower_load_float(l, places[i].registers[0], &l->arguments[i]->operands[OPERAND_PRIMARY_1], types[i].type);
+			floats += 1;
+		}
+	}
+
+	//Values in registers are shuffled into place together. Homes in
+	//argument registers are only ever read this way
+	char destinations[LOWER_INTEGER_REGISTERS];
+	char sources[LOWER_INTEGER_REGISTERS];
+	size_t moves = 0;
+	char* moved = calloc(count + 1, 1);
+	for (size_t i = 0; i < count && !result; ++i) {
+		struct Operand* value = &l->arguments[i]->operands[OPERAND_PRIMARY_1];
+		struct LowerHome* home = lower_operand_home(l, value);
+		if (places[i].in_memory || lower_type_class(&types[i]) != LOWER_CLASS_INTEGER || types[i].type == IR_TYPE_STRUCT)
+			continue;
+		if (!home || home->kind != LOWER_HOME_REGISTER || (value->info_flags & (OPERAND_FLAG_ADDRESS | OPERAND_FLAG_DEREFERENCE)))
+			continue;
+		destinations[moves] = places[i].registers[0];
+		sources[moves] = home->reg;
+		moves += 1;
+		moved[i] = 1;
+	}
+	if (!result && moves)
+		x86_encoder_write_parallel_move(l->enc, destinations, sources, moves, -1);
+
+	//Everything else reads the frame, immediates or pointers that are not
+	//in argument registers
+	for (size_t i = 0; i < count && !result; ++i) {
+		struct Operand* value = &l->arguments[i]->operands[OPERAND_PRIMARY_1];
+		struct LowerPlace* place = &places[i];
+		if (place->in_memory || moved[i] || ir_type_is_float(types[i].type))
+			continue;
+		if (types[i].type == IR_TYPE_STRUCT) {
+			char base;
+			int32_t disp;
+			result = lower_operand_memory(l, value, X86_REG_A, &base, &disp);
+			for (int w = 0; w < place->registers_size && !result; ++w) {
+				int size = types[i].struct_size - 8 * w;
+				lower_load_partial(l, place->registers[w], base, disp + 8 * w, size < 8 ? size : 8);
+			}
+		} else {
+			result = lower_load_integer(l, place->registers[0], value);
+		}
+	}
+	free(moved);
+
+	if (!result && hidden) {
+		char base;
+		int32_t disp;
+		result = lower_operand_memory(l, &call->operands[OPERAND_TARGET], X86_REG_DI, &base, &disp);
+		if (!result)
+			x86_encoder_write_lea(l->enc, X86_REG_DI, base, disp);
+	}
+
+done:
+	free(types);
+	free(places);
+	return result ? -1 : floats;
+}
+
+// Lowers CALL and TAIL_CALL. Tail calls with stack arguments or memory
+// results are lowered as calls followed by a return
+int lower_call(struct Lowering* l, struct Opcode* op)
+{
+	struct Operand* target = &op->operands[OPERAND_TARGET];
+	struct Operand* callee = &op->operands[OPERAND_PRIMARY_1];
+	int has_result = target->info_type == OPERAND_INFO_TYPE_VARIABLE || target->info_type == OPERAND_INFO_TYPE_ARGUMENT;
+	int result_type = has_result ? lower_operand_value_type(l, target) : IR_TYPE_VOID;
+	int hidden = has_result && lower_returns_in_memory(&target->type_info);
+
+	int tail = op->type == OPCODE_TAIL_CALL;
+	if (tail) {
+		struct TypeInfo* types = malloc((l->arguments_size + 1) * sizeof *types);
+		struct LowerPlace* places = malloc((l->arguments_size + 1) * sizeof *places);
+		for (size_t i = 0; i < l->arguments_size; ++i)
+			types[i] = l->arguments[i] ? l->arguments[i]->operands[OPERAND_PRIMARY_1].type_info : callee->type_info;
+		if (lower_place_values(types, l->arguments_size, hidden, places) > 0 || hidden || l->sret_offset >= 0)
+			tail = 0;
+		free(types);
+		free(places);
+	}
+
+	int floats = lower_call_arguments(l, op, hidden);
+	l->arguments_size = 0;
+	//Functions in the same code are called directly
+	size_t label = lower_function_label(l, callee);
+	if (floats < 0 || (label == LOWER_NO_LABEL && lower_load_integer(l, X86_REG_R11, callee)))
+		return -1;
+	//Variadic callees expect the amount of vector registers in AL
+	x86_encoder_write_mov_imm_32(l->enc, X86_REG_A, floats);
+
+	if (tail) {
+		lower_epilogue_body(l);
+		if (label != LOWER_NO_LABEL)
+			x86_encoder_write_jmp(l->enc, 0, label);
+		else
+			x86_encoder_write_jmp_reg(l->enc, 0, X86_REG_R11);
+		return 0;
+	}
+	if (label != LOWER_NO_LABEL)
+		x86_encoder_write_jmp(l->enc, 1, label);
+	else
+		x86_encoder_write_jmp_reg(l->enc, 1, X86_REG_R11);
+
+	if (op->type == OPCODE_TAIL_CALL) {
+		//The result is already where the return value goes
+		x86_encoder_write_jmp(l->enc, 0, l->labels[l->function->opcodes_size]);
+		return 0;
+	}
+	if (!has_result || hidden)
+		return 0;
+	if (ir_type_is_float(result_type))
+		return lower_store_float(l, 0, target);
+	if (result_type == IR_TYPE_STRUCT) {
+		char base;
+		int32_t disp;
+		if (lower_operand_memory(l, target, X86_REG_C, &base, &disp))
+			return -1;
+		int size = target->type_info.struct_size;
+		lower_store_partial(l, base, disp, X86_REG_A, size < 8 ? size : 8);
+		if (size > 8)
+			lower_store_partial(l, base, disp + 8, X86_REG_D, size - 8);
+		return 0;
+	}
+	return lower_store_integer(l, X86_REG_A, target, X86_REG_C);
+}
+
+int lower_return(struct Lowering* l, struct Opcode* op)
+{
+	struct Function* fn = l->function;
+	struct Operand* value = &op->operands[OPERAND_PRIMARY_1];
+	int type = fn->return_type.type;
+
+	if (type == IR_TYPE_STRUCT) {
+		char base;
+		int32_t disp;
+		if (lower_operand_memory(l, value, X86_REG_C, &base, &disp))
+			return -1;
+		int size = fn->return_type.struct_size;
+		if (l->sret_offset >= 0) {
+			x86_encoder_write_load(l->enc, X86_REG_D, X86_REG_SP, l->sret_offset);
+			lower_copy_memory(l, X86_REG_D, 0, base, disp, size);
+			x86_encoder_write_modrm(l->enc, X86_MOV_MODRM, X86_REG_A, X86_REG_D);
+		} else {
+			lower_load_partial(l, X86_REG_A, base, disp, size < 8 ? size : 8);
+			if (size > 8)
+				lower_load_partial(l, X86_REG_D, base, disp + 8, size - 8);
+		}
+	} else if (ir_type_is_float(type)) {
+		if (lower_load_float(l, 0, value, type))
+			return -1;
+	} else if (type != IR_TYPE_VOID) {
+		if (lower_load_integer(l, X86_REG_A, value))
+			return -1;
+	}
+	x86_encoder_write_jmp(l->enc, 0, l->labels[fn->opcodes_size]);
+	return 0;
+}
+
+// Whether the variable is overwritten before being read on every path
+// from the opcode at "index". Conditional jumps end the scan unless the
+// variable is named nowhere else
+int lower_is_dead_from(struct Lowering* l, int variable, size_t index)
+{
+	struct Function* fn = l->function;
+	for (size_t steps = 0; steps <= fn->opcodes_size; ++steps) {
+		if (index >= fn->opcodes_size)
+			return 1;
+		struct Opcode* op = &fn->opcodes[index];
+		for (int o = OPERAND_PRIMARY_1; o <= OPERAND_PRIMARY_2; ++o)
+			if (operand_is_variable(&op->operands[o]) && op->operands[o].ref_id == variable)
+				return 0;
+		struct Operand* target = &op->operands[OPERAND_TARGET];
+		if (!opcode_is_jump(op) && operand_is_variable(target) && target->ref_id == variable) {
+			return opcode_writes_target_variable(op) && type_info_equal(&target->type_info, &fn->variables[variable].type_info);
+		}
+		if (op->type == OPCODE_RETURN)
+			return 1;
+		if (op->type == OPCODE_GOTO_BASE)
+			index = target->ref_id;
+		else if (opcode_is_jump(op) || op->type == OPCODE_TAIL_CALL)
+			return 0;
+		else
+			index += 1;
+	}
+	return 0;
+}
+
+// Whether the comparison at "index" only feeds the conditional jump right
+// after it, as in "t = x < y; if (t != 0) goto L". Nothing may jump to the
+// second opcode and t must be dead after it, so t is never needed
+int lower_is_fused_branch(struct Lowering* l, size_t index)
+{
+	struct Function* fn = l->function;
+	if (!l->references || index + 1 >= fn->opcodes_size || l->analysis->infos[index + 1].jump_from >= 0)
+		return 0;
+	struct Opcode* compare = &fn->opcodes[index];
+	struct Opcode* jump = compare + 1;
+	if (compare->type <= OPCODE_COMPARE(COMPARISON_ALWAYS) || compare->type >= OPCODE_COMPARE_BASE + 8)
+		return 0;
+	if (jump->type != OPCODE_GOTO_COND(COMPARISON_EQUAL) && jump->type != OPCODE_GOTO_COND(COMPARISON_NOT_EQUAL))
+		return 0;
+
+	struct Operand* t = &compare->operands[OPERAND_TARGET];
+	if (!operand_is_variable(t) || !operand_is_plain(t) || ir_type_is_float(lower_operand_value_type(l, t)))
+		return 0;
+	if (l->analysis->variables[t->ref_id].flags & VARIABLE_INFO_ETERNAL)
+		return 0;
+	struct Operand* x = &jump->operands[OPERAND_PRIMARY_1];
+	struct Operand* zero = &jump->operands[OPERAND_PRIMARY_2];
+	if (x->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+		zero = x;
+		x = &jump->operands[OPERAND_PRIMARY_2];
+	}
+	if (!operand_is_variable(x) || !operand_is_plain(x) || x->ref_id != t->ref_id)
+		return 0;
+	if (zero->info_type != OPERAND_INFO_TYPE_IMMEDIATE || ir_type_is_float(zero->type_info.type) || operand_immediate_unsigned(zero))
+		return 0;
+	if (l->references[t->ref_id] == 2)
+		return 1;
+	int label = jump->operands[OPERAND_TARGET].ref_id;
+	return label >= 0 && lower_is_dead_from(l, t->ref_id, index + 2) && lower_is_dead_from(l, t->ref_id, label);
+}
+
+// Lowers the pair at "index" found by lower_is_fused_branch as CMP and Jcc
+int lower_fused_branch(struct Lowering* l, size_t index)
+{
+	struct Opcode* compare = &l->function->opcodes[index];
+	struct Opcode* jump = compare + 1;
+	int label = jump->operands[OPERAND_TARGET].ref_id;
+	if (label < 0 || (size_t)label > l->function->opcodes_size)
+		return -1;
+	int condition = lower_compare(l, compare, compare->type - OPCODE_COMPARE_BASE);
+	if (condition < 0)
+		return -1;
+	//Conditions come in pairs differing in the lowest bit, one the negation of the other
+	if (jump->type == OPCODE_GOTO_COND(COMPARISON_EQUAL))
+		condition ^= 1;
+	x86_encoder_write_jmp_cond(l->enc, condition, l->labels[label]);
+	return 0;
+}
+
+int lower_opcode(struct Lowering* l, struct Opcode* op)
+{
+	if (opcode_is_jump(op)) {
+		int label = op->operands[OPERAND_TARGET].ref_id;
+		if (label < 0 || (size_t)label > l->function->opcodes_size)
+			return -1;
+		int comparison = op->type - OPCODE_GOTO_BASE;
+		if (comparison == COMPARISON_ALWAYS) {
+			x86_encoder_write_jmp(l->enc, 0, l->labels[label]);
+			return 0;
+		}
+		int condition = lower_compare(l, op, comparison);
+		if (condition < 0)
+			return -1;
+		x86_encoder_write_jmp_cond(l->enc, condition, l->labels[label]);
+		return 0;
+	}
+
+	switch (op->type) {
+		case OPCODE_NOP:
+			return 0;
+		case OPCODE_COPY:
+			return lower_copy(l, op);
+		case OPCODE_SET_ARGUMENT: {
+			int index = op->operands[OPERAND_TARGET].ref_id;
+			if (index < 0 || (size_t)index > l->function->opcodes_size)
+				return -1;
+			while (l->arguments_size <= (size_t)index)
+				DYNAMIC_ARRAY_PUSH(l->arguments, l->arguments_size, l->arguments_capacity, 0, 8);
+			l->arguments[index] = op;
+			return 0;
+		}
+		case OPCODE_CALL:
+		case OPCODE_TAIL_CALL:
+			return lower_call(l, op);
+		case OPCODE_RETURN:
+			return lower_return(l, op);
+	}
+
+	int type = lower_operand_value_type(l, &op->operands[OPERAND_TARGET]);
+	if (ir_type_is_float(type))
+		return lower_float_operation(l, op, type);
+	return lower_integer_operation(l, op);
+}
+
+/*
+	Switch lowering
+
+	Front-ends write a multi-way branch as a chain of "if (x == k) goto L"
+	opcodes on the same value, followed by the default case. A chain of
+	at least LOWER_SWITCH_MIN_CASES of them that nothing jumps into is
+	lowered as a whole. The cases are sorted and split into clusters:
+	runs of cases dense enough for a jump table, and single cases. A
+	balanced binary tree of comparisons finds the cluster, so the switch
+	takes O(log n) branches instead of O(n), and a single indirect jump
+	when one table covers it. A case repeating an earlier key is dropped
+	as the earlier one is taken first.
+
+	Tables hold 32bit offsets of the targets from the start of the table
+	and are placed after the code of the function. They are addressed
+	RIP-relative, so the code stays position independent. Holes in a
+	table lead to the default case.
+*/
+
+#define LOWER_SWITCH_MIN_CASES (4)
+#define LOWER_SWITCH_MIN_TABLE (4) //Cases of the smallest table
+#define LOWER_SWITCH_DENSITY (40) //Percentage of the table entries that must be cases
+#define LOWER_SWITCH_MAX_TABLE (4096) //Entries of the largest table
+#define LOWER_SWITCH_LINEAR (3) //Clusters tested one after the other instead of searched
+
+struct LowerSwitchCase
+{
+	uint64_t value; //Key as loaded to a register
+	uint64_t order; //Key biased so that unsigned order is the order of the keys
+	int label; //Opcode index of the target
+	int position; //Position in the chain
+};
+
+struct LowerSwitchCluster
+{
+	size_t first; //Index of the first case
+	size_t size; //Amount of cases, a jump table if more than one
+};
+
+struct LowerSwitch
+{
+	struct Operand* value;
+	int is_signed;
+	size_t length; //Opcodes of the chain
+	int fallback; //Opcode index of the default case
+
+	struct LowerSwitchCase* cases;
+	size_t cases_size;
+	struct LowerSwitchCluster* clusters;
+	size_t clusters_size;
+	size_t clusters_capacity;
+};
+
+void free_lower_switch(struct LowerSwitch* sw)
+{
+	free(sw->cases);
+	free(sw->clusters);
+}
+
+// Operand the jump compares to an immediate, null if it is not a case
+struct Operand* lower_switch_value(struct Opcode* op, struct Operand** key)
+{
+	struct Operand* value = &op->operands[OPERAND_PRIMARY_1];
+	*key = &op->operands[OPERAND_PRIMARY_2];
+	if (value->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+		*key = value;
+		value = &op->operands[OPERAND_PRIMARY_2];
+	}
+	if (op->type != OPCODE_GOTO_COND(COMPARISON_EQUAL) || (*key)->info_type != OPERAND_INFO_TYPE_IMMEDIATE)
+		return 0;
+	if (!ir_type_is_integer(value->type_info.type) || (*key)->type_info.type != value->type_info.type)
+		return 0;
+	if (value->info_type != OPERAND_INFO_TYPE_VARIABLE && value->info_type != OPERAND_INFO_TYPE_ARGUMENT)
+		return 0;
+	return operand_is_plain(value) ? value : 0;
+}
+
+int lower_switch_case_compare(const void* x, const void* y)
+{
+	const struct LowerSwitchCase* a = x;
+	const struct LowerSwitchCase* b = y;
+	if (a->order != b->order)
+		return a->order < b->order ? -1 : 1;
+	return a->position - b->position;
+}
+
+// Splits the sorted cases into clusters, each taking the longest dense
+// run of cases from where the previous one ended
+void lower_switch_clusters(struct LowerSwitch* sw)
+{
+	for (size_t first = 0; first < sw->cases_size;) {
+		struct LowerSwitchCluster cluster;
+		cluster.first = first;
+		cluster.size = 1;
+		for (size_t last = first + LOWER_SWITCH_MIN_TABLE - 1; last < sw->cases_size; ++last) {
+			uint64_t range = sw->cases[last].order - sw->cases[first].order;
+			if (range >= LOWER_SWITCH_MAX_TABLE)
+				break;
+			if ((last - first + 1) * 100 >= (range + 1) * LOWER_SWITCH_DENSITY)
+				cluster.size = last - first + 1;
+		}
+		DYNAMIC_ARRAY_PUSH(sw->clusters, sw->clusters_size, sw->clusters_capacity, cluster, 16);
+		first += cluster.size;
+	}
+}
+
+// Finds a chain of cases starting at "index" as described above
+int lower_find_switch(struct Lowering* l, size_t index, struct LowerSwitch* sw)
+{
+	struct Function* fn = l->function;
+	if (!l->analysis || l->counters)
+		return 0;
+	memset(sw, 0, sizeof *sw);
+	struct Operand* key;
+	sw->value = lower_switch_value(&fn->opcodes[index], &key);
+	if (!sw->value)
+		return 0;
+
+	size_t length = 0;
+	for (size_t k = index; k < fn->opcodes_size; ++k, ++length) {
+		struct Opcode* op = &fn->opcodes[k];
+		struct Operand* value = lower_switch_value(op, &key);
+		int label = op->operands[OPERAND_TARGET].ref_id;
+		if (!value || !operand_same(value, sw->value) || label < 0 || (size_t)label > fn->opcodes_size)
+			break;
+		if (k > index && l->analysis->infos[k].jump_from >= 0)
+			break;
+	}
+	if (length < LOWER_SWITCH_MIN_CASES)
+		return 0;
+
+	sw->is_signed = ir_type_is_signed(sw->value->type_info.type);
+	sw->length = length;
+	sw->fallback = index + length;
+	sw->cases = malloc(length * sizeof *sw->cases);
+	for (size_t k = 0; k < length; ++k) {
+		struct Opcode* op = &fn->opcodes[index + k];
+		lower_switch_value(op, &key);
+		struct LowerSwitchCase* c = &sw->cases[k];
+		c->value = sw->is_signed ? (uint64_t)operand_immediate_signed(key) : operand_immediate_unsigned(key);
+		c->order = sw->is_signed ? c->value ^ ((uint64_t)1 << 63) : c->value;
+		c->label = op->operands[OPERAND_TARGET].ref_id;
+		c->position = k;
+	}
+	qsort(sw->cases, length, sizeof *sw->cases, lower_switch_case_compare);
+	for (size_t k = 0; k < length; ++k) {
+		if (!sw->cases_size || sw->cases[sw->cases_size - 1].order != sw->cases[k].order)
+			sw->cases[sw->cases_size++] = sw->cases[k];
+	}
+	lower_switch_clusters(sw);
+	return 1;
+}
+
+// Compares RAX to the key of a case
+void lower_switch_compare(struct Lowering* l, uint64_t value)
+{
+	if ((int64_t)value >= INT32_MIN && (int64_t)value <= INT32_MAX) {
+		x86_encoder_write_cmp_imm(l->enc, X86_REG_A, (int32_t)value);
+	} else {
+		x86_encoder_write_mov_imm(l->enc, X86_REG_C, value);
+		x86_encoder_write_cmp_reg(l->enc, X86_REG_A, X86_REG_C);
+	}
+}
+
+// Lowers a cluster, continuing after it when RAX is not one of its keys
+void lower_switch_cluster(struct Lowering* l, struct LowerSwitch* sw, struct LowerSwitchCluster* cluster)
+{
+	struct x86_encoder* enc = l->enc;
+	struct LowerSwitchCase* cases = &sw->cases[cluster->first];
+	if (cluster->size == 1) {
+		lower_switch_compare(l, cases[0].value);
+		x86_encoder_write_jmp_cond(enc, X86_COND_E, l->labels[cases[0].label]);
+		return;
+	}
+
+	//Entries for every key from the first case to the last
+	struct LowerJumpTable table;
+	table.label = x86_encoder_add_label(enc);
+	table.size = cases[cluster->size - 1].order - cases[0].order + 1;
+	table.targets = malloc(table.size * sizeof *table.targets);
+	for (size_t e = 0; e < table.size; ++e)
+		table.targets[e] = l->labels[sw->fallback];
+	for (size_t c = 0; c < cluster->size; ++c)
+		table.targets[cases[c].order - cases[0].order] = l->labels[cases[c].label];
+	DYNAMIC_ARRAY_PUSH(l->tables, l->tables_size, l->tables_capacity, table, 4);
+
+	size_t next = x86_encoder_add_label(enc);
+	x86_encoder_write_modrm(enc, X86_MOV_MODRM, X86_REG_C, X86_REG_A);
+	if ((int64_t)cases[0].value >= INT32_MIN && (int64_t)cases[0].value <= INT32_MAX) {
+		x86_encoder_write_op_imm(enc, X86_OP_MODRM_SUB, X86_REG_C, (int32_t)cases[0].value);
+	} else {
+		x86_encoder_write_mov_imm(enc, X86_REG_R11, cases[0].value);
+		x86_encoder_write_modrm(enc, X86_SUB_MODRM, X86_REG_C, X86_REG_R11);
+	}
+	x86_encoder_write_cmp_imm(enc, X86_REG_C, table.size - 1);
+	x86_encoder_write_jmp_cond(enc, X86_COND_A, next);
+	x86_encoder_write_lea_label(enc, X86_REG_R11, table.label);
+	x86_encoder_write_shift_imm(enc, X86_SHIFT_MODRM_SHL, X86_REG_C, 2);
+	x86_encoder_write_modrm(enc, X86_ADD_MODRM, X86_REG_C, X86_REG_R11);
+	x86_encoder_write_modrm_generic(enc, 0, 0, X86_MOVSXD_MODRM, 1, X86_REG_C, 0, X86_REG_C, 1);
+	x86_encoder_write_modrm(enc, X86_ADD_MODRM, X86_REG_C, X86_REG_R11);
+	x86_encoder_write_jmp_reg(enc, 0, X86_REG_C);
+	x86_encoder_move_label(enc, next);
+}
+
+// Lowers the clusters from "first" up to "last" with the value in RAX,
+// going to the default case when none of them has it
+void lower_switch_tree(struct Lowering* l, struct LowerSwitch* sw, size_t first, size_t last)
+{
+	if (last - first <= LOWER_SWITCH_LINEAR) {
+		for (size_t c = first; c < last; ++c)
+			lower_switch_cluster(l, sw, &sw->clusters[c]);
+		x86_encoder_write_jmp(l->enc, 0, l->labels[sw->fallback]);
+		return;
+	}
+	size_t middle = first + (last - first) / 2;
+	size_t below = x86_encoder_add_label(l->enc);
+	lower_switch_compare(l, sw->cases[sw->clusters[middle].first].value);
+	x86_encoder_write_jmp_cond(l->enc, sw->is_signed ? X86_COND_L : X86_COND_B, below);
+	lower_switch_tree(l, sw, middle, last);
+	x86_encoder_move_label(l->enc, below);
+	lower_switch_tree(l, sw, first, middle);
+}
+
+int lower_switch(struct Lowering* l, struct LowerSwitch* sw)
+{
+	if (lower_load_integer(l, X86_REG_A, sw->value))
+		return -1;
+	lower_switch_tree(l, sw, 0, sw->clusters_size);
+	return 0;
+}
+
+// Writes the jump tables of the function after its code
+void lower_write_tables(struct Lowering* l)
+{
+	if (!l->tables_size)
+		return;
+	while (l->enc->buffer_size % 4)
+		x86_encoder_write_nop(l->enc);
+	for (size_t t = 0; t < l->tables_size; ++t) {
+		struct LowerJumpTable* table = &l->tables[t];
+		x86_encoder_move_label(l->enc, table->label);
+		for (size_t e = 0; e < table->size; ++e)
+			x86_encoder_write_table_entry(l->enc, table->label, table->targets[e]);
+	}
+}
+
+// Runs the peephole pass over the code of the function, which starts at
+// instruction "first" and label "first_label", and adds its savings to
+// the environment
+void lower_peephole(struct Lowering* l, size_t first, size_t first_label)
+{
+	struct x86_peephole_stats stats;
+	x86_encoder_peephole(l->enc, first, first_label, &stats);
+	struct x86_peephole_stats* total = l->env->peephole;
+	if (total) {
+		total->instructions_removed += stats.instructions_removed;
+		total->bytes_saved += stats.bytes_saved;
+		total->jumps_retargeted += stats.jumps_retargeted;
+		total->passes += stats.passes;
+	}
+}
+
+void free_lower_tables(struct Lowering* l)
+{
+	for (size_t t = 0; t < l->tables_size; ++t)
+		free(l->tables[t].targets);
+	free(l->tables);
+}
+
+/*
+	Loop vectorization
+
+	Innermost loops of the form
+
+		header: if (i >= n) goto exit
+			... element-wise body ...
+			goto header
+		exit:
+
+	get a 256bit AVX2 copy placed before the header, so only entering the
+	loop from the opcode before it runs the vector loop. It processes as
+	many whole vectors as fit in the n - i remaining iterations and leaves
+	i and the pointers where the scalar loop continues from, the scalar
+	loop running the remaining iterations. The vector loop is skipped when
+	fewer iterations than lanes remain, or when a pointer that is stored
+	through is closer than a vector to another pointer of the loop.
+
+	The body may only contain, for a single element type:
+
+	- loads "t = *p" and stores "*p = x" through pointers p that are
+	  incremented by the element size once per iteration, after every
+	  access through them
+	- element-wise arithmetic on temporaries, immediates and variables
+	  the loop does not write
+	- "i = i + 1"
+
+	Temporaries are variables written once per iteration before being
+	read, and never referenced outside the loop. Every temporary and
+	loop invariant needs a YMM register of its own.
+*/
+
+#define LOWER_VECTOR_WIDTH (32)
+#define LOWER_VECTOR_REGISTERS (16)
+
+#define LOWER_VECTOR_NONE (0)
+#define LOWER_VECTOR_TEMPORARY (1)
+#define LOWER_VECTOR_POINTER (2)
+#define LOWER_VECTOR_INVARIANT (3)
+
+#define LOWER_VECTOR_LOADED (1 << 0)
+#define LOWER_VECTOR_STORED (1 << 1)
+
+struct LowerVectorLoop
+{
+	int header; //Exit test
+	int back; //Jump back to the header
+	int counter; //Home of the induction variable
+	int type; //Element type
+	int lanes;
+
+	int* roles; //LOWER_VECTOR_* of every home
+	int* positions; //Definition of every temporary, increment of every pointer
+	int* steps; //Increment of every pointer in bytes
+	int* access; //LOWER_VECTOR_LOADED and LOWER_VECTOR_STORED of every pointer
+	char* registers; //YMM register of every temporary and invariant, -1 if none
+	char* immediates; //YMM register of every immediate operand by opcode and operand, -1 if none
+	int registers_size;
+};
+
+void free_vector_loop(struct LowerVectorLoop* vl)
+{
+	free(vl->roles);
+	free(vl->positions);
+	free(vl->steps);
+	free(vl->access);
+	free(vl->registers);
+	free(vl->immediates);
+}
+
+// Home index of a variable or argument operand, -1 for other operands
+int lower_home_index(struct Lowering* l, struct Operand* operand)
+{
+	if (operand->info_type == OPERAND_INFO_TYPE_VARIABLE && (size_t)operand->ref_id < l->function->variables_size)
+		return operand->ref_id;
+	if (operand->info_type == OPERAND_INFO_TYPE_ARGUMENT && (size_t)operand->ref_id < l->function->arguments_size)
+		return l->function->variables_size + operand->ref_id;
+	return -1;
+}
+
+// Packed form of an operation on the element type: mandatory prefix, map
+// and opcode. Returns -1 if there is none
+int lower_vector_operation(int operation, int type, unsigned char* prefix, int* map, unsigned char* opcode)
+{
+	*map = X86_VEX_MAP_0F;
+	*prefix = type == IR_TYPE_F32 ? 0 : X86_OPERAND_SIZE_OVERRIDE;
+	if (ir_type_is_float(type)) {
+		switch (operation) {
+			case OPCODE_ADD: *opcode = X86_0F_PACKED_ADD; return 0;
+			case OPCODE_SUB: *opcode = X86_0F_PACKED_SUB; return 0;
+			case OPCODE_MUL: *opcode = X86_0F_PACKED_MUL; return 0;
+			case OPCODE_DIV: *opcode = X86_0F_PACKED_DIV; return 0;
+		}
+		return -1;
+	}
+	int wide = ir_type_bits(type) == 64;
+	switch (operation) {
+		case OPCODE_ADD: *opcode = wide ? X86_0F_PADDQ : X86_0F_PADDD; return 0;
+		case OPCODE_SUB: *opcode = wide ? X86_0F_PSUBQ : X86_0F_PSUBD; return 0;
+		case OPCODE_BIT_AND: *opcode = X86_0F_PAND; return 0;
+		case OPCODE_BIT_OR: *opcode = X86_0F_POR; return 0;
+		case OPCODE_BIR_XOR: *opcode = X86_0F_PXOR; return 0;
+		case OPCODE_MUL:
+			if (wide)
+				return -1;
+			*map = X86_VEX_MAP_0F38;
+			*opcode = X86_0F38_PMULLD;
+			return 0;
+	}
+	return -1;
+}
+
+// Gives a value read by the vector body its register
+int lower_vector_value(struct Lowering* l, struct LowerVectorLoop* vl, int index, int operand_index)
+{
+	struct Operand* operand = &l->function->opcodes[index].operands[operand_index];
+	if (operand->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+		if (operand->type_info.type != vl->type || vl->registers_size >= LOWER_VECTOR_REGISTERS)
+			return -1;
+		vl->immediates[index * 3 + operand_index] = vl->registers_size++;
+		return 0;
+	}
+
+	int home = lower_home_index(l, operand);
+	if (home < 0 || home == vl->counter || operand->info_flags || lower_operand_value_type(l, operand) != vl->type)
+		return -1;
+	if (vl->roles[home] == LOWER_VECTOR_TEMPORARY)
+		return vl->positions[home] < index ? 0 : -1;
+	if (vl->roles[home] == LOWER_VECTOR_INVARIANT)
+		return 0;
+	if (vl->roles[home] != LOWER_VECTOR_NONE || vl->registers_size >= LOWER_VECTOR_REGISTERS)
+		return -1;
+	vl->roles[home] = LOWER_VECTOR_INVARIANT;
+	vl->registers[home] = vl->registers_size++;
+	return 0;
+}
+
+// Records an access through a pointer at opcode "index"
+int lower_vector_access(struct Lowering* l, struct LowerVectorLoop* vl, struct Operand* operand, int index, int flag)
+{
+	int home = lower_home_index(l, operand);
+	if (home < 0 || operand->info_flags != OPERAND_FLAG_DEREFERENCE || operand->type_info.type != vl->type)
+		return -1;
+	if (vl->roles[home] != LOWER_VECTOR_POINTER || vl->positions[home] <= index)
+		return -1;
+	if (vl->steps[home] != ir_type_bits(vl->type) / 8 || ir_type_bits(lower_operand_declared_type(l, operand)->type) != 64)
+		return -1;
+	vl->access[home] |= flag;
+	return 0;
+}
+
+// Checks whether the loop with the exit test at "header" can be
+// vectorized. Returns 1 and fills "vl" if so
+int lower_find_vector_loop(struct Lowering* l, int header, struct LowerVectorLoop* vl)
+{
+	struct Function* fn = l->function;
+	struct Opcode* test = &fn->opcodes[header];
+	if (!(l->features & LOWER_FEATURE_AVX2) || test->type != OPCODE_GOTO_COND(COMPARISON_GEQUAL))
+		return 0;
+
+	struct Operand* counter = &test->operands[OPERAND_PRIMARY_1];
+	struct Operand* limit = &test->operands[OPERAND_PRIMARY_2];
+	int counter_home = lower_home_index(l, counter);
+	int limit_home = lower_home_index(l, limit);
+	if (counter_home < 0 || counter->info_flags || !ir_type_is_integer(lower_operand_value_type(l, counter)))
+		return 0;
+	if (limit->info_flags || (limit_home < 0 && limit->info_type != OPERAND_INFO_TYPE_IMMEDIATE))
+		return 0;
+
+	//The body runs up to the first jump, which has to be the back edge
+	int back = header + 1;
+	while ((size_t)back < fn->opcodes_size && !opcode_is_jump(&fn->opcodes[back]))
+		back += 1;
+	if ((size_t)back >= fn->opcodes_size)
+		return 0;
+	struct Opcode* jump = &fn->opcodes[back];
+	if (jump->type != OPCODE_GOTO_COND(COMPARISON_ALWAYS) || jump->operands[OPERAND_TARGET].ref_id != header
+		|| test->operands[OPERAND_TARGET].ref_id != back + 1)
+		return 0;
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		int target = fn->opcodes[i].operands[OPERAND_TARGET].ref_id;
+		if (opcode_is_jump(&fn->opcodes[i]) && target > header && target <= back)
+			return 0;
+	}
+
+	size_t count = fn->variables_size + fn->arguments_size;
+	memset(vl, 0, sizeof *vl);
+	vl->header = header;
+	vl->back = back;
+	vl->counter = counter_home;
+	vl->type = -1;
+	vl->roles = calloc(count + 1, sizeof *vl->roles);
+	vl->positions = calloc(count + 1, sizeof *vl->positions);
+	vl->steps = calloc(count + 1, sizeof *vl->steps);
+	vl->access = calloc(count + 1, sizeof *vl->access);
+	vl->registers = malloc(count + 1);
+	memset(vl->registers, -1, count + 1);
+	vl->immediates = malloc(3 * fn->opcodes_size + 1);
+	memset(vl->immediates, -1, 3 * fn->opcodes_size + 1);
+
+	//Roles of the written homes first
+	int counter_increments = 0;
+	for (int i = header + 1; i < back; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		struct Operand* target = &op->operands[OPERAND_TARGET];
+		struct Operand* x = &op->operands[OPERAND_PRIMARY_1];
+		struct Operand* y = &op->operands[OPERAND_PRIMARY_2];
+		int home = lower_home_index(l, target);
+
+		if (op->type == OPCODE_NOP || (target->info_flags & OPERAND_FLAG_DEREFERENCE))
+			continue;
+		if (home < 0 || target->info_flags)
+			goto fail;
+		if (op->type == OPCODE_ADD && lower_home_index(l, x) == home && !x->info_flags && y->info_type == OPERAND_INFO_TYPE_IMMEDIATE) {
+			if (home == counter_home) {
+				if (operand_immediate_unsigned(y) != 1)
+					goto fail;
+				counter_increments += 1;
+				continue;
+			}
+			if (vl->roles[home] != LOWER_VECTOR_NONE)
+				goto fail;
+			vl->roles[home] = LOWER_VECTOR_POINTER;
+			vl->steps[home] = (int)operand_immediate_signed(y);
+			vl->positions[home] = i;
+			continue;
+		}
+		if (home == counter_home || home == limit_home || (size_t)home >= fn->variables_size || vl->roles[home] != LOWER_VECTOR_NONE)
+			goto fail;
+		vl->roles[home] = LOWER_VECTOR_TEMPORARY;
+		vl->positions[home] = i;
+		if (vl->type < 0)
+			vl->type = lower_operand_declared_type(l, target)->type;
+	}
+	if (counter_increments != 1 || (limit_home >= 0 && vl->roles[limit_home] != LOWER_VECTOR_NONE))
+		goto fail;
+
+	//Stores decide the type when there are no temporaries
+	for (int i = header + 1; i < back && vl->type < 0; ++i) {
+		struct Operand* target = &fn->opcodes[i].operands[OPERAND_TARGET];
+		if (target->info_flags & OPERAND_FLAG_DEREFERENCE)
+			vl->type = target->type_info.type;
+	}
+	switch (vl->type) {
+		case IR_TYPE_F32:
+		case IR_TYPE_F64:
+		case IR_TYPE_I32:
+		case IR_TYPE_U32:
+		case IR_TYPE_I64:
+		case IR_TYPE_U64:
+			break;
+		default:
+			goto fail;
+	}
+	vl->lanes = LOWER_VECTOR_WIDTH / (ir_type_bits(vl->type) / 8);
+
+	//Then every opcode has to be one of the supported forms
+	int stores = 0;
+	for (int i = header + 1; i < back; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		struct Operand* target = &op->operands[OPERAND_TARGET];
+		struct Operand* x = &op->operands[OPERAND_PRIMARY_1];
+		int home = lower_home_index(l, target);
+
+		if (op->type == OPCODE_NOP)
+			continue;
+		if (!(target->info_flags & OPERAND_FLAG_DEREFERENCE) && (home == counter_home || vl->roles[home] == LOWER_VECTOR_POINTER))
+			continue;
+
+		if (op->type == OPCODE_COPY && (target->info_flags & OPERAND_FLAG_DEREFERENCE)) {
+			if (lower_vector_access(l, vl, target, i, LOWER_VECTOR_STORED) || lower_vector_value(l, vl, i, OPERAND_PRIMARY_1))
+				goto fail;
+			stores += 1;
+		} else if (op->type == OPCODE_COPY && (x->info_flags & OPERAND_FLAG_DEREFERENCE)) {
+			if (lower_operand_declared_type(l, target)->type != vl->type || lower_vector_access(l, vl, x, i, LOWER_VECTOR_LOADED))
+				goto fail;
+		} else {
+			unsigned char prefix, opcode;
+			int map;
+			if (target->info_flags || lower_operand_declared_type(l, target)->type != vl->type)
+				goto fail;
+			if (lower_vector_operation(op->type, vl->type, &prefix, &map, &opcode))
+				goto fail;
+			if (lower_vector_value(l, vl, i, OPERAND_PRIMARY_1) || lower_vector_value(l, vl, i, OPERAND_PRIMARY_2))
+				goto fail;
+		}
+	}
+	if (!stores)
+		goto fail;
+
+	//Temporaries get their registers after the invariants, and must not
+	//be referenced outside the loop
+	for (size_t home = 0; home < count; ++home) {
+		if (vl->roles[home] != LOWER_VECTOR_TEMPORARY)
+			continue;
+		if (vl->registers_size >= LOWER_VECTOR_REGISTERS)
+			goto fail;
+		vl->registers[home] = vl->registers_size++;
+	}
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		if ((int)i >= header && (int)i <= back)
+			continue;
+		for (int o = 0; o < 3; ++o) {
+			if (opcode_is_jump(&fn->opcodes[i]) && o == OPERAND_TARGET)
+				continue;
+			int home = lower_home_index(l, &fn->opcodes[i].operands[o]);
+			if (home >= 0 && vl->roles[home] == LOWER_VECTOR_TEMPORARY)
+				goto fail;
+		}
+	}
+	return 1;
+
+fail:
+	free_vector_loop(vl);
+	return 0;
+}
+
+// Plain operand naming a home
+struct Operand lower_home_operand(struct Lowering* l, int home)
+{
+	struct Function* fn = l->function;
+	if ((size_t)home < fn->variables_size)
+		return make_variable_operand(home, fn->variables[home].type_info);
+	struct Operand operand = make_variable_operand(home - fn->variables_size, fn->arguments[home - fn->variables_size]);
+	operand.info_type = OPERAND_INFO_TYPE_ARGUMENT;
+	return operand;
+}
+
+// Register holding the pointer of a dereferenced operand, RAX if the
+// pointer has to be loaded
+char lower_vector_base(struct Lowering* l, struct Operand* operand)
+{
+	struct LowerHome* home = lower_operand_home(l, operand);
+	if (home->kind == LOWER_HOME_REGISTER)
+		return home->reg;
+	struct Operand pointer = lower_home_operand(l, lower_home_index(l, operand));
+	lower_load_integer(l, X86_REG_A, &pointer);
+	return X86_REG_A;
+}
+
+// Fills a YMM register with copies of a scalar value
+void lower_vector_broadcast(struct Lowering* l, struct LowerVectorLoop* vl, char reg, struct Operand* value)
+{
+	struct x86_encoder* enc = l->enc;
+	if (ir_type_is_float(vl->type)) {
+		lower_load_float(l, reg, value, vl->type);
+		x86_encoder_write_vex_modrm(enc, X86_OPERAND_SIZE_OVERRIDE, X86_VEX_MAP_0F38, 0, 1,
+			vl->type == IR_TYPE_F32 ? X86_0F38_VBROADCASTSS : X86_0F38_VBROADCASTSD, 0, reg, 0, reg, 0);
+		return;
+	}
+	int wide = ir_type_bits(vl->type) == 64;
+	lower_load_integer(l, X86_REG_R11, value);
+	x86_encoder_write_vex_modrm(enc, X86_OPERAND_SIZE_OVERRIDE, X86_VEX_MAP_0F, wide, 0, X86_0F_MOVD_TO_XMM, 0, X86_REG_R11, 0, reg, 0);
+	x86_encoder_write_vex_modrm(enc, X86_OPERAND_SIZE_OVERRIDE, X86_VEX_MAP_0F38, 0, 1,
+		wide ? X86_0F38_VPBROADCASTQ : X86_0F38_VPBROADCASTD, 0, reg, 0, reg, 0);
+}
+
+// Adds "amount" to a home, through RAX unless it is a 64bit register
+void lower_vector_advance(struct Lowering* l, struct Operand* operand, int32_t amount)
+{
+	struct LowerHome* home = lower_operand_home(l, operand);
+	if (home->kind == LOWER_HOME_REGISTER && ir_type_bits(lower_operand_declared_type(l, operand)->type) == 64) {
+		x86_encoder_write_op_imm(l->enc, X86_OP_MODRM_ADD, home->reg, amount);
+		return;
+	}
+	lower_load_integer(l, X86_REG_A, operand);
+	x86_encoder_write_op_imm(l->enc, X86_OP_MODRM_ADD, X86_REG_A, amount);
+	lower_store_integer(l, X86_REG_A, operand, X86_REG_R11);
+}
+
+void lower_vector_loop(struct Lowering* l, struct LowerVectorLoop* vl)
+{
+	struct x86_encoder* enc = l->enc;
+	struct Function* fn = l->function;
+	struct Opcode* test = &fn->opcodes[vl->header];
+	size_t count = fn->variables_size + fn->arguments_size;
+	size_t skip = x86_encoder_add_label(enc);
+	size_t body = x86_encoder_add_label(enc);
+
+	//Whole vectors left: RCX = n - i when i < n
+	struct Operand* counter = &test->operands[OPERAND_PRIMARY_1];
+	int is_signed = ir_type_is_signed(lower_operand_value_type(l, counter));
+	lower_load_integer(l, X86_REG_A, counter);
+	lower_load_integer(l, X86_REG_C, &test->operands[OPERAND_PRIMARY_2]);
+	x86_encoder_write_cmp_reg(enc, X86_REG_A, X86_REG_C);
+	x86_encoder_write_jmp_cond(enc, is_signed ? X86_COND_NL : X86_COND_NB, skip);
+	x86_encoder_write_modrm(enc, X86_SUB_MODRM, X86_REG_C, X86_REG_A);
+	x86_encoder_write_cmp_imm(enc, X86_REG_C, vl->lanes);
+	x86_encoder_write_jmp_cond(enc, X86_COND_B, skip);
+
+	//Pointers stored through must be equal to or at least a vector away
+	//from the others: -WIDTH < p - q < WIDTH fails unless p == q
+	for (size_t p = 0; p < count; ++p) {
+		if (!(vl->access[p] & LOWER_VECTOR_STORED))
+			continue;
+		for (size_t q = 0; q < count; ++q) {
+			if (q == p || !vl->access[q] || ((vl->access[q] & LOWER_VECTOR_STORED) && q < p))
+				continue;
+			struct Operand x = lower_home_operand(l, p);
+			struct Operand y = lower_home_operand(l, q);
+			size_t apart = x86_encoder_add_label(enc);
+			lower_load_integer(l, X86_REG_A, &x);
+			lower_load_integer(l, X86_REG_R11, &y);
+			x86_encoder_write_modrm(enc, X86_SUB_MODRM, X86_REG_A, X86_REG_R11);
+			x86_encoder_write_jmp_cond(enc, X86_COND_E, apart);
+			x86_encoder_write_op_imm(enc, X86_OP_MODRM_ADD, X86_REG_A, LOWER_VECTOR_WIDTH - 1);
+			x86_encoder_write_cmp_imm(enc, X86_REG_A, 2 * LOWER_VECTOR_WIDTH - 2);
+			x86_encoder_write_jmp_cond(enc, X86_COND_NA, skip);
+			x86_encoder_move_label(enc, apart);
+		}
+	}
+
+	//Loop invariants and immediates stay in their registers
+	for (size_t home = 0; home < count; ++home) {
+		if (vl->roles[home] == LOWER_VECTOR_INVARIANT) {
+			struct Operand value = lower_home_operand(l, home);
+			lower_vector_broadcast(l, vl, vl->registers[home], &value);
+		}
+	}
+	for (int i = vl->header + 1; i < vl->back; ++i) {
+		for (int o = OPERAND_PRIMARY_1; o <= OPERAND_PRIMARY_2; ++o) {
+			struct Operand* operand = &fn->opcodes[i].operands[o];
+			if (vl->immediates[i * 3 + o] >= 0)
+				lower_vector_broadcast(l, vl, vl->immediates[i * 3 + o], operand);
+		}
+	}
+	x86_encoder_write_modrm(enc, X86_MOV_MODRM, X86_REG_D, X86_REG_C);
+	int shift = 0;
+	while ((1 << shift) < vl->lanes)
+		shift += 1;
+	x86_encoder_write_shift_imm(enc, X86_SHIFT_MODRM_SHR, X86_REG_D, shift);
+
+	//RDX counts the vector iterations left
+	x86_encoder_move_label(enc, body);
+	for (int i = vl->header + 1; i < vl->back; ++i) {
+		struct Opcode* op = &fn->opcodes[i];
+		struct Operand* target = &op->operands[OPERAND_TARGET];
+		struct Operand* x = &op->operands[OPERAND_PRIMARY_1];
+		int home = lower_home_index(l, target);
+		if (op->type == OPCODE_NOP)
+			continue;
+
+		if (target->info_flags & OPERAND_FLAG_DEREFERENCE) {
+			char value = x->info_type == OPERAND_INFO_TYPE_IMMEDIATE ? vl->immediates[i * 3 + OPERAND_PRIMARY_1]
+				: vl->registers[lower_home_index(l, x)];
+			x86_encoder_write_vex_modrm(enc, 0, X86_VEX_MAP_0F, 0, 1, X86_0F_MOVUPS_STORE, 1, lower_vector_base(l, target), 0, value, 0);
+		} else if (home == vl->counter) {
+			lower_vector_advance(l, target, vl->lanes);
+		} else if (vl->roles[home] == LOWER_VECTOR_POINTER) {
+			lower_vector_advance(l, target, vl->lanes * vl->steps[home]);
+		} else if (x->info_flags & OPERAND_FLAG_DEREFERENCE) {
+			x86_encoder_write_vex_modrm(enc, 0, X86_VEX_MAP_0F, 0, 1, X86_0F_MOVUPS_LOAD, 1, lower_vector_base(l, x), 0, vl->registers[home], 0);
+		} else {
+			char operands[2];
+			for (int o = 0; o < 2; ++o) {
+				struct Operand* operand = &op->operands[OPERAND_PRIMARY_1 + o];
+				operands[o] = operand->info_type == OPERAND_INFO_TYPE_IMMEDIATE ? vl->immediates[i * 3 + OPERAND_PRIMARY_1 + o]
+					: vl->registers[lower_home_index(l, operand)];
+			}
+			unsigned char prefix, opcode;
+			int map;
+			lower_vector_operation(op->type, vl->type, &prefix, &map, &opcode);
+			x86_encoder_write_vex_modrm(enc, prefix, map, 0, 1, opcode, 0, operands[1], 0, vl->registers[home], operands[0]);
+		}
+	}
+	x86_encoder_write_op_imm(enc, X86_OP_MODRM_SUB, X86_REG_D, 1);
+	x86_encoder_write_jmp_cond(enc, X86_COND_NZ, body);
+	x86_encoder_write_vzeroupper(enc);
+	x86_encoder_move_label(enc, skip);
+}
+
+/*
+	Instrumentation
+
+	With a profile to count into, every block increments its entry counter
+	when entered and every conditional jump increments the fall-through
+	counter of its block when not taken. An increment takes RAX and R11
+	and clobbers the flags, which are all free between opcodes. Sharded
+	profiles pick the shard from the stack pointer. Vectorized loops are
+	not emitted while counting since their iterations would not be seen.
+*/
+
+// Emits an increment of the counter "index" of the instrumented function
+void lower_count(struct Lowering* l, size_t index)
+{
+	struct x86_encoder* enc = l->enc;
+	struct Profile* profile = l->env->instrument;
+	struct FunctionProfile* fp = l->counters;
+	size_t shards = profile_shards(profile);
+
+	x86_encoder_write_mov_imm(enc, X86_REG_R11, (int64_t)(uintptr_t)&fp->counters[index]);
+	if (shards > 1) {
+		int shift = 0;
+		while (((size_t)1 << shift) < fp->stride)
+			shift += 1;
+		x86_encoder_write_modrm(enc, X86_MOV_MODRM, X86_REG_A, X86_REG_SP);
+		x86_encoder_write_shift_imm(enc, X86_SHIFT_MODRM_SHR, X86_REG_A, PROFILE_SHARD_SHIFT);
+		x86_encoder_write_op_imm(enc, X86_OP_MODRM_AND, X86_REG_A, shards - 1);
+		x86_encoder_write_shift_imm(enc, X86_SHIFT_MODRM_SHL, X86_REG_A, shift);
+		x86_encoder_write_modrm(enc, X86_ADD_MODRM, X86_REG_R11, X86_REG_A);
+	}
+	x86_encoder_write_modrm_generic(enc, profile->atomic ? X86_PREFIX_LOCK : 0, 0, X86_FF_MODRM,
+		1, X86_REG_R11, 0, X86_FF_MODRM_INC, 1);
+}
+
+
+// Whether the lowering handles every operand of the function
+int lower_is_supported(struct Function* fn)
+{
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		for (int o = 0; o < 3; ++o) {
+			if (opcode_is_jump(&fn->opcodes[i]) && o == OPERAND_TARGET)
+				continue;
+			if (fn->opcodes[i].operands[o].info_type == OPERAND_INFO_TYPE_CONSTANT)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+// Lowers the function at the current position of the encoder.
+// Returns 0 on success, -1 if the function uses something the lowering
+// does not support
+int lower_function(struct x86_encoder* enc, struct Function* fn, struct LowerEnvironment* env)
+{
+	struct Lowering l;
+	memset(&l, 0, sizeof l);
+	l.enc = enc;
+	l.function = fn;
+	l.env = env;
+	l.features = lower_cpu_features();
+	l.analysis = analysis_manager_get(env->analyses, fn);
+	if (!lower_is_supported(fn))
+		goto fail;
+	size_t first = enc->instructions_size;
+	size_t first_label = enc->labels_size;
+
+	lower_assign_homes(&l);
+	l.labels = malloc((fn->opcodes_size + 1) * sizeof *l.labels);
+	for (size_t i = 0; i <= fn->opcodes_size; ++i)
+		l.labels[i] = x86_encoder_add_label(enc);
+
+	struct FunctionAnalysis* a = l.analysis;
+	if (env->instrument)
+		l.counters = profile_add_function(env->instrument, fn, a->blocks_size);
+
+	l.references = calloc(fn->variables_size + 1, sizeof *l.references);
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &fn->opcodes[i].operands[o];
+			if (operand_is_variable(operand) && !(o == OPERAND_TARGET && opcode_is_jump(&fn->opcodes[i])))
+				l.references[operand->ref_id] += 1;
+		}
+	}
+
+	lower_prologue(&l);
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		struct LowerVectorLoop vl;
+		if (!l.counters && lower_find_vector_loop(&l, i, &vl)) {
+			lower_vector_loop(&l, &vl);
+			free_vector_loop(&vl);
+		}
+		x86_encoder_move_label(enc, l.labels[i]);
+		int block = a->opcode_blocks[i];
+		if (l.counters && block >= 0 && a->blocks[block].start == (int)i)
+			lower_count(&l, block);
+		struct LowerSwitch sw;
+		if (lower_is_fused_branch(&l, i)) {
+			if (lower_fused_branch(&l, i))
+				goto fail;
+			i += 1;
+			x86_encoder_move_label(enc, l.labels[i]);
+		} else if (lower_find_switch(&l, i, &sw)) {
+			int failed = lower_switch(&l, &sw);
+			for (size_t k = 1; k < sw.length; ++k)
+				x86_encoder_move_label(enc, l.labels[i + k]);
+			i += sw.length - 1;
+			free_lower_switch(&sw);
+			if (failed)
+				goto fail;
+		} else if (lower_opcode(&l, &fn->opcodes[i])) {
+			goto fail;
+		}
+		if (l.counters && block >= 0 && a->blocks[block].end == (int)i + 1 && a->blocks[block].successors_size == 2)
+			lower_count(&l, a->blocks_size + block);
+	}
+	x86_encoder_move_label(enc, l.labels[fn->opcodes_size]);
+	lower_epilogue_body(&l);
+	x86_encoder_write_ret(enc);
+	lower_peephole(&l, first, first_label);
+	lower_write_tables(&l);
+
+	int result = 0;
+	if (0) {
+fail:
+		result = -1;
+	}
+	free(l.labels);
+	free(l.homes);
+	free(l.places);
+	free(l.arguments);
+	free(l.references);
+	free_lower_tables(&l);
+	free_frame_layout(&l.layout);
+	analysis_manager_release(env->analyses, l.analysis, 0);
+	return result;
+}
+
+
+/*
+	Tiered compilation
+
+	Functions start out as baseline code, lowered in a single pass without
+	analysing the function: every variable and argument gets its own frame
+	slot and each opcode is lowered on its own. This is several times
+	faster to produce than the optimizing lowering, at the price of
+	keeping every value in memory.
+
+	Baseline code counts its calls down before the prologue. The call that
+	reaches zero saves the argument registers and queues the function for
+	the optimizing lowering, which runs on a background thread. Calls
+	between functions are late bound through the environment, so storing
+	the optimized entry point in it moves every later call over. Calls
+	already running finish in the baseline code, which is only unmapped
+	with the tiers. The countdown is decremented without a lock: a race
+	can lose a decrement or reach zero twice, queueing ignores repeats.
+*/
+
+enum
+{
+	LOWER_TIER_BASELINE,
+	LOWER_TIER_QUEUED,
+	LOWER_TIER_OPTIMIZED,
+	LOWER_TIER_FAILED, //The optimizing lowering failed, the baseline code stays
+};
+
+struct LowerTierFunction
+{
+	struct LowerTiers* tiers;
+	struct Function* function; //Null for ids without a function
+	int64_t countdown; //Calls left until optimizing, decremented by the baseline code
+	int state; //LOWER_TIER_*
+	void* baseline;
+	size_t baseline_size;
+	void* optimized; //Null until optimized
+	size_t optimized_size;
+};
+
+struct LowerTiers
+{
+	struct LowerEnvironment env; //Late bound, "functions" holds the current entry points
+	struct LowerTierFunction* functions; //By function id
+	size_t functions_size;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed; //Signaled when the queue or a state changes
+	int* queue; //Ids of the functions to optimize
+	size_t queue_size;
+	size_t queue_capacity;
+	int compiling; //Whether the thread is lowering a function
+	int running; //Whether the thread was started
+	int stop;
+};
+
+// Lowers the function without analysis, every value living in the frame.
+// With "countdown" set the code decrements it when called and calls
+// "expired(data)" when it reaches zero. Returns 0 on success, -1 if the
+// function uses something the lowering does not support
+int lower_function_baseline(struct x86_encoder* enc, struct Function* fn, struct LowerEnvironment* env,
+	int64_t* countdown, void (*expired)(void*), void* data)
+{
+	struct Lowering l;
+	memset(&l, 0, sizeof l);
+	l.enc = enc;
+	l.function = fn;
+	l.env = env;
+	l.features = lower_cpu_features();
+	if (!lower_is_supported(fn))
+		return -1;
+
+	size_t count = fn->variables_size + fn->arguments_size;
+	l.homes = calloc(count + 1, sizeof *l.homes);
+	l.places = malloc((fn->arguments_size + 1) * sizeof *l.places);
+	int hidden = lower_returns_in_memory(&fn->return_type);
+	lower_place_values(fn->arguments, fn->arguments_size, hidden, l.places);
+
+	//One slot for every value, in order
+	int area = lower_outgoing_size(fn);
+	for (size_t i = 0; i < count; ++i) {
+		struct TypeInfo* type_info = i < fn->variables_size ? &fn->variables[i].type_info : &fn->arguments[i - fn->variables_size];
+		if (i >= fn->variables_size && l.places[i - fn->variables_size].in_memory)
+			continue;
+		int alignment = type_info_alignment(type_info) > 8 ? type_info_alignment(type_info) : 8;
+		area = (area + alignment - 1) & -alignment;
+		l.homes[i].kind = LOWER_HOME_FRAME;
+		l.homes[i].offset = area;
+		area += lower_type_words(type_info) * 8;
+	}
+	l.sret_offset = -1;
+	if (hidden) {
+		l.sret_offset = area;
+		area += 8;
+	}
+	lower_finish_frame(&l, area);
+
+	l.labels = malloc((fn->opcodes_size + 1) * sizeof *l.labels);
+	for (size_t i = 0; i <= fn->opcodes_size; ++i)
+		l.labels[i] = x86_encoder_add_label(enc);
+
+	size_t expire = x86_encoder_add_label(enc);
+	size_t resume = x86_encoder_add_label(enc);
+	if (countdown) {
+		x86_encoder_write_mov_imm_64(enc, X86_REG_R11, (uint64_t)(uintptr_t)countdown);
+		x86_encoder_write_modrm_generic(enc, 0, 0, X86_FF_MODRM, 1, X86_REG_R11, 0, X86_FF_MODRM_DEC, 1);
+		x86_encoder_write_jmp_cond(enc, X86_COND_Z, expire);
+		x86_encoder_move_label(enc, resume);
+	}
+	lower_prologue(&l);
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		x86_encoder_move_label(enc, l.labels[i]);
+		if (lower_opcode(&l, &fn->opcodes[i]))
+			goto fail;
+	}
+	x86_encoder_move_label(enc, l.labels[fn->opcodes_size]);
+	lower_epilogue_body(&l);
+	x86_encoder_write_ret(enc);
+
+	//Out of line: keep every argument register across the call, the
+	//7 pushes and 8 vector registers keep the stack 16 byte aligned
+	if (countdown) {
+		static const char saved[] = {X86_REG_DI, X86_REG_SI, X86_REG_D, X86_REG_C, X86_REG_R8, X86_REG_R9, X86_REG_A};
+		x86_encoder_move_label(enc, expire);
+		for (size_t r = 0; r < sizeof saved; ++r)
+			x86_encoder_write_push(enc, saved[r]);
+		x86_encoder_write_op_imm(enc, X86_OP_MODRM_SUB, X86_REG_SP, 64);
+		for (int x = 0; x < 8; ++x)
+			x86_encoder_write_modrm_generic(enc, X86_PREFIX_SD, 1, X86_0F_SSE_STORE, 1, X86_REG_SP, 8 * x, x, 0);
+		x86_encoder_write_mov_imm_64(enc, X86_REG_DI, (uint64_t)(uintptr_t)data);
+		x86_encoder_write_mov_imm_64(enc, X86_REG_R11, (uint64_t)(uintptr_t)expired);
+		x86_encoder_write_jmp_reg(enc, 1, X86_REG_R11);
+		for (int x = 0; x < 8; ++x)
+			x86_encoder_write_modrm_generic(enc, X86_PREFIX_SD, 1, X86_0F_SSE_LOAD, 1, X86_REG_SP, 8 * x, x, 0);
+		x86_encoder_write_op_imm(enc, X86_OP_MODRM_ADD, X86_REG_SP, 64);
+		for (size_t r = sizeof saved; r > 0; --r)
+			x86_encoder_write_pop(enc, saved[r - 1]);
+		x86_encoder_write_jmp(enc, 0, resume);
+	}
+
+	int result = 0;
+	if (0) {
+fail:
+		result = -1;
+	}
+	free(l.labels);
+	free(l.homes);
+	free(l.places);
+	free(l.arguments);
+	return result;
+}
+
+// Links the code of the encoder into new executable memory. Returns null
+// on failure
+void* lower_map_code(struct x86_encoder* enc, size_t* size)
+{
+	*size = enc->buffer_size ? enc->buffer_size : 1;
+	char* code = mmap(0, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+		return 0;
+	if (x86_encoder_link_to_memory(enc, code) || mprotect(code, *size, PROT_READ | PROT_EXEC)) {
+		munmap(code, *size);
+		return 0;
+	}
+	return code;
+}
+
+// Queues the function for optimizing, called by the baseline code
+void lower_tiers_expired(void* data)
+{
+	struct LowerTierFunction* tf = data;
+	struct LowerTiers* tiers = tf->tiers;
+	pthread_mutex_lock(&tiers->lock);
+	if (tf->state == LOWER_TIER_BASELINE) {
+		tf->state = LOWER_TIER_QUEUED;
+		DYNAMIC_ARRAY_PUSH(tiers->queue, tiers->queue_size, tiers->queue_capacity, tf->function->id, 16);
+		pthread_cond_broadcast(&tiers->changed);
+	}
+	pthread_mutex_unlock(&tiers->lock);
+}
+
+void* lower_tiers_thread(void* data)
+{
+	struct LowerTiers* tiers = data;
+	pthread_mutex_lock(&tiers->lock);
+	for (;;) {
+		while (!tiers->stop && !tiers->queue_size)
+			pthread_cond_wait(&tiers->changed, &tiers->lock);
+		if (tiers->stop)
+			break;
+		struct LowerTierFunction* tf = &tiers->functions[tiers->queue[0]];
+		memmove(tiers->queue, tiers->queue + 1, --tiers->queue_size * sizeof *tiers->queue);
+		tiers->compiling = 1;
+		pthread_mutex_unlock(&tiers->lock);
+
+		//The function and the environment are only read, so lowering
+		//runs unlocked next to the running code
+		struct x86_encoder enc;
+		memset(&enc, 0, sizeof enc);
+		void* code = 0;
+		size_t size = 0;
+		if (!lower_function(&enc, tf->function, &tiers->env))
+			code = lower_map_code(&enc, &size);
+		x86_encoder_free(&enc);
+
+		pthread_mutex_lock(&tiers->lock);
+		tf->optimized = code;
+		tf->optimized_size = size;
+		tf->state = code ? LOWER_TIER_OPTIMIZED : LOWER_TIER_FAILED;
+		if (code)
+			__atomic_store_n(&tiers->env.functions[tf->function->id], code, __ATOMIC_RELEASE);
+		tiers->compiling = 0;
+		pthread_cond_broadcast(&tiers->changed);
+	}
+	pthread_mutex_unlock(&tiers->lock);
+	return 0;
+}
+
+void lower_tiers_free(struct LowerTiers* tiers);
+
+// Lowers the functions, indexed by their ids, to baseline code and
+// starts the optimizing thread. "natives" are the addresses of the ids
+// without a function. A function is optimized after "threshold" calls,
+// never if it is 0. Returns 0 on success, -1 if a function could not be
+// lowered
+int lower_tiers_init(struct LowerTiers* tiers, struct Function** functions, size_t functions_size,
+	void** natives, size_t natives_size, int64_t threshold)
+{
+	memset(tiers, 0, sizeof *tiers);
+	size_t size = natives_size;
+	for (size_t i = 0; i < functions_size; ++i) {
+		if (functions[i]->id < 0)
+			return -1;
+		if ((size_t)functions[i]->id >= size)
+			size = functions[i]->id + 1;
+	}
+	tiers->env.functions = calloc(size + 1, sizeof *tiers->env.functions);
+	tiers->env.functions_size = size;
+	tiers->env.late_binding = 1;
+	if (natives_size)
+		memcpy(tiers->env.functions, natives, natives_size * sizeof *natives);
+	tiers->functions = calloc(size + 1, sizeof *tiers->functions);
+	tiers->functions_size = size;
+	pthread_mutex_init(&tiers->lock, 0);
+	pthread_cond_init(&tiers->changed, 0);
+
+	int result = 0;
+	for (size_t i = 0; i < functions_size && !result; ++i) {
+		struct LowerTierFunction* tf = &tiers->functions[functions[i]->id];
+		tf->tiers = tiers;
+		tf->function = functions[i];
+		tf->countdown = threshold;
+		tf->state = LOWER_TIER_BASELINE;
+
+		struct x86_encoder enc;
+		memset(&enc, 0, sizeof enc);
+		result = lower_function_baseline(&enc, tf->function, &tiers->env,
+			threshold > 0 ? &tf->countdown : 0, lower_tiers_expired, tf);
+		if (!result)
+			tf->baseline = lower_map_code(&enc, &tf->baseline_size);
+		x86_encoder_free(&enc);
+		if (!result && !tf->baseline)
+			result = -1;
+		tiers->env.functions[tf->function->id] = tf->baseline;
+	}
+	if (!result) {
+		tiers->running = !pthread_create(&tiers->thread, 0, lower_tiers_thread, tiers);
+		result = tiers->running ? 0 : -1;
+	}
+	if (result) {
+		lower_tiers_free(tiers);
+		return -1;
+	}
+	return 0;
+}
+
+// Current entry point of the function id
+void* lower_tiers_entry(struct LowerTiers* tiers, int id)
+{
+	return __atomic_load_n(&tiers->env.functions[id], __ATOMIC_ACQUIRE);
+}
+
+// Waits until every queued function has been optimized
+void lower_tiers_wait(struct LowerTiers* tiers)
+{
+	pthread_mutex_lock(&tiers->lock);
+	while (tiers->queue_size || tiers->compiling)
+		pthread_cond_wait(&tiers->changed, &tiers->lock);
+	pthread_mutex_unlock(&tiers->lock);
+}
+
+// Stops the optimizing thread and unmaps all code. Nothing may be
+// running in it anymore
+void lower_tiers_free(struct LowerTiers* tiers)
+{
+	if (tiers->running) {
+		pthread_mutex_lock(&tiers->lock);
+		tiers->stop = 1;
+		pthread_cond_broadcast(&tiers->changed);
+		pthread_mutex_unlock(&tiers->lock);
+		pthread_join(tiers->thread, 0);
+	}
+	for (size_t i = 0; i < tiers->functions_size; ++i) {
+		struct LowerTierFunction* tf = &tiers->functions[i];
+		if (tf->baseline)
+			munmap(tf->baseline, tf->baseline_size);
+		if (tf->optimized)
+			munmap(tf->optimized, tf->optimized_size);
+	}
+	pthread_mutex_destroy(&tiers->lock);
+	pthread_cond_destroy(&tiers->changed);
+	free(tiers->functions);
+	free(tiers->env.functions);
+	free(tiers->queue);
+	memset(tiers, 0, sizeof *tiers);
+}
+
+
+/*
+	Compilation cache
+
+	Maps functions to their linked code, so lowering a function that was
+	lowered before costs a hash and a lookup. The key is the hash of the
+	function combined with everything else the code depends on: the CPU
+	features and the addresses of the environment the code embeds. The
+	code holds no other absolute addresses and all jumps are relative, so
+	the bytes work wherever they are copied to.
+
+	The cache keeps the most recently used code up to "capacity" bytes in
+	memory. With a directory it also keeps every code in a file named by
+	its key, which outlives the process. Functions not calling others
+	hit there from any process, the others only while the environment is
+	at the same addresses.
+
+	Lowering with a profile, counting into one or linking a module
+	bypasses the cache, as the code then depends on the counts or on
+	where the other functions are. A cache is used by one thread at a
+	time.
+*/
+
+#define LOWER_CACHE_MAGIC (0x4343524Cu) //"LRCC"
+
+struct LowerCacheEntry
+{
+	uint64_t key;
+	struct LowerCacheEntry* next; //Next entry of the bucket
+	struct LowerCacheEntry* newer; //Neighbours in order of use
+	struct LowerCacheEntry* older;
+	size_t size;
+	char code[];
+};
+
+struct LowerCacheStats
+{
+	uint64_t lookups;
+	uint64_t hits; //Found in memory
+	uint64_t disk_hits; //Found in the directory
+	uint64_t misses; //Lowered
+	uint64_t evictions;
+	uint64_t bypassed; //Not cacheable, lowered
+	size_t entries; //In memory
+	size_t bytes; //Code in memory
+	size_t bytes_written; //Code written to the directory
+};
+
+struct LowerCache
+{
+	struct LowerCacheEntry** buckets;
+	size_t mask; //Buckets - 1, a power of two minus one
+	struct LowerCacheEntry* newest;
+	struct LowerCacheEntry* oldest;
+	size_t capacity; //Bytes of code kept in memory
+	char* directory; //Null for none
+	struct LowerCacheStats stats;
+};
+
+// Key of the function lowered in the environment. Returns 0 if the code
+// cannot be cached
+int lower_cache_key(struct Function* fn, struct LowerEnvironment* env, uint64_t* key)
+{
+	if (env->profile || env->instrument || env->labels)
+		return 0;
+	uint64_t hash = hash_mix(function_hash(fn), lower_cpu_features() | (uint64_t)env->late_binding << 32);
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &fn->opcodes[i].operands[o];
+			if (operand->info_type != OPERAND_INFO_TYPE_FUNCTION || (o == OPERAND_TARGET && opcode_is_jump(&fn->opcodes[i])))
+				continue;
+			int id = operand->ref_id;
+			if (id < 0 || (size_t)id >= env->functions_size)
+				return 0;
+			hash = hash_mix(hash, env->late_binding ? (uintptr_t)&env->functions[id] : (uintptr_t)env->functions[id]);
+		}
+	}
+	*key = hash;
+	return 1;
+}
+
+void lower_cache_init(struct LowerCache* cache, size_t capacity, const char* directory)
+{
+	memset(cache, 0, sizeof *cache);
+	cache->mask = 255;
+	cache->buckets = calloc(cache->mask + 1, sizeof *cache->buckets);
+	cache->capacity = capacity;
+	if (directory)
+		cache->directory = strdup(directory);
+}
+
+void lower_cache_unlink(struct LowerCache* cache, struct LowerCacheEntry* entry)
+{
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+}
+
+void lower_cache_link_newest(struct LowerCache* cache, struct LowerCacheEntry* entry)
+{
+	entry->newer = 0;
+	entry->older = cache->newest;
+	if (cache->newest)
+		cache->newest->newer = entry;
+	else
+		cache->oldest = entry;
+	cache->newest = entry;
+}
+
+struct LowerCacheEntry* lower_cache_find(struct LowerCache* cache, uint64_t key)
+{
+	struct LowerCacheEntry* entry = cache->buckets[key & cache->mask];
+	while (entry && entry->key != key)
+		entry = entry->next;
+	return entry;
+}
+
+void lower_cache_evict(struct LowerCache* cache)
+{
+	struct LowerCacheEntry* entry = cache->oldest;
+	lower_cache_unlink(cache, entry);
+	struct LowerCacheEntry** link = &cache->buckets[entry->key & cache->mask];
+	while (*link != entry)
+		link = &(*link)->next;
+	*link = entry->next;
+	cache->stats.entries -= 1;
+	cache->stats.bytes -= entry->size;
+	cache->stats.evictions += 1;
+	free(entry);
+}
+
+void lower_cache_insert(struct LowerCache* cache, uint64_t key, const char* code, size_t size)
+{
+	if (size > cache->capacity)
+		return;
+	while (cache->stats.bytes + size > cache->capacity)
+		lower_cache_evict(cache);
+
+	//Rehashes at one entry per bucket
+	if (cache->stats.entries > cache->mask) {
+		size_t mask = cache->mask * 2 + 1;
+		struct LowerCacheEntry** buckets = calloc(mask + 1, sizeof *buckets);
+		for (size_t b = 0; b <= cache->mask; ++b) {
+			struct LowerCacheEntry* entry = cache->buckets[b];
+			while (entry) {
+				struct LowerCacheEntry* next = entry->next;
+				entry->next = buckets[entry->key & mask];
+				buckets[entry->key & mask] = entry;
+				entry = next;
+			}
+		}
+		free(cache->buckets);
+		cache->buckets = buckets;
+		cache->mask = mask;
+	}
+
+	struct LowerCacheEntry* entry = malloc(sizeof *entry + size);
+	entry->key = key;
+	entry->size = size;
+	memcpy(entry->code, code, size);
+	entry->next = cache->buckets[key & cache->mask];
+	cache->buckets[key & cache->mask] = entry;
+	lower_cache_link_newest(cache, entry);
+	cache->stats.entries += 1;
+	cache->stats.bytes += size;
+}
+
+// Path of the file of the key in the directory
+void lower_cache_path(struct LowerCache* cache, uint64_t key, char* path, size_t path_size)
+{
+	snprintf(path, path_size, "%s/%016llx.code", cache->directory, (unsigned long long)key);
+}
+
+// Reads the code of the key from the directory into new memory. Files
+// start with the magic, the key and the size of the code
+char* lower_cache_read(struct LowerCache* cache, uint64_t key, size_t* size)
+{
+	char path[4096];
+	lower_cache_path(cache, key, path, sizeof path);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	uint64_t header[3];
+	char* code = 0;
+	if (read(fd, header, sizeof header) == sizeof header && header[0] == LOWER_CACHE_MAGIC && header[1] == key && header[2]) {
+		code = malloc(header[2]);
+		if (read(fd, code, header[2]) != (ssize_t)header[2]) {
+			free(code);
+			code = 0;
+		}
+		*size = header[2];
+	}
+	close(fd);
+	return code;
+}
+
+// Writes the code to the directory. It is written to a temporary file
+// first and renamed, so readers never see a partial file
+void lower_cache_write(struct LowerCache* cache, uint64_t key, const char* code, size_t size)
+{
+	char path[4096];
+	char temporary[4096 + 32];
+	lower_cache_path(cache, key, path, sizeof path);
+	snprintf(temporary, sizeof temporary, "%s.%d.tmp", path, (int)getpid());
+	int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+	uint64_t header[3] = {LOWER_CACHE_MAGIC, key, size};
+	int ok = write(fd, header, sizeof header) == sizeof header && write(fd, code, size) == (ssize_t)size;
+	ok = !close(fd) && ok;
+	if (ok && !rename(temporary, path))
+		cache->stats.bytes_written += size;
+	else
+		unlink(temporary);
+}
+
+// Copies the code into new executable memory
+void* lower_cache_map(const char* code, size_t size)
+{
+	char* memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return 0;
+	memcpy(memory, code, size);
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC)) {
+		munmap(memory, size);
+		return 0;
+	}
+	return memory;
+}
+
+// Lowers the function into new executable memory of "size" bytes, which
+// the caller unmaps, taking the code from the cache when it is there.
+// Returns null if the function cannot be lowered
+void* lower_cache_compile(struct LowerCache* cache, struct Function* fn, struct LowerEnvironment* env, size_t* size)
+{
+	uint64_t key;
+	int cacheable = lower_cache_key(fn, env, &key);
+	if (cacheable) {
+		cache->stats.lookups += 1;
+		struct LowerCacheEntry* entry = lower_cache_find(cache, key);
+		if (entry) {
+			cache->stats.hits += 1;
+			lower_cache_unlink(cache, entry);
+			lower_cache_link_newest(cache, entry);
+			*size = entry->size;
+			return lower_cache_map(entry->code, entry->size);
+		}
+		char* code = cache->directory ? lower_cache_read(cache, key, size) : 0;
+		if (code) {
+			cache->stats.disk_hits += 1;
+			lower_cache_insert(cache, key, code, *size);
+			void* memory = lower_cache_map(code, *size);
+			free(code);
+			return memory;
+		}
+		cache->stats.misses += 1;
+	} else {
+		cache->stats.bypassed += 1;
+	}
+
+	struct x86_encoder enc;
+	memset(&enc, 0, sizeof enc);
+	void* memory = 0;
+	if (!lower_function(&enc, fn, env))
+		memory = lower_map_code(&enc, size);
+	x86_encoder_free(&enc);
+	if (memory && cacheable) {
+		lower_cache_insert(cache, key, memory, *size);
+		if (cache->directory)
+			lower_cache_write(cache, key, memory, *size);
+	}
+	return memory;
+}
+
+// Share of the lookups found in memory or in the directory
+double lower_cache_hit_rate(struct LowerCache* cache)
+{
+	if (!cache->stats.lookups)
+		return 0;
+	return (double)(cache->stats.hits + cache->stats.disk_hits) / cache->stats.lookups;
+}
+
+void lower_cache_free(struct LowerCache* cache)
+{
+	while (cache->oldest)
+		lower_cache_evict(cache);
+	free(cache->buckets);
+	free(cache->directory);
+	memset(cache, 0, sizeof *cache);
+}
+
+
+/*
+	Module linking
+
+	Lowers every function of a module into one code region. Each function
+	gets an encoder label, so calls between them are direct relative
+	calls and jumps resolved when linking, and function addresses are
+	RIP relative. Only the calls of native functions go through the
+	environment.
+
+	Functions are placed in the bottom-up order of the module, which puts
+	callees right in front of their first callers, and start at 16 bytes.
+*/
+
+#define LOWER_FUNCTION_ALIGNMENT (16)
+
+struct LowerModule
+{
+	char* code;
+	size_t size;
+	void** functions; //Address of every function id, the natives included
+	size_t functions_size;
+	struct x86_peephole_stats peephole; //Saved by the peephole pass over all functions
+};
+
+// Lowers and links the functions of the analysed module. "natives" are
+// the addresses of the ids without a function in the module. Returns 0
+// on success, -1 if a function could not be lowered or linked
+int lower_module(struct LowerModule* out, struct Module* module, void** natives, size_t natives_size)
+{
+	memset(out, 0, sizeof *out);
+	size_t size = module->table.functions_size > natives_size ? module->table.functions_size : natives_size;
+	struct LowerEnvironment env;
+	memset(&env, 0, sizeof env);
+	env.functions = calloc(size + 1, sizeof *env.functions);
+	env.functions_size = size;
+	if (natives_size)
+		memcpy(env.functions, natives, natives_size * sizeof *natives);
+	env.labels = malloc((size + 1) * sizeof *env.labels);
+	env.peephole = &out->peephole;
+
+	struct x86_encoder enc;
+	memset(&enc, 0, sizeof enc);
+	for (size_t id = 0; id < size; ++id)
+		env.labels[id] = module_find(module, id) ? x86_encoder_add_label(&enc) : LOWER_NO_LABEL;
+
+	int result = 0;
+	for (size_t i = 0; i < module->order_size && !result; ++i) {
+		struct Function* fn = module_find(module, module->order[i]);
+		while (enc.buffer_size % LOWER_FUNCTION_ALIGNMENT)
+			x86_encoder_write_nop(&enc);
+		x86_encoder_move_label(&enc, env.labels[fn->id]);
+		result = lower_function(&enc, fn, &env);
+	}
+	if (!result)
+		out->code = lower_map_code(&enc, &out->size);
+	if (out->code) {
+		for (size_t id = 0; id < size; ++id) {
+			if (env.labels[id] != LOWER_NO_LABEL)
+				env.functions[id] = out->code + enc.labels[env.labels[id]];
+		}
+		out->functions = env.functions;
+		out->functions_size = size;
+	} else {
+		free(env.functions);
+		result = -1;
+	}
+	x86_encoder_free(&enc);
+	free(env.labels);
+	return result;
+}
+
+void lower_module_free(struct LowerModule* lowered)
+{
+	if (lowered->code)
+		munmap(lowered->code, lowered->size);
+	free(lowered->functions);
+	memset(lowered, 0, sizeof *lowered);
+}
+
+
+/*
+	Parallel module compilation
+
+	Compiles a module on a pool of threads. Every worker has a deque of
+	tasks: it pushes and pops at the bottom of its own and, once that is
+	empty, steals from the top of the others, so work spreads without a
+	shared queue. Each deque has a lock of its own, held only to move
+	an index.
+
+	A task optimizes a component of the call graph, inlining into its
+	functions first, and then queues the encoding of each of them on the
+	worker. Inlining reads the callees, so a component becomes ready once
+	every component it calls is optimized, which follows the bottom-up
+	order. Without inlining all components are ready from the start.
+	Functions are encoded into encoders of their own, with a label for
+	every function of the module they refer to.
+
+	When all are encoded the functions are laid out in bottom-up order
+	and linked in parallel: a label of a callee becomes the distance to
+	it, and every encoder writes its code straight into the region.
+*/
+
+enum
+{
+	LOWER_TASK_OPTIMIZE, //Index of a component
+	LOWER_TASK_ENCODE, //Function id
+	LOWER_TASK_LINK, //Index of a range of the bottom-up order
+};
+
+struct LowerTask
+{
+	int kind;
+	int index;
+};
+
+struct LowerDeque
+{
+	pthread_mutex_t lock;
+	struct LowerTask* tasks; //Tasks from "top" up to "bottom"
+	size_t top;
+	size_t bottom;
+	size_t capacity;
+};
+
+// Code of a function until it is linked
+struct LowerPiece
+{
+	struct x86_encoder enc;
+	int* callees; //Functions of the module the code refers to
+	size_t* labels; //Their labels in the encoder
+	size_t callees_size;
+	size_t callees_capacity;
+	size_t offset; //Place in the code region
+	size_t padding; //Bytes up to the next function
+};
+
+struct LowerPipeline
+{
+	struct Module* module;
+	struct LowerEnvironment env; //Natives for every worker, without labels
+	struct InlineParameters* inline_params; //Null to not inline
+	int optimize;
+	int* depth; //Inlining depth of every function id
+	size_t* component_start; //Members of a component in the bottom-up order, and one past the last
+	size_t* dependents_start; //Components calling a component, and one past the last
+	int* dependents;
+	int* pending; //Called components of each component not optimized yet
+	struct LowerPiece* pieces; //By function id
+	char* code;
+	size_t link_range; //Functions linked by a task
+
+	struct LowerDeque* deques;
+	int threads;
+	size_t remaining; //Tasks of the phase not done yet
+	int failed;
+};
+
+struct LowerWorker
+{
+	struct LowerPipeline* pipeline;
+	int index;
+	unsigned seed;
+	size_t* labels; //Labels of the function being encoded, by function id
+	struct AnalysisManager analyses; //Of the functions this worker optimized
+	struct x86_peephole_stats peephole; //Saved on the functions this worker encoded
+};
+
+void lower_deque_push(struct LowerDeque* deque, int kind, int index)
+{
+	struct LowerTask task = {kind, index};
+	pthread_mutex_lock(&deque->lock);
+	if (deque->top == deque->bottom)
+		deque->top = deque->bottom = 0;
+	if (deque->bottom == deque->capacity) {
+		deque->capacity = deque->capacity ? 2 * deque->capacity : 256;
+		deque->tasks = realloc(deque->tasks, deque->capacity * sizeof *deque->tasks);
+	}
+	deque->tasks[deque->bottom++] = task;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+// Takes the newest task for the owner, or the oldest for a thief.
+// Returns 0 if the deque is empty
+int lower_deque_take(struct LowerDeque* deque, int steal, struct LowerTask* task)
+{
+	pthread_mutex_lock(&deque->lock);
+	int taken = deque->top < deque->bottom;
+	if (taken)
+		*task = steal ? deque->tasks[deque->top++] : deque->tasks[--deque->bottom];
+	pthread_mutex_unlock(&deque->lock);
+	return taken;
+}
+
+void lower_pipeline_optimize(struct LowerWorker* w, int component)
+{
+	struct LowerPipeline* p = w->pipeline;
+	struct Module* module = p->module;
+	for (size_t k = p->component_start[component]; k < p->component_start[component + 1]; ++k) {
+		struct Function* fn = module_find(module, module->order[k]);
+		if (p->inline_params) {
+			struct InlineState s;
+			s.table = &module->table;
+			s.params = *p->inline_params;
+			s.depth = p->depth;
+			s.visited = 0;
+			s.analyses = &w->analyses;
+			inline_function_calls(&s, fn);
+		}
+		if (p->optimize)
+			optimize_function(&w->analyses, fn);
+	}
+	for (size_t k = p->component_start[component]; k < p->component_start[component + 1]; ++k)
+		lower_deque_push(&p->deques[w->index], LOWER_TASK_ENCODE, module->order[k]);
+	for (size_t d = p->dependents_start[component]; d < p->dependents_start[component + 1]; ++d) {
+		if (!__atomic_sub_fetch(&p->pending[p->dependents[d]], 1, __ATOMIC_ACQ_REL))
+			lower_deque_push(&p->deques[w->index], LOWER_TASK_OPTIMIZE, p->dependents[d]);
+	}
+}
+
+void lower_pipeline_encode(struct LowerWorker* w, int id)
+{
+	struct LowerPipeline* p = w->pipeline;
+	struct Function* fn = module_find(p->module, id);
+	struct LowerPiece* piece = &p->pieces[id];
+	for (size_t i = 0; i < fn->opcodes_size; ++i) {
+		for (int o = 0; o < 3; ++o) {
+			struct Operand* operand = &fn->opcodes[i].operands[o];
+			int callee = operand->ref_id;
+			if (operand->info_type != OPERAND_INFO_TYPE_FUNCTION || (o == OPERAND_TARGET && opcode_is_jump(&fn->opcodes[i])))
+				continue;
+			if (!module_find(p->module, callee) || w->labels[callee] != LOWER_NO_LABEL)
+				continue;
+			w->labels[callee] = x86_encoder_add_label(&piece->enc);
+			DYNAMIC_ARRAY_PUSH(piece->callees, piece->callees_size, piece->callees_capacity, callee, 8);
+		}
+	}
+	piece->labels = malloc((piece->callees_size + 1) * sizeof *piece->labels);
+	for (size_t c = 0; c < piece->callees_size; ++c)
+		piece->labels[c] = w->labels[piece->callees[c]];
+
+	struct LowerEnvironment env = p->env;
+	env.labels = w->labels;
+	env.analyses = &w->analyses;
+	env.peephole = &w->peephole;
+	if (lower_function(&piece->enc, fn, &env))
+		__atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+	for (size_t c = 0; c < piece->callees_size; ++c)
+		w->labels[piece->callees[c]] = LOWER_NO_LABEL;
+}
+
+void lower_pipeline_link(struct LowerWorker* w, int range)
+{
+	struct LowerPipeline* p = w->pipeline;
+	struct Module* module = p->module;
+	size_t end = (range + 1) * p->link_range;
+	for (size_t k = range * p->link_range; k < end && k < module->order_size; ++k) {
+		struct LowerPiece* piece = &p->pieces[module->order[k]];
+		//Labels may lie before the code, the distance wraps around
+		for (size_t c = 0; c < piece->callees_size; ++c)
+			piece->enc.labels[piece->labels[c]] = p->pieces[piece->callees[c]].offset - piece->offset;
+		if (x86_encoder_link_to_memory(&piece->enc, p->code + piece->offset))
+			__atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+		memset(p->code + piece->offset + piece->enc.buffer_size, X86_NOP, piece->padding);
+		x86_encoder_free(&piece->enc);
+	}
+}
+
+void* lower_worker_run(void* data)
+{
+	struct LowerWorker* w = data;
+	struct LowerPipeline* p = w->pipeline;
+	while (__atomic_load_n(&p->remaining, __ATOMIC_ACQUIRE)) {
+		struct LowerTask task;
+		int taken = lower_deque_take(&p->deques[w->index], 0, &task);
+		for (int attempt = 0; !taken && attempt < p->threads - 1; ++attempt) {
+			int victim = rand_r(&w->seed) % p->threads;
+			if (victim != w->index)
+				taken = lower_deque_take(&p->deques[victim], 1, &task);
+		}
+		if (!taken) {
+			sched_yield();
+			continue;
+		}
+		if (task.kind == LOWER_TASK_OPTIMIZE)
+			lower_pipeline_optimize(w, task.index);
+		else if (task.kind == LOWER_TASK_ENCODE)
+			lower_pipeline_encode(w, task.index);
+		else
+			lower_pipeline_link(w, task.index);
+		__atomic_sub_fetch(&p->remaining, 1, __ATOMIC_ACQ_REL);
+	}
+	return 0;
+}
+
+// Runs the queued tasks of a phase on all workers, the calling thread
+// being the first
+void lower_pipeline_phase(struct LowerPipeline* p, struct LowerWorker* workers)
+{
+	pthread_t* threads = malloc(p->threads * sizeof *threads);
+	int started = 1;
+	while (started < p->threads && !pthread_create(&threads[started], 0, lower_worker_run, &workers[started]))
+		started += 1;
+	lower_worker_run(&workers[0]);
+	for (int t = 1; t < started; ++t)
+		pthread_join(threads[t], 0);
+	free(threads);
+}
+
+// Counts the components calling each component and what each waits for
+void lower_pipeline_dependencies(struct LowerPipeline* p)
+{
+	struct Module* module = p->module;
+	size_t components = module->components_size;
+	p->component_start = calloc(components + 1, sizeof *p->component_start);
+	p->dependents_start = calloc(components + 2, sizeof *p->dependents_start);
+	p->pending = calloc(components + 1, sizeof *p->pending);
+	for (size_t k = 0; k < module->order_size; ++k)
+		p->component_start[module->components[module->order[k]] + 1] += 1;
+	for (size_t c = 0; c < components; ++c)
+		p->component_start[c + 1] += p->component_start[c];
+	if (!p->inline_params) {
+		p->dependents = malloc(sizeof *p->dependents);
+		return;
+	}
+
+	//Edges between components, counted first and then filled in
+	int* last = malloc((components + 1) * sizeof *last);
+	for (int pass = 0; pass < 2; ++pass) {
+		for (size_t c = 0; c < components; ++c)
+			last[c] = -1;
+		for (size_t k = 0; k < module->order_size; ++k) {
+			int caller = module->order[k];
+			int from = module->components[caller];
+			for (size_t e = module->callees_start[caller]; e < module->callees_start[caller + 1]; ++e) {
+				int to = module->components[module->callees[e]];
+				if (to == from || last[to] == from)
+					continue;
+				last[to] = from;
+				if (pass)
+					p->dependents[p->dependents_start[to + 1]++] = from;
+				else {
+					p->dependents_start[to + 2] += 1;
+					p->pending[from] += 1;
+				}
+			}
+		}
+		if (!pass) {
+			for (size_t c = 0; c < components; ++c)
+				p->dependents_start[c + 2] += p->dependents_start[c + 1];
+			p->dependents = malloc((p->dependents_start[components + 1] + 1) * sizeof *p->dependents);
+		}
+	}
+	free(last);
+}
+
+// Inlines, optimizes and lowers the functions of the analysed module on
+// "threads" threads and links them into one code region like
+// lower_module. Inlining is skipped without "inline_params" and the
+// function passes without "optimize". The functions are changed in
+// place, their arrays must be heap allocated. Returns 0 on success, -1 if
+// a function could not be lowered or linked
+int lower_module_parallel(struct LowerModule* out, struct Module* module, void** natives, size_t natives_size,
+	struct InlineParameters* inline_params, int optimize, int threads)
+{
+	memset(out, 0, sizeof *out);
+	struct LowerPipeline p;
+	memset(&p, 0, sizeof p);
+	size_t size = module->table.functions_size > natives_size ? module->table.functions_size : natives_size;
+	p.module = module;
+	p.env.functions = calloc(size + 1, sizeof *p.env.functions);
+	p.env.functions_size = size;
+	if (natives_size)
+		memcpy(p.env.functions, natives, natives_size * sizeof *natives);
+	p.inline_params = inline_params;
+	p.optimize = optimize;
+	p.depth = calloc(size + 1, sizeof *p.depth);
+	p.pieces = calloc(size + 1, sizeof *p.pieces);
+	p.threads = threads > 0 ? threads : 1;
+	p.deques = calloc(p.threads, sizeof *p.deques);
+	struct LowerWorker* workers = calloc(p.threads, sizeof *workers);
+	for (int t = 0; t < p.threads; ++t) {
+		pthread_mutex_init(&p.deques[t].lock, 0);
+		workers[t].pipeline = &p;
+		workers[t].index = t;
+		workers[t].seed = t + 1;
+		workers[t].labels = malloc((size + 1) * sizeof *workers[t].labels);
+		for (size_t id = 0; id < size; ++id)
+			workers[t].labels[id] = LOWER_NO_LABEL;
+		analysis_manager_init(&workers[t].analyses);
+	}
+
+	//Optimizing and encoding, starting from the components calling none
+	lower_pipeline_dependencies(&p);
+	int next = 0;
+	for (size_t c = 0; c < module->components_size; ++c) {
+		if (!p.pending[c])
+			lower_deque_push(&p.deques[next++ % p.threads], LOWER_TASK_OPTIMIZE, c);
+	}
+	p.remaining = module->components_size + module->order_size;
+	lower_pipeline_phase(&p, workers);
+
+	//Layout, then linking
+	size_t offset = 0;
+	for (size_t k = 0; k < module->order_size; ++k) {
+		struct LowerPiece* piece = &p.pieces[module->order[k]];
+		piece->offset = offset;
+		offset += piece->enc.buffer_size;
+		piece->padding = (LOWER_FUNCTION_ALIGNMENT - offset % LOWER_FUNCTION_ALIGNMENT) % LOWER_FUNCTION_ALIGNMENT;
+		offset += piece->padding;
+	}
+	out->size = offset ? offset : 1;
+	p.code = p.failed ? MAP_FAILED : mmap(0, out->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p.code != MAP_FAILED) {
+		p.link_range = module->order_size / (8 * p.threads) + 1;
+		if (p.link_range < 64)
+			p.link_range = 64;
+		size_t ranges = (module->order_size + p.link_range - 1) / p.link_range;
+		for (size_t r = 0; r < ranges; ++r)
+			lower_deque_push(&p.deques[r % p.threads], LOWER_TASK_LINK, r);
+		p.remaining = ranges;
+		lower_pipeline_phase(&p, workers);
+		if (p.failed || mprotect(p.code, out->size, PROT_READ | PROT_EXEC)) {
+			munmap(p.code, out->size);
+			p.code = MAP_FAILED;
+		}
+	}
+
+	int result = -1;
+	if (p.code != MAP_FAILED) {
+		out->code = p.code;
+		for (size_t k = 0; k < module->order_size; ++k)
+			p.env.functions[module->order[k]] = out->code + p.pieces[module->order[k]].offset;
+		out->functions = p.env.functions;
+		out->functions_size = size;
+		result = 0;
+	} else {
+		free(p.env.functions);
+		out->size = 0;
+	}
+	if (inline_params)
+		module_analyse(module);
+
+	for (size_t id = 0; id < size; ++id) {
+		x86_encoder_free(&p.pieces[id].enc);
+		free(p.pieces[id].callees);
+		free(p.pieces[id].labels);
+	}
+	for (int t = 0; t < p.threads; ++t) {
+		pthread_mutex_destroy(&p.deques[t].lock);
+		free(p.deques[t].tasks);
+		free(workers[t].labels);
+		analysis_manager_free(&workers[t].analyses);
+		out->peephole.instructions_removed += workers[t].peephole.instructions_removed;
+		out->peephole.bytes_saved += workers[t].peephole.bytes_saved;
+		out->peephole.jumps_retargeted += workers[t].peephole.jumps_retargeted;
+		out->peephole.passes += workers[t].peephole.passes;
+	}
+	free(workers);
+	free(p.deques);
+	free(p.pieces);
+	free(p.depth);
+	free(p.component_start);
+	free(p.dependents_start);
+	free(p.dependents);
+	free(p.pending);
+	return result;
+}
+
+#ifndef LOWER_NO_MAIN
+long lower_demo_square(long x)
+{
+	return x * x;
+}
+
+// Builds a module of "count" functions
+//	long f<i>(long x) {
+//		for (long k = 0; k < 4; k += 1)
+//			x = x * 3 + k;
+//		return i ? x + f<i / 2>(x) + f<i / 3>(x ^ i) : x;
+//	}
+struct Function* lower_demo_module(struct Module* module, size_t count)
+{
+	static struct TypeInfo long_type = {IR_TYPE_I64, 0, 0};
+	struct Function* functions = calloc(count, sizeof *functions);
+	struct Operand none;
+	memset(&none, 0, sizeof none);
+	module_init(module);
+	for (size_t i = 0; i < count; ++i) {
+		struct Function* fn = &functions[i];
+		fn->id = i;
+		fn->arguments = &long_type;
+		fn->arguments_size = 1;
+		fn->return_type = long_type;
+		struct Operand x = make_variable_operand(function_add_variable(fn, long_type), long_type);
+		struct Operand k = make_variable_operand(function_add_variable(fn, long_type), long_type);
+		struct Operand half = make_variable_operand(function_add_variable(fn, long_type), long_type);
+		struct Operand third = make_variable_operand(function_add_variable(fn, long_type), long_type);
+		struct Operand argument = make_variable_operand(0, long_type);
+		argument.info_type = OPERAND_INFO_TYPE_ARGUMENT;
+		struct Operand callee_half = make_variable_operand(i / 2, long_type);
+		callee_half.info_type = OPERAND_INFO_TYPE_FUNCTION;
+		struct Operand callee_third = make_variable_operand(i / 3, long_type);
+		callee_third.info_type = OPERAND_INFO_TYPE_FUNCTION;
+		struct Operand label_calls = none;
+		label_calls.ref_id = 7;
+		struct Operand label_loop = none;
+		label_loop.ref_id = 2;
+		struct Opcode opcodes[] = {
+			make_opcode(OPCODE_COPY, x, argument, none),
+			make_opcode(OPCODE_COPY, k, make_immediate_operand(long_type, 0), none),
+			make_opcode(OPCODE_GOTO_COND(COMPARISON_GEQUAL), label_calls, k, make_immediate_operand(long_type, 4)),
+			make_opcode(OPCODE_MUL, x, x, make_immediate_operand(long_type, 3)),
+			make_opcode(OPCODE_ADD, x, x, k),
+			make_opcode(OPCODE_ADD, k, k, make_immediate_operand(long_type, 1)),
+			make_opcode(OPCODE_GOTO_COND(COMPARISON_ALWAYS), label_loop, none, none),
+			make_opcode(OPCODE_SET_ARGUMENT, none, x, none),
+			make_opcode(OPCODE_CALL, half, callee_half, none),
+			make_opcode(OPCODE_BIR_XOR, third, x, make_immediate_operand(long_type, i)),
+			make_opcode(OPCODE_SET_ARGUMENT, none, third, none),
+			make_opcode(OPCODE_CALL, third, callee_third, none),
+			make_opcode(OPCODE_ADD, x, x, half),
+			make_opcode(OPCODE_ADD, x, x, third),
+			make_opcode(OPCODE_RETURN, none, x, none),
+		};
+		for (size_t o = 0; o < sizeof opcodes / sizeof *opcodes; ++o) {
+			if (!i && o >= 7 && o < 14)
+				continue;
+			DYNAMIC_ARRAY_PUSH(fn->opcodes, fn->opcodes_size, fn->opcodes_capacity, opcodes[o], 16);
+		}
+		module_add(module, fn);
+	}
+	module_analyse(module);
+	return functions;
+}
+
+double lower_demo_seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Compiles a module with growing numbers of threads
+int lower_demo_parallel(size_t count)
+{
+	static const int threads[] = {1, 2, 4, 8, 16, 32};
+	double single = 0;
+	long expected = 0;
+	for (size_t t = 0; t < sizeof threads / sizeof *threads; ++t) {
+		struct Module module;
+		struct Function* functions = lower_demo_module(&module, count);
+		struct InlineParameters params = default_inline_parameters();
+		struct LowerModule lowered;
+		double start = lower_demo_seconds();
+		int res = lower_module_parallel(&lowered, &module, 0, 0, &params, 1, threads[t]);
+		double seconds = lower_demo_seconds() - start;
+		if (res) {
+			printf("Lowering failed with %d threads\n", threads[t]);
+			return 1;
+		}
+		if (!t)
+			single = seconds;
+		long (*last)(long) = lowered.functions[count - 1];
+		long result = last(7);
+		if (!t)
+			expected = result;
+		printf("%2d threads: %8.1f ms, speedup %5.2f, %zu bytes, %zu saved by peephole, f%zu(7) == %ld\n",
+			threads[t], seconds * 1e3, single / seconds, lowered.size, lowered.peephole.bytes_saved, count - 1, result);
+
+		lower_module_free(&lowered);
+		module_free(&module);
+		for (size_t i = 0; i < count; ++i) {
+			free(functions[i].opcodes);
+			free(functions[i].variables);
+		}
+		free(functions);
+		if (result != expected)
+			return 1;
+	}
+	return 0;
+}
+
+int main(int argc, const char** argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "parallel"))
+		return lower_demo_parallel(argc > 2 ? strtoul(argv[2], 0, 10) : 50000);
+
+	struct TypeInfo long_type = {IR_TYPE_I64, 0, 0};
+	struct TypeInfo double_type = {IR_TYPE_F64, 0, 0};
+	struct x86_encoder enc;
+	memset(&enc, 0, sizeof enc);
+
+	//Native functions are reached through the environment
+	void* natives[] = {(void*)lower_demo_square};
+	struct x86_peephole_stats peephole;
+	memset(&peephole, 0, sizeof peephole);
+	struct LowerEnvironment env = {natives, 1, 0, 0, 0, 0, 0, &peephole};
+
+	// long sum_squares(long n) {
+	//	long sum = 0;
+	//	for (long i = 0; i < n; i += 1)
+	//		sum += square(i);
+	//	return sum;
+	// }
+	struct Function sum_squares;
+	memset(&sum_squares, 0, sizeof sum_squares);
+	sum_squares.arguments = &long_type;
+	sum_squares.arguments_size = 1;
+	sum_squares.return_type = long_type;
+	struct Operand sum = make_variable_operand(function_add_variable(&sum_squares, long_type), long_type);
+	struct Operand i = make_variable_operand(function_add_variable(&sum_squares, long_type), long_type);
+	struct Operand squared = make_variable_operand(function_add_variable(&sum_squares, long_type), long_type);
+	struct Operand n = make_variable_operand(0, long_type);
+	n.info_type = OPERAND_INFO_TYPE_ARGUMENT;
+	struct Operand square = make_variable_operand(0, long_type);
+	square.info_type = OPERAND_INFO_TYPE_FUNCTION;
+	struct Operand none;
+	memset(&none, 0, sizeof none);
+	struct Operand zero = make_immediate_operand(long_type, 0);
+	struct Operand one = make_immediate_operand(long_type, 1);
+	struct Operand label_end = none;
+	label_end.ref_id = 8;
+	struct Operand label_loop = none;
+	label_loop.ref_id = 2;
+	struct Opcode sum_squares_opcodes[] = {
+		make_opcode(OPCODE_COPY, sum, zero, none),
+		make_opcode(OPCODE_COPY, i, zero, none),
+		make_opcode(OPCODE_GOTO_COND(COMPARISON_GEQUAL), label_end, i, n),
+		make_opcode(OPCODE_SET_ARGUMENT, none, i, none),
+		make_opcode(OPCODE_CALL, squared, square, none),
+		make_opcode(OPCODE_ADD, sum, sum, squared),
+		make_opcode(OPCODE_ADD, i, i, one),
+		make_opcode(OPCODE_GOTO_COND(COMPARISON_ALWAYS), label_loop, none, none),
+		make_opcode(OPCODE_RETURN, none, sum, none),
+	};
+	for (size_t k = 0; k < sizeof sum_squares_opcodes / sizeof *sum_squares_opcodes; ++k)
+		DYNAMIC_ARRAY_PUSH(sum_squares.opcodes, sum_squares.opcodes_size, sum_squares.opcodes_capacity, sum_squares_opcodes[k], 16);
+
+	// double scale(double x, long k) { return x * k + 0.5; }
+	struct TypeInfo scale_arguments[] = {double_type, long_type};
+	struct Function scale;
+	memset(&scale, 0, sizeof scale);
+	scale.arguments = scale_arguments;
+	scale.arguments_size = 2;
+	scale.return_type = double_type;
+	struct Operand x = make_variable_operand(0, double_type);
+	x.info_type = OPERAND_INFO_TYPE_ARGUMENT;
+	struct Operand k = make_variable_operand(1, long_type);
+	k.info_type = OPERAND_INFO_TYPE_ARGUMENT;
+	struct Operand product = make_variable_operand(function_add_variable(&scale, double_type), double_type);
+	struct Operand result = make_variable_operand(function_add_variable(&scale, double_type), double_type);
+	struct Operand half = make_immediate_operand(double_type, 0);
+	half.value_f64 = 0.5;
+	struct Opcode scale_opcodes[] = {
+		make_opcode(OPCODE_MUL, product, x, k),
+		make_opcode(OPCODE_ADD, result, product, half),
+		make_opcode(OPCODE_RETURN, none, result, none),
+	};
+	for (size_t k = 0; k < sizeof scale_opcodes / sizeof *scale_opcodes; ++k)
+		DYNAMIC_ARRAY_PUSH(scale.opcodes, scale.opcodes_size, scale.opcodes_capacity, scale_opcodes[k], 16);
+
+	// void scale_all(float* dst, float* src, long n, float k) {
+	//	for (long i = 0; i < n; i += 1)
+	//		dst[i] = src[i] * k;
+	// }
+	struct TypeInfo float_type = {IR_TYPE_F32, 0, 0};
+	struct TypeInfo scale_all_arguments[] = {long_type, long_type, long_type, float_type};
+	struct Function scale_all;
+	memset(&scale_all, 0, sizeof scale_all);
+	scale_all.arguments = scale_all_arguments;
+	scale_all.arguments_size = 4;
+	scale_all.return_type.type = IR_TYPE_VOID;
+	struct Operand scale_all_arguments_operands[4];
+	for (int a = 0; a < 4; ++a) {
+		scale_all_arguments_operands[a] = make_variable_operand(a, scale_all_arguments[a]);
+		scale_all_arguments_operands[a].info_type = OPERAND_INFO_TYPE_ARGUMENT;
+	}
+	struct Operand dst = scale_all_arguments_operands[0];
+	struct Operand src = scale_all_arguments_operands[1];
+	struct Operand dst_element = dst;
+	dst_element.info_flags = OPERAND_FLAG_DEREFERENCE;
+	dst_element.type_info = float_type;
+	struct Operand src_element = src;
+	src_element.info_flags = OPERAND_FLAG_DEREFERENCE;
+	src_element.type_info = float_type;
+	struct Operand index = make_variable_operand(function_add_variable(&scale_all, long_type), long_type);
+	struct Operand element = make_variable_operand(function_add_variable(&scale_all, float_type), float_type);
+	struct Operand scaled = make_variable_operand(function_add_variable(&scale_all, float_type), float_type);
+	struct Operand four = make_immediate_operand(long_type, 4);
+	struct Operand label_done = none;
+	label_done.ref_id = 9;
+	struct Operand label_test = none;
+	label_test.ref_id = 1;
+	struct Opcode scale_all_opcodes[] = {
+		make_opcode(OPCODE_COPY, index, zero, none),
+		make_opcode(OPCODE_GOTO_COND(COMPARISON_GEQUAL), label_done, index, scale_all_arguments_operands[2]),
+		make_opcode(OPCODE_COPY, element, src_element, none),
+		make_opcode(OPCODE_MUL, scaled, element, scale_all_arguments_operands[3]),
+		make_opcode(OPCODE_COPY, dst_element, scaled, none),
+		make_opcode(OPCODE_ADD, dst, dst, four),
+		make_opcode(OPCODE_ADD, src, src, four),
+		make_opcode(OPCODE_ADD, index, index, one),
+		make_opcode(OPCODE_GOTO_COND(COMPARISON_ALWAYS), label_test, none, none),
+		make_opcode(OPCODE_RETURN, none, none, none),
+	};
+	for (size_t k = 0; k < sizeof scale_all_opcodes / sizeof *scale_all_opcodes; ++k)
+		DYNAMIC_ARRAY_PUSH(scale_all.opcodes, scale_all.opcodes_size, scale_all.opcodes_capacity, scale_all_opcodes[k], 16);
+
+	//Textual form of the IR, parsed back to check it
+	struct IrText text;
+	memset(&text, 0, sizeof text);
+	ir_print_function(&text, &sum_squares);
+	fwrite(text.data, 1, text.size, stdout);
+	struct IrArena arena;
+	memset(&arena, 0, sizeof arena);
+	struct IrParser parser;
+	struct Function parsed;
+	ir_parser_init(&parser, text.data, text.size, &arena);
+	if (ir_parse_function(&parser, &parsed) != 1 || parsed.opcodes_size != sum_squares.opcodes_size) {
+		printf("Parse error on line %d: %s\n", ir_parser_line(&parser), parser.error);
+		return 1;
+	}
+	ir_parser_free(&parser);
+	ir_arena_free(&arena);
+	ir_text_free(&text);
+
+	//The functions are lowered from a serialized module, used in place
+	struct Function* module_functions[] = {&sum_squares, &scale, &scale_all};
+	size_t module_size;
+	char* module_data = ir_module_serialize(module_functions, 3, &module_size);
+	struct IrModule module;
+	struct Function views[3];
+	int res = ir_module_open(&module, module_data, module_size);
+	for (size_t f = 0; f < 3 && !res; ++f)
+		res = ir_module_function(&module, f, &views[f]);
+	printf("Module result: %d, %zu bytes\n", res, module_size);
+	if (res)
+		return 1;
+
+	size_t scale_start = 0;
+	size_t scale_all_start = 0;
+	res = lower_function(&enc, &views[0], &env);
+	scale_start = enc.buffer_size;
+	res |= lower_function(&enc, &views[1], &env);
+	scale_all_start = enc.buffer_size;
+	res |= lower_function(&enc, &views[2], &env);
+	printf("Lowering result: %d, %zu bytes, peephole removed %zu instructions and %zu bytes\n",
+		res, enc.buffer_size, peephole.instructions_removed, peephole.bytes_saved);
+	if (res)
+		return 1;
+
+	char* target_mem = mmap(0, enc.buffer_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	printf("Linking result: %d\n", x86_encoder_link_to_memory(&enc, target_mem));
+
+	long (*sum_squares_native)(long) = (void*)target_mem;
+	double (*scale_native)(double, long) = (void*)(target_mem + scale_start);
+	for (long v = 0; v < 6; ++v)
+		printf("sum_squares(%ld) == %ld, scale(1.25, %ld) == %g\n", v, sum_squares_native(v), v, scale_native(1.25, v));
+
+	//Vectorized when the CPU has AVX2, 19 = 2 vectors and 3 scalar iterations
+	void (*scale_all_native)(float*, float*, long, float) = (void*)(target_mem + scale_all_start);
+	float values[19], scaled_values[19];
+	for (int v = 0; v < 19; ++v)
+		values[v] = v;
+	scale_all_native(scaled_values, values, 19, 0.5f);
+	printf("scale_all:");
+	for (int v = 0; v < 19; ++v)
+		printf(" %g", scaled_values[v]);
+	printf("\n");
+
+	//Lowering the same functions again takes them from the cache
+	struct LowerCache cache;
+	lower_cache_init(&cache, 1 << 20, 0);
+	for (int round = 0; round < 2; ++round) {
+		for (size_t f = 0; f < 3; ++f) {
+			size_t size;
+			void* code = lower_cache_compile(&cache, &views[f], &env, &size);
+			if (code)
+				munmap(code, size);
+		}
+	}
+	printf("Cache: %llu lookups, %llu hits, %zu entries of %zu bytes, hit rate %g\n",
+		(unsigned long long)cache.stats.lookups, (unsigned long long)cache.stats.hits,
+		cache.stats.entries, cache.stats.bytes, lower_cache_hit_rate(&cache));
+	lower_cache_free(&cache);
+
+	munmap(target_mem, enc.buffer_size);
+	x86_encoder_free(&enc);
+	ir_module_close(&module);
+	free(module_data);
+	free(sum_squares.opcodes);
+	free(sum_squares.variables);
+	free(scale.opcodes);
+	free(scale.variables);
+	free(scale_all.opcodes);
+	free(scale_all.variables);
+	return 0;
+}
+#endif